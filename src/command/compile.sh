@@ -26,7 +26,7 @@ SEC_CNT=$(ls -l $BIN|awk '{printf("%d", ($5+511)/512)}')
 
 if [[ -f $BIN ]];then
    dd if=./$DD_IN of=$DD_OUT bs=512 \
-   count=$SEC_CNT seek=300 conv=notrunc
+   count=$SEC_CNT seek=400 conv=notrunc
 fi
 
 ##########   以上核心就是下面这三条命令   ##########
@@ -35,4 +35,4 @@ fi
 #ld -e main prog_no_arg.o ../build/string.o ../build/syscall.o\
 #   ../build/stdio.o ../build/assert.o -o prog_no_arg
 #dd if=prog_no_arg of=/home/work/my_workspace/bochs/hd60M.img \
-#   bs=512 count=10 seek=300 conv=notrunc
\ No newline at end of file
+#   bs=512 count=10 seek=400 conv=notrunc
\ No newline at end of file
@@ -0,0 +1,700 @@
+#include "ahci.h"
+#include "block.h"
+#include "pci.h"
+#include "interrupt.h"
+#include "softirq.h"
+#include "kthread.h"
+#include "memory.h"
+#include "timer.h"
+#include "string.h"
+#include "stdio.h"
+#include "stdio_kernel.h"
+#include "debug.h"
+
+#define AHCI_ABAR_SIZE  0x1100  // 全局寄存器加32个端口的寄存器
+#define AHCI_PRIO       31      // 派发线程的优先级
+
+/* HBA全局寄存器 */
+#define HBA_CAP         0x00
+#define HBA_GHC         0x04
+#define HBA_IS          0x08    // 各端口的中断汇总, 写1清除
+#define HBA_PI          0x0c    // 实现了的端口的位图
+#define HBA_PORT_BASE   0x100
+#define HBA_PORT_SIZE   0x80
+
+#define HBA_CAP_SNCQ    (1 << 30)   // 支持NCQ
+#define HBA_GHC_IE      (1 << 1)
+#define HBA_GHC_AE      0x80000000  // 使用AHCI模式
+
+/* 端口寄存器 */
+#define PORT_CLB        0x00    // 命令列表的物理地址, 1KB对齐
+#define PORT_CLBU       0x04
+#define PORT_FB         0x08    // 接收FIS区的物理地址, 256字节对齐
+#define PORT_FBU        0x0c
+#define PORT_IS         0x10
+#define PORT_IE         0x14
+#define PORT_CMD        0x18
+#define PORT_TFD        0x20    // 低8位是设备的状态寄存器
+#define PORT_SIG        0x24
+#define PORT_SSTS       0x28
+#define PORT_SCTL       0x2c
+#define PORT_SERR       0x30
+#define PORT_SACT       0x34    // 设备尚未完成的NCQ命令
+#define PORT_CI         0x38    // 已发出尚未被HBA处理完的命令
+
+#define PORT_CMD_ST     (1 << 0)
+#define PORT_CMD_FRE    (1 << 4)
+#define PORT_CMD_FR     (1 << 14)
+#define PORT_CMD_CR     (1 << 15)
+
+#define PORT_IS_DHRS    (1 << 0)    // 收到D2H寄存器FIS, 普通命令完成
+#define PORT_IS_PSS     (1 << 1)    // 收到PIO Setup FIS
+#define PORT_IS_SDBS    (1 << 3)    // 收到Set Device Bits FIS, NCQ命令完成
+#define PORT_IS_ERROR   (0xf << 27) // 接口错误, 总线主控错误, 任务文件错误等
+#define PORT_IE_MASK    (PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_SDBS | PORT_IS_ERROR)
+
+#define TFD_STAT_ERR    0x01
+#define TFD_STAT_DRQ    0x08
+#define TFD_STAT_BSY    0x80
+
+#define SATA_SIG_ATA    0x00000101  // 端口上是硬盘
+#define SSTS_DET_OK     0x3         // 检测到设备且物理链路已建立
+
+#define FIS_TYPE_REG_H2D    0x27
+#define AHCI_CMD_WRITE      (1 << 6)    // 命令头中表示数据从内存到设备
+#define AHCI_PRD_MAX        (4 * 1024 * 1024)   // 一项PRD最多描述的字节数
+
+/* ATA命令 */
+#define CMD_IDENTIFY            0xec
+#define CMD_READ_DMA            0xc8
+#define CMD_WRITE_DMA           0xca
+#define CMD_READ_DMA_EXT        0x25
+#define CMD_WRITE_DMA_EXT       0x35
+#define CMD_READ_FPDMA_QUEUED   0x60
+#define CMD_WRITE_FPDMA_QUEUED  0x61
+#define CMD_FLUSH_CACHE         0xe7
+#define CMD_FLUSH_CACHE_EXT     0xea
+
+/* 命令列表中的一项 */
+struct ahci_cmd_header {
+    uint16_t flags;     // 低5位是命令FIS的双字数, 第6位表示写
+    uint16_t prdtl;     // PRDT的项数
+    uint32_t prdbc;     // 已传输的字节数, 由HBA填写
+    uint32_t ctba;      // 命令表的物理地址, 128字节对齐
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__ ((packed));
+
+/* 主机发往设备的寄存器FIS, 相当于写一遍IDE的命令块寄存器 */
+struct fis_reg_h2d {
+    uint8_t type;
+    uint8_t flags;      // 第7位为1表示这是一条命令
+    uint8_t command;
+    uint8_t feature_lo;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t feature_hi;
+    uint8_t count_lo;
+    uint8_t count_hi;
+    uint8_t icc;
+    uint8_t control;
+    uint32_t reserved;
+} __attribute__ ((packed));
+
+/* 物理区域描述符 */
+struct ahci_prd {
+    uint32_t dba;       // 数据的物理地址
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;       // 低22位为字节数减1
+} __attribute__ ((packed));
+
+#define AHCI_PRDT_LEN ((PG_SIZE - 0x80) / sizeof(struct ahci_prd))
+
+/* 命令表, 每个槽一页 */
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRDT_LEN];
+} __attribute__ ((packed));
+
+/* 命令槽, 用NCQ时槽号就是命令的tag */
+struct ahci_slot {
+    struct ahci_cmd_table* table;
+    bool busy;              // 正在处理rq
+    struct request rq;
+    struct bio_iter iter;   // rq中下一条命令的起点
+    uint32_t next_lba;
+    uint32_t left;          // rq中还没交给设备的扇区数
+};
+
+/* 接了硬盘的一个端口 */
+struct ahci_port {
+    uint8_t port_no;
+    uint32_t regs;                  // 端口寄存器的虚拟地址
+    struct ahci_cmd_header* cmd_list;
+    bool lba48;
+    bool ncq;
+    uint32_t nr_slots;              // 使用的命令槽数, 不用NCQ时只有1个
+    uint32_t nr_free;               // 空闲的命令槽数
+    uint32_t issued;                // 已交给HBA尚未回收的槽的位图
+    volatile uint32_t irq_status;   // 中断处理程序累积的PxIS, 由派发线程取走
+    bool flush_pending;             // 有flush在等待, 暂停下发新请求
+    bool flushing;                  // flush命令已交给设备, 占用0号槽
+    int32_t flush_error;
+    struct lock flush_lock;         // 同一时刻只有一个flush
+    struct completion flush_done;
+    struct wait_queue wq;           // 派发线程在此等待bio入队或命令完成
+    struct ahci_slot slots[AHCI_MAX_SLOTS];
+    struct block_device bdev;
+};
+
+static uint32_t hba_base;           // 全局寄存器的虚拟地址
+static struct ahci_port ports[AHCI_MAX_DISKS];
+static uint8_t port_cnt;            // 接了硬盘的端口数
+
+static uint32_t hba_read(uint32_t reg) {
+    return *(volatile uint32_t*)(hba_base + reg);
+}
+
+static void hba_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(hba_base + reg) = value;
+}
+
+static uint32_t port_read(struct ahci_port* port, uint32_t reg) {
+    return *(volatile uint32_t*)(port->regs + reg);
+}
+
+static void port_write(struct ahci_port* port, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(port->regs + reg) = value;
+}
+
+/* 等待端口寄存器reg中mask各位全部变为0, 最多等ms毫秒, 超时返回false */
+static bool ahci_wait_clear(struct ahci_port* port, uint32_t reg, uint32_t mask, uint32_t ms) {
+    uint32_t waited = 0;
+    while (port_read(port, reg) & mask) {
+        if (waited >= ms) {
+            return false;
+        }
+        mtime_sleep(10);
+        waited += 10;
+    }
+    return true;
+}
+
+/* 停止端口的命令引擎和FIS接收, 未完成的命令随之作废 */
+static void ahci_port_stop(struct ahci_port* port) {
+    port_write(port, PORT_CMD, port_read(port, PORT_CMD) & ~PORT_CMD_ST);
+    if (!ahci_wait_clear(port, PORT_CMD, PORT_CMD_CR, 500)) {
+        printk("%s: command engine does not stop\n", port->bdev.name);
+    }
+    port_write(port, PORT_CMD, port_read(port, PORT_CMD) & ~PORT_CMD_FRE);
+    if (!ahci_wait_clear(port, PORT_CMD, PORT_CMD_FR, 500)) {
+        printk("%s: fis receive does not stop\n", port->bdev.name);
+    }
+}
+
+/* 复位端口上的链路(COMRESET), 设备一直忙时使用 */
+static void ahci_port_reset(struct ahci_port* port) {
+    uint32_t sctl = port_read(port, PORT_SCTL) & ~0xf;
+    port_write(port, PORT_SCTL, sctl | 0x1);
+    mtime_sleep(10);        // 至少保持1ms
+    port_write(port, PORT_SCTL, sctl);
+    uint32_t waited = 0;
+    while ((port_read(port, PORT_SSTS) & 0xf) != SSTS_DET_OK && waited < 1000) {
+        mtime_sleep(10);
+        waited += 10;
+    }
+    port_write(port, PORT_SERR, 0xffffffff);
+}
+
+/* 打开FIS接收, 等设备空闲后启动命令引擎 */
+static void ahci_port_start(struct ahci_port* port) {
+    port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_FRE);
+    if (!ahci_wait_clear(port, PORT_TFD, TFD_STAT_BSY | TFD_STAT_DRQ, 1000)) {
+        ahci_port_reset(port);
+        if (!ahci_wait_clear(port, PORT_TFD, TFD_STAT_BSY | TFD_STAT_DRQ, 1000)) {
+            printk("%s: device stays busy after reset\n", port->bdev.name);
+        }
+    }
+    port_write(port, PORT_CMD, port_read(port, PORT_CMD) | PORT_CMD_ST);
+}
+
+/* 在命令表中填写寄存器FIS. lba按48位寻址填写, 28位命令由调用者另填device */
+static void ahci_build_fis(struct ahci_cmd_table* table, uint8_t command, uint32_t lba, \
+                           uint16_t count, uint16_t features, uint8_t device) {
+    struct fis_reg_h2d* fis = (struct fis_reg_h2d*)table->cfis;
+    memset(fis, 0, sizeof(struct fis_reg_h2d));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = 0x80;
+    fis->command = command;
+    fis->device = device;
+    fis->lba0 = lba;
+    fis->lba1 = lba >> 8;
+    fis->lba2 = lba >> 16;
+    fis->lba3 = lba >> 24;
+    fis->count_lo = count;
+    fis->count_hi = count >> 8;
+    fis->feature_lo = features;
+    fis->feature_hi = features >> 8;
+}
+
+/* 把idx号槽交给HBA, queued表示是NCQ命令 */
+static void ahci_port_issue_slot(struct ahci_port* port, uint32_t idx, bool queued) {
+    port->issued |= 1u << idx;
+    if (queued) {
+        port_write(port, PORT_SACT, 1u << idx);
+    }
+    port_write(port, PORT_CI, 1u << idx);
+}
+
+/* 把idx号槽的请求中的下一段作为一条命令交给HBA.
+ * PRDT装不下或超过命令的扇区数上限时, 剩下的扇区留给下一条命令 */
+static void ahci_issue(struct ahci_port* port, uint32_t idx) {
+    struct ahci_slot* slot = &port->slots[idx];
+    struct ahci_cmd_table* table = slot->table;
+    bool is_write = slot->rq.write;
+    uint32_t cmd_max = port->lba48 ? 0xffff : 256;
+    uint32_t nr = 0;
+    uint32_t prd_len = 0;   // 当前项已描述的字节数
+    uint32_t sec_cnt = 0;
+    while (slot->left > 0 && sec_cnt < cmd_max) {
+        /* n个扇区的一段最多跨n/8+2页, 按剩下的PRD项数限制这一段的扇区数 */
+        uint32_t room = AHCI_PRDT_LEN - nr;
+        if (room < 3) {
+            break;
+        }
+        uint32_t max_secs = (room - 2) * 8;
+        if (max_secs > cmd_max - sec_cnt) {
+            max_secs = cmd_max - sec_cnt;
+        }
+        void* buf;
+        uint32_t secs;
+        struct bio* bio = bio_iter_next(&slot->iter, slot->left < max_secs ? slot->left : max_secs, &buf, &secs);
+        bool used = bio_use_mm(bio);    // 用户空间的缓冲区要在提交者的页表中翻译
+        uint32_t vaddr = (uint32_t)buf;
+        uint32_t byte_cnt = secs * BLOCK_SECTOR_SIZE;
+        while (byte_cnt > 0) {
+            uint32_t phys = addr_v2p(vaddr);
+            uint32_t len = PG_SIZE - (vaddr & 0xfff);   // 到本页结束
+            if (len > byte_cnt) {
+                len = byte_cnt;
+            }
+            struct ahci_prd* cur = nr > 0 ? &table->prdt[nr - 1] : NULL;
+            if (cur != NULL && cur->dba + prd_len == phys && prd_len + len <= AHCI_PRD_MAX) {
+                prd_len += len;     // 物理上紧接着, 并入当前项
+            } else {
+                cur = &table->prdt[nr++];
+                cur->dba = phys;
+                cur->dbau = 0;
+                cur->reserved = 0;
+                prd_len = len;
+            }
+            cur->dbc = prd_len - 1;
+            vaddr += len;
+            byte_cnt -= len;
+        }
+        bio_unuse_mm(used);
+        slot->left -= secs;
+        sec_cnt += secs;
+    }
+
+    if (port->ncq) {
+        /* FPDMA命令的扇区数在features中, count的高5位是tag */
+        ahci_build_fis(table, is_write ? CMD_WRITE_FPDMA_QUEUED : CMD_READ_FPDMA_QUEUED, \
+                       slot->next_lba, idx << 3, sec_cnt, 0x40);
+    } else if (port->lba48) {
+        ahci_build_fis(table, is_write ? CMD_WRITE_DMA_EXT : CMD_READ_DMA_EXT, slot->next_lba, sec_cnt, 0, 0x40);
+    } else {
+        /* 28位命令的lba高4位在device中, 扇区数256写作0 */
+        ahci_build_fis(table, is_write ? CMD_WRITE_DMA : CMD_READ_DMA, slot->next_lba, sec_cnt, 0, \
+                       0x40 | ((slot->next_lba >> 24) & 0xf));
+    }
+    struct ahci_cmd_header* hdr = &port->cmd_list[idx];
+    hdr->flags = sizeof(struct fis_reg_h2d) / 4 | (is_write ? AHCI_CMD_WRITE : 0);
+    hdr->prdtl = nr;
+    hdr->prdbc = 0;
+    slot->next_lba += sec_cnt;
+    ahci_port_issue_slot(port, idx, port->ncq);
+}
+
+/* 在0号槽发出FLUSH CACHE. 它不能与NCQ命令并存, 须在没有命令时发出 */
+static void ahci_issue_flush(struct ahci_port* port) {
+    struct ahci_cmd_table* table = port->slots[0].table;
+    ahci_build_fis(table, port->lba48 ? CMD_FLUSH_CACHE_EXT : CMD_FLUSH_CACHE, 0, 0, 0, 0);
+    struct ahci_cmd_header* hdr = &port->cmd_list[0];
+    hdr->flags = sizeof(struct fis_reg_h2d) / 4;
+    hdr->prdtl = 0;
+    hdr->prdbc = 0;
+    port->flushing = true;
+    ahci_port_issue_slot(port, 0, false);
+}
+
+/* idx号槽的命令结束, error为0表示成功. 请求还有剩余扇区时接着下发 */
+static void ahci_complete(struct ahci_port* port, uint32_t idx, int32_t error) {
+    if (port->flushing) {
+        ASSERT(idx == 0);
+        port->flushing = false;
+        port->flush_pending = false;
+        port->flush_error = error;
+        complete(&port->flush_done);
+        return;
+    }
+    struct ahci_slot* slot = &port->slots[idx];
+    if (error == 0 && slot->left > 0) {
+        ahci_issue(port, idx);
+        return;
+    }
+    if (error != 0) {
+        printk("%s: %s lba %d failed\n", port->bdev.name, slot->rq.write ? "write" : "read", slot->rq.lba);
+    }
+    blk_end_request(&slot->rq, error);
+    slot->busy = false;
+    port->nr_free++;
+}
+
+/* 端口出错后恢复: 停下命令引擎使设备放弃所有未完成的命令, 清除错误后重新启动.
+ * 已交给设备的命令全部以出错结束 */
+static void ahci_port_recover(struct ahci_port* port, uint32_t is) {
+    printk("%s: port error, is 0x%x tfd 0x%x serr 0x%x\n", port->bdev.name, is, \
+           port_read(port, PORT_TFD), port_read(port, PORT_SERR));
+    ahci_port_stop(port);
+    port_write(port, PORT_SERR, 0xffffffff);
+    port_write(port, PORT_IS, 0xffffffff);
+    uint32_t failed = port->issued;
+    port->issued = 0;
+    ahci_port_start(port);
+
+    uint32_t idx = 0;
+    while (failed != 0) {
+        if (failed & 1) {
+            ahci_complete(port, idx, -1);
+        }
+        failed >>= 1;
+        idx++;
+    }
+}
+
+/* 回收已完成的命令: CI和SACT中都已清除的槽 */
+static void ahci_port_reap(struct ahci_port* port) {
+    enum intr_status old_status = intr_disable();
+    uint32_t is = port->irq_status;
+    port->irq_status = 0;
+    intr_set_status(old_status);
+
+    if (is & PORT_IS_ERROR) {
+        ahci_port_recover(port, is);
+        return;
+    }
+    uint32_t done = port->issued & ~(port_read(port, PORT_CI) | port_read(port, PORT_SACT));
+    port->issued &= ~done;
+    uint32_t idx = 0;
+    while (done != 0) {
+        if (done & 1) {
+            ahci_complete(port, idx, 0);
+        }
+        done >>= 1;
+        idx++;
+    }
+}
+
+/* 从请求队列取出请求放入空闲的槽. 有flush等待时先不取, 等已发出的命令都完成后发出flush */
+static void ahci_port_dispatch(struct ahci_port* port) {
+    if (port->flush_pending) {
+        if (!port->flushing && port->nr_free == port->nr_slots) {
+            ahci_issue_flush(port);
+        }
+        return;
+    }
+    uint32_t idx = 0;
+    while (port->nr_free > 0 && idx < port->nr_slots) {
+        struct ahci_slot* slot = &port->slots[idx];
+        if (slot->busy) {
+            idx++;
+            continue;
+        }
+        if (!blk_queue_fetch(&port->bdev.queue, &slot->rq)) {
+            break;
+        }
+        slot->busy = true;
+        port->nr_free--;
+        bio_iter_init(&slot->iter, &slot->rq);
+        slot->next_lba = slot->rq.lba;
+        slot->left = slot->rq.sec_cnt;
+        ahci_issue(port, idx);
+        idx++;
+    }
+}
+
+/* 派发线程是否有事可做, 调用时已关中断 */
+static bool ahci_port_has_work(struct ahci_port* port) {
+    if (port->irq_status != 0) {
+        return true;
+    }
+    if (port->flush_pending) {
+        return !port->flushing && port->nr_free == port->nr_slots;
+    }
+    return port->nr_free > 0 && !blk_queue_empty(&port->bdev.queue);
+}
+
+/* 端口的派发线程, 回收完成的命令并下发新的请求, 用NCQ时设备上同时有多条命令 */
+static void ahci_port_thread(void* arg) {
+    struct ahci_port* port = arg;
+    while (1) {
+        wait_event(&port->wq, ahci_port_has_work(port));
+        ahci_port_reap(port);
+        ahci_port_dispatch(port);
+    }
+}
+
+/* AHCI控制器的中断处理程序, 记下各端口的中断原因后交给派发线程 */
+static void intr_ahci_handler(uint8_t irq_no UNUSED) {
+    uint32_t hba_is = hba_read(HBA_IS);
+    if (hba_is == 0) {
+        return;     // 共用中断线的其他设备发出的
+    }
+    uint8_t idx = 0;
+    while (idx < port_cnt) {
+        struct ahci_port* port = &ports[idx];
+        if (hba_is & (1u << port->port_no)) {
+            /* 先清端口的中断状态再清全局的, 否则全局状态会立刻再次置位 */
+            uint32_t is = port_read(port, PORT_IS);
+            port_write(port, PORT_IS, is);
+            port->irq_status |= is;
+        }
+        idx++;
+    }
+    hba_write(HBA_IS, hba_is);
+    raise_softirq(SOFTIRQ_AHCI);
+}
+
+/* AHCI软中断, 唤醒有命令完成的端口的派发线程 */
+static void ahci_softirq(void) {
+    uint8_t idx = 0;
+    while (idx < port_cnt) {
+        struct ahci_port* port = &ports[idx];
+        enum intr_status old_status = intr_disable();
+        if (port->irq_status != 0) {
+            wait_queue_wake_one(&port->wq);
+        }
+        intr_set_status(old_status);
+        idx++;
+    }
+}
+
+/* 让硬盘把写缓存落盘, 由派发线程在队列中没有命令时发出 */
+static int32_t ahci_flush(struct block_device* bdev) {
+    struct ahci_port* port = bdev->private;
+    lock_acquire(&port->flush_lock);
+    reinit_completion(&port->flush_done);
+    enum intr_status old_status = intr_disable();
+    port->flush_pending = true;
+    wait_queue_wake_one(&port->wq);
+    intr_set_status(old_status);
+    wait_for_completion(&port->flush_done);
+    int32_t error = port->flush_error;
+    lock_release(&port->flush_lock);
+    return error;
+}
+
+static const struct block_ops ahci_block_ops = {
+    .submit = blk_queue_submit,
+    .flush = ahci_flush
+};
+
+/* 为idx号槽准备命令表 */
+static bool ahci_slot_setup(struct ahci_port* port, uint32_t idx) {
+    struct ahci_slot* slot = &port->slots[idx];
+    slot->table = get_kernel_pages(1);
+    if (slot->table == NULL) {
+        return false;
+    }
+    slot->busy = false;
+    port->cmd_list[idx].ctba = addr_v2p((uint32_t)slot->table);
+    port->cmd_list[idx].ctbau = 0;
+    return true;
+}
+
+/* 端口初始化失败时停下端口, 归还命令列表(含接收FIS区)和已分配的命令表.
+ * ports中的该项会留给下一个端口用, 指针一并清空 */
+static void ahci_port_free(struct ahci_port* port) {
+    ahci_port_stop(port);   // 停下后HBA不会再访问这些内存
+    uint32_t idx = 0;
+    while (idx < AHCI_MAX_SLOTS) {
+        if (port->slots[idx].table != NULL) {
+            mfree_page(PF_KERNEL, port->slots[idx].table, 1);
+            port->slots[idx].table = NULL;
+        }
+        idx++;
+    }
+    if (port->cmd_list != NULL) {
+        mfree_page(PF_KERNEL, port->cmd_list, 1);
+        port->cmd_list = NULL;
+    }
+}
+
+/* 用0号槽轮询执行IDENTIFY, 结果存入id_words, 它须在一页之内. 成功返回true */
+static bool ahci_identify(struct ahci_port* port, uint16_t* id_words) {
+    struct ahci_cmd_table* table = port->slots[0].table;
+    ahci_build_fis(table, CMD_IDENTIFY, 0, 0, 0, 0);
+    table->prdt[0].dba = addr_v2p((uint32_t)id_words);
+    table->prdt[0].dbau = 0;
+    table->prdt[0].dbc = 512 - 1;
+    struct ahci_cmd_header* hdr = &port->cmd_list[0];
+    hdr->flags = sizeof(struct fis_reg_h2d) / 4;
+    hdr->prdtl = 1;
+    hdr->prdbc = 0;
+    port_write(port, PORT_CI, 1);
+    if (!ahci_wait_clear(port, PORT_CI, 1, 5000)) {
+        return false;
+    }
+    return !(port_read(port, PORT_TFD) & TFD_STAT_ERR) && !(port_read(port, PORT_IS) & PORT_IS_ERROR);
+}
+
+/* 初始化port_no号端口, 接的是硬盘时注册为块设备的准备工作都在此完成 */
+static bool ahci_port_init(struct ahci_port* port, uint8_t port_no, uint32_t cap) {
+    port->port_no = port_no;
+    port->regs = hba_base + HBA_PORT_BASE + port_no * HBA_PORT_SIZE;
+    if ((port_read(port, PORT_SSTS) & 0xf) != SSTS_DET_OK || port_read(port, PORT_SIG) != SATA_SIG_ATA) {
+        return false;   // 没接设备, 或者接的是光驱等ATAPI设备
+    }
+    sprintf(port->bdev.name, "ad%c", 'a' + port_cnt);
+
+    /* 命令列表和接收FIS区共用一页 */
+    ahci_port_stop(port);
+    port->cmd_list = get_kernel_pages(1);
+    uint16_t* id_words = get_kernel_pages(1);
+    if (port->cmd_list == NULL || id_words == NULL || !ahci_slot_setup(port, 0)) {
+        printk("   %s: alloc memory failed\n", port->bdev.name);
+        if (id_words != NULL) {
+            mfree_page(PF_KERNEL, id_words, 1);
+        }
+        ahci_port_free(port);
+        return false;
+    }
+    uint32_t cmd_list_phys = addr_v2p((uint32_t)port->cmd_list);
+    port_write(port, PORT_CLB, cmd_list_phys);
+    port_write(port, PORT_CLBU, 0);
+    port_write(port, PORT_FB, cmd_list_phys + 1024);
+    port_write(port, PORT_FBU, 0);
+    port_write(port, PORT_SERR, 0xffffffff);
+    port_write(port, PORT_IE, 0);
+    port_write(port, PORT_IS, 0xffffffff);
+    ahci_port_start(port);
+
+    if (!ahci_identify(port, id_words)) {
+        printk("   %s: identify failed\n", port->bdev.name);
+        mfree_page(PF_KERNEL, id_words, 1);
+        ahci_port_free(port);
+        return false;
+    }
+    /* 第83字的第10位表示支持LBA48, 扇区号只用32位, 超过2TB的部分用不到 */
+    uint32_t sectors;
+    port->lba48 = (id_words[83] & 0x400) != 0;
+    if (port->lba48) {
+        sectors = id_words[100] | ((uint32_t)id_words[101] << 16);
+        if (id_words[102] != 0 || id_words[103] != 0) {
+            sectors = 0xffffffff;
+        }
+    } else {
+        sectors = id_words[60] | ((uint32_t)id_words[61] << 16);
+    }
+    /* 第76字的第8位表示支持NCQ, 第75字低5位是队列深度减1 */
+    uint32_t hba_slots = ((cap >> 8) & 0x1f) + 1;
+    port->ncq = (cap & HBA_CAP_SNCQ) && port->lba48 && (id_words[76] & 0x100);
+    port->nr_slots = 1;
+    if (port->ncq) {
+        uint32_t depth = (id_words[75] & 0x1f) + 1;
+        port->nr_slots = depth < hba_slots ? depth : hba_slots;
+    }
+    mfree_page(PF_KERNEL, id_words, 1);
+
+    uint32_t idx = 1;
+    while (idx < port->nr_slots) {
+        if (!ahci_slot_setup(port, idx)) {
+            break;      // 内存不够时少用几个槽
+        }
+        idx++;
+    }
+    port->nr_slots = idx;
+    port->nr_free = port->nr_slots;
+    port->issued = 0;
+    port->irq_status = 0;
+    port->flush_pending = false;
+    port->flushing = false;
+    lock_init(&port->flush_lock);
+    completion_init(&port->flush_done);
+    wait_queue_init(&port->wq);
+
+    struct block_device* bdev = &port->bdev;
+    bdev->sectors = sectors;
+    bdev->sector_size = BLOCK_SECTOR_SIZE;
+    bdev->ops = &ahci_block_ops;
+    bdev->private = port;
+    blk_queue_init(&bdev->queue, port->lba48 ? AHCI_MAX_SECTORS : 256, &port->wq);
+    printk("   %s: sata port %d, %d sectors, LBA48: %s, NCQ depth: %d\n", bdev->name, port_no, \
+           sectors, port->lba48 ? "yes" : "no", port->ncq ? port->nr_slots : 0);
+    return true;
+}
+
+/* 探测AHCI控制器, 把各端口上的硬盘注册为adX并扫描分区 */
+void ahci_init(void) {
+    printk("ahci_init start\n");
+    struct pci_device* pdev = pci_find_class(0x01, 0x06);    // 大容量存储控制器, SATA
+    /* prog_if为1表示AHCI, BAR5是寄存器所在的内存空间(ABAR) */
+    if (pdev == NULL || pdev->prog_if != 0x01 || pdev->irq_line >= 16) {
+        printk("ahci_init done\n");
+        return;
+    }
+    pci_enable(pdev, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+    hba_base = (uint32_t)ioremap(pci_bar(pdev, 5), AHCI_ABAR_SIZE);
+    if (hba_base == 0) {
+        printk("   ahci: map registers failed\n");
+        return;
+    }
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | HBA_GHC_AE);
+    uint32_t cap = hba_read(HBA_CAP);
+    uint32_t implemented = hba_read(HBA_PI);
+    printk("   ahci: abar 0x%x irq %d ports 0x%x\n", pci_bar(pdev, 5), pdev->irq_line, implemented);
+
+    port_cnt = 0;
+    uint8_t port_no = 0;
+    while (port_no < 32 && port_cnt < AHCI_MAX_DISKS) {
+        if ((implemented & (1u << port_no)) && ahci_port_init(&ports[port_cnt], port_no, cap)) {
+            port_cnt++;
+        }
+        port_no++;
+    }
+
+    /* 端口都准备好后再打开中断 */
+    open_softirq(SOFTIRQ_AHCI, ahci_softirq);
+    register_handler(0x20 + pdev->irq_line, intr_ahci_handler);
+    uint8_t idx = 0;
+    while (idx < port_cnt) {
+        port_write(&ports[idx], PORT_IS, 0xffffffff);
+        port_write(&ports[idx], PORT_IE, PORT_IE_MASK);
+        idx++;
+    }
+    hba_write(HBA_IS, 0xffffffff);
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | HBA_GHC_IE);
+    pic_enable_irq(pdev->irq_line);
+
+    idx = 0;
+    while (idx < port_cnt) {
+        struct ahci_port* port = &ports[idx];
+        struct task_struct* dispatcher = kthread_create(port->bdev.name, AHCI_PRIO, 1, ahci_port_thread, port);
+        if (dispatcher == NULL) {
+            PANIC("ahci_init: create dispatch thread failed\n");
+        }
+        kthread_detach(dispatcher);     // 派发线程不会退出, 也无人join
+        block_register(&port->bdev, true);
+        idx++;
+    }
+    printk("ahci_init done\n");
+}
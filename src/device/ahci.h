@@ -0,0 +1,9 @@
+#ifndef __DEVICE_AHCI_H
+#define __DEVICE_AHCI_H
+
+#define AHCI_MAX_DISKS      4       // 最多驱动的SATA硬盘数
+#define AHCI_MAX_SLOTS      32      // 每个端口的命令槽数上限, 也是NCQ的最大队列深度
+#define AHCI_MAX_SECTORS    1024    // 合并后一个请求最多的扇区数, 超出PRDT时分成几条命令
+
+void ahci_init(void);
+#endif
@@ -0,0 +1,310 @@
+#include "blk_queue.h"
+#include "block.h"
+#include "thread.h"
+#include "process.h"
+#include "interrupt.h"
+#include "timer.h"
+#include "debug.h"
+
+/* 初始化请求队列, 有bio入队时唤醒在dispatch_wq上等待的派发线程 */
+void blk_queue_init(struct request_queue* q, uint32_t max_sectors, struct wait_queue* dispatch_wq) {
+    list_init(&q->sorted);
+    list_init(&q->fifo);
+    q->nr_queued = 0;
+    q->head_pos = 0;
+    q->max_sectors = max_sectors;
+    q->dispatch_wq = dispatch_wq;
+}
+
+/* 判断队列中是否没有待下发的bio */
+bool blk_queue_empty(struct request_queue* q) {
+    return list_empty(&q->sorted);
+}
+
+/* 初始化读写bdev上从lba开始sec_cnt个扇区的bio */
+void bio_init(struct bio* bio, struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt, bool write) {
+    bio->bdev = bdev;
+    bio->lba = lba;
+    bio->sec_cnt = sec_cnt;
+    bio->buf = buf;
+    bio->write = write;
+    bio->owner = NULL;
+    bio->error = 0;
+    bio->end_io = NULL;
+    bio->private = NULL;
+}
+
+/* 累计忙碌时间和队列深度对时间的积分, 在in_flight变化前调用. 调用前须关中断 */
+static void blk_stats_update_time(struct blk_stats* st) {
+    uint32_t now = ticks;
+    if (st->in_flight > 0) {
+        st->io_ticks += now - st->stamp;
+        st->time_in_queue += st->in_flight * (now - st->stamp);
+    }
+    st->stamp = now;
+}
+
+/* 一个bio开始, 调用前须关中断 */
+static void blk_stats_start(struct blk_stats* st) {
+    blk_stats_update_time(st);
+    if (++st->in_flight > st->max_in_flight) {
+        st->max_in_flight = st->in_flight;
+    }
+}
+
+/* 一个bio结束, 延迟落在bucket号桶中. 调用前须关中断 */
+static void blk_stats_done(struct blk_stats* st, struct bio* bio, uint32_t bucket) {
+    blk_stats_update_time(st);
+    st->in_flight--;
+    st->ios[bio->write]++;
+    st->sectors[bio->write] += bio->sec_cnt;
+    st->lat_hist[bio->write][bucket]++;
+}
+
+/* bio从提交到现在的延迟所在的直方图桶. 时间戳计数器只有低32位, 超过1秒的按嘀嗒计 */
+static uint32_t blk_lat_bucket(struct bio* bio) {
+    uint32_t elapsed_ticks = ticks - bio->start_ticks;
+    uint32_t us = elapsed_ticks >= 100 ? elapsed_ticks * 10000 : tsc_to_us(rdtsc32() - bio->start_tsc);
+    uint32_t bucket = 0;
+    while (us > 1 && bucket < BLK_LAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/* 将bio按lba插入q的排序链表, 同一扇区的bio保持提交先后. 调用前须关中断 */
+static void blk_queue_insert(struct request_queue* q, struct bio* bio) {
+    struct list_elem* elem = q->sorted.head.next;
+    while (elem != &q->sorted.tail) {
+        struct bio* queued = elem2entry(struct bio, queue_tag, elem);
+        if (queued->lba > bio->lba) {
+            break;
+        }
+        elem = elem->next;
+    }
+    list_insert_before(elem, &bio->queue_tag);
+    list_append(&q->fifo, &bio->fifo_tag);
+    q->nr_queued++;
+    wait_queue_wake_one(q->dispatch_wq);
+}
+
+/* 使用请求队列的驱动的submit操作, 把bio排入bdev的请求队列 */
+void blk_queue_submit(struct block_device* bdev, struct bio* bio) {
+    enum intr_status old_status = intr_disable();
+    blk_queue_insert(&bdev->queue, bio);
+    intr_set_status(old_status);
+}
+
+/* 异步提交bio, 立即返回, 传输结束时调用bio->end_io.
+ * 当前线程在攒批时bio先留在plug中. bio及其缓冲区在结束前须保持有效 */
+void submit_bio(struct bio* bio) {
+    ASSERT(bio->sec_cnt > 0);
+    struct task_struct* cur = running_thread();
+    bio->owner = cur;
+    bio->deadline = ticks + (bio->write ? BLK_WRITE_EXPIRE : BLK_READ_EXPIRE);
+    bio->part = block_find_partition(bio->bdev, bio->lba);
+    bio->start_ticks = ticks;
+    bio->start_tsc = rdtsc32();
+    enum intr_status old_status = intr_disable();
+    blk_stats_start(&bio->bdev->stats);
+    if (bio->part != NULL) {
+        blk_stats_start(&bio->part->stats);
+    }
+    if (cur->plug != NULL) {
+        list_append(&cur->plug->bios, &bio->queue_tag);
+        intr_set_status(old_status);
+        return;
+    }
+    intr_set_status(old_status);
+    bio->bdev->ops->submit(bio->bdev, bio);
+}
+
+/* 通用的end_io, private指向等待者的完成量 */
+void bio_end_complete(struct bio* bio) {
+    complete((struct completion*)bio->private);
+}
+
+/* 提交bio并等待传输结束, 返回bio->error */
+int32_t submit_bio_wait(struct bio* bio) {
+    struct completion done;
+    completion_init(&done);
+    bio->end_io = bio_end_complete;
+    bio->private = &done;
+    submit_bio(bio);
+    wait_for_completion(&done);
+    return bio->error;
+}
+
+/* 选出请求的起点. 最早提交的bio已到期时先下发它, 否则按C-LOOK:
+ * 从上个请求的结束处向高地址找第一个, 没有则回到最低地址 */
+static struct bio* blk_queue_pick(struct request_queue* q) {
+    struct bio* oldest = elem2entry(struct bio, fifo_tag, q->fifo.head.next);
+    if (ticks_reached(oldest->deadline)) {
+        return oldest;
+    }
+    struct list_elem* elem = q->sorted.head.next;
+    while (elem != &q->sorted.tail) {
+        struct bio* bio = elem2entry(struct bio, queue_tag, elem);
+        if (bio->lba >= q->head_pos) {
+            return bio;
+        }
+        elem = elem->next;
+    }
+    return elem2entry(struct bio, queue_tag, q->sorted.head.next);
+}
+
+/* 排序链表中相邻的front和back方向相同且扇区首尾相接 */
+static bool bio_adjacent(struct bio* front, struct bio* back) {
+    return front->write == back->write && front->lba + front->sec_cnt == back->lba;
+}
+
+/* 取出下一个请求存入rq: 选出起点后向两头合并首尾相接的同向bio.
+ * 队列为空时返回false */
+bool blk_queue_fetch(struct request_queue* q, struct request* rq) {
+    enum intr_status old_status = intr_disable();
+    if (list_empty(&q->sorted)) {
+        intr_set_status(old_status);
+        return false;
+    }
+    struct bio* start = blk_queue_pick(q);
+    struct list_elem* first = &start->queue_tag;
+    struct list_elem* last = first;
+    uint32_t total = start->sec_cnt;
+
+    while (first->prev != &q->sorted.head) {
+        struct bio* front = elem2entry(struct bio, queue_tag, first->prev);
+        struct bio* back = elem2entry(struct bio, queue_tag, first);
+        if (!bio_adjacent(front, back) || total + front->sec_cnt > q->max_sectors) {
+            break;
+        }
+        total += front->sec_cnt;
+        first = first->prev;
+    }
+    while (last->next != &q->sorted.tail) {
+        struct bio* front = elem2entry(struct bio, queue_tag, last);
+        struct bio* back = elem2entry(struct bio, queue_tag, last->next);
+        if (!bio_adjacent(front, back) || total + back->sec_cnt > q->max_sectors) {
+            break;
+        }
+        total += back->sec_cnt;
+        last = last->next;
+    }
+
+    struct bio* head = elem2entry(struct bio, queue_tag, first);
+    rq->lba = head->lba;
+    rq->sec_cnt = total;
+    rq->write = start->write;
+    list_init(&rq->bios);
+    struct list_elem* elem = first;
+    while (1) {
+        struct list_elem* next = elem->next;
+        struct bio* bio = elem2entry(struct bio, queue_tag, elem);
+        list_remove(elem);
+        list_remove(&bio->fifo_tag);
+        list_append(&rq->bios, elem);
+        q->nr_queued--;
+        if (elem != first) {
+            bio->bdev->stats.merges[bio->write]++;
+            if (bio->part != NULL) {
+                bio->part->stats.merges[bio->write]++;
+            }
+        }
+        if (elem == last) {
+            break;
+        }
+        elem = next;
+    }
+    q->head_pos = rq->lba + total;
+    intr_set_status(old_status);
+    return true;
+}
+
+/* 请求传输结束, error为0表示成功. 对其中每个bio记入统计并调用end_io */
+void blk_end_request(struct request* rq, int32_t error) {
+    struct list_elem* elem = rq->bios.head.next;
+    while (elem != &rq->bios.tail) {
+        /* end_io之后bio可能随即被提交者释放, 先取出下一个 */
+        struct list_elem* next = elem->next;
+        struct bio* bio = elem2entry(struct bio, queue_tag, elem);
+        bio->error = error;
+        uint32_t bucket = blk_lat_bucket(bio);
+        enum intr_status old_status = intr_disable();
+        blk_stats_done(&bio->bdev->stats, bio, bucket);
+        if (bio->part != NULL) {
+            blk_stats_done(&bio->part->stats, bio, bucket);
+        }
+        intr_set_status(old_status);
+        if (bio->end_io != NULL) {
+            bio->end_io(bio);
+        }
+        elem = next;
+    }
+}
+
+/* 游标指向请求rq的第一个扇区 */
+void bio_iter_init(struct bio_iter* iter, struct request* rq) {
+    iter->elem = rq->bios.head.next;
+    iter->done = 0;
+}
+
+/* 取出接下来最多max_secs个扇区在同一bio中的一段, 存入buf和sec_cnt, 返回该段所属的bio */
+struct bio* bio_iter_next(struct bio_iter* iter, uint32_t max_secs, void** buf, uint32_t* sec_cnt) {
+    struct bio* bio = elem2entry(struct bio, queue_tag, iter->elem);
+    uint32_t left = bio->sec_cnt - iter->done;
+    *sec_cnt = left < max_secs ? left : max_secs;
+    *buf = (void*)((uint32_t)bio->buf + iter->done * 512);
+    iter->done += *sec_cnt;
+    if (iter->done == bio->sec_cnt) {
+        iter->elem = iter->elem->next;
+        iter->done = 0;
+    }
+    return bio;
+}
+
+/* 派发线程访问bio的缓冲区前调用. buf在提交者的用户空间时换上提交者的页表, 返回是否换过.
+ * 换页表期间禁止抢占, 否则被换下再换上时装回的是派发线程自己的页表 */
+bool bio_use_mm(struct bio* bio) {
+    if (bio->owner->pgdir == NULL || (uint32_t)bio->buf >= 0xc0000000) {
+        return false;       // 内核空间在所有页表中都相同
+    }
+    preempt_disable();
+    page_dir_activate(bio->owner);
+    return true;
+}
+
+/* 访问完缓冲区后恢复派发线程自己的页表 */
+void bio_unuse_mm(bool used) {
+    if (used) {
+        page_dir_activate(running_thread());
+        preempt_enable();
+    }
+}
+
+/* 开始攒批, 此后当前线程提交的bio先留在plug中, 便于在队列中合并 */
+void blk_start_plug(struct blk_plug* plug) {
+    struct task_struct* cur = running_thread();
+    ASSERT(cur->plug == NULL);
+    list_init(&plug->bios);
+    cur->plug = plug;
+}
+
+/* 结束攒批, 把攒下的bio全部交给请求队列 */
+void blk_finish_plug(struct blk_plug* plug UNUSED) {
+    struct task_struct* cur = running_thread();
+    ASSERT(cur->plug == plug);
+    blk_flush_plug(cur);
+    cur->plug = NULL;
+}
+
+/* 把pthread攒下的bio交给各自的设备, 线程睡眠前也会调用.
+ * 驱动的submit不会在此就结束bio, 因此不会唤醒正要睡眠的pthread自己 */
+void blk_flush_plug(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    struct blk_plug* plug = pthread->plug;
+    while (!list_empty(&plug->bios)) {
+        struct bio* bio = elem2entry(struct bio, queue_tag, list_pop(&plug->bios));
+        bio->bdev->ops->submit(bio->bdev, bio);
+    }
+    intr_set_status(old_status);
+}
@@ -0,0 +1,100 @@
+#ifndef __DEVICE_BLK_QUEUE_H
+#define __DEVICE_BLK_QUEUE_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "sync.h"
+
+struct task_struct;
+struct block_device;
+struct partition;
+struct bio;
+
+/* bio传输结束时的回调, 在派发线程中执行, 不应长时间阻塞 */
+typedef void bio_end_io_t(struct bio* bio);
+
+/* 未下发的bio最多等待的嘀嗒数, 超时后不再按扇区号排队.
+ * 读通常有线程在等, 期限比写短得多 */
+#define BLK_READ_EXPIRE     50
+#define BLK_WRITE_EXPIRE    500
+
+#define BLK_LAT_BUCKETS 24  // 延迟直方图的桶数, 第i桶统计[2^i, 2^(i+1))微秒, 末桶包括更长的
+
+/* 块设备或分区的I/O统计, 以bio为单位, 下标0为读, 1为写 */
+struct blk_stats {
+    uint32_t ios[2];            // 完成的bio数
+    uint32_t sectors[2];        // 完成的扇区数
+    uint32_t merges[2];         // 派发时与前面的bio合并成一个请求的bio数
+    uint32_t in_flight;         // 已提交尚未完成的bio数, 即当前队列深度
+    uint32_t max_in_flight;
+    uint32_t io_ticks;          // 有bio未完成的累计嘀嗒数, 即忙碌时间
+    uint32_t time_in_queue;     // in_flight对嘀嗒的累积, 除以io_ticks得忙碌时的平均队列深度
+    uint32_t stamp;             // 上次累计时间的嘀嗒
+    uint32_t lat_hist[2][BLK_LAT_BUCKETS];  // 从提交到完成的延迟, 按微秒取log2分桶
+};
+
+/* 块设备的请求队列, bio在此排队, 由驱动的派发线程取出 */
+struct request_queue {
+    struct list sorted;             // 待下发的bio, 按lba升序
+    struct list fifo;               // 待下发的bio, 按提交先后
+    uint32_t nr_queued;             // 待下发的bio数
+    uint32_t head_pos;              // 上个请求的结束扇区, C-LOOK从这里向高地址扫描
+    uint32_t max_sectors;           // 合并后一个请求最多的扇区数
+    struct wait_queue* dispatch_wq; // 有bio入队时唤醒的派发线程
+};
+
+/* 一次块I/O, 读写从lba开始的连续sec_cnt个扇区 */
+struct bio {
+    struct block_device* bdev;      // 目标设备
+    uint32_t lba;
+    uint32_t sec_cnt;
+    void* buf;
+    bool write;
+    struct task_struct* owner;      // 提交者, buf在其用户空间时驱动要借用它的页表
+    uint32_t deadline;              // 到此嘀嗒仍未下发则优先下发
+    struct list_elem queue_tag;     // 用于加入sorted, plug或request的bios
+    struct list_elem fifo_tag;      // 用于加入fifo
+    int32_t error;                  // 传输结束后为0表示成功, -1表示出错
+    bio_end_io_t* end_io;           // 传输结束时调用, 可为NULL
+    void* private;                  // 供end_io使用
+    struct partition* part;         // lba所在的分区, 用于统计, 不在分区内时为NULL
+    uint32_t start_ticks;           // 提交时刻, 用于统计延迟
+    uint32_t start_tsc;
+};
+
+/* 派发时合并成的请求, 由扇区首尾相接, 方向相同的若干bio组成 */
+struct request {
+    uint32_t lba;
+    uint32_t sec_cnt;
+    bool write;
+    struct list bios;               // 按lba升序
+};
+
+/* 在请求中逐段取出缓冲区的游标 */
+struct bio_iter {
+    struct list_elem* elem;         // 当前bio
+    uint32_t done;                  // 当前bio中已取出的扇区数
+};
+
+/* 线程攒批提交, 期间的bio在结束攒批或线程睡眠时才进入请求队列 */
+struct blk_plug {
+    struct list bios;
+};
+
+void blk_queue_init(struct request_queue* q, uint32_t max_sectors, struct wait_queue* dispatch_wq);
+bool blk_queue_empty(struct request_queue* q);
+bool blk_queue_fetch(struct request_queue* q, struct request* rq);
+void blk_end_request(struct request* rq, int32_t error);
+void blk_queue_submit(struct block_device* bdev, struct bio* bio);
+void bio_init(struct bio* bio, struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt, bool write);
+void submit_bio(struct bio* bio);
+int32_t submit_bio_wait(struct bio* bio);
+void bio_end_complete(struct bio* bio);
+void bio_iter_init(struct bio_iter* iter, struct request* rq);
+struct bio* bio_iter_next(struct bio_iter* iter, uint32_t max_secs, void** buf, uint32_t* sec_cnt);
+bool bio_use_mm(struct bio* bio);
+void bio_unuse_mm(bool used);
+void blk_start_plug(struct blk_plug* plug);
+void blk_finish_plug(struct blk_plug* plug);
+void blk_flush_plug(struct task_struct* pthread);
+#endif
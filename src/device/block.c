@@ -0,0 +1,242 @@
+#include "block.h"
+#include "memory.h"
+#include "string.h"
+#include "stdio.h"
+#include "stdio_kernel.h"
+#include "debug.h"
+
+struct list block_devices;      // 已注册的块设备
+struct list partition_list;     // 分区队列
+
+/* 用于记录总扩展分区的起始lba,初始为0,partition_scan时以此为标记 */
+static int32_t ext_lba_base = 0;
+
+static uint8_t p_no = 0, l_no = 0;     // 用来记录硬盘主分区和逻辑分区的下标
+
+/* 构建一个16字节大小的结构体,用来存分区表项 */
+struct partition_table_entry {
+   uint8_t  bootable;		 // 是否可引导
+   uint8_t  start_head;		 // 起始磁头号
+   uint8_t  start_sec;		 // 起始扇区号
+   uint8_t  start_chs;		 // 起始柱面号
+   uint8_t  fs_type;		 // 分区类型
+   uint8_t  end_head;		 // 结束磁头号
+   uint8_t  end_sec;		 // 结束扇区号
+   uint8_t  end_chs;		 // 结束柱面号
+/* 更需要关注的是下面这两项 */
+   uint32_t start_lba;		 // 本分区起始扇区的lba地址
+   uint32_t sec_cnt;		 // 本分区的扇区数目
+} __attribute__ ((packed));	 // 保证此结构是16字节大小
+
+/* 引导扇区,mbr或ebr所在的扇区 */
+struct boot_sector {
+   uint8_t  other[446];		 // 引导代码
+   struct   partition_table_entry partition_table[4];       // 分区表中有4项,共64字节
+   uint16_t signature;		 // 启动扇区的结束标志是0x55,0xaa,
+} __attribute__ ((packed));
+
+/* 初始化块设备层, 须在各驱动注册设备之前调用 */
+void block_init(void) {
+    printk("block_init start\n");
+    list_init(&block_devices);
+    list_init(&partition_list);
+    printk("block_init done\n");
+}
+
+/* 为bdev登记一个分区, logical为true时是逻辑分区. 分区数已满时返回NULL */
+struct partition* block_add_partition(struct block_device* bdev, uint32_t start_lba, uint32_t sec_cnt, bool logical) {
+    struct partition* part;
+    if (logical) {
+        if (l_no >= 8) {    // 只支持8个逻辑分区,避免数组越界
+            return NULL;
+        }
+        part = &bdev->logic_parts[l_no];
+        sprintf(part->name, "%s%d", bdev->name, l_no + 5);	 // 逻辑分区数字是从5开始,主分区是1～4.
+        l_no++;
+    } else {
+        if (p_no >= 4) {
+            return NULL;
+        }
+        part = &bdev->prime_parts[p_no];
+        sprintf(part->name, "%s%d", bdev->name, p_no + 1);
+        p_no++;
+    }
+    part->start_lba = start_lba;
+    part->sec_cnt = sec_cnt;
+    part->bdev = bdev;
+    list_append(&partition_list, &part->part_tag);
+    printk("   %s start_lba:0x%x, sec_cnt:0x%x\n", part->name, part->start_lba, part->sec_cnt);
+    return part;
+}
+
+/* 扫描块设备bdev中地址为ext_lba的扇区中的所有分区 */
+static void partition_scan(struct block_device* bdev, uint32_t ext_lba) {
+    struct boot_sector* bs = sys_malloc(sizeof(struct boot_sector));
+    block_read(bdev, ext_lba, bs, 1);
+    uint8_t part_idx = 0;
+    struct partition_table_entry* p = bs->partition_table;
+
+    /* 遍历分区表4个分区表项 */
+    while (part_idx++ < 4) {
+        if (p->fs_type == 0x5) {	 // 若为扩展分区
+            if (ext_lba_base != 0) {
+            /* 子扩展分区的start_lba是相对于主引导扇区中的总扩展分区地址 */
+                partition_scan(bdev, p->start_lba + ext_lba_base);
+            } else { // ext_lba_base为0表示是第一次读取引导块,也就是主引导记录所在的扇区
+            /* 记录下扩展分区的起始lba地址,后面所有的扩展分区地址都相对于此 */
+                ext_lba_base = p->start_lba;
+                partition_scan(bdev, p->start_lba);
+            }
+        } else if (p->fs_type != 0) { // 若是有效的分区类型
+            /* ext_lba为0时全是主分区 */
+            if (block_add_partition(bdev, ext_lba + p->start_lba, p->sec_cnt, ext_lba != 0) == NULL) {
+                break;
+            }
+        }
+        p++;
+    }
+    sys_free(bs);
+}
+
+/* 注册驱动已初始化好的块设备, scan_parts为true时扫描其上的分区表 */
+void block_register(struct block_device* bdev, bool scan_parts) {
+    ASSERT(bdev->sector_size == BLOCK_SECTOR_SIZE);
+    ASSERT(bdev->ops != NULL && bdev->ops->submit != NULL);
+    list_append(&block_devices, &bdev->bdev_tag);
+    printk("   block device %s: %dMB\n", bdev->name, bdev->sectors / 2048);
+
+    /* 每块设备的分区从头编号 */
+    ext_lba_base = 0;
+    p_no = 0, l_no = 0;
+    if (scan_parts) {
+        partition_scan(bdev, 0);
+    }
+}
+
+/* 按名字查找块设备, 找不到返回NULL */
+struct block_device* block_find(const char* name) {
+    struct list_elem* elem = block_devices.head.next;
+    while (elem != &block_devices.tail) {
+        struct block_device* bdev = elem2entry(struct block_device, bdev_tag, elem);
+        if (!strcmp(bdev->name, name)) {
+            return bdev;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
+/* 返回bdev上包含扇区lba的分区, 不在任何分区内时返回NULL */
+struct partition* block_find_partition(struct block_device* bdev, uint32_t lba) {
+    uint32_t part_idx = 0;
+    while (part_idx < 12) {
+        struct partition* part = part_idx < 4 ? &bdev->prime_parts[part_idx] : &bdev->logic_parts[part_idx - 4];
+        if (part->sec_cnt != 0 && lba >= part->start_lba && lba - part->start_lba < part->sec_cnt) {
+            return part;
+        }
+        part_idx++;
+    }
+    return NULL;
+}
+
+/* 从bdev读取sec_cnt个扇区到buf, 返回时数据已读入 */
+void block_read(struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    ASSERT(sec_cnt > 0);
+    ASSERT(lba + sec_cnt <= bdev->sectors);
+    struct bio bio;
+    bio_init(&bio, bdev, lba, buf, sec_cnt, false);
+    if (submit_bio_wait(&bio) != 0) {
+        char error[64];
+        sprintf(error, "%s read sector %d failed!!!!!!\n", bdev->name, lba);
+        PANIC(error);
+    }
+}
+
+/* 将buf中sec_cnt扇区数据写入bdev, 返回时数据已写入 */
+void block_write(struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    ASSERT(sec_cnt > 0);
+    ASSERT(lba + sec_cnt <= bdev->sectors);
+    struct bio bio;
+    bio_init(&bio, bdev, lba, buf, sec_cnt, true);
+    if (submit_bio_wait(&bio) != 0) {
+        char error[64];
+        sprintf(error, "%s write sector %d failed!!!!!!\n", bdev->name, lba);
+        PANIC(error);
+    }
+}
+
+/* 让bdev把已完成的写落到介质上, 成功返回0 */
+int32_t block_flush(struct block_device* bdev) {
+    if (bdev->ops->flush == NULL) {
+        return 0;
+    }
+    return bdev->ops->flush(bdev);
+}
+
+/* 输出一行统计: 读写的bio数, 扇区数, 合并数, 当前和最大队列深度, 忙碌时间及平均队列深度 */
+static void iostat_summary(const char* name, struct blk_stats* st) {
+    uint32_t avg_queue = st->io_ticks == 0 ? 0 : st->time_in_queue * 100 / st->io_ticks;
+    printk("   %s: read %d/%d/%d write %d/%d/%d queue %d max %d busy %dms avgq %d.%d%d\n", name,
+           st->ios[0], st->sectors[0], st->merges[0], st->ios[1], st->sectors[1], st->merges[1],
+           st->in_flight, st->max_in_flight, st->io_ticks * 10,
+           avg_queue / 100, avg_queue / 10 % 10, avg_queue % 10);
+}
+
+/* 输出读或写的延迟直方图, 只列出非空的桶, 以桶的下限标注 */
+static void iostat_histogram(const char* label, uint32_t* hist) {
+    printk("   %s latency(us):", label);
+    uint32_t bucket = 0;
+    while (bucket < BLK_LAT_BUCKETS) {
+        if (hist[bucket] != 0) {
+            printk(" %d+:%d", bucket == 0 ? 0 : 1 << bucket, hist[bucket]);
+        }
+        bucket++;
+    }
+    printk("\n");
+}
+
+/* 输出I/O统计. name为NULL时列出所有块设备及分区的汇总,
+ * 否则输出该设备或分区的汇总和延迟直方图, 找不到时返回-1 */
+int32_t sys_iostat(const char* name) {
+    struct list_elem* elem;
+    if (name == NULL) {
+        printk("io statistics (ios/sectors/merges):\n");
+        elem = block_devices.head.next;
+        while (elem != &block_devices.tail) {
+            struct block_device* bdev = elem2entry(struct block_device, bdev_tag, elem);
+            iostat_summary(bdev->name, &bdev->stats);
+            elem = elem->next;
+        }
+        elem = partition_list.head.next;
+        while (elem != &partition_list.tail) {
+            struct partition* part = elem2entry(struct partition, part_tag, elem);
+            iostat_summary(part->name, &part->stats);
+            elem = elem->next;
+        }
+        return 0;
+    }
+
+    struct blk_stats* st = NULL;
+    struct block_device* bdev = block_find(name);
+    if (bdev != NULL) {
+        st = &bdev->stats;
+    } else {
+        elem = partition_list.head.next;
+        while (elem != &partition_list.tail) {
+            struct partition* part = elem2entry(struct partition, part_tag, elem);
+            if (!strcmp(part->name, name)) {
+                st = &part->stats;
+                break;
+            }
+            elem = elem->next;
+        }
+    }
+    if (st == NULL) {
+        return -1;
+    }
+    printk("io statistics (ios/sectors/merges):\n");
+    iostat_summary(name, st);
+    iostat_histogram("read", st->lat_hist[0]);
+    iostat_histogram("write", st->lat_hist[1]);
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef __DEVICE_BLOCK_H
+#define __DEVICE_BLOCK_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "bitmap.h"
+#include "sync.h"
+#include "blk_queue.h"
+
+#define BLOCK_NAME_LEN 8
+#define BLOCK_SECTOR_SIZE 512   // 块设备层只支持512字节的扇区
+
+struct block_device;
+
+struct partition {
+    uint32_t start_lba;         // 起始扇区
+    uint32_t sec_cnt;           // 扇区数
+    struct block_device* bdev;  // 分区所属的块设备
+    struct list_elem part_tag;  // 队列标记
+    char name[8];               // 分区名
+    struct super_block* sb;     // 本分区的超级块
+    struct bitmap block_bitmap; // 块位图，管理本分区的块
+    struct bitmap prealloc_bitmap;  // 被文件预分配窗口预留的块, 只在内存中, 分配块时与块位图一起检查
+    struct bitmap inode_bitmap; // i结点位图
+    struct list open_inodes;    // 本分区打开的i结点队列
+    struct rwlock inode_lock;   // 保护open_inodes, 查找多而增删少, 用读写锁
+    struct blk_stats stats;     // 落在本分区的I/O统计
+};
+
+/* 块设备驱动提供的操作 */
+struct block_ops {
+    /* 开始传输bio并立即返回, 传输结束后调用bio->end_io, 不能在调用者上下文中完成 */
+    void (*submit)(struct block_device* bdev, struct bio* bio);
+    /* 把设备写缓存中的数据落到介质上, 成功返回0, 不需要时可为NULL */
+    int32_t (*flush)(struct block_device* bdev);
+};
+
+/* 块设备, 文件系统只通过它访问硬盘, 不关心背后是哪种驱动 */
+struct block_device {
+    char name[BLOCK_NAME_LEN];          // 设备名, 如sda
+    uint32_t sectors;                   // 容量, 以扇区计
+    uint32_t sector_size;               // 扇区字节数
+    const struct block_ops* ops;
+    void* private;                      // 驱动的私有数据
+    struct request_queue queue;         // 使用请求队列的驱动在此排队
+    struct partition prime_parts[4];    // 主分区最多4个
+    struct partition logic_parts[8];    // 逻辑分区无限，但这里就支持8个
+    struct list_elem bdev_tag;          // 用于加入block_devices
+    struct blk_stats stats;             // 整个设备的I/O统计
+};
+
+extern struct list block_devices;
+extern struct list partition_list;
+
+void block_init(void);
+void block_register(struct block_device* bdev, bool scan_parts);
+struct partition* block_add_partition(struct block_device* bdev, uint32_t start_lba, uint32_t sec_cnt, bool logical);
+struct block_device* block_find(const char* name);
+struct partition* block_find_partition(struct block_device* bdev, uint32_t lba);
+void block_read(struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt);
+void block_write(struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt);
+int32_t block_flush(struct block_device* bdev);
+int32_t sys_iostat(const char* name);
+#endif
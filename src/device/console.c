@@ -8,6 +8,7 @@ static struct lock console_lock;    // 控制台锁
 /* 初始化终端 */
 void console_init() {
     lock_init(&console_lock);
+    lock_stat_register(&console_lock, "console");
 }
 
 /* 获取终端 */
@@ -1,4 +1,5 @@
 #include "ide.h"
+#include "softirq.h"
 #include "sync.h"
 #include "io.h"
 #include "stdio.h"
@@ -10,6 +11,9 @@
 #include "timer.h"
 #include "string.h"
 #include "list.h"
+#include "trace.h"
+#include "pci.h"
+#include "kthread.h"
 
 /* 定义硬盘各寄存器的端口号 */
 #define reg_data(channel)	 (channel->port_base + 0)
@@ -28,6 +32,7 @@
 #define BIT_STAT_BSY	 0x80	      // 硬盘忙
 #define BIT_STAT_DRDY	 0x40	      // 驱动器准备好	 
 #define BIT_STAT_DRQ	 0x8	      // 数据传输准备好了
+#define BIT_STAT_ERR	 0x1	      // 命令出错
 
 /* device寄存器的一些关键位 */
 #define BIT_DEV_MBS	0xa0	    // 第7位和第5位固定为1
@@ -38,43 +43,46 @@
 #define CMD_IDENTIFY	   0xec	    // identify指令
 #define CMD_READ_SECTOR	   0x20     // 读扇区指令
 #define CMD_WRITE_SECTOR   0x30	    // 写扇区指令
-
-/* 定义可读写的最大扇区数,调试用的 */
-#define max_lba ((80*1024*1024/512) - 1)	// 只支持80MB硬盘
+#define CMD_READ_DMA	   0xc8	    // DMA读扇区指令
+#define CMD_WRITE_DMA	   0xca	    // DMA写扇区指令
+#define CMD_READ_SECTOR_EXT  0x24   // LBA48读扇区指令
+#define CMD_WRITE_SECTOR_EXT 0x34   // LBA48写扇区指令
+#define CMD_READ_DMA_EXT   0x25	    // LBA48 DMA读扇区指令
+#define CMD_WRITE_DMA_EXT  0x35	    // LBA48 DMA写扇区指令
+#define CMD_READ_MULTIPLE  0xc4	    // 每次中断读多个扇区
+#define CMD_WRITE_MULTIPLE 0xc5	    // 每次中断写多个扇区
+#define CMD_READ_MULTIPLE_EXT  0x29 // LBA48每次中断读多个扇区
+#define CMD_WRITE_MULTIPLE_EXT 0x39 // LBA48每次中断写多个扇区
+#define CMD_SET_MULTIPLE   0xc6	    // 设置每次中断传输的扇区数
+#define CMD_FLUSH_CACHE	   0xe7	    // 把写缓存落盘
+#define CMD_FLUSH_CACHE_EXT 0xea    // LBA48把写缓存落盘
+
+#define BUSY_SPIN_READS	 1000	      // 睡眠前先自旋读状态的次数, 每次端口读约1微秒
+
+/* 一条命令最多读写的扇区数 */
+#define LBA28_MAX_SECTORS  256	    // 扇区数寄存器8位, 0表示256
+#define LBA48_MAX_SECTORS  65536    // 扇区数寄存器16位, 0表示65536
+
+/* 总线主控IDE寄存器, 每个通道8个端口 */
+#define reg_bm_cmd(channel)	 (channel->bmide_base + 0)
+#define reg_bm_status(channel)	 (channel->bmide_base + 2)
+#define reg_bm_prdt(channel)	 (channel->bmide_base + 4)
+#define BIT_BM_START	 0x1	      // 开始DMA
+#define BIT_BM_READ	 0x8	      // 方向为硬盘到内存
+#define BIT_BM_ERR	 0x2	      // DMA出错, 写1清除
+#define BIT_BM_IRQ	 0x4	      // 硬盘已发中断, 写1清除
+#define PRD_EOT		 0x8000	      // PRD表的最后一项
+#define PRD_MAX		 (PG_SIZE / sizeof(struct prd))
+#define DMA_BOUNDARY	 0x10000      // PRD描述的区域不能跨越64KB边界
+/* 单个缓冲区不按页对齐时也放得下PRD表, 每页至少占一项.
+ * 由多个bio合并成的请求仍可能放不下, 那时改用PIO */
+#define DMA_MAX_SECTORS	 ((PRD_MAX - 1) * (PG_SIZE / 512))
+
+#define IDE_DISPATCH_PRIO 31	      // 派发线程的优先级
 
 uint8_t channel_cnt;	   // 按硬盘数计算的通道数
 struct ide_channel channels[2];	 // 有两个ide通道
 
-/* 用于记录总扩展分区的起始lba,初始为0,partition_scan时以此为标记 */
-int32_t ext_lba_base = 0;
-
-uint8_t p_no = 0, l_no = 0;	 // 用来记录硬盘主分区和逻辑分区的下标
-
-struct list partition_list;	 // 分区队列
-
-/* 构建一个16字节大小的结构体,用来存分区表项 */
-struct partition_table_entry {
-   uint8_t  bootable;		 // 是否可引导	
-   uint8_t  start_head;		 // 起始磁头号
-   uint8_t  start_sec;		 // 起始扇区号
-   uint8_t  start_chs;		 // 起始柱面号
-   uint8_t  fs_type;		 // 分区类型
-   uint8_t  end_head;		 // 结束磁头号
-   uint8_t  end_sec;		 // 结束扇区号
-   uint8_t  end_chs;		 // 结束柱面号
-/* 更需要关注的是下面这两项 */
-   uint32_t start_lba;		 // 本分区起始扇区的lba地址
-   uint32_t sec_cnt;		 // 本分区的扇区数目
-} __attribute__ ((packed));	 // 保证此结构是16字节大小
-
-/* 引导扇区,mbr或ebr所在的扇区 */
-struct boot_sector {
-   uint8_t  other[446];		 // 引导代码
-   struct   partition_table_entry partition_table[4];       // 分区表中有4项,共64字节
-   uint16_t signature;		 // 启动扇区的结束标志是0x55,0xaa,
-} __attribute__ ((packed));
-
-
 /* 选择读写的硬盘（主盘或从盘） */
 static void select_disk(struct disk* hd) {  
     uint8_t reg_device = BIT_DEV_MBS | BIT_DEV_LBA;
@@ -86,10 +94,27 @@ static void select_disk(struct disk* hd) {
 }
 
 /* 向硬盘控制器写入起始扇区地址及要读写的扇区数 */
-static void select_sector(struct disk* hd, uint32_t lba, uint8_t sec_cnt) {
-    ASSERT(lba <= max_lba);
+static void select_sector(struct disk* hd, uint32_t lba, uint32_t sec_cnt) {
+    ASSERT(lba + sec_cnt <= hd->sectors);
     struct ide_channel* channel = hd->my_channel;
 
+    if (hd->lba48) {
+        ASSERT(sec_cnt <= LBA48_MAX_SECTORS);
+        /* LBA48的扇区数和地址寄存器都是先写高字节再写低字节.
+         * 扇区数为65536时两次都写入0; lba只有32位, 32~47位恒为0 */
+        outb(reg_sect_cnt(channel), sec_cnt >> 8);
+        outb(reg_lba_l(channel), lba >> 24);
+        outb(reg_lba_m(channel), 0);
+        outb(reg_lba_h(channel), 0);
+        outb(reg_sect_cnt(channel), sec_cnt);
+        outb(reg_lba_l(channel), lba);
+        outb(reg_lba_m(channel), lba >> 8);
+        outb(reg_lba_h(channel), lba >> 16);
+        outb(reg_dev(channel), BIT_DEV_MBS | BIT_DEV_LBA | (hd->dev_no == 1 ? BIT_DEV_DEV : 0));
+        return;
+    }
+    ASSERT(sec_cnt <= LBA28_MAX_SECTORS);
+
     /* 写入要读写的扇区数*/
     outb(reg_sect_cnt(channel), sec_cnt);	 // 如果sec_cnt为0,则表示写入256个扇区
 
@@ -103,138 +128,352 @@ static void select_sector(struct disk* hd, uint32_t lba, uint8_t sec_cnt) {
     outb(reg_dev(channel), BIT_DEV_MBS | BIT_DEV_LBA | (hd->dev_no == 1 ? BIT_DEV_DEV : 0) | lba >> 24);
 }
 
-/* 向通道channel发命令cmd */
-static void cmd_out(struct ide_channel* channel, uint8_t cmd) {
+/* 准备等待通道的下一次中断, 须在硬盘可能发中断之前调用 */
+static void arm_intr(struct ide_channel* channel) {
     /* 只要向硬盘发出了命令便将此标记置为true,硬盘中断处理程序需要根据它来判断 */
+    reinit_completion(&channel->disk_done);
     channel->expecting_intr = true;
+}
+
+/* 向通道channel发命令cmd */
+static void cmd_out(struct ide_channel* channel, uint8_t cmd) {
+    arm_intr(channel);
     outb(reg_cmd(channel), cmd);
 }
 
+/* 阻塞自己直到硬盘中断处理程序通知命令完成 */
+static void wait_disk_done(struct ide_channel* channel) {
+    /* 若中断在睡眠前就已到来, 完成量已被置位, 不会再睡眠 */
+    wait_for_completion(&channel->disk_done);
+}
+
 /* 硬盘读入sec_cnt个扇区的数据到buf */
-static void read_from_sector(struct disk* hd, void* buf, uint8_t sec_cnt) {
-    uint32_t size_in_byte;
-    if (sec_cnt == 0) {     // 0表示256个扇区，而不是0个扇区
-    /* 因为sec_cnt是8位变量,由主调函数将其赋值时,若为256则会将最高位的1丢掉变为0 */
-        size_in_byte = 256 * 512;
-    } else { 
-        size_in_byte = sec_cnt * 512; 
+static void read_from_sector(struct disk* hd, void* buf, uint32_t sec_cnt) {
+    uint32_t size_in_byte = sec_cnt * 512;
+    if (hd->io32) {
+        insl(reg_data(hd->my_channel), buf, size_in_byte / 4);  // 按双字读, 端口访问次数减半
+    } else {
+        insw(reg_data(hd->my_channel), buf, size_in_byte / 2);  // insw的单位是字，用(扇区数*512 / 2)计算得到
     }
-    insw(reg_data(hd->my_channel), buf, size_in_byte / 2);  // insw的单位是字，用(扇区数*512 / 2)计算得到
 }
 
 /* 将buf中sec_cnt扇区的数据写入硬盘 */
-static void write2sector(struct disk* hd, void* buf, uint8_t sec_cnt) {
-    uint32_t size_in_byte;
-    if (sec_cnt == 0) {
-    /* 因为sec_cnt是8位变量,由主调函数将其赋值时,若为256则会将最高位的1丢掉变为0 */
-        size_in_byte = 256 * 512;
-    } else { 
-        size_in_byte = sec_cnt * 512; 
+static void write2sector(struct disk* hd, void* buf, uint32_t sec_cnt) {
+    uint32_t size_in_byte = sec_cnt * 512;
+    if (hd->io32) {
+        outsl(reg_data(hd->my_channel), buf, size_in_byte / 4);
+    } else {
+        outsw(reg_data(hd->my_channel), buf, size_in_byte / 2);
+    }
+}
+
+/* 一条命令最多读写的扇区数, 受寻址方式和PRD表大小限制 */
+static uint32_t ide_max_sectors(struct disk* hd) {
+    uint32_t max_sectors = hd->lba48 ? LBA48_MAX_SECTORS : LBA28_MAX_SECTORS;
+    if (hd->dma && max_sectors > DMA_MAX_SECTORS) {
+        max_sectors = DMA_MAX_SECTORS;
     }
-    outsw(reg_data(hd->my_channel), buf, size_in_byte / 2);
+    return max_sectors;
 }
 
-/* 等待30秒 */
+/* 等待硬盘不忙, 返回是否可以传输数据, 最多等待30秒.
+ * 多数情况下硬盘很快就绪, 先自旋读备用状态寄存器, 不必为此睡过整个嘀嗒;
+ * 读备用状态寄存器不会清除硬盘的中断. 自旋后仍忙才每次睡眠10毫秒 */
 static bool busy_wait(struct disk* hd) {
     struct ide_channel* channel = hd->my_channel;
-    uint16_t time_limit = 30 * 1000;	     // 可以等待30000毫秒
-    while (time_limit -= 10 >= 0) {
-        if (!(inb(reg_status(channel)) & BIT_STAT_BSY)) {
-            return (inb(reg_status(channel)) & BIT_STAT_DRQ);
-        } else {
-            mtime_sleep(10);		     // 睡眠10毫秒
+    uint32_t spin = BUSY_SPIN_READS;
+    while (spin-- > 0) {
+        if (!(inb(reg_alt_status(channel)) & BIT_STAT_BSY)) {
+            return (inb(reg_alt_status(channel)) & BIT_STAT_DRQ);
+        }
+    }
+    int32_t time_limit = 30 * 1000;	     // 可以等待30000毫秒
+    while (time_limit > 0) {
+        if (!(inb(reg_alt_status(channel)) & BIT_STAT_BSY)) {
+            return (inb(reg_alt_status(channel)) & BIT_STAT_DRQ);
         }
+        mtime_sleep(10);		     // 睡眠10毫秒
+        time_limit -= 10;
     }
     return false;
 }
 
-/* 从硬盘读取sec_cnt个扇区到buf */
-void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {   // 此处的sec_cnt为32位大小
-    ASSERT(lba <= max_lba);
-    ASSERT(sec_cnt > 0);
-    lock_acquire (&hd->my_channel->lock);
+/* 为iter接下来的sec_cnt个扇区建立PRD表.
+ * 这些扇区可能分属多个bio, 每段缓冲区在虚拟地址上连续, 物理页却可能分散,
+ * 逐页翻译, 物理上相邻的页合并为一项.
+ * 某段未按2字节对齐或PRD表放不下时返回false, 由调用者改用PIO */
+static bool ide_dma_build_prd(struct ide_channel* channel, struct bio_iter* iter, uint32_t sec_cnt) {
+    int32_t prd_idx = -1;
+    uint32_t prd_len = 0;   // 当前项已描述的字节数
+    while (sec_cnt > 0) {
+        void* buf;
+        uint32_t secs;
+        struct bio* bio = bio_iter_next(iter, sec_cnt, &buf, &secs);
+        if ((uint32_t)buf & 0x1) {
+            return false;
+        }
+        bool used = bio_use_mm(bio);    // 用户空间的缓冲区要在提交者的页表中翻译
+        uint32_t vaddr = (uint32_t)buf;
+        uint32_t byte_cnt = secs * 512;
+        while (byte_cnt > 0) {
+            uint32_t phys = addr_v2p(vaddr);
+            uint32_t len = PG_SIZE - (vaddr & 0xfff);   // 到本页结束
+            if (len > byte_cnt) {
+                len = byte_cnt;
+            }
+            struct prd* cur = prd_idx >= 0 ? &channel->prd_table[prd_idx] : NULL;
+            if (cur != NULL && cur->phys_addr + prd_len == phys && \
+                (cur->phys_addr & ~(DMA_BOUNDARY - 1)) == ((phys + len - 1) & ~(DMA_BOUNDARY - 1))) {
+                prd_len += len;     // 物理上紧接着且不跨64KB, 并入当前项
+            } else {
+                if (++prd_idx == (int32_t)PRD_MAX) {
+                    bio_unuse_mm(used);
+                    return false;
+                }
+                cur = &channel->prd_table[prd_idx];
+                cur->phys_addr = phys;
+                cur->flags = 0;
+                prd_len = len;
+            }
+            cur->byte_cnt = prd_len & 0xffff;   // 恰为64KB时写0
+            vaddr += len;
+            byte_cnt -= len;
+        }
+        bio_unuse_mm(used);
+        sec_cnt -= secs;
+    }
+    channel->prd_table[prd_idx].flags = PRD_EOT;
+    return true;
+}
 
-    /* 1 先选择操作的硬盘 */
-    select_disk(hd);
+/* 用总线主控DMA读写hd上从lba开始的sec_cnt个扇区, 缓冲区依次取自iter.
+ * 传输期间线程阻塞在disk_done上, cpu可以运行其他任务.
+ * 成功返回true; 返回false时数据未传输, 由调用者恢复iter后改用PIO */
+static bool ide_dma_transfer(struct disk* hd, uint32_t lba, struct bio_iter* iter, uint32_t sec_cnt, bool is_write) {
+    struct ide_channel* channel = hd->my_channel;
+    if (!ide_dma_build_prd(channel, iter, sec_cnt)) {
+        return false;
+    }
+    uint8_t direction = is_write ? 0 : BIT_BM_READ;
+    outl(reg_bm_prdt(channel), channel->prd_table_phys);
+    outb(reg_bm_cmd(channel), direction);
+    outb(reg_bm_status(channel), inb(reg_bm_status(channel)) | BIT_BM_ERR | BIT_BM_IRQ);  // 清除上次的状态
+
+    select_sector(hd, lba, sec_cnt);
+    if (hd->lba48) {
+        cmd_out(channel, is_write ? CMD_WRITE_DMA_EXT : CMD_READ_DMA_EXT);
+    } else {
+        cmd_out(channel, is_write ? CMD_WRITE_DMA : CMD_READ_DMA);
+    }
+    TRACE(TRACE_IDE_ISSUE, lba, sec_cnt | (is_write ? 0x80000000 : 0));
+    outb(reg_bm_cmd(channel), direction | BIT_BM_START);
+
+    wait_disk_done(channel);
+
+    outb(reg_bm_cmd(channel), direction);   // 停止DMA
+    uint8_t bm_status = inb(reg_bm_status(channel));
+    outb(reg_bm_status(channel), bm_status | BIT_BM_ERR | BIT_BM_IRQ);
+    if ((bm_status & BIT_BM_ERR) || (inb(reg_status(channel)) & BIT_STAT_ERR)) {
+        /* 出错后不再对这块硬盘使用DMA, 本次由调用者用PIO重做 */
+        printk("%s: dma %s lba %d failed, fall back to pio\n", hd->name, is_write ? "write" : "read", lba);
+        hd->dma = false;
+        return false;
+    }
+    return true;
+}
 
-    uint32_t secs_op;		 // 每次操作的扇区数
-    uint32_t secs_done = 0;	 // 已完成的扇区数
-    while(secs_done < sec_cnt) {
-        if ((secs_done + 256) <= sec_cnt) {   // 由于保存读写扇区数的端口只有8位，因此每次最多读256个扇区
-            secs_op = 256;
+/* 在数据端口与iter接下来的sec_cnt个扇区的缓冲区之间搬运数据 */
+static void ide_pio_copy(struct disk* hd, struct bio_iter* iter, uint32_t sec_cnt, bool is_write) {
+    while (sec_cnt > 0) {
+        void* buf;
+        uint32_t secs;
+        struct bio* bio = bio_iter_next(iter, sec_cnt, &buf, &secs);
+        bool used = bio_use_mm(bio);
+        if (is_write) {
+            write2sector(hd, buf, secs);
         } else {
-            secs_op = sec_cnt - secs_done;
+            read_from_sector(hd, buf, secs);
         }
+        bio_unuse_mm(used);
+        sec_cnt -= secs;
+    }
+}
+
+/* 每次中断传输的扇区数, 即一个DRQ数据块的大小 */
+static uint32_t ide_drq_sectors(struct disk* hd) {
+    return hd->multi_sectors != 0 ? hd->multi_sectors : 1;
+}
 
-        /* 2 写入待读入的扇区数和起始扇区号 */
-        select_sector(hd, lba + secs_done, secs_op);
+/* 用PIO读入从lba开始的sec_cnt个扇区, sec_cnt不超过单条命令的上限. 出错返回false.
+ * 硬盘每备好一个数据块发一次中断, 用READ MULTIPLE时一块有multi_sectors个扇区 */
+static bool ide_pio_read(struct disk* hd, uint32_t lba, struct bio_iter* iter, uint32_t sec_cnt) {
+    struct ide_channel* channel = hd->my_channel;
+    /* 1 写入待读入的扇区数和起始扇区号 */
+    select_sector(hd, lba, sec_cnt);
+
+    /* 2 执行的命令写入reg_cmd寄存器 */
+    uint8_t cmd;
+    if (hd->multi_sectors != 0) {
+        cmd = hd->lba48 ? CMD_READ_MULTIPLE_EXT : CMD_READ_MULTIPLE;
+    } else {
+        cmd = hd->lba48 ? CMD_READ_SECTOR_EXT : CMD_READ_SECTOR;
+    }
+    cmd_out(channel, cmd);	      // 准备开始读数据
+    TRACE(TRACE_IDE_ISSUE, lba, sec_cnt);
 
-        /* 3 执行的命令写入reg_cmd寄存器 */
-        cmd_out(hd->my_channel, CMD_READ_SECTOR);	      // 准备开始读数据
+    uint32_t drq_sectors = ide_drq_sectors(hd);
+    while (sec_cnt > 0) {
+        uint32_t secs = sec_cnt < drq_sectors ? sec_cnt : drq_sectors;
 
         /*********************   阻塞自己的时机  ***********************
              在硬盘已经开始工作(开始在内部读数据或写数据)后才能阻塞自己,现在硬盘已经开始忙了,
             将自己阻塞,等待硬盘完成读操作后通过中断处理程序唤醒自己*/
-        sema_down(&hd->my_channel->disk_done);
+        wait_disk_done(channel);
         /*************************************************************/
 
-        /* 4 检测硬盘状态是否可读 */
+        /* 3 检测硬盘状态是否可读 */
         /* 醒来后开始执行下面代码*/
         if (!busy_wait(hd)) {			      // 若失败
-            char error[64];
-            sprintf(error, "%s read sector %d failed!!!!!!\n", hd->name, lba);
-            PANIC(error);
+            printk("%s read sector %d failed\n", hd->name, lba);
+            return false;
         }
 
-        /* 5 把数据从硬盘的缓冲区中读出 */
-        read_from_sector(hd, (void*)((uint32_t)buf + secs_done * 512), secs_op);
-        secs_done += secs_op;
+        /* 读完本块硬盘就会准备下一块并发中断, 须在读之前准备好等待 */
+        if (sec_cnt > secs) {
+            arm_intr(channel);
+        }
+
+        /* 4 把数据从硬盘的缓冲区中读出 */
+        ide_pio_copy(hd, iter, secs, false);
+        sec_cnt -= secs;
     }
-    lock_release(&hd->my_channel->lock);
+    return true;
 }
 
-/* 将buf中sec_cnt扇区数据写入硬盘 */
-void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt) {
-    ASSERT(lba <= max_lba);
-    ASSERT(sec_cnt > 0);
-    lock_acquire (&hd->my_channel->lock);
+/* 用PIO写出从lba开始的sec_cnt个扇区, sec_cnt不超过单条命令的上限. 出错返回false.
+ * 第一块数据在硬盘就绪后直接写入, 此后每写完一块硬盘发一次中断 */
+static bool ide_pio_write(struct disk* hd, uint32_t lba, struct bio_iter* iter, uint32_t sec_cnt) {
+    struct ide_channel* channel = hd->my_channel;
+    /* 1 写入待写入的扇区数和起始扇区号 */
+    select_sector(hd, lba, sec_cnt);
+
+    /* 2 执行的命令写入reg_cmd寄存器 */
+    uint8_t cmd;
+    if (hd->multi_sectors != 0) {
+        cmd = hd->lba48 ? CMD_WRITE_MULTIPLE_EXT : CMD_WRITE_MULTIPLE;
+    } else {
+        cmd = hd->lba48 ? CMD_WRITE_SECTOR_EXT : CMD_WRITE_SECTOR;
+    }
+    cmd_out(channel, cmd);	      // 准备开始写数据
+    TRACE(TRACE_IDE_ISSUE, lba, sec_cnt | 0x80000000);
+
+    uint32_t drq_sectors = ide_drq_sectors(hd);
+    while (sec_cnt > 0) {
+        uint32_t secs = sec_cnt < drq_sectors ? sec_cnt : drq_sectors;
 
-    /* 1 先选择操作的硬盘 */
+        /* 3 检测硬盘状态是否可写 */
+        if (!busy_wait(hd)) {			      // 若失败
+            printk("%s write sector %d failed\n", hd->name, lba);
+            return false;
+        }
+
+        /* 4 将数据写入硬盘 */
+        ide_pio_copy(hd, iter, secs, true);
+
+        /* 在硬盘响应期间阻塞自己 */
+        wait_disk_done(channel);
+        sec_cnt -= secs;
+        if (sec_cnt > 0) {
+            arm_intr(channel);
+        }
+    }
+    return true;
+}
+
+/* 执行合并后的请求rq, 扇区数超过单条命令的上限时分成多条命令.
+ * 成功返回0, 出错返回-1 */
+static int32_t ide_do_request(struct disk* hd, struct request* rq) {
+    lock_acquire(&hd->my_channel->lock);
     select_disk(hd);
 
+    struct bio_iter iter;
+    bio_iter_init(&iter, rq);
     uint32_t secs_op;		 // 每次操作的扇区数
     uint32_t secs_done = 0;	 // 已完成的扇区数
-    while(secs_done < sec_cnt) {
-        if ((secs_done + 256) <= sec_cnt) {
-            secs_op = 256;
+    while (secs_done < rq->sec_cnt) {
+        uint32_t max_sectors = ide_max_sectors(hd);     // DMA出错后上限会变
+        if ((secs_done + max_sectors) <= rq->sec_cnt) {
+            secs_op = max_sectors;
         } else {
-            secs_op = sec_cnt - secs_done;
+            secs_op = rq->sec_cnt - secs_done;
         }
 
-        /* 2 写入待写入的扇区数和起始扇区号 */
-        select_sector(hd, lba + secs_done, secs_op);		      // 先将待读的块号lba地址和待读入的扇区数写入lba寄存器
+        /* 能用DMA时不必由cpu逐字搬运数据 */
+        if (hd->dma) {
+            struct bio_iter saved = iter;
+            if (ide_dma_transfer(hd, rq->lba + secs_done, &iter, secs_op, rq->write)) {
+                secs_done += secs_op;
+                continue;
+            }
+            iter = saved;
+        }
+        bool ok = rq->write ? ide_pio_write(hd, rq->lba + secs_done, &iter, secs_op) : \
+                              ide_pio_read(hd, rq->lba + secs_done, &iter, secs_op);
+        if (!ok) {
+            lock_release(&hd->my_channel->lock);
+            return -1;
+        }
+        secs_done += secs_op;
+    }
+    lock_release(&hd->my_channel->lock);
+    return 0;
+}
 
-        /* 3 执行的命令写入reg_cmd寄存器 */
-        cmd_out(hd->my_channel, CMD_WRITE_SECTOR);	      // 准备开始写数据
+/* 通道上是否有待下发的请求 */
+static bool ide_channel_pending(struct ide_channel* channel) {
+    return !blk_queue_empty(&channel->device[0].bdev.queue) || !blk_queue_empty(&channel->device[1].bdev.queue);
+}
 
-        /* 4 检测硬盘状态是否可读 */
-        if (!busy_wait(hd)) {			      // 若失败
-            char error[64];
-            sprintf(error, "%s write sector %d failed!!!!!!\n", hd->name, lba);
-            PANIC(error);
+/* 通道的派发线程. 通道上同一时刻只能执行一条命令,
+ * 由它从两块硬盘的请求队列中轮流取出合并好的请求执行.
+ * 两个通道各有一个派发线程, 可以同时工作 */
+static void ide_dispatch_thread(void* arg) {
+    struct ide_channel* channel = arg;
+    uint8_t dev_no = 0;
+    struct request rq;
+    while (1) {
+        wait_event(&channel->dispatch_wq, ide_channel_pending(channel));
+        struct disk* hd = &channel->device[dev_no];
+        dev_no ^= 1;    // 两块硬盘交替, 一块盘的I/O再多也不会饿死另一块
+        if (!blk_queue_fetch(&hd->bdev.queue, &rq)) {
+            continue;
         }
+        blk_end_request(&rq, ide_do_request(hd, &rq));
+    }
+}
 
-        /* 5 将数据写入硬盘 */
-        write2sector(hd, (void*)((uint32_t)buf + secs_done * 512), secs_op);
-
-        /* 在硬盘响应期间阻塞自己 */
-        sema_down(&hd->my_channel->disk_done);
-        secs_done += secs_op;
+/* 块设备的flush操作, 让硬盘把写缓存中的数据落盘 */
+static int32_t ide_flush(struct block_device* bdev) {
+    struct disk* hd = bdev->private;
+    struct ide_channel* channel = hd->my_channel;
+    lock_acquire(&channel->lock);
+    select_disk(hd);
+    cmd_out(channel, hd->lba48 ? CMD_FLUSH_CACHE_EXT : CMD_FLUSH_CACHE);
+    wait_disk_done(channel);
+    bool failed = inb(reg_alt_status(channel)) & BIT_STAT_ERR;
+    lock_release(&channel->lock);
+    if (failed) {
+        printk("%s: flush cache failed\n", hd->name);
+        return -1;
     }
-    /* 醒来后开始释放锁*/
-    lock_release(&hd->my_channel->lock);
+    return 0;
 }
 
+static const struct block_ops ide_block_ops = {
+    .submit = blk_queue_submit,
+    .flush = ide_flush
+};
+
 /* 将dst中len个相邻字节交换位置后存入buf */
 static void swap_pairs_bytes(const char* dst, char* buf, uint32_t len) {
     uint8_t idx;
@@ -246,14 +485,24 @@ static void swap_pairs_bytes(const char* dst, char* buf, uint32_t len) {
     buf[idx] = '\0';
 }
 
+/* 设置READ/WRITE MULTIPLE每次中断传输的扇区数, 硬盘拒绝时返回false */
+static bool ide_set_multiple(struct disk* hd, uint8_t sectors) {
+    struct ide_channel* channel = hd->my_channel;
+    outb(reg_sect_cnt(channel), sectors);
+    cmd_out(channel, CMD_SET_MULTIPLE);
+    wait_disk_done(channel);
+    return !(inb(reg_alt_status(channel)) & BIT_STAT_ERR);
+}
+
 /* 获得硬盘参数信息 */
 static void identify_disk(struct disk* hd) {
     char id_info[512];
+    hd->io32 = false;       // 先按字读出identify信息, 据此再决定
     select_disk(hd);
     cmd_out(hd->my_channel, CMD_IDENTIFY);
-    /* 向硬盘发送指令后便通过信号量阻塞自己,
+    /* 向硬盘发送指令后便等待disk_done阻塞自己,
     * 待硬盘处理完成后,通过中断处理程序将自己唤醒 */
-    sema_down(&hd->my_channel->disk_done);
+    wait_disk_done(hd->my_channel);
 
     /* 醒来后开始执行下面代码*/
     if (!busy_wait(hd)) {     //  若失败
@@ -270,62 +519,63 @@ static void identify_disk(struct disk* hd) {
     memset(buf, 0, sizeof(buf));
     swap_pairs_bytes(&id_info[md_start], buf, md_len);
     printk("      MODULE: %s\n", buf);
-    uint32_t sectors = *(uint32_t*)&id_info[60 * 2];
-    printk("      SECTORS: %d\n", sectors);
-    printk("      CAPACITY: %dMB\n", sectors * 512 / 1024 / 1024);
-}
-
-/* 扫描硬盘hd中地址为ext_lba的扇区中的所有分区 */
-static void partition_scan(struct disk* hd, uint32_t ext_lba) {
-    struct boot_sector* bs = sys_malloc(sizeof(struct boot_sector));
-    ide_read(hd, ext_lba, bs, 1);
-    uint8_t part_idx = 0;
-    struct partition_table_entry* p = bs->partition_table;
-
-    /* 遍历分区表4个分区表项 */
-    while (part_idx++ < 4) {
-        if (p->fs_type == 0x5) {	 // 若为扩展分区
-            if (ext_lba_base != 0) { 
-            /* 子扩展分区的start_lba是相对于主引导扇区中的总扩展分区地址 */
-                partition_scan(hd, p->start_lba + ext_lba_base);
-            } else { // ext_lba_base为0表示是第一次读取引导块,也就是主引导记录所在的扇区
-            /* 记录下扩展分区的起始lba地址,后面所有的扩展分区地址都相对于此 */
-                ext_lba_base = p->start_lba;
-                partition_scan(hd, p->start_lba);
-            }
-        } else if (p->fs_type != 0) { // 若是有效的分区类型
-            if (ext_lba == 0) {	    // 此时全是主分区
-                hd->prime_parts[p_no].start_lba = ext_lba + p->start_lba;
-                hd->prime_parts[p_no].sec_cnt = p->sec_cnt;
-                hd->prime_parts[p_no].my_disk = hd;
-                list_append(&partition_list, &hd->prime_parts[p_no].part_tag);
-                sprintf(hd->prime_parts[p_no].name, "%s%d", hd->name, p_no + 1);
-                p_no++;
-                ASSERT(p_no < 4);	    // 0,1,2,3
-            } else {
-                hd->logic_parts[l_no].start_lba = ext_lba + p->start_lba;
-                hd->logic_parts[l_no].sec_cnt = p->sec_cnt;
-                hd->logic_parts[l_no].my_disk = hd;
-                list_append(&partition_list, &hd->logic_parts[l_no].part_tag);
-                sprintf(hd->logic_parts[l_no].name, "%s%d", hd->name, l_no + 5);	 // 逻辑分区数字是从5开始,主分区是1～4.
-                l_no++;
-                if (l_no >= 8)    // 只支持8个逻辑分区,避免数组越界
-                return;
-            }
-        } 
-        p++;
+    /* 第83字的第10位表示支持LBA48, 此时容量在第100~103字, 否则在第60~61字.
+     * 扇区号只用32位, 超过2TB的部分用不到 */
+    uint16_t* id_words = (uint16_t*)id_info;
+    hd->lba48 = (id_words[83] & 0x400) != 0;
+    if (hd->lba48) {
+        hd->sectors = id_words[100] | ((uint32_t)id_words[101] << 16);
+        if (id_words[102] != 0 || id_words[103] != 0) {
+            hd->sectors = 0xffffffff;
+        }
+    } else {
+        hd->sectors = id_words[60] | ((uint32_t)id_words[61] << 16);
+    }
+    printk("      SECTORS: %d\n", hd->sectors);
+    printk("      CAPACITY: %dMB\n", hd->sectors / 2048);
+    printk("      LBA48: %s\n", hd->lba48 ? "yes" : "no");
+
+    /* 第49字的第8位表示支持DMA */
+    uint16_t capabilities = *(uint16_t*)&id_info[49 * 2];
+    hd->dma = hd->my_channel->bmide_base != 0 && (capabilities & 0x100);
+    printk("      DMA: %s\n", hd->dma ? "yes" : "no");
+
+    /* 第47字低8位是每次中断最多传输的扇区数, 为0表示不支持READ/WRITE MULTIPLE */
+    hd->multi_sectors = 0;
+    uint8_t max_multi = id_words[47] & 0xff;
+    if (max_multi != 0 && ide_set_multiple(hd, max_multi)) {
+        hd->multi_sectors = max_multi;
     }
-    sys_free(bs);
+#ifdef CONFIG_IDE_IO32
+    /* 第48字的第0位表示数据端口可以按双字传输.
+     * 该位在ATA-2之后已废弃, 新盘上的值不可信, 能否32位PIO实际取决于控制器, 故默认不开 */
+    hd->io32 = (id_words[48] & 0x1) != 0;
+#else
+    hd->io32 = false;
+#endif
+    printk("      MULTIPLE: %d, IO32: %s\n", hd->multi_sectors, hd->io32 ? "yes" : "no");
 }
 
-/* 打印分区信息 */
-static bool partition_info(struct list_elem* pelem, int arg UNUSED) {
-   struct partition* part = elem2entry(struct partition, part_tag, pelem);
-   printk("   %s start_lba:0x%x, sec_cnt:0x%x\n",part->name, part->start_lba, part->sec_cnt);
-
-/* 在此处return false与函数本身功能无关,
- * 只是为了让主调函数list_traversal继续向下遍历元素 */
-   return false;
+/* 查找pci上的IDE控制器, 支持总线主控时为通道准备DMA */
+static void ide_dma_init(struct ide_channel* channel, uint8_t channel_no) {
+    channel->bmide_base = 0;
+    struct pci_device* pdev = pci_find_class(0x01, 0x01);    // 大容量存储控制器, IDE
+    /* prog_if第7位表示支持总线主控, BAR4是总线主控寄存器的I/O基址 */
+    if (pdev == NULL || !(pdev->prog_if & 0x80)) {
+        return;
+    }
+    uint32_t bar4 = pci_bar(pdev, 4);
+    if (bar4 == 0) {
+        return;
+    }
+    channel->prd_table = get_kernel_pages(1);
+    if (channel->prd_table == NULL) {
+        return;
+    }
+    channel->prd_table_phys = addr_v2p((uint32_t)channel->prd_table);
+    pci_enable(pdev, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    channel->bmide_base = bar4 + channel_no * 8;
+    printk("   %s: bus master dma at 0x%x\n", channel->name, channel->bmide_base);
 }
 
 /* 硬盘中断处理程序 */
@@ -338,11 +588,30 @@ void intr_hd_handler(uint8_t irq_no) {
     * 每次读写硬盘时会申请锁,从而保证了同步一致性 */
    if (channel->expecting_intr) {
       channel->expecting_intr = false;
-      sema_up(&channel->disk_done);
 
     /* 读取状态寄存器使硬盘控制器，清除本次中断,
     * 从而硬盘可以继续执行新的读写 */
       inb(reg_status(channel));
+      TRACE(TRACE_IDE_DONE, irq_no, 0);
+
+      /* 唤醒等待者推迟到块设备软中断中进行 */
+      channel->intr_arrived = true;
+      raise_softirq(SOFTIRQ_BLOCK);
+   }
+}
+
+/* 块设备软中断, 通知各通道上等待的线程命令已完成 */
+static void ide_softirq(void) {
+   uint8_t ch_no = 0;
+   while (ch_no < channel_cnt) {
+      struct ide_channel* channel = &channels[ch_no];
+      enum intr_status old_status = intr_disable();
+      if (channel->intr_arrived) {
+         channel->intr_arrived = false;
+         complete(&channel->disk_done);
+      }
+      intr_set_status(old_status);
+      ch_no++;
    }
 }
 
@@ -352,7 +621,7 @@ void ide_init() {
     uint8_t hd_cnt = *((uint8_t*)(0x475));	      // 获取硬盘的数量
     printk("   ide_init hd_cnt:%d\n",hd_cnt);
     ASSERT(hd_cnt > 0);
-    list_init(&partition_list);
+    open_softirq(SOFTIRQ_BLOCK, ide_softirq);
     channel_cnt = DIV_ROUND_UP(hd_cnt, 2);	   // 一个ide通道上有两个硬盘,根据硬盘数量反推有几个ide通道
     struct ide_channel* channel;
     uint8_t channel_no = 0, dev_no = 0; 
@@ -375,33 +644,49 @@ void ide_init() {
         }
 
         channel->expecting_intr = false;		   // 未向硬盘写入指令时不期待硬盘的中断
-        lock_init(&channel->lock);		     
+        lock_init(&channel->lock);
+        lock_stat_register(&channel->lock, channel->name);
 
-        /* 初始化为0,目的是向硬盘控制器请求数据后,硬盘驱动sema_down此信号量会阻塞线程,
-        直到硬盘完成后通过发中断,由中断处理程序将此信号量sema_up,唤醒线程. */
-        sema_init(&channel->disk_done, 0);
+        /* 向硬盘控制器请求数据后,硬盘驱动等待disk_done完成,
+        直到硬盘完成后通过发中断,由中断处理程序complete唤醒线程. */
+        completion_init(&channel->disk_done);
+        channel->intr_arrived = false;
 
         register_handler(channel->irq_no, intr_hd_handler);
+        ide_dma_init(channel, channel_no);
 
-        /* 分别获取两个硬盘的参数及分区信息 */
+        /* 分别获取两个硬盘的参数 */
+        wait_queue_init(&channel->dispatch_wq);
         while (dev_no < 2) {
             struct disk* hd = &channel->device[dev_no];
             hd->my_channel = channel;
             hd->dev_no = dev_no;
             sprintf(hd->name, "sd%c", 'a' + channel_no * 2 + dev_no);
             identify_disk(hd);	 // 获取硬盘参数
-            if (dev_no != 0) {	 // 内核本身的裸硬盘(hd60M.img)不处理
-                partition_scan(hd, 0);  // 扫描该硬盘上的分区  
-            }
-            p_no = 0, l_no = 0;
+
+            struct block_device* bdev = &hd->bdev;
+            strcpy(bdev->name, hd->name);
+            bdev->sectors = hd->sectors;
+            bdev->sector_size = BLOCK_SECTOR_SIZE;
+            bdev->ops = &ide_block_ops;
+            bdev->private = hd;
+            blk_queue_init(&bdev->queue, ide_max_sectors(hd), &channel->dispatch_wq);
             dev_no++; 
         }
+
+        /* 此后对硬盘的读写都经请求队列由派发线程完成 */
+        struct task_struct* dispatcher = kthread_create(channel->name, IDE_DISPATCH_PRIO, 1, ide_dispatch_thread, channel);
+        if (dispatcher == NULL) {
+            PANIC("ide_init: create dispatch thread failed\n");
+        }
+        kthread_detach(dispatcher);     // 派发线程不会退出, 也无人join
+
+        /* 再注册到块设备层并扫描分区, 主盘不处理, 其中sda是内核本身的裸硬盘(hd60M.img) */
+        block_register(&channel->device[0].bdev, false);
+        block_register(&channel->device[1].bdev, true);
         dev_no = 0;			  	   // 将硬盘驱动器号置0,为下一个channel的两个硬盘初始化。
         channel_no++;				   // 下一个channel
     }
 
-    printk("\n   all partition info\n");
-    /* 打印所有分区信息 */
-    list_traversal(&partition_list, partition_info, (int)NULL);
     printk("ide_init done\n");
 }
\ No newline at end of file
@@ -4,44 +4,46 @@
 #include "list.h"
 #include "bitmap.h"
 #include "sync.h"
-
-struct partition {
-    uint32_t start_lba;         // 起始扇区
-    uint32_t sec_cnt;           // 扇区数
-    struct disk* my_disk;       // 分区所属的硬盘
-    struct list_elem part_tag;  // 队列标记
-    char name[8];               // 分区名
-    struct super_block* sb;     // 本分区的超级块
-    struct bitmap block_bitmap; // 块位图，管理本分区的块
-    struct bitmap inode_bitmap; // i结点位图
-    struct list open_inodes;    // 本分区打开的i结点队列
-};
+#include "block.h"
 
 /* 硬盘结构 */
 struct disk {
     char name[8];                       // 硬盘名
     struct ide_channel* my_channel;     // 此块硬盘属于哪个ide通道
     uint8_t dev_no;                     // 本硬盘是主0，还是从1
-    struct partition prime_parts[4];    // 主分区最多4个
-    struct partition logic_parts[8];    // 逻辑分区无限，但这里就支持8个
+    bool dma;                           // 是否用总线主控DMA传输, 出错后退回PIO
+    bool lba48;                         // 是否支持48位LBA, 支持时读写都用EXT命令
+    uint32_t sectors;                   // 总扇区数, 由identify得到
+    uint8_t multi_sectors;              // READ/WRITE MULTIPLE每次中断传输的扇区数, 0表示不用
+    bool io32;                          // 数据端口是否可以按双字读写
+    struct block_device bdev;           // 注册到块设备层的设备
 };
 
+/* 物理区域描述符, 描述DMA的一段物理内存, 不能跨越64KB边界 */
+struct prd {
+    uint32_t phys_addr;     // 物理地址, 须2字节对齐
+    uint16_t byte_cnt;      // 字节数, 0表示64KB
+    uint16_t flags;         // 最高位为1表示最后一项
+} __attribute__ ((packed));
+
 /* ata通道结构 */
 struct ide_channel {
     char name[8];                   // 本ata通道名称
     uint16_t port_base;             // 本通道的起始端口号
     uint8_t irq_no;                 // 本通道所用的中断号
     struct lock lock;               // 通道锁，通道上有主从两块硬盘，设置锁实现互斥
+    struct wait_queue dispatch_wq;  // 两块硬盘的请求队列都空时派发线程在此等待
     bool expecting_intr;            // 表示等待硬盘的中断
-    struct semaphore disk_done;     // 用于阻塞、唤醒驱动程序
+    bool intr_arrived;              // 中断已到, 待块设备软中断通知完成
+    struct completion disk_done;    // 硬盘完成命令时由中断处理程序通知
     struct disk device[2];          // 一个通道上连接两个硬盘
+    uint16_t bmide_base;            // 总线主控寄存器的端口基址, 为0表示不支持DMA
+    struct prd* prd_table;          // 本通道的PRD表, 占一页, 受通道锁保护
+    uint32_t prd_table_phys;        // PRD表的物理地址
 };
 
 void intr_hd_handler(uint8_t irq_no);
 void ide_init(void);
 extern uint8_t channel_cnt;
 extern struct ide_channel channels[];
-extern struct list partition_list;
-void ide_read(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
-void ide_write(struct disk* hd, uint32_t lba, void* buf, uint32_t sec_cnt);
 #endif
\ No newline at end of file
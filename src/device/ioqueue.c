@@ -5,8 +5,8 @@
 
 /* 初始化io队列 */
 void ioqueue_init(struct ioqueue* ioq) {
-    lock_init(&ioq->lock);
-    ioq->producer = NULL;
+    wait_queue_init(&ioq->producers);
+    wait_queue_init(&ioq->consumers);
     ioq->head = ioq->tail = 0;
 }
 
@@ -27,35 +27,19 @@ bool ioqueue_empty(struct ioqueue* ioq) {
     return ioq->head == ioq->tail;
 }
 
-/* 使当前消费者或生产者在此缓冲区上等待 */
-static void ioqueue_wait(struct task_struct** waiter) {
-    ASSERT(*waiter == NULL && waiter != NULL);
-    *waiter = running_thread();
-    thread_block(TASK_BLOCKED);
-}
-
-/* 唤醒waiter */
-static void wakeup(struct task_struct** waiter) {
-    ASSERT(*waiter != NULL);
-    thread_unblock(*waiter);
-    *waiter = NULL;
-}
-
 /* 消费者从ioq队列中获取一个字符 */
 char ioqueue_getchar(struct ioqueue* ioq) {
     ASSERT(intr_get_status() == INTR_OFF);
+    /* 可以有多个消费者同时等待, 被唤醒后须重新检查,
+     * 数据可能已被其他未睡眠的消费者取走 */
     while (ioqueue_empty(ioq)) {
-        lock_acquire(&ioq->lock);       // 上锁，防止其他消费者也进入ioq的等待
-        ioqueue_wait(&ioq->consumer);   // 缓冲区空，将ioq->consumer记为自己
-        lock_release(&ioq->lock);
+        wait_queue_sleep(&ioq->consumers);
     }
 
     char byte = ioq->buf[ioq->tail];
     ioq->tail = next_pos(ioq->tail);
 
-    if (ioq->producer != NULL) {
-        wakeup(&ioq->producer);     // 唤醒生产者
-    }
+    wait_queue_wake_one(&ioq->producers);   // 腾出一个位置，只唤醒一个生产者
 
     return byte;
 }
@@ -64,14 +48,10 @@ char ioqueue_getchar(struct ioqueue* ioq) {
 void ioqueue_putchar(struct ioqueue* ioq, char byte) {
     ASSERT(intr_get_status() == INTR_OFF);
     while (ioqueue_full(ioq)) {
-        lock_acquire(&ioq->lock);
-        ioqueue_wait(&ioq->producer);   // 缓冲区满，将ioq->producer记为自己
-        lock_release(&ioq->lock);
+        wait_queue_sleep(&ioq->producers);
     }
     ioq->buf[ioq->head] = byte;
     ioq->head = next_pos(ioq->head);
 
-    if (ioq->consumer != NULL) {
-        wakeup(&ioq->consumer);     // 唤醒消费者
-    }
+    wait_queue_wake_one(&ioq->consumers);   // 放入一个字符，只唤醒一个消费者
 }
\ No newline at end of file
@@ -4,8 +4,10 @@
 #include "io.h"
 #include "global.h"
 #include "ioqueue.h"
+#include "softirq.h"
 
 #define KBD_BUF_PORT 0x60   // 键盘buffer寄存器端口号为0x60
+#define SCANCODE_BUF_SIZE 32    // 暂存未解码扫描码的环形缓冲区大小
 
 /* 用转义字符定义部分控制字符 */
 #define esc         '\033'      // 八进制表示字符，也可以用十六进制'\x1b'
@@ -40,6 +42,10 @@
 static bool ctrl_status, shift_status, alt_status, caps_lock_status, ext_scancode;
 struct ioqueue kbd_buf;     // 定义键盘缓冲区
 
+/* 中断处理程序只把扫描码存入此处, 由键盘软中断解码 */
+static uint8_t scancode_buf[SCANCODE_BUF_SIZE];
+static uint32_t scancode_head, scancode_tail;
+
 /* 以通码make_code为索引的二维数组 */
 static char keymap[][2] = {
 /* 0x00 */	{0,	0},		
@@ -104,15 +110,14 @@ static char keymap[][2] = {
 };
 
 
-/* 键盘中断处理程序 */
-static void intr_keyboard_handler(void) {
+/* 解码一个扫描码, 在软中断中调用 */
+static void keyboard_decode(uint8_t byte) {
     bool ctrl_down_last = ctrl_status;
     bool shift_down_last = shift_status;
     bool caps_lock_last = caps_lock_status;
 
     bool is_break_code;
-    /* 必须要读取输出缓冲寄存器，否则9042不再继续相应键盘中断 */
-    uint16_t scancode = inb(KBD_BUF_PORT);
+    uint16_t scancode = byte;
 
     /* 若扫描码scancode是e0开头，表示该键按下将产生多个扫描码 */
     if (scancode == 0xe0) {
@@ -187,10 +192,12 @@ static void intr_keyboard_handler(void) {
             }
             /****************************************************************/
 
+            enum intr_status old_status = intr_disable();
             if (!ioqueue_full(&kbd_buf)) {
                 // put_char(cur_char);     // 临时打印到终端
                 ioqueue_putchar(&kbd_buf, cur_char);
             }
+            intr_set_status(old_status);
             return ;
         }
 
@@ -207,11 +214,40 @@ static void intr_keyboard_handler(void) {
     }
 }
 
+/* 键盘中断处理程序, 只取出扫描码暂存, 解码推迟到软中断, 缩短关中断时间 */
+static void intr_keyboard_handler(void) {
+    /* 必须要读取输出缓冲寄存器，否则8042不再继续响应键盘中断 */
+    uint8_t scancode = inb(KBD_BUF_PORT);
+    uint32_t next = (scancode_head + 1) % SCANCODE_BUF_SIZE;
+    if (next != scancode_tail) {    // 缓冲区满时丢弃
+        scancode_buf[scancode_head] = scancode;
+        scancode_head = next;
+    }
+    raise_softirq(SOFTIRQ_KEYBOARD);
+}
+
+/* 键盘软中断, 逐个解码暂存的扫描码 */
+static void keyboard_softirq(void) {
+    while (1) {
+        enum intr_status old_status = intr_disable();
+        if (scancode_tail == scancode_head) {
+            intr_set_status(old_status);
+            break;
+        }
+        uint8_t scancode = scancode_buf[scancode_tail];
+        scancode_tail = (scancode_tail + 1) % SCANCODE_BUF_SIZE;
+        intr_set_status(old_status);
+        keyboard_decode(scancode);
+    }
+}
+
 /* 键盘初始化 */
 void keyboard_init() {
     put_str("keyboard init start\n");
 
     ioqueue_init(&kbd_buf);
+    scancode_head = scancode_tail = 0;
+    open_softirq(SOFTIRQ_KEYBOARD, keyboard_softirq);
     register_handler(0x21, intr_keyboard_handler);
 
     ctrl_status = false;
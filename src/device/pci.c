@@ -0,0 +1,120 @@
+#include "pci.h"
+#include "io.h"
+#include "stdio_kernel.h"
+#include "debug.h"
+
+/* 配置机制1的地址及数据端口 */
+#define PCI_CONFIG_ADDRESS  0xcf8
+#define PCI_CONFIG_DATA     0xcfc
+
+static struct pci_device pci_devices[PCI_MAX_DEVICES];  // 枚举到的设备
+static uint32_t pci_device_cnt;
+
+/* 构造配置地址, offset须4字节对齐 */
+static uint32_t pci_config_addr(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
+    return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)dev << 11) | ((uint32_t)func << 8) | (offset & 0xfc);
+}
+
+static uint32_t pci_read(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_addr(bus, dev, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+/* 读设备配置空间中offset处的双字 */
+uint32_t pci_config_read(struct pci_device* pdev, uint8_t offset) {
+    return pci_read(pdev->bus, pdev->dev, pdev->func, offset);
+}
+
+/* 写设备配置空间中offset处的双字 */
+void pci_config_write(struct pci_device* pdev, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_addr(pdev->bus, pdev->dev, pdev->func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+/* 返回第bar_no个基址寄存器中的地址, 已去掉低位的类型标志 */
+uint32_t pci_bar(struct pci_device* pdev, uint8_t bar_no) {
+    ASSERT(bar_no < 6);
+    uint32_t bar = pci_config_read(pdev, PCI_BAR0 + bar_no * 4);
+    if (bar & 0x1) {
+        return bar & ~0x3;      // I/O空间
+    }
+    return bar & ~0xf;          // 内存空间
+}
+
+/* 在命令寄存器中置上command_bits */
+void pci_enable(struct pci_device* pdev, uint32_t command_bits) {
+    uint32_t cmd_status = pci_config_read(pdev, PCI_COMMAND);
+    /* 高16位是状态寄存器, 写1清除, 写回时置0以免误清 */
+    pci_config_write(pdev, PCI_COMMAND, (cmd_status & 0xffff) | command_bits);
+}
+
+/* 按厂商号和设备号查找, 找不到返回NULL */
+struct pci_device* pci_find_device(uint16_t vendor_id, uint16_t device_id) {
+    uint32_t idx = 0;
+    while (idx < pci_device_cnt) {
+        if (pci_devices[idx].vendor_id == vendor_id && pci_devices[idx].device_id == device_id) {
+            return &pci_devices[idx];
+        }
+        idx++;
+    }
+    return NULL;
+}
+
+/* 按类别查找第一个匹配的设备, 找不到返回NULL */
+struct pci_device* pci_find_class(uint8_t class_code, uint8_t subclass) {
+    uint32_t idx = 0;
+    while (idx < pci_device_cnt) {
+        if (pci_devices[idx].class_code == class_code && pci_devices[idx].subclass == subclass) {
+            return &pci_devices[idx];
+        }
+        idx++;
+    }
+    return NULL;
+}
+
+/* 记录一个存在的功能 */
+static void pci_add_device(uint8_t bus, uint8_t dev, uint8_t func, uint32_t id) {
+    if (pci_device_cnt == PCI_MAX_DEVICES) {
+        return;
+    }
+    struct pci_device* pdev = &pci_devices[pci_device_cnt++];
+    pdev->bus = bus;
+    pdev->dev = dev;
+    pdev->func = func;
+    pdev->vendor_id = id & 0xffff;
+    pdev->device_id = id >> 16;
+    uint32_t class_rev = pci_config_read(pdev, PCI_CLASS_REVISION);
+    pdev->class_code = class_rev >> 24;
+    pdev->subclass = class_rev >> 16;
+    pdev->prog_if = class_rev >> 8;
+    pdev->irq_line = pci_config_read(pdev, PCI_INTERRUPT_LINE);
+    printk("   pci %d:%d.%d %x:%x class %x.%x\n", bus, dev, func, \
+           pdev->vendor_id, pdev->device_id, pdev->class_code, pdev->subclass);
+}
+
+/* 用配置机制1枚举所有总线上的设备 */
+void pci_init(void) {
+    printk("pci_init start\n");
+    pci_device_cnt = 0;
+    uint32_t bus, dev, func;
+    for (bus = 0; bus < 256; bus++) {
+        for (dev = 0; dev < 32; dev++) {
+            uint32_t id = pci_read(bus, dev, 0, PCI_VENDOR_ID);
+            if ((id & 0xffff) == 0xffff) {
+                continue;       // 无此设备
+            }
+            pci_add_device(bus, dev, 0, id);
+            /* 头部类型最高位为1表示多功能设备, 才需要探测其余功能 */
+            if (!((pci_read(bus, dev, 0, PCI_HEADER_TYPE) >> 16) & 0x80)) {
+                continue;
+            }
+            for (func = 1; func < 8; func++) {
+                id = pci_read(bus, dev, func, PCI_VENDOR_ID);
+                if ((id & 0xffff) != 0xffff) {
+                    pci_add_device(bus, dev, func, id);
+                }
+            }
+        }
+    }
+    printk("pci_init done\n");
+}
@@ -0,0 +1,40 @@
+#ifndef __DEVICE_PCI_H
+#define __DEVICE_PCI_H
+#include "stdint.h"
+#include "global.h"
+
+#define PCI_MAX_DEVICES 32      // 最多记录的pci设备(功能)数
+
+/* 配置空间中常用寄存器的偏移 */
+#define PCI_VENDOR_ID       0x00
+#define PCI_COMMAND         0x04
+#define PCI_CLASS_REVISION  0x08    // 高24位依次为class, subclass, prog_if
+#define PCI_HEADER_TYPE     0x0e
+#define PCI_BAR0            0x10
+#define PCI_INTERRUPT_LINE  0x3c
+
+#define PCI_COMMAND_IO      0x1     // 允许响应I/O空间访问
+#define PCI_COMMAND_MEMORY  0x2     // 允许响应内存空间访问
+#define PCI_COMMAND_MASTER  0x4     // 允许作为总线主控发起DMA
+
+/* 枚举到的一个pci功能 */
+struct pci_device {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;       // BIOS分配的中断引脚号
+};
+
+uint32_t pci_config_read(struct pci_device* pdev, uint8_t offset);
+void pci_config_write(struct pci_device* pdev, uint8_t offset, uint32_t value);
+uint32_t pci_bar(struct pci_device* pdev, uint8_t bar_no);
+void pci_enable(struct pci_device* pdev, uint32_t command_bits);
+struct pci_device* pci_find_device(uint16_t vendor_id, uint16_t device_id);
+struct pci_device* pci_find_class(uint8_t class_code, uint8_t subclass);
+void pci_init(void);
+#endif
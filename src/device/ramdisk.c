@@ -0,0 +1,81 @@
+#include "ramdisk.h"
+#include "block.h"
+#include "kthread.h"
+#include "memory.h"
+#include "string.h"
+#include "stdio_kernel.h"
+#include "debug.h"
+
+#define RAMDISK_PRIO 31         // 派发线程的优先级
+
+static struct block_device ramdisk;     // 注册为rda
+static uint8_t* ramdisk_base;           // RAM盘的内存, 虚拟地址连续
+static struct wait_queue ramdisk_wq;    // 请求队列为空时派发线程在此等待
+
+/* 在RAM盘和rq中各bio的缓冲区之间复制数据 */
+static void ramdisk_do_request(struct request* rq) {
+    struct bio_iter iter;
+    bio_iter_init(&iter, rq);
+    uint8_t* addr = ramdisk_base + rq->lba * BLOCK_SECTOR_SIZE;
+    uint32_t left = rq->sec_cnt;
+    while (left > 0) {
+        void* buf;
+        uint32_t secs;
+        struct bio* bio = bio_iter_next(&iter, left, &buf, &secs);
+        bool used = bio_use_mm(bio);
+        if (rq->write) {
+            memcpy(addr, buf, secs * BLOCK_SECTOR_SIZE);
+        } else {
+            memcpy(buf, addr, secs * BLOCK_SECTOR_SIZE);
+        }
+        bio_unuse_mm(used);
+        addr += secs * BLOCK_SECTOR_SIZE;
+        left -= secs;
+    }
+}
+
+/* RAM盘的派发线程. 复制内存本可以在提交时直接完成,
+ * 但bio不能在提交者的上下文中结束, 所以也经请求队列交给它 */
+static void ramdisk_thread(void* arg UNUSED) {
+    struct request rq;
+    while (1) {
+        wait_event(&ramdisk_wq, !blk_queue_empty(&ramdisk.queue));
+        if (blk_queue_fetch(&ramdisk.queue, &rq)) {
+            ramdisk_do_request(&rq);
+            blk_end_request(&rq, 0);
+        }
+    }
+}
+
+static const struct block_ops ramdisk_ops = {
+    .submit = blk_queue_submit,
+    .flush = NULL               // 没有写缓存
+};
+
+/* 创建RAM盘rda, 整块盘作为一个分区rda1, 开机时由filesys_init格式化.
+ * 要占用RAMDISK_SECTORS扇区的内核内存, 只在以make RAMDISK=1编译时调用 */
+void ramdisk_init(void) {
+    printk("ramdisk_init start\n");
+    ramdisk_base = get_kernel_pages(RAMDISK_SECTORS * BLOCK_SECTOR_SIZE / PG_SIZE);
+    if (ramdisk_base == NULL) {
+        printk("ramdisk_init: alloc memory failed\n");
+        return;
+    }
+    strcpy(ramdisk.name, "rda");
+    ramdisk.sectors = RAMDISK_SECTORS;
+    ramdisk.sector_size = BLOCK_SECTOR_SIZE;
+    ramdisk.ops = &ramdisk_ops;
+    ramdisk.private = NULL;
+    wait_queue_init(&ramdisk_wq);
+    blk_queue_init(&ramdisk.queue, RAMDISK_SECTORS, &ramdisk_wq);
+
+    struct task_struct* dispatcher = kthread_create("ramdisk", RAMDISK_PRIO, 1, ramdisk_thread, NULL);
+    if (dispatcher == NULL) {
+        PANIC("ramdisk_init: create dispatch thread failed\n");
+    }
+    kthread_detach(dispatcher);     // 派发线程不会退出, 也无人join
+
+    block_register(&ramdisk, false);
+    block_add_partition(&ramdisk, 0, RAMDISK_SECTORS, false);
+    printk("ramdisk_init done\n");
+}
@@ -0,0 +1,7 @@
+#ifndef __DEVICE_RAMDISK_H
+#define __DEVICE_RAMDISK_H
+
+#define RAMDISK_SECTORS 4096    // RAM盘容量, 2MB, 占用内核内存池
+
+void ramdisk_init(void);
+#endif
@@ -4,6 +4,7 @@
 #include "thread.h"
 #include "debug.h"
 #include "interrupt.h"
+#include "softirq.h"
 
 
 #define IRQ0_FREQUENCY 	100
@@ -16,7 +17,12 @@
 #define PIT_COUNTROL_PORT	0x43
 #define mil_seconds_per_intr (1000 / IRQ0_FREQUENCY)
 
+#define TSC_CALIBRATE_START 10  // 开中断后跳过最初的若干嘀嗒再校准
+#define TSC_CALIBRATE_TICKS 10  // 用来校准时间戳计数器的嘀嗒数
+
 uint32_t ticks;     // 内核自中断开启依赖总共的嘀嗒数
+static uint32_t tsc_calibrate_start;    // 开始校准时的时间戳计数
+uint32_t tsc_per_us;                    // 每微秒的时间戳计数, 校准前为0
 
 void frequency_set(uint8_t counter_port, uint8_t counter_no, uint8_t rwl, uint8_t counter_mode, uint16_t counter_value)
 {
@@ -28,16 +34,21 @@ void frequency_set(uint8_t counter_port, uint8_t counter_no, uint8_t rwl, uint8_
 /* 时钟中断函数 */
 static void intr_timer_handler(void) {
     struct task_struct* cur_thread = running_thread();
-    ASSERT(cur_thread->stack_magic == 0x19870916);  // 检查是否溢出
+    ASSERT(cur_thread->stack_magic == STACK_MAGIC);  // 检查是否溢出
 
     cur_thread->elapsed_ticks++;    // 记录此线程占用的 cpu 时间
     ticks++;                        // 从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
 
-    if (cur_thread->ticks == 0) {   // 时间片用完，调度新进程上cpu
-        schedule();
-    } else {
-        cur_thread->ticks--;
+    raise_softirq(SOFTIRQ_TIMER);   // 到期的延迟工作推迟到软中断中处理
+
+    /* 以时钟中断为基准校准时间戳计数器 */
+    if (ticks == TSC_CALIBRATE_START) {
+        tsc_calibrate_start = rdtsc32();
+    } else if (ticks == TSC_CALIBRATE_START + TSC_CALIBRATE_TICKS) {
+        tsc_per_us = (rdtsc32() - tsc_calibrate_start) / (TSC_CALIBRATE_TICKS * mil_seconds_per_intr * 1000);
     }
+
+    sched_tick();   // 消耗时间片或实时任务的预算, 需要调度时在中断返回前进行
 }
 
 /* 设置时钟频率 */
@@ -49,6 +60,11 @@ void timer_init(void)
     put_str("timer_init done!\n");
 }
 
+/* 将时间戳计数换算为微秒, 校准完成前返回0 */
+uint32_t tsc_to_us(uint32_t cycles) {
+    return tsc_per_us == 0 ? 0 : cycles / tsc_per_us;
+}
+
 /* 以ticks为单位的sleep，任何时间形式的sleep都会转换为此ticks形式 */
 static void ticks_to_sleep(uint32_t sleep_ticks) {
     uint32_t start_tick = ticks;
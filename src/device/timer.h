@@ -2,7 +2,21 @@
 #define __DEVICE_TIMER_H
 #include "stdint.h"
 
+extern uint32_t ticks;
+extern uint32_t tsc_per_us;
+
+/* 以嘀嗒为单位比较时间, 容忍ticks回绕 */
+#define ticks_reached(t) ((int32_t)(ticks - (t)) >= 0)
+
+/* 读时间戳计数器的低32位, 只用于测量1秒以内的间隔 */
+static inline uint32_t rdtsc32(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc":"=a"(low), "=d"(high));
+    return low;
+}
+
 void timer_init(void);
 static void intr_timer_handler(void);
 void mtime_sleep(uint32_t m_seconds);
+uint32_t tsc_to_us(uint32_t cycles);
 #endif
\ No newline at end of file
@@ -0,0 +1,466 @@
+#include "virtio_blk.h"
+#include "block.h"
+#include "pci.h"
+#include "io.h"
+#include "interrupt.h"
+#include "softirq.h"
+#include "kthread.h"
+#include "memory.h"
+#include "string.h"
+#include "stdio_kernel.h"
+#include "debug.h"
+
+#define VIRTIO_VENDOR_ID        0x1af4
+#define VIRTIO_BLK_LEGACY_ID    0x1001  // 过渡设备, 同时提供legacy的I/O端口接口
+#define VIRTIO_BLK_MODERN_ID    0x1042  // 只有modern接口, 寄存器在内存空间
+
+/* legacy接口的寄存器, 在BAR0的I/O空间中的偏移 */
+#define VIRTIO_PCI_HOST_FEATURES    0x00
+#define VIRTIO_PCI_GUEST_FEATURES   0x04
+#define VIRTIO_PCI_QUEUE_PFN        0x08    // 虚拟队列的物理页号
+#define VIRTIO_PCI_QUEUE_NUM        0x0c    // 队列大小, 由设备决定
+#define VIRTIO_PCI_QUEUE_SEL        0x0e
+#define VIRTIO_PCI_QUEUE_NOTIFY     0x10
+#define VIRTIO_PCI_STATUS           0x12
+#define VIRTIO_PCI_ISR              0x13    // 读出后清零, 同时撤销中断
+#define VIRTIO_PCI_CONFIG           0x14    // 设备相关的配置, 未启用MSI-X时在此
+
+/* 设备状态位 */
+#define VIRTIO_STATUS_ACK           0x1
+#define VIRTIO_STATUS_DRIVER        0x2
+#define VIRTIO_STATUS_DRIVER_OK     0x4
+#define VIRTIO_STATUS_FAILED        0x80
+
+/* 特性位 */
+#define VIRTIO_BLK_F_FLUSH          (1 << 9)    // 有写缓存, 支持FLUSH命令
+#define VIRTIO_RING_F_INDIRECT_DESC (1 << 28)   // 支持间接描述符表
+
+/* 描述符标志 */
+#define VRING_DESC_F_NEXT       0x1
+#define VRING_DESC_F_WRITE      0x2     // 设备写入此缓冲区
+#define VRING_DESC_F_INDIRECT   0x4     // 缓冲区是一张描述符表
+
+#define VRING_AVAIL_F_NO_INTERRUPT  0x1 // 驱动暂不需要完成中断
+#define VRING_USED_F_NO_NOTIFY      0x1 // 设备暂不需要通知
+
+/* 命令类型及状态 */
+#define VIRTIO_BLK_T_IN     0
+#define VIRTIO_BLK_T_OUT    1
+#define VIRTIO_BLK_T_FLUSH  4
+#define VIRTIO_BLK_S_OK     0
+
+#define VIRTIO_BLK_PRIO     31                  // 派发线程的优先级
+#define VIRTIO_BLK_FLUSH_SLOT VIRTIO_BLK_SLOTS  // 最后一个槽留给flush
+
+/* 写avail环与读used环之间须防止cpu把读提前到写之前 */
+#define virtio_mb() asm volatile("lock; addl $0, 0(%%esp)":::"memory")
+
+struct vring_desc {
+    uint64_t addr;      // 缓冲区的物理地址
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;      // 有VRING_DESC_F_NEXT时, 链中下一项的下标
+} __attribute__ ((packed));
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;       // 驱动下次写入ring的位置, 只增不减
+    uint16_t ring[];
+} __attribute__ ((packed));
+
+struct vring_used_elem {
+    uint32_t id;        // 完成的描述符链的首项
+    uint32_t len;
+} __attribute__ ((packed));
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;       // 设备下次写入ring的位置
+    struct vring_used_elem ring[];
+} __attribute__ ((packed));
+
+/* 命令的请求头 */
+struct virtio_blk_req_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__ ((packed));
+
+#define VIRTIO_BLK_TABLE_LEN ((PG_SIZE - 32) / sizeof(struct vring_desc))
+
+/* 一条命令, 占一页: 请求头, 设备写回的状态, 以及描述它们和数据的间接描述符表.
+ * 每条命令只占用虚拟队列的一个描述符, 数据段再多也不会挤占队列 */
+struct virtio_blk_cmd {
+    struct virtio_blk_req_hdr hdr;
+    uint8_t status;
+    uint8_t pad[15];
+    struct vring_desc table[VIRTIO_BLK_TABLE_LEN];
+} __attribute__ ((packed));
+
+/* 命令槽, 第i个槽固定使用虚拟队列的第i个描述符 */
+struct virtio_blk_slot {
+    struct virtio_blk_cmd* cmd;
+    uint32_t cmd_phys;
+    bool busy;              // 正在处理rq
+    struct request rq;
+    struct bio_iter iter;   // rq中下一条命令的起点
+    uint32_t next_lba;
+    uint32_t left;          // rq中还没交给设备的扇区数
+};
+
+static struct virtio_blk {
+    uint16_t iobase;
+    uint16_t queue_size;
+    struct vring_desc* desc;
+    volatile struct vring_avail* avail;
+    volatile struct vring_used* used;
+    uint16_t last_used;     // 已回收到的used环位置
+    uint16_t last_kick;     // 上次通知设备时的avail环位置
+    bool has_flush;
+    struct virtio_blk_slot slots[VIRTIO_BLK_SLOTS + 1];
+    uint32_t nr_free;       // 空闲的读写槽数, 只由派发线程修改
+    struct wait_queue wq;   // 派发线程在此等待bio入队或命令完成
+    struct lock flush_lock; // 同一时刻只有一个flush
+    struct completion flush_done;
+    int32_t flush_error;
+    struct block_device bdev;
+} vblk;
+
+/* 设备是否有尚未回收的已完成命令 */
+static bool virtio_blk_used_pending(void) {
+    return vblk.used->idx != vblk.last_used;
+}
+
+/* 把以第head项为首的命令放入avail环, 描述符表有table_len项. 通知设备由virtio_blk_kick统一进行 */
+static void virtio_blk_add(uint16_t head, uint32_t table_len) {
+    vblk.desc[head].len = table_len * sizeof(struct vring_desc);
+    enum intr_status old_status = intr_disable();
+    vblk.avail->ring[vblk.avail->idx % vblk.queue_size] = head;
+    asm volatile("":::"memory");    // 先写好ring再更新idx, x86的写不会乱序
+    vblk.avail->idx++;
+    intr_set_status(old_status);
+}
+
+/* 有新命令时通知设备, 设备正在处理avail环时不必通知. 一批命令只通知一次 */
+static void virtio_blk_kick(void) {
+    enum intr_status old_status = intr_disable();
+    if (vblk.avail->idx != vblk.last_kick) {
+        vblk.last_kick = vblk.avail->idx;
+        virtio_mb();
+        if (!(vblk.used->flags & VRING_USED_F_NO_NOTIFY)) {
+            outw(vblk.iobase + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+        }
+    }
+    intr_set_status(old_status);
+}
+
+/* 从slot的请求中取出下一条命令的数据段并放入avail环.
+ * 描述符表装不下时剩下的扇区留给下一条命令 */
+static void virtio_blk_issue(struct virtio_blk_slot* slot) {
+    struct virtio_blk_cmd* cmd = slot->cmd;
+    bool is_write = slot->rq.write;
+    uint16_t data_flags = VRING_DESC_F_NEXT | (is_write ? 0 : VRING_DESC_F_WRITE);
+    uint32_t nr = 1;        // table[0]是请求头, 最后一项留给状态
+    uint32_t sec_cnt = 0;
+    while (slot->left > 0) {
+        /* n个扇区的一段最多跨n/8+2页, 按剩下的描述符数限制这一段的扇区数 */
+        uint32_t room = VIRTIO_BLK_TABLE_LEN - 1 - nr;
+        if (room < 3) {
+            break;
+        }
+        uint32_t max_secs = (room - 2) * 8;
+        void* buf;
+        uint32_t secs;
+        struct bio* bio = bio_iter_next(&slot->iter, slot->left < max_secs ? slot->left : max_secs, &buf, &secs);
+        bool used = bio_use_mm(bio);    // 用户空间的缓冲区要在提交者的页表中翻译
+        uint32_t vaddr = (uint32_t)buf;
+        uint32_t byte_cnt = secs * BLOCK_SECTOR_SIZE;
+        while (byte_cnt > 0) {
+            uint32_t phys = addr_v2p(vaddr);
+            uint32_t len = PG_SIZE - (vaddr & 0xfff);   // 到本页结束
+            if (len > byte_cnt) {
+                len = byte_cnt;
+            }
+            struct vring_desc* cur = &cmd->table[nr - 1];
+            if (nr > 1 && cur->addr + cur->len == phys) {
+                cur->len += len;    // 物理上紧接着, 并入当前项
+            } else {
+                cur = &cmd->table[nr];
+                cur->addr = phys;
+                cur->len = len;
+                cur->flags = data_flags;
+                cur->next = nr + 1;
+                nr++;
+            }
+            vaddr += len;
+            byte_cnt -= len;
+        }
+        bio_unuse_mm(used);
+        slot->left -= secs;
+        sec_cnt += secs;
+    }
+
+    cmd->hdr.type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    cmd->hdr.reserved = 0;
+    cmd->hdr.sector = slot->next_lba;
+    cmd->table[0].addr = slot->cmd_phys;
+    cmd->table[0].len = sizeof(struct virtio_blk_req_hdr);
+    cmd->table[0].flags = VRING_DESC_F_NEXT;
+    cmd->table[0].next = 1;
+    cmd->status = 0xff;
+    cmd->table[nr].addr = slot->cmd_phys + offset(struct virtio_blk_cmd, status);
+    cmd->table[nr].len = 1;
+    cmd->table[nr].flags = VRING_DESC_F_WRITE;
+    cmd->table[nr].next = 0;
+    slot->next_lba += sec_cnt;
+    virtio_blk_add(slot - vblk.slots, nr + 1);
+}
+
+/* 回收所有已完成的命令. 请求还有剩余扇区时接着下发, 全部完成或出错时结束请求 */
+static void virtio_blk_reap(void) {
+    while (virtio_blk_used_pending()) {
+        asm volatile("":::"memory");    // 看到idx后再读ring和状态
+        uint32_t id = vblk.used->ring[vblk.last_used % vblk.queue_size].id;
+        vblk.last_used++;
+        ASSERT(id <= VIRTIO_BLK_FLUSH_SLOT);
+        struct virtio_blk_slot* slot = &vblk.slots[id];
+        int32_t error = slot->cmd->status == VIRTIO_BLK_S_OK ? 0 : -1;
+        if (id == VIRTIO_BLK_FLUSH_SLOT) {
+            vblk.flush_error = error;
+            complete(&vblk.flush_done);
+            continue;
+        }
+        if (error == 0 && slot->left > 0) {
+            virtio_blk_issue(slot);
+            continue;
+        }
+        if (error != 0) {
+            printk("%s: %s lba %d failed, status %d\n", vblk.bdev.name, \
+                   slot->rq.write ? "write" : "read", slot->rq.lba, slot->cmd->status);
+        }
+        blk_end_request(&slot->rq, error);
+        slot->busy = false;
+        vblk.nr_free++;
+    }
+}
+
+/* 从请求队列取出请求放入空闲的槽, 设备可以同时处理多个请求 */
+static void virtio_blk_dispatch(void) {
+    uint32_t idx = 0;
+    while (vblk.nr_free > 0 && idx < VIRTIO_BLK_SLOTS) {
+        struct virtio_blk_slot* slot = &vblk.slots[idx++];
+        if (slot->busy) {
+            continue;
+        }
+        if (!blk_queue_fetch(&vblk.bdev.queue, &slot->rq)) {
+            break;
+        }
+        slot->busy = true;
+        vblk.nr_free--;
+        bio_iter_init(&slot->iter, &slot->rq);
+        slot->next_lba = slot->rq.lba;
+        slot->left = slot->rq.sec_cnt;
+        virtio_blk_issue(slot);
+    }
+}
+
+/* 派发线程是否有事可做, 调用时已关中断.
+ * 中断处理程序会关掉设备的完成中断, 此后完成的命令由派发线程顺带回收,
+ * 直到无事可做要睡眠时才重新打开, 连续完成的命令因此只产生一次中断 */
+static bool virtio_blk_has_work(void) {
+    if (virtio_blk_used_pending() || (vblk.nr_free > 0 && !blk_queue_empty(&vblk.bdev.queue))) {
+        return true;
+    }
+    vblk.avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    virtio_mb();
+    /* 打开中断之前完成的命令不会再有中断, 再查一次 */
+    return virtio_blk_used_pending();
+}
+
+/* virtio盘的派发线程, 回收完成的命令并下发新的请求 */
+static void virtio_blk_thread(void* arg UNUSED) {
+    while (1) {
+        wait_event(&vblk.wq, virtio_blk_has_work());
+        virtio_blk_reap();
+        virtio_blk_dispatch();
+        virtio_blk_kick();
+    }
+}
+
+/* virtio盘的中断处理程序 */
+static void intr_virtio_blk_handler(uint8_t irq_no UNUSED) {
+    /* 读ISR同时撤销中断, 中断线与其他设备共用时不是本设备发出的则为0 */
+    if (inb(vblk.iobase + VIRTIO_PCI_ISR) & 0x1) {
+        vblk.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+        raise_softirq(SOFTIRQ_VIRTIO_BLK);
+    }
+}
+
+/* virtio块设备软中断, 唤醒派发线程 */
+static void virtio_blk_softirq(void) {
+    enum intr_status old_status = intr_disable();
+    wait_queue_wake_one(&vblk.wq);
+    intr_set_status(old_status);
+}
+
+/* 让设备把写缓存落盘. 不经请求队列, 用专门的槽直接下发 */
+static int32_t virtio_blk_flush(struct block_device* bdev UNUSED) {
+    if (!vblk.has_flush) {
+        return 0;       // 没有写缓存, 写完成即已落盘
+    }
+    lock_acquire(&vblk.flush_lock);
+    struct virtio_blk_slot* slot = &vblk.slots[VIRTIO_BLK_FLUSH_SLOT];
+    struct virtio_blk_cmd* cmd = slot->cmd;
+    cmd->hdr.type = VIRTIO_BLK_T_FLUSH;
+    cmd->hdr.reserved = 0;
+    cmd->hdr.sector = 0;
+    cmd->status = 0xff;
+    cmd->table[0].addr = slot->cmd_phys;
+    cmd->table[0].len = sizeof(struct virtio_blk_req_hdr);
+    cmd->table[0].flags = VRING_DESC_F_NEXT;
+    cmd->table[0].next = 1;
+    cmd->table[1].addr = slot->cmd_phys + offset(struct virtio_blk_cmd, status);
+    cmd->table[1].len = 1;
+    cmd->table[1].flags = VRING_DESC_F_WRITE;
+    cmd->table[1].next = 0;
+    reinit_completion(&vblk.flush_done);
+    virtio_blk_add(VIRTIO_BLK_FLUSH_SLOT, 2);
+    virtio_blk_kick();
+    wait_for_completion(&vblk.flush_done);  // 由派发线程回收时完成
+    int32_t error = vblk.flush_error;
+    lock_release(&vblk.flush_lock);
+    return error;
+}
+
+static const struct block_ops virtio_blk_ops = {
+    .submit = blk_queue_submit,
+    .flush = virtio_blk_flush
+};
+
+/* 申请pg_cnt页物理上也连续的内核内存, 供设备整块访问. 做不到时返回NULL */
+static void* virtio_alloc_contig(uint32_t pg_cnt) {
+    void* vaddr = get_kernel_pages(pg_cnt);
+    if (vaddr == NULL) {
+        return NULL;
+    }
+    uint32_t phys = addr_v2p((uint32_t)vaddr);
+    uint32_t pg_idx = 1;
+    while (pg_idx < pg_cnt) {
+        if (addr_v2p((uint32_t)vaddr + pg_idx * PG_SIZE) != phys + pg_idx * PG_SIZE) {
+            mfree_page(PF_KERNEL, vaddr, pg_cnt);
+            return NULL;
+        }
+        pg_idx++;
+    }
+    return vaddr;
+}
+
+/* 按legacy布局建立0号虚拟队列: 描述符表, avail环, 按页对齐的used环 */
+static bool virtio_blk_setup_queue(void) {
+    outw(vblk.iobase + VIRTIO_PCI_QUEUE_SEL, 0);
+    vblk.queue_size = inw(vblk.iobase + VIRTIO_PCI_QUEUE_NUM);
+    if (vblk.queue_size <= VIRTIO_BLK_SLOTS) {
+        printk("   virtio_blk: queue size %d too small\n", vblk.queue_size);
+        return false;
+    }
+    uint32_t used_off = (vblk.queue_size * sizeof(struct vring_desc) + 6 + 2 * vblk.queue_size + PG_SIZE - 1) & ~(PG_SIZE - 1);
+    uint32_t pg_cnt = DIV_ROUND_UP(used_off + 6 + 8 * vblk.queue_size, PG_SIZE);
+    void* ring = virtio_alloc_contig(pg_cnt);
+    if (ring == NULL) {
+        printk("   virtio_blk: alloc %d contiguous pages for queue failed\n", pg_cnt);
+        return false;
+    }
+    vblk.desc = ring;
+    vblk.avail = (struct vring_avail*)((uint32_t)ring + vblk.queue_size * sizeof(struct vring_desc));
+    vblk.used = (struct vring_used*)((uint32_t)ring + used_off);
+    vblk.last_used = 0;
+    vblk.last_kick = 0;
+
+    /* 每个槽固定占用一个描述符, 指向它自己的间接描述符表 */
+    uint32_t idx = 0;
+    while (idx <= VIRTIO_BLK_FLUSH_SLOT) {
+        struct virtio_blk_slot* slot = &vblk.slots[idx];
+        slot->cmd = get_kernel_pages(1);
+        if (slot->cmd == NULL) {
+            printk("   virtio_blk: alloc command page failed\n");
+            return false;
+        }
+        slot->cmd_phys = addr_v2p((uint32_t)slot->cmd);
+        slot->busy = false;
+        vblk.desc[idx].addr = slot->cmd_phys + offset(struct virtio_blk_cmd, table);
+        vblk.desc[idx].flags = VRING_DESC_F_INDIRECT;
+        idx++;
+    }
+    vblk.nr_free = VIRTIO_BLK_SLOTS;
+    outl(vblk.iobase + VIRTIO_PCI_QUEUE_PFN, addr_v2p((uint32_t)ring) / PG_SIZE);
+    return true;
+}
+
+/* 探测virtio-blk设备, 初始化后注册为vda并扫描分区 */
+void virtio_blk_init(void) {
+    printk("virtio_blk_init start\n");
+    struct pci_device* pdev = pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_LEGACY_ID);
+    if (pdev == NULL) {
+        if (pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_MODERN_ID) != NULL) {
+            printk("   virtio_blk: modern-only device not supported, use disable-legacy=off\n");
+        }
+        printk("virtio_blk_init done\n");
+        return;
+    }
+    uint32_t bar0 = pci_config_read(pdev, PCI_BAR0);
+    if (!(bar0 & 0x1) || pdev->irq_line >= 16) {
+        printk("   virtio_blk: no i/o port or irq assigned\n");
+        return;
+    }
+    pci_enable(pdev, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    vblk.iobase = pci_bar(pdev, 0);
+
+    /* 复位后依次告知设备: 已发现, 有驱动 */
+    outb(vblk.iobase + VIRTIO_PCI_STATUS, 0);
+    outb(vblk.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+    outb(vblk.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    uint32_t features = inl(vblk.iobase + VIRTIO_PCI_HOST_FEATURES);
+    if (!(features & VIRTIO_RING_F_INDIRECT_DESC)) {
+        printk("   virtio_blk: indirect descriptors not supported\n");
+        outb(vblk.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    features &= VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_BLK_F_FLUSH;
+    outl(vblk.iobase + VIRTIO_PCI_GUEST_FEATURES, features);
+    vblk.has_flush = (features & VIRTIO_BLK_F_FLUSH) != 0;
+
+    if (!virtio_blk_setup_queue()) {
+        outb(vblk.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    wait_queue_init(&vblk.wq);
+    lock_init(&vblk.flush_lock);
+    completion_init(&vblk.flush_done);
+    open_softirq(SOFTIRQ_VIRTIO_BLK, virtio_blk_softirq);
+    register_handler(0x20 + pdev->irq_line, intr_virtio_blk_handler);
+    pic_enable_irq(pdev->irq_line);
+
+    /* 容量是64位的扇区数, 配置空间起始处 */
+    uint32_t cap_lo = inl(vblk.iobase + VIRTIO_PCI_CONFIG);
+    uint32_t cap_hi = inl(vblk.iobase + VIRTIO_PCI_CONFIG + 4);
+    struct block_device* bdev = &vblk.bdev;
+    strcpy(bdev->name, "vda");
+    bdev->sectors = cap_hi != 0 ? 0xffffffff : cap_lo;     // 块设备层只用32位扇区号
+    bdev->sector_size = BLOCK_SECTOR_SIZE;
+    bdev->ops = &virtio_blk_ops;
+    bdev->private = &vblk;
+    blk_queue_init(&bdev->queue, VIRTIO_BLK_MAX_SECTORS, &vblk.wq);
+
+    struct task_struct* dispatcher = kthread_create("virtio_blk", VIRTIO_BLK_PRIO, 1, virtio_blk_thread, NULL);
+    if (dispatcher == NULL) {
+        PANIC("virtio_blk_init: create dispatch thread failed\n");
+    }
+    kthread_detach(dispatcher);     // 派发线程不会退出, 也无人join
+
+    outb(vblk.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    printk("   virtio_blk: io 0x%x irq %d queue %d%s\n", vblk.iobase, pdev->irq_line, \
+           vblk.queue_size, vblk.has_flush ? " flush" : "");
+    block_register(bdev, true);
+    printk("virtio_blk_init done\n");
+}
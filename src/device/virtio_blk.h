@@ -0,0 +1,8 @@
+#ifndef __DEVICE_VIRTIO_BLK_H
+#define __DEVICE_VIRTIO_BLK_H
+
+#define VIRTIO_BLK_SLOTS        16      // 最多同时交给设备的命令数
+#define VIRTIO_BLK_MAX_SECTORS  1024    // 合并后一个请求最多的扇区数, 超出描述符表时分成几条命令
+
+void virtio_blk_init(void);
+#endif
@@ -0,0 +1,484 @@
+#include "bcache.h"
+#include "blk_queue.h"
+#include "sync.h"
+#include "thread.h"
+#include "kthread.h"
+#include "workqueue.h"
+#include "timer.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "string.h"
+#include "stdio.h"
+#include "stdio_kernel.h"
+#include "debug.h"
+
+static struct buffer_head buffers[BCACHE_NR_BUFFERS];
+static struct list hash_table[BCACHE_HASH_SIZE];    // 按 (bdev, lba) 散列的已缓存扇区
+static struct list lru_list;        // 全部缓冲块, 队首最久未用, 淘汰时从队首找
+static struct wait_queue buffer_wq; // 等待传输结束或有缓冲块可淘汰的线程
+static uint32_t nr_dirty;           // 脏缓冲块数
+
+#define BCACHE_FLUSH_PRIO 31        // 回写线程的优先级
+
+static struct wait_queue flush_wq;  // 回写线程在此等待被唤醒
+static bool flush_kick;             // 有回写的工作要做
+static struct delayed_work flush_timer;     // 定期唤醒回写线程
+
+// 返回 (bdev, lba) 所在的哈希桶
+static struct list* bcache_bucket(struct block_device* bdev, uint32_t lba) {
+    return &hash_table[(((uint32_t)bdev >> 4) + lba) & (BCACHE_HASH_SIZE - 1)];
+}
+
+// 在哈希表中查找缓存 (bdev, lba) 的缓冲块, 调用前须关中断
+static struct buffer_head* bcache_lookup(struct block_device* bdev, uint32_t lba) {
+    struct list* bucket = bcache_bucket(bdev, lba);
+    struct list_elem* elem = bucket->head.next;
+    while (elem != &bucket->tail) {
+        struct buffer_head* bh = elem2entry(struct buffer_head, hash_tag, elem);
+        if (bh->bdev == bdev && bh->lba == lba) {
+            return bh;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
+// 从 lru 队首找一个无人使用且没在传输的缓冲块, 优先选干净的, 免得淘汰时同步写回.
+// 都在使用时返回 NULL, 调用前须关中断
+static struct buffer_head* bcache_victim(void) {
+    struct buffer_head* dirty_victim = NULL;
+    struct list_elem* elem = lru_list.head.next;
+    while (elem != &lru_list.tail) {
+        struct buffer_head* bh = elem2entry(struct buffer_head, lru_tag, elem);
+        if (bh->refcnt == 0 && !bh->busy) {
+            if (!bh->dirty) {
+                return bh;
+            }
+            if (dirty_victim == NULL) {
+                dirty_victim = bh;
+            }
+        }
+        elem = elem->next;
+    }
+    return dirty_victim;
+}
+
+// 唤醒回写线程, 可在关中断时调用
+static void bcache_wakeup_flusher(void) {
+    enum intr_status old_status = intr_disable();
+    flush_kick = true;
+    wait_queue_wake_one(&flush_wq);
+    intr_set_status(old_status);
+}
+
+// 缓冲块的传输结束, 在派发线程中执行
+static void bcache_end_io(struct bio* bio) {
+    struct buffer_head* bh = (struct buffer_head*)bio->private;
+    enum intr_status old_status = intr_disable();
+    bh->error = bio->error != 0;
+    if (!bh->error) {
+        bh->valid = true;
+        if (bio->write) {
+            // 写回期间没人能修改 data, 写完的就是最新的内容
+            bh->dirty = false;
+            nr_dirty--;
+        }
+    } else if (bio->write) {
+        printk("bcache: %s write sector %d failed\n", bh->bdev->name, bh->lba);
+    }
+    bh->busy = false;
+    wait_queue_wake_all(&buffer_wq);
+    intr_set_status(old_status);
+}
+
+// 开始在 bh->data 和硬盘之间传输, 调用者须已将 bh->busy 置为 true
+static void bcache_start_io(struct buffer_head* bh, bool write) {
+    ASSERT(bh->busy);
+    bio_init(&bh->bio, bh->bdev, bh->lba, bh->data, 1, write);
+    bh->bio.end_io = bcache_end_io;
+    bh->bio.private = bh;
+    submit_bio(&bh->bio);
+}
+
+// 让缓冲块 bh 改为缓存 (bdev, lba), 调用前须关中断且 bh 无人使用
+static void bcache_rebind(struct buffer_head* bh, struct block_device* bdev, uint32_t lba) {
+    ASSERT(bh->refcnt == 0 && !bh->busy && !bh->dirty);
+    if (bh->bdev != NULL) {
+        list_remove(&bh->hash_tag);
+    }
+    bh->bdev = bdev;
+    bh->lba = lba;
+    bh->valid = false;
+    list_append(bcache_bucket(bdev, lba), &bh->hash_tag);
+}
+
+// 把 bh 移到 lru 队尾, 成为最近使用的, 调用前须关中断
+static void bcache_touch(struct buffer_head* bh) {
+    list_remove(&bh->lru_tag);
+    list_append(&lru_list, &bh->lru_tag);
+}
+
+// 返回缓存 (bdev, lba) 的缓冲块并增加其引用, 未缓存时淘汰最久未用的缓冲块来存放,
+// 此时返回的缓冲块 valid 为 false. 被淘汰的缓冲块若是脏的, 先写回硬盘
+static struct buffer_head* bcache_get(struct block_device* bdev, uint32_t lba) {
+    enum intr_status old_status = intr_disable();
+    struct buffer_head* bh;
+    while (1) {
+        bh = bcache_lookup(bdev, lba);
+        if (bh != NULL) {
+            break;
+        }
+        bh = bcache_victim();
+        if (bh == NULL) {   // 全都在使用, 等其他线程用完
+            wait_queue_sleep(&buffer_wq);
+            continue;
+        }
+        if (bh->dirty) {
+            // 干净的都在使用, 回写线程落后了. 同步写回这一块,
+            // 写回期间可能有其他线程缓存了 (bdev, lba), 写完后从头再来
+            bcache_wakeup_flusher();
+            bh->refcnt++;
+            bh->busy = true;
+            intr_set_status(old_status);
+            bcache_start_io(bh, true);
+            intr_disable();
+            while (bh->busy) {
+                wait_queue_sleep(&buffer_wq);
+            }
+            if (bh->error) {
+                char error[64];
+                sprintf(error, "%s write sector %d failed!!!!!!\n", bh->bdev->name, bh->lba);
+                PANIC(error);
+            }
+            bh->refcnt--;
+            continue;
+        }
+
+        bcache_rebind(bh, bdev, lba);
+        break;
+    }
+    bh->refcnt++;
+    bcache_touch(bh);
+    intr_set_status(old_status);
+    return bh;
+}
+
+// 减少 bh 的引用, 引用为 0 后可以被淘汰
+static void bcache_put(struct buffer_head* bh) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(bh->refcnt > 0);
+    if (--bh->refcnt == 0) {
+        wait_queue_wake_all(&buffer_wq);
+    }
+    intr_set_status(old_status);
+}
+
+// 经缓存从 bdev 读取 sec_cnt 个扇区到 buf, 命中的扇区不再访问硬盘
+void bcache_read(struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    ASSERT(sec_cnt > 0);
+    ASSERT(lba + sec_cnt <= bdev->sectors);
+    struct buffer_head* bhs[BCACHE_BATCH];
+    uint8_t* dst = (uint8_t*)buf;
+    while (sec_cnt > 0) {
+        uint32_t cnt = sec_cnt < BCACHE_BATCH ? sec_cnt : BCACHE_BATCH;
+        uint32_t idx;
+
+        // 先为所有未命中的扇区发起读, 相邻扇区的 bio 在请求队列中合并成一个请求
+        struct blk_plug plug;
+        bool plugged = running_thread()->plug == NULL;
+        if (plugged) {
+            blk_start_plug(&plug);
+        }
+        idx = 0;
+        while (idx < cnt) {
+            struct buffer_head* bh = bhs[idx] = bcache_get(bdev, lba + idx);
+            enum intr_status old_status = intr_disable();
+            bool miss = !bh->valid && !bh->busy;
+            if (miss) {
+                bh->busy = true;
+            }
+            intr_set_status(old_status);
+            if (miss) {
+                bcache_start_io(bh, false);
+            }
+            idx++;
+        }
+        if (plugged) {
+            blk_finish_plug(&plug);
+        }
+
+        // 再逐个等待读完并复制出来
+        idx = 0;
+        while (idx < cnt) {
+            struct buffer_head* bh = bhs[idx];
+            enum intr_status old_status = intr_disable();
+            while (bh->busy) {
+                wait_queue_sleep(&buffer_wq);
+            }
+            if (bh->error || !bh->valid) {
+                char error[64];
+                sprintf(error, "%s read sector %d failed!!!!!!\n", bdev->name, lba + idx);
+                PANIC(error);
+            }
+            memcpy(dst, bh->data, BLOCK_SECTOR_SIZE);
+            intr_set_status(old_status);
+            bcache_put(bh);
+            dst += BLOCK_SECTOR_SIZE;
+            idx++;
+        }
+        lba += cnt;
+        sec_cnt -= cnt;
+    }
+}
+
+// 为 bdev 上从 lba 开始的 sec_cnt 个扇区发起异步读, 不等待读完, 之后的 bcache_read 便能命中.
+// 已缓存或正在读的扇区跳过. 没有干净的空闲缓冲块时放弃剩下的, 预读不值得为此同步写回脏块
+void bcache_readahead(struct block_device* bdev, uint32_t lba, uint32_t sec_cnt) {
+    ASSERT(lba + sec_cnt <= bdev->sectors);
+    struct blk_plug plug;
+    bool plugged = running_thread()->plug == NULL;
+    if (plugged) {
+        blk_start_plug(&plug);
+    }
+    uint32_t idx = 0;
+    while (idx < sec_cnt) {
+        enum intr_status old_status = intr_disable();
+        struct buffer_head* bh = bcache_lookup(bdev, lba + idx);
+        if (bh == NULL) {
+            bh = bcache_victim();
+            if (bh == NULL || bh->dirty) {
+                intr_set_status(old_status);
+                break;
+            }
+            bcache_rebind(bh, bdev, lba + idx);
+            bcache_touch(bh);
+        }
+        // 预读的缓冲块不持有引用, 读完后和其他无人使用的一样可以被淘汰
+        bool start = !bh->valid && !bh->busy;
+        if (start) {
+            bh->busy = true;
+        }
+        intr_set_status(old_status);
+        if (start) {
+            bcache_start_io(bh, false);
+        }
+        idx++;
+    }
+    if (plugged) {
+        blk_finish_plug(&plug);
+    }
+}
+
+// 将 bh 标记为脏, 调用前须关中断
+static void bcache_mark_dirty(struct buffer_head* bh) {
+    bh->valid = true;
+    if (!bh->dirty) {
+        bh->dirty = true;
+        bh->dirty_ticks = ticks;
+        nr_dirty++;
+    }
+}
+
+// 用 src 中的 sec_cnt 个扇区覆盖缓存中 bdev 从 lba 开始的扇区, src 为 NULL 时全部清 0
+static void bcache_fill(struct block_device* bdev, uint32_t lba, const uint8_t* src, uint32_t sec_cnt) {
+    ASSERT(sec_cnt > 0);
+    ASSERT(lba + sec_cnt <= bdev->sectors);
+    uint32_t idx = 0;
+    while (idx < sec_cnt) {
+        // 整扇区覆盖, 不需要先读入. 正在传输的缓冲块要等传输结束才能修改
+        struct buffer_head* bh = bcache_get(bdev, lba + idx);
+        enum intr_status old_status = intr_disable();
+        while (bh->busy) {
+            wait_queue_sleep(&buffer_wq);
+        }
+        if (src != NULL) {
+            memcpy(bh->data, src, BLOCK_SECTOR_SIZE);
+            src += BLOCK_SECTOR_SIZE;
+        } else {
+            memset(bh->data, 0, BLOCK_SECTOR_SIZE);
+        }
+        bcache_mark_dirty(bh);
+        intr_set_status(old_status);
+        bcache_put(bh);
+        idx++;
+    }
+    if (nr_dirty >= BCACHE_DIRTY_HIGH) {
+        bcache_wakeup_flusher();
+    }
+}
+
+// 经缓存把 buf 中 sec_cnt 个扇区写入 bdev, 返回时数据只在缓存中, 稍后由回写线程写入硬盘.
+// 同一扇区在写回前的多次写入只需写一次硬盘
+void bcache_write(struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt) {
+    bcache_fill(bdev, lba, buf, sec_cnt);
+}
+
+// 经缓存把 bdev 上从 lba 开始的 sec_cnt 个扇区清 0, 用于新分配的块
+void bcache_zero(struct block_device* bdev, uint32_t lba, uint32_t sec_cnt) {
+    bcache_fill(bdev, lba, NULL, sec_cnt);
+}
+
+// 返回缓存 (bdev, lba) 且内容有效的缓冲块并增加其引用, 未缓存时读入并等待读完
+static struct buffer_head* bcache_get_valid(struct block_device* bdev, uint32_t lba) {
+    struct buffer_head* bh = bcache_get(bdev, lba);
+    enum intr_status old_status = intr_disable();
+    while (!bh->valid) {
+        if (!bh->busy) {
+            bh->busy = true;
+            intr_set_status(old_status);
+            bcache_start_io(bh, false);
+            intr_disable();
+        }
+        while (bh->busy) {
+            wait_queue_sleep(&buffer_wq);
+        }
+        if (!bh->valid) {
+            char error[64];
+            sprintf(error, "%s read sector %d failed!!!!!!\n", bdev->name, lba);
+            PANIC(error);
+        }
+    }
+    intr_set_status(old_status);
+    return bh;
+}
+
+// 经缓存读取 bdev 第 lba 扇区中从 offset 开始的 len 个字节, 不能跨扇区
+void bcache_read_part(struct block_device* bdev, uint32_t lba, uint32_t offset, void* buf, uint32_t len) {
+    ASSERT(offset + len <= BLOCK_SECTOR_SIZE);
+    struct buffer_head* bh = bcache_get_valid(bdev, lba);
+    enum intr_status old_status = intr_disable();
+    memcpy(buf, bh->data + offset, len);
+    intr_set_status(old_status);
+    bcache_put(bh);
+}
+
+// 经缓存把 buf 中 len 个字节写到 bdev 第 lba 扇区的 offset 处, 不能跨扇区.
+// 扇区的其余内容不变, 未缓存时先读入
+void bcache_write_part(struct block_device* bdev, uint32_t lba, uint32_t offset, const void* buf, uint32_t len) {
+    ASSERT(offset + len <= BLOCK_SECTOR_SIZE);
+    struct buffer_head* bh = bcache_get_valid(bdev, lba);
+    enum intr_status old_status = intr_disable();
+    while (bh->busy) {      // 可能正在写回
+        wait_queue_sleep(&buffer_wq);
+    }
+    memcpy(bh->data + offset, buf, len);
+    bcache_mark_dirty(bh);
+    intr_set_status(old_status);
+    bcache_put(bh);
+}
+
+// 提交 bdev 上(bdev 为 NULL 时为所有设备)脏缓冲块的写回, 不等待写完.
+// only_expired 为 true 时只写回变脏已超过 BCACHE_DIRTY_EXPIRE 的
+static void bcache_writeback(struct block_device* bdev, bool only_expired) {
+    // 在 plug 中攒齐再进请求队列, 相邻扇区合并成一个请求
+    struct blk_plug plug;
+    bool plugged = running_thread()->plug == NULL;
+    if (plugged) {
+        blk_start_plug(&plug);
+    }
+    uint32_t idx = 0;
+    while (idx < BCACHE_NR_BUFFERS) {
+        struct buffer_head* bh = &buffers[idx];
+        enum intr_status old_status = intr_disable();
+        bool start = bh->dirty && !bh->busy && (bdev == NULL || bh->bdev == bdev) &&
+                     (!only_expired || ticks_reached(bh->dirty_ticks + BCACHE_DIRTY_EXPIRE));
+        if (start) {
+            bh->busy = true;
+        }
+        intr_set_status(old_status);
+        if (start) {
+            bcache_start_io(bh, true);
+        }
+        idx++;
+    }
+    if (plugged) {
+        blk_finish_plug(&plug);
+    }
+}
+
+// 把 bdev 上(bdev 为 NULL 时为所有设备)的脏数据写入硬盘并落到介质上, 成功返回 0
+int32_t bcache_sync(struct block_device* bdev) {
+    bcache_writeback(bdev, false);
+
+    // 等待本设备所有缓冲块的传输结束, 包括回写线程之前提交的
+    int32_t ret = 0;
+    uint32_t idx = 0;
+    while (idx < BCACHE_NR_BUFFERS) {
+        struct buffer_head* bh = &buffers[idx];
+        enum intr_status old_status = intr_disable();
+        if (bh->bdev != NULL && (bdev == NULL || bh->bdev == bdev)) {
+            while (bh->busy) {
+                wait_queue_sleep(&buffer_wq);
+            }
+            if (bh->dirty && bh->error) {
+                ret = -1;
+            }
+        }
+        intr_set_status(old_status);
+        idx++;
+    }
+
+    // 再让硬盘把写缓存中的数据落到介质上
+    if (bdev != NULL) {
+        return block_flush(bdev) == 0 ? ret : -1;
+    }
+    struct list_elem* elem = block_devices.head.next;
+    while (elem != &block_devices.tail) {
+        struct block_device* dev = elem2entry(struct block_device, bdev_tag, elem);
+        if (block_flush(dev) != 0) {
+            ret = -1;
+        }
+        elem = elem->next;
+    }
+    return ret;
+}
+
+// 回写线程, 定期写回到期的脏数据, 脏块过多时全部写回
+static void bcache_flush_thread(void* arg UNUSED) {
+    while (1) {
+        wait_event(&flush_wq, flush_kick);
+        flush_kick = false;
+        bcache_writeback(NULL, nr_dirty < BCACHE_DIRTY_HIGH);
+    }
+}
+
+// 每 BCACHE_FLUSH_INTERVAL 个嘀嗒唤醒一次回写线程
+static void bcache_flush_timer(struct work_struct* work UNUSED) {
+    bcache_wakeup_flusher();
+    queue_delayed_work(&system_wq, &flush_timer, BCACHE_FLUSH_INTERVAL);
+}
+
+// 初始化缓冲区缓存, 须在挂载文件系统前调用
+void bcache_init(void) {
+    printk("bcache_init start\n");
+    uint8_t* data = get_kernel_pages(BCACHE_NR_BUFFERS * BLOCK_SECTOR_SIZE / PG_SIZE);
+    if (data == NULL) {
+        PANIC("bcache_init: alloc memory failed!");
+    }
+    uint32_t idx = 0;
+    while (idx < BCACHE_HASH_SIZE) {
+        list_init(&hash_table[idx]);
+        idx++;
+    }
+    list_init(&lru_list);
+    wait_queue_init(&buffer_wq);
+
+    idx = 0;
+    while (idx < BCACHE_NR_BUFFERS) {
+        struct buffer_head* bh = &buffers[idx];
+        memset(bh, 0, sizeof(struct buffer_head));
+        bh->data = data + idx * BLOCK_SECTOR_SIZE;
+        list_append(&lru_list, &bh->lru_tag);
+        idx++;
+    }
+
+    wait_queue_init(&flush_wq);
+    struct task_struct* flusher = kthread_create("bflush", BCACHE_FLUSH_PRIO, 1, bcache_flush_thread, NULL);
+    if (flusher == NULL) {
+        PANIC("bcache_init: create flush thread failed!");
+    }
+    kthread_detach(flusher);
+    delayed_work_init(&flush_timer, bcache_flush_timer);
+    queue_delayed_work(&system_wq, &flush_timer, BCACHE_FLUSH_INTERVAL);
+    printk("bcache_init done\n");
+}
@@ -0,0 +1,53 @@
+#ifndef __FS_BCACHE_H
+#define __FS_BCACHE_H
+#include "stdint.h"
+#include "list.h"
+#include "block.h"
+
+#define BCACHE_NR_BUFFERS   1024    // 缓冲块总数, 每块缓存一个扇区, 共 512KB
+#define BCACHE_HASH_SIZE    256     // 哈希桶数, 须为 2 的幂
+#define BCACHE_BATCH        16      // 一次读写最多同时占用的缓冲块数, 更长的读写分批进行
+#define BCACHE_DIRTY_EXPIRE 300     // 脏数据在内存中最多停留的嘀嗒数, 到期后由回写线程写回
+#define BCACHE_FLUSH_INTERVAL 100   // 回写线程定期检查的间隔嘀嗒数
+#define BCACHE_DIRTY_HIGH   (BCACHE_NR_BUFFERS / 4)  // 脏块数达到此值时立即回写, 不等到期
+
+// 缓冲块, 缓存块设备 bdev 上的第 lba 个扇区
+struct buffer_head {
+    struct block_device* bdev;  // 为 NULL 时未缓存任何扇区
+    uint32_t lba;
+    uint8_t* data;              // 扇区数据, 512 字节
+    bool valid;                 // data 中是该扇区的内容(可能比硬盘上的新)
+    bool dirty;                 // data 比硬盘上的新, 被淘汰前必须写回
+    bool busy;                  // 正在与硬盘传输 data, 期间不能修改
+    bool error;                 // 上次传输出错
+    uint32_t dirty_ticks;       // 变脏的时刻
+    uint32_t refcnt;            // 正在使用它的线程数, 不为 0 时不会被淘汰
+    struct bio bio;             // 传输 data 用的 bio
+    struct list_elem hash_tag;  // 用于加入 (bdev, lba) 的哈希桶
+    struct list_elem lru_tag;   // 用于加入 lru 队列
+};
+
+// 初始化缓冲区缓存, 须在挂载文件系统前调用
+void bcache_init(void);
+
+// 经缓存从 bdev 读取 sec_cnt 个扇区到 buf, 命中的扇区不再访问硬盘
+void bcache_read(struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt);
+
+// 为 bdev 上从 lba 开始的 sec_cnt 个扇区发起异步读, 不等待读完
+void bcache_readahead(struct block_device* bdev, uint32_t lba, uint32_t sec_cnt);
+
+// 经缓存把 buf 中 sec_cnt 个扇区写入 bdev, 返回时数据只在缓存中, 稍后由回写线程写入硬盘
+void bcache_write(struct block_device* bdev, uint32_t lba, void* buf, uint32_t sec_cnt);
+
+// 经缓存把 bdev 上从 lba 开始的 sec_cnt 个扇区清 0, 用于新分配的块
+void bcache_zero(struct block_device* bdev, uint32_t lba, uint32_t sec_cnt);
+
+// 经缓存读取 bdev 第 lba 扇区中从 offset 开始的 len 个字节, 不能跨扇区
+void bcache_read_part(struct block_device* bdev, uint32_t lba, uint32_t offset, void* buf, uint32_t len);
+
+// 经缓存把 buf 中 len 个字节写到 bdev 第 lba 扇区的 offset 处, 不能跨扇区
+void bcache_write_part(struct block_device* bdev, uint32_t lba, uint32_t offset, const void* buf, uint32_t len);
+
+// 把 bdev 上(bdev 为 NULL 时为所有设备)的脏数据写入硬盘并落到介质上, 成功返回 0
+int32_t bcache_sync(struct block_device* bdev);
+#endif
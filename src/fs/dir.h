@@ -3,7 +3,7 @@
 #include "stdint.h"
 #include "list.h"
 #include "fs.h"
-#include "ide.h"
+#include "block.h"
 
 #define MAX_FILE_NAME_LEN 16 // 最大文件名长度
 extern struct dir root_dir;
@@ -12,7 +12,7 @@ extern struct dir root_dir;
 struct dir {
     struct inode* inode;
     uint32_t dir_pos; // 记录在目录内的偏移
-    uint8_t dir_buf[512]; // 目录的数据缓冲
+    uint8_t* dir_buf; // 目录的数据缓冲, 打开时按分区的块大小分配, 能放下一个目录块
 };
 
 // 目录项结构
@@ -2,7 +2,8 @@
 #include "global.h"
 #include "thread.h"
 #include "inode.h"
-#include "ide.h"
+#include "block.h"
+#include "bcache.h"
 #include "fs.h"
 #include "super_block.h"
 #include "interrupt.h"
@@ -60,25 +61,137 @@ int32_t inode_bitmap_alloc(struct partition* part) {
     return bit_idx; // inode号
 }
 
-// 分配 1 个扇区, 返回其扇区地址
+// 第 bit_idx 块是否不能分配: 块位图中已占用, 或被某个文件的预分配窗口预留
+static bool block_busy(struct partition* part, uint32_t bit_idx) {
+    return bitmap_scan_test(&part->block_bitmap, bit_idx) || bitmap_scan_test(&part->prealloc_bitmap, bit_idx);
+}
+
+// 从 goal_lba 所在的块往后找空闲块, 到位图末尾再从头找, 找出最多 cnt 个连续的空闲块.
+// 找到够长的一段就停下, 否则取找到的最长的一段. 返回起始位索引, 块数存入 *got, 没有空闲块时返回 -1
+static int32_t block_find_near(struct partition* part, uint32_t goal_lba, uint32_t cnt, uint32_t* got) {
+    ASSERT(cnt > 0);
+    struct bitmap* btmp = &part->block_bitmap;
+    uint32_t bit_len = btmp->btmp_bytes_len * 8;    // 位图末尾多出的位在格式化时已置 1
+    uint32_t goal = 0;
+    if (goal_lba >= part->sb->data_start_lba) {
+        goal = (goal_lba - part->sb->data_start_lba) / part->sb->block_sects;
+    }
+    if (goal >= bit_len) {
+        goal = 0;
+    }
+
+    uint32_t best_start = 0, best_len = 0;
+    uint32_t bit_idx = goal, end = bit_len, pass = 0;
+    while (pass < 2 && best_len < cnt) {
+        while (bit_idx < end && best_len < cnt) {
+            if (bit_idx % 8 == 0 && bit_idx + 8 <= end && btmp->bits[bit_idx / 8] == 0xff) {
+                bit_idx += 8;       // 整字节都已占用, 一次跳过
+                continue;
+            }
+            if (block_busy(part, bit_idx)) {
+                bit_idx++;
+                continue;
+            }
+            uint32_t run_start = bit_idx;
+            while (bit_idx < end && bit_idx - run_start < cnt && !block_busy(part, bit_idx)) {
+                bit_idx++;
+            }
+            if (bit_idx - run_start > best_len) {
+                best_start = run_start;
+                best_len = bit_idx - run_start;
+            }
+        }
+        // 第二遍从位图开头找到 goal 为止
+        bit_idx = 0;
+        end = goal;
+        pass++;
+    }
+    if (best_len == 0) {
+        return -1;
+    }
+    *got = best_len;
+    return best_start;
+}
+
+// 分配 1 个块并同步块位图, 返回其起始扇区地址
 int32_t block_bitmap_alloc(struct partition* part) {
-    int32_t bit_idx = bitmap_scan(&part->block_bitmap, 1);
+    uint32_t got;
+    int32_t bit_idx = block_find_near(part, part->sb->data_start_lba, 1, &got);
     if (bit_idx == -1) {
         return -1;
     }
 
     bitmap_set(&part->block_bitmap, bit_idx, 1);
+    bitmap_sync(part, bit_idx, BLOCK_BITMAP);
     // 和 inode_bitmap_malloc 不同, 此处返回的不是位索引
-    // 而是具体可用的扇区地址
-    return (part->sb->data_start_lba + bit_idx);    // 具体的扇区lba地址
+    // 而是块起始的扇区地址, 块和块之间相隔 block_sects 个扇区
+    return (part->sb->data_start_lba + bit_idx * part->sb->block_sects);    // 具体的扇区lba地址
+}
+
+// 从 goal_lba 所在的块往后找空闲块, 到位图末尾再从头找, 分配其中最多 cnt 个连续的块并同步块位图.
+// 找到够长的一段就停下, 否则取找到的最长的一段. 返回起始扇区地址, 分到的块数存入 *got, 没有空闲块时返回 -1
+int32_t block_bitmap_alloc_near(struct partition* part, uint32_t goal_lba, uint32_t cnt, uint32_t* got) {
+    int32_t best_start = block_find_near(part, goal_lba, cnt, got);
+    if (best_start == -1) {
+        return -1;
+    }
+
+    uint32_t bit_idx = best_start;
+    while (bit_idx < best_start + *got) {
+        bitmap_set(&part->block_bitmap, bit_idx, 1);
+        // 每个位图扇区只同步一次
+        if (bit_idx == (uint32_t)best_start || bit_idx % BITS_PER_SECTOR == 0) {
+            bitmap_sync(part, bit_idx, BLOCK_BITMAP);
+        }
+        bit_idx++;
+    }
+    return part->sb->data_start_lba + best_start * part->sb->block_sects;
+}
+
+// 和 block_bitmap_alloc_near 一样找最多 cnt 个连续的空闲块, 但只在内存中的 prealloc_bitmap 里预留,
+// 不写块位图, 宕机后这些块仍是空闲的. 返回起始扇区地址, 预留到的块数存入 *got, 没有空闲块时返回 -1
+int32_t block_reserve_near(struct partition* part, uint32_t goal_lba, uint32_t cnt, uint32_t* got) {
+    int32_t best_start = block_find_near(part, goal_lba, cnt, got);
+    if (best_start == -1) {
+        return -1;
+    }
+    uint32_t bit_idx = best_start;
+    while (bit_idx < best_start + *got) {
+        bitmap_set(&part->prealloc_bitmap, bit_idx++, 1);
+    }
+    return part->sb->data_start_lba + best_start * part->sb->block_sects;
+}
+
+// 把预留的块 lba 转为正式分配, 并同步块位图
+void block_reserve_take(struct partition* part, uint32_t lba) {
+    uint32_t bit_idx = (lba - part->sb->data_start_lba) / part->sb->block_sects;
+    ASSERT(bitmap_scan_test(&part->prealloc_bitmap, bit_idx) && !bitmap_scan_test(&part->block_bitmap, bit_idx));
+    bitmap_set(&part->prealloc_bitmap, bit_idx, 0);
+    bitmap_set(&part->block_bitmap, bit_idx, 1);
+    bitmap_sync(part, bit_idx, BLOCK_BITMAP);
+}
+
+// 取消对块 lba 的预留, 块位图不受影响
+void block_reserve_cancel(struct partition* part, uint32_t lba) {
+    uint32_t bit_idx = (lba - part->sb->data_start_lba) / part->sb->block_sects;
+    ASSERT(bitmap_scan_test(&part->prealloc_bitmap, bit_idx));
+    bitmap_set(&part->prealloc_bitmap, bit_idx, 0);
+}
+
+// 回收块地址为 lba 的块, 并同步块位图
+void block_bitmap_free(struct partition* part, uint32_t lba) {
+    uint32_t bit_idx = (lba - part->sb->data_start_lba) / part->sb->block_sects;
+    ASSERT(bit_idx > 0);    // 第 0 块是根目录的, 不会被回收
+    bitmap_set(&part->block_bitmap, bit_idx, 0);
+    bitmap_sync(part, bit_idx, BLOCK_BITMAP);
 }
 
 // 将内存中 bitmap 第 bit_idx 位所在的 512 字节同步到硬盘
 void bitmap_sync(struct partition* part, uint32_t bit_idx, uint8_t btmp) {
     // 本 inode 索引相对于位图的扇区偏移量
-    uint32_t off_sec = bit_idx / 4096;
+    uint32_t off_sec = bit_idx / BITS_PER_SECTOR;
     // 本 inode 索引相对于位图的字节偏移量
-    uint32_t off_size = off_sec * BLOCK_SIZE;
+    uint32_t off_size = off_sec * SECTOR_SIZE;
     uint32_t sec_lba;
     uint8_t* bitmap_off;
 
@@ -92,13 +205,13 @@ void bitmap_sync(struct partition* part, uint32_t bit_idx, uint8_t btmp) {
             bitmap_off = part->block_bitmap.bits + off_size;
             break;
     }
-    ide_write(part->my_disk, sec_lba, bitmap_off, 1);
+    bcache_write(part->bdev, sec_lba, bitmap_off, 1);
 }
 
 // 创建文件, 若成功则返回文件描述符, 否则返回 -1
 int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
-    // 后续操作的公共缓冲区
-    void* io_buf = sys_malloc(1024);
+    // 后续操作的公共缓冲区, 要能放下一个目录块
+    void* io_buf = sys_malloc(MAX_BLOCK_SIZE);
     if (io_buf == NULL) {
         printk("in file_creat: sys_malloc for io_buf failed\n");
         return -1;
@@ -134,6 +247,7 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
     file_table[fd_idx].fd_inode = new_file_inode;
     file_table[fd_idx].fd_pos = 0;
     file_table[fd_idx].fd_flag = flag;
+    file_table[fd_idx].ra_prev = file_table[fd_idx].ra_size = 0;
     file_table[fd_idx].fd_inode->write_deny = false;
 
     struct dir_entry new_dir_entry;
@@ -162,8 +276,10 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
     bitmap_sync(cur_part, inode_no, INODE_BITMAP);
 
     // e 将创建的文件 inode 添加到 open_inodes 链表
-    list_push(&cur_part->open_inodes, &new_file_inode->inode_tag);
     new_file_inode->i_open_cnts = 1;
+    rwlock_write_acquire(&cur_part->inode_lock);
+    list_push(&cur_part->open_inodes, &new_file_inode->inode_tag);
+    rwlock_write_release(&cur_part->inode_lock);
 
     sys_free(io_buf);
     return pcb_fd_install(fd_idx);
@@ -198,6 +314,7 @@ int32_t file_open(uint32_t inode_no, uint8_t flag) {
     file_table[fd_idx].fd_inode = inode_open(cur_part, inode_no);
     file_table[fd_idx].fd_pos = 0; // 每次打开文件, 要将 fd_pos 还原为 0, 即让文件内的指针指向开头
     file_table[fd_idx].fd_flag = flag;
+    file_table[fd_idx].ra_prev = file_table[fd_idx].ra_size = 0;
     bool* write_deny = &file_table[fd_idx].fd_inode->write_deny;
 
     // 只要是关于写文件, 判断是否有其它进程正写此文件
@@ -231,195 +348,145 @@ int32_t file_close(struct file* file) {
 
 // 把 buf 中的 count 个字节写入 file, 成功则返回写入的字节数, 失败则返回 -1
 int32_t file_write(struct file* file, const void* buf, uint32_t count) {
-    if ((file->fd_inode->i_size + count) > (BLOCK_SIZE * 140)) { // 文件目前最大只支持 512*140=71680 字节
-        printk("exceed max file_size 71680 bytes, write file failed\n");
+    struct inode* inode = file->fd_inode;
+    if (inode->i_size + count < inode->i_size) { // 文件大小用 32 位记录, 最大 4GB
+        printk("exceed max file_size 4GB, write file failed\n");
         return -1;
     }
 
-    uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
+    uint32_t block_size = cur_part->sb->block_size;
+    // 最后 inode_sync 可能要读写两个扇区, 故多申请一个扇区
+    uint8_t* io_buf = sys_malloc(block_size + SECTOR_SIZE);
     if (io_buf == NULL) {
         printk("file_write: sys_malloc for io_buf failed\n");
         return -1;
     }
 
-    uint32_t* all_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE + 48); // 用来记录文件所有的块（128+12）地址
-    if (all_blocks == NULL) {
-        printk("file_write: sys_malloc for all_blocks failed\n");
+    // 打包在尾块中的小文件先移回整块再追加, 写完后若仍不满一块会再次打包.
+    // 已有块的文件不再打包, 以免回收 file_fallocate 预先分配的块
+    bool packable = inode->i_blocks == 0;
+    if (inode->i_tail != 0 && inode_unpack_tail(cur_part, inode, io_buf) == -1) {
+        printk("file_write: inode_unpack_tail failed\n");
+        sys_free(io_buf);
         return -1;
     }
 
+    // 本次写入要新增的块在硬盘上预留成连续的一段, 多留的块给以后的追加用.
+    // 写完后不满一块的小文件会打包进尾块, 不必预留
+    uint32_t blocks_needed = (inode->i_size + count) / block_size + ((inode->i_size + count) % block_size != 0);
+    bool will_pack = packable && cur_part->sb->block_sects >= TAIL_MIN_BLOCK_SECTS &&
+                     DIV_ROUND_UP(inode->i_size + count, SECTOR_SIZE) < cur_part->sb->block_sects;
+    if (blocks_needed > inode->i_blocks && !will_pack) {
+        blocks_needed -= inode->i_blocks;
+        inode_prealloc(cur_part, inode, blocks_needed > INODE_PREALLOC_BLOCKS ? blocks_needed : INODE_PREALLOC_BLOCKS);
+    }
+
     const uint8_t* src = buf;       // 用 src 指向 buf 中待写入的数据
     uint32_t bytes_written = 0;     // 用来记录已写入数据大小
     uint32_t size_left = count;	    // 用来记录未写入数据大小
-    int32_t block_lba = -1;	        // 块地址
-    uint32_t block_bitmap_idx = 0;  // 用来记录block对应于block_bitmap中的索引,做为参数传给bitmap_sync
-    uint32_t sec_idx;	            // 用来索引扇区
-    uint32_t sec_lba;	            // 扇区地址
-    uint32_t sec_off_bytes;         // 扇区内字节偏移量
-    uint32_t sec_left_bytes;        // 扇区内剩余字节量
-    uint32_t chunk_size;	        // 每次写入硬盘的数据块大小
-    int32_t indirect_block_table;   // 用来获取一级间接表地址
-    uint32_t block_idx;		        // 块索引
-
-    // 判断文件是否是第一次写, 如果是, 先为其分配一个块
-    if (file->fd_inode->i_sectors[0] == 0) {
-        block_lba = block_bitmap_alloc(cur_part);
-        if (block_lba == -1) {
-            printk("file_write: block_bitmap_alloc failed\n");
-            return -1;
-        }
-        file->fd_inode->i_sectors[0] = block_lba;
+    uint32_t block_idx;             // 文件内的块号
+    uint32_t block_lba;             // 块地址
+    uint32_t blk_off_bytes;         // 块内字节偏移量
+    uint32_t blk_left_bytes;        // 块内剩余字节量
+    uint32_t chunk_size;	        // 每次写入的数据大小
+    uint32_t sec_off, sec_cnt;      // 不满一块时只写涉及的扇区
+
+    // 数据总是追加到文件末尾, 写到哪一块才为哪一块分配硬盘块
+    file->fd_pos = inode->i_size - 1;
+    while (bytes_written < count) {
+        block_idx = inode->i_size / block_size;
+        blk_off_bytes = inode->i_size % block_size;
+        blk_left_bytes = block_size - blk_off_bytes;
+        chunk_size = size_left < blk_left_bytes ? size_left : blk_left_bytes;
 
-        // 每分配一个块就将位图同步到硬盘
-        block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-        ASSERT(block_bitmap_idx != 0);
-        bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-    }
-    
-    // 写入 count 个字节前, 该文件已经占用的块数
-    uint32_t file_has_used_blocks = file->fd_inode->i_size / BLOCK_SIZE + 1;
-
-    // 存储 count 字节后该文件将占用的块数
-    uint32_t file_will_use_blocks = (file->fd_inode->i_size + count) / BLOCK_SIZE + 1;
-    ASSERT(file_will_use_blocks <= 140);
-
-    // 通过此增量判断是否需要分配扇区, 如增量为 0, 表示原扇区够用
-    uint32_t add_blocks = file_will_use_blocks - file_has_used_blocks;
-
-    // 开始将所有块地址收集到 all_blocks (系统中块大小等于扇区大小)
-    // 后面都统一在 all_blocks 中获取写入扇区地址
-    if (add_blocks == 0) {
-        if (file_has_used_blocks <= 12) {
-            // 在同一扇区内写入数据, 不涉及到分配新扇区
-            block_idx = file_has_used_blocks - 1;
-            all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
+        if (block_idx < inode->i_blocks) {
+            inode_bmap(cur_part, inode, block_idx, 1, &block_lba);
         } else {
-            // 未写入新数据之前已经占用了间接块, 需要将间接块地址读进来
-            ASSERT(file->fd_inode->i_sectors[12] != 0);
-            indirect_block_table = file->fd_inode->i_sectors[12];
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks+12, 1);
-        }
-    } else {
-        // 有增量, 涉及到分配新扇区及是否分配一级间接块表
-        // 第一种情况, 12 个直接块够用，
-        if (file_will_use_blocks <= 12) {
-            block_idx = file_has_used_blocks - 1;
-            ASSERT(file->fd_inode->i_sectors[block_idx] != 0);
-            all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-
-            // 再将未来要用的扇区分配好后写入 all_blocks
-            block_idx = file_has_used_blocks; // 指向第一个要分配的新扇区
-            while (block_idx < file_will_use_blocks) {
-                block_lba = block_bitmap_alloc(cur_part);
-                if (block_lba == -1) {
-                    printk("file_write: block_bitmap_alloc for situation 1 failed\n");
-                    return -1;
-                }
-
-                ASSERT(file->fd_inode->i_sectors[block_idx] == 0);
-                file->fd_inode->i_sectors[block_idx] = all_blocks[block_idx] = block_lba;
-
-                // 每分配一个块就将位图同步到硬盘
-                block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-
-                block_idx++; // 下一个分配的新扇区
-            }
-        } else if (file_has_used_blocks <= 12 && file_will_use_blocks > 12) {
-            // 第二种情况: 旧数据在 12 个直接块内, 新数据将使用间接块
-            
-            // 先将有剩余空间的可继续用的扇区地址收集到 all_blocks
-            block_idx = file_has_used_blocks - 1; // 指向旧数据所在的最后一个扇区
-            all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-
-            // 创建一级间接块表
-            block_lba = block_bitmap_alloc(cur_part);
-            if (block_lba == -1) {
-                printk("file_write: block_bitmap_alloc for situation 2 failed\n");
-                return -1;
-            }
-
-            ASSERT(file->fd_inode->i_sectors[12] == 0);
-            // 分配一级间接块索引表
-            indirect_block_table = file->fd_inode->i_sectors[12] = block_lba;
-
-            block_idx = file_has_used_blocks;
-            while (block_idx < file_will_use_blocks) {
-                block_lba = block_bitmap_alloc(cur_part);
-                if (block_lba == -1) {
-                    printk("file_write: block_bitmap_alloc for situation 2 failed\n");
-                    return -1;
-                }
-
-                if (block_idx < 12) {
-                    ASSERT(file->fd_inode->i_sectors[block_idx] == 0);
-                    file->fd_inode->i_sectors[block_idx] = all_blocks[block_idx] = block_lba;
-                } else { // 间接块只写入到 all_block 数组中, 待全部分配完成后一次性同步到硬盘
-                    all_blocks[block_idx] = block_lba;
-                }
-
-                // 每分配一个块就将位图同步到硬盘
-                block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-
-                block_idx++; // 下一个扇区
+            int32_t new_lba = inode_alloc_block(cur_part, inode);
+            if (new_lba == -1) {
+                printk("file_write: inode_alloc_block failed\n");
+                break;
             }
-            ide_write(cur_part->my_disk, indirect_block_table, all_blocks+12, 1); // 同步一级间接块表到硬盘
-        } else if (file_has_used_blocks > 12) {
-            // 第三种情况: 新数据占据间接块
-            ASSERT(file->fd_inode->i_sectors[12] != 0);
-            indirect_block_table = file->fd_inode->i_sectors[12];
-
-            // 已使用的间接块也将被读入 all_blocks, 无须单独收录
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks+12, 1); // 获取所有间接块地址
-
-            block_idx = file_has_used_blocks;
-            while (block_idx < file_will_use_blocks) {
-                block_lba = block_bitmap_alloc(cur_part);
-                if (block_lba == -1) {
-                    printk("file_write: block_bitmap_alloc for situation 3 failed\n");
-                    return -1;
-                }
-                all_blocks[block_idx++] = block_lba;
-
-                // 每分配一个块就将位图同步到硬盘
-                block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-                bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-            }
-            ide_write(cur_part->my_disk, indirect_block_table, all_blocks+12, 1); 
+            block_lba = new_lba;
         }
-    }
 
-    bool first_write_block = true; // 含有剩余空间的扇区标识
-    // 块地址已经收集到 all_blocks 中, 下面开始写数据
-    file->fd_pos = file->fd_inode->i_size - 1;
-    while (bytes_written < count) {
-        memset(io_buf, 0, BLOCK_SIZE);
-        sec_idx = file->fd_inode->i_size / BLOCK_SIZE;  // 根据文件大小计算块索引
-        sec_lba = all_blocks[sec_idx];                  // 获取数据块的LBA地址
-        sec_off_bytes = file->fd_inode->i_size % BLOCK_SIZE;    // 当前文件数据在最后一个块中的偏移
-        sec_left_bytes = BLOCK_SIZE - sec_off_bytes;    // 块中的可用字节
-
-        // 判断此次写入硬盘的数据大小
-        chunk_size = size_left < sec_left_bytes ? size_left : sec_left_bytes;
-        if (first_write_block) {
-            ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
-            first_write_block = false;
+        if (chunk_size == block_size) {
+            // 整块直接从 buf 写入缓存, 不经 io_buf 中转
+            bcache_write(cur_part->bdev, block_lba, (void*)src, cur_part->sb->block_sects);
+        } else {
+            sec_off = blk_off_bytes / SECTOR_SIZE;
+            sec_cnt = DIV_ROUND_UP(blk_off_bytes + chunk_size, SECTOR_SIZE) - sec_off;
+            if (blk_off_bytes % SECTOR_SIZE != 0) {   // 接着扇区内已有的数据写
+                bcache_read(cur_part->bdev, block_lba + sec_off, io_buf, 1);
+            }
+            memcpy(io_buf + blk_off_bytes % SECTOR_SIZE, src, chunk_size);
+            // 文件尾之后的部分清 0
+            memset(io_buf + blk_off_bytes % SECTOR_SIZE + chunk_size, 0,
+                   sec_cnt * SECTOR_SIZE - blk_off_bytes % SECTOR_SIZE - chunk_size);
+            bcache_write(cur_part->bdev, block_lba + sec_off, io_buf, sec_cnt);
         }
-        memcpy(io_buf+sec_off_bytes, src, chunk_size);
-        ide_write(cur_part->my_disk, sec_lba, io_buf, 1);
-        printk("file write at lba 0x%x\n", sec_lba);
 
         src += chunk_size; // 将指针推移到下个新数据
-        file->fd_inode->i_size += chunk_size; // 更新文件大小
+        inode->i_size += chunk_size; // 更新文件大小
         file->fd_pos += chunk_size;
         bytes_written += chunk_size;
         size_left -= chunk_size;
+        cond_resched();     // 逐块写入缓存, 长写入时在此让出cpu
+    }
+    if (packable) {
+        inode_pack_tail(cur_part, inode, io_buf);
     }
-    inode_sync(cur_part, file->fd_inode, io_buf);
-    sys_free(all_blocks);
+    inode_sync(cur_part, inode, io_buf);
     sys_free(io_buf);
-    return bytes_written;
+    return bytes_written == 0 && count != 0 ? -1 : (int32_t)bytes_written;
+}
+
+// 根据本次要读的块 [first, last] 更新预读窗口, 并为这些块连同窗口内的块一起发起异步读
+static void file_readahead(struct file* file, uint32_t first, uint32_t last) {
+    struct inode* inode = file->fd_inode;
+    if (first != file->ra_prev) {
+        file->ra_size = 0;      // 不是接着上次读, 视为随机读, 不预读
+    } else if (file->ra_size == 0) {
+        file->ra_start = first;
+        file->ra_size = FILE_RA_INIT_BLOCKS;
+    }
+
+    uint32_t end = last + 1;    // 要发起读的块为 [first, end)
+    if (file->ra_size != 0) {
+        // 读进窗口的后一半时, 紧接着窗口再开一个加倍的窗口, 让数据在被读到之前就已经读入缓存
+        while (last >= file->ra_start + file->ra_size / 2) {
+            file->ra_start += file->ra_size;
+            file->ra_size = file->ra_size * 2 < FILE_RA_MAX_BLOCKS ? file->ra_size * 2 : FILE_RA_MAX_BLOCKS;
+        }
+        if (end < file->ra_start + file->ra_size) {
+            end = file->ra_start + file->ra_size;
+        }
+    }
+    // 打包在尾块中的小文件没有数据块, 下面 inode_bmap 直接返回 0
+    uint32_t file_blocks = DIV_ROUND_UP(inode->i_size, cur_part->sb->block_size);
+    if (end > file_blocks) {
+        end = file_blocks;
+    }
+
+    // 全部放进一个 plug, 在硬盘上相邻的块合并成一个请求
+    struct blk_plug plug;
+    bool plugged = running_thread()->plug == NULL;
+    if (plugged) {
+        blk_start_plug(&plug);
+    }
+    uint32_t block_idx = first;
+    while (block_idx < end) {
+        uint32_t lba;
+        uint32_t run = inode_bmap(cur_part, inode, block_idx, end - block_idx, &lba);
+        if (run == 0) {
+            break;
+        }
+        bcache_readahead(cur_part->bdev, lba, run * cur_part->sb->block_sects);
+        block_idx += run;
+    }
+    if (plugged) {
+        blk_finish_plug(&plug);
+    }
 }
 
 // 从文件 file 中读取 count 个字节写入 buf, 返回读出的字节数, 若到文件尾则返回 -1
@@ -436,85 +503,90 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
         }
     }
 
-    uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
+    uint32_t block_size = cur_part->sb->block_size;
+    uint8_t* io_buf = sys_malloc(block_size);
     if (io_buf == NULL) {
         printk("file_read: sys_malloc for io_buf failed\n");
-    }
-    
-    uint32_t* all_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE+48); // 用来记录文件所有的块地址
-    if (all_blocks == NULL) {
-        printk("file_read: sys_malloc for all_blocks failed\n");
         return -1;
     }
 
-    uint32_t block_read_start_idx = file->fd_pos / BLOCK_SIZE; // 数据所在块的起始地址
-    uint32_t block_read_end_idx = (file->fd_pos + size) / BLOCK_SIZE; // 数据所在块的终止地址
-    uint32_t read_blocks = block_read_start_idx - block_read_end_idx; // 如增量为 0, 表示数据在同一扇区
-    ASSERT(block_read_start_idx < 139 && block_read_end_idx < 139);
-
-    int32_t indirect_block_table; // 用来获取一级间接表地址
-    uint32_t block_idx; // 获取待读的块地址
+    // 先把要读的块连同预读的块一起提交, 下面逐段读时只需等待它们读完
+    uint32_t block_read_start_idx = file->fd_pos / block_size; // 数据所在块的起始地址
+    uint32_t block_read_end_idx = (file->fd_pos + size - 1) / block_size; // 数据所在块的终止地址
+    file_readahead(file, block_read_start_idx, block_read_end_idx);
 
-    // 开始构建 all_blocks 块地址数组, 专门存储用到的块地址
-    if (read_blocks == 0) {
-        ASSERT(block_read_end_idx == block_read_start_idx);
-        if (block_read_end_idx < 12) { // 待读的数据在 12 个直接块之内
-            block_idx = block_read_end_idx;
-            all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
+    uint32_t block_idx, block_lba, blk_off_bytes, blk_left_bytes, chunk_size, run;
+    uint32_t sec_off, sec_cnt;
+    uint32_t bytes_read = 0;
+    while (bytes_read < size) {
+        block_idx = file->fd_pos / block_size;
+        blk_off_bytes = file->fd_pos % block_size;
+        blk_left_bytes = block_size - blk_off_bytes;
+
+        if (blk_off_bytes == 0 && size_left >= block_size) {
+            // 整块直接读到目的地, 硬盘上连续的块一次读完
+            run = inode_bmap(cur_part, file->fd_inode, block_idx, size_left / block_size, &block_lba);
+            ASSERT(run != 0);
+            chunk_size = run * block_size;
+            bcache_read(cur_part->bdev, block_lba, buf_dst, run * cur_part->sb->block_sects);
         } else {
-            indirect_block_table = file->fd_inode->i_sectors[12];
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks+12, 1);
-        }
-    } else { // 若要读多个块
-        if (block_read_end_idx < 12) { // 数据结束所在的块属于直接块
-            // 第一种情况, 起始块和终止块属于直接块
-            block_idx = block_read_start_idx;
-            while (block_idx <= block_read_end_idx) {
-                all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-                block_idx++;
-            }
-        } else if (block_read_start_idx < 12 && block_read_end_idx >= 12) {
-            // 第二种情况, 待读入的数据跨越直接块和间接块两类
-            // 先将直接块地址写入 all_blocks
-            block_idx = block_read_start_idx;
-            while (block_idx < 12) {
-                all_blocks[block_idx] = file->fd_inode->i_sectors[block_idx];
-                block_idx++;
+            chunk_size = size_left < blk_left_bytes ? size_left : blk_left_bytes; // 待读入的数据大小
+            if (file->fd_inode->i_tail != 0) {
+                // 小文件的数据打包在尾块中, 扇区的排列和第 0 块相同
+                block_lba = file->fd_inode->i_tail;
+            } else {
+                run = inode_bmap(cur_part, file->fd_inode, block_idx, 1, &block_lba);
+                ASSERT(run != 0);
             }
-            ASSERT(file->fd_inode->i_sectors[12] != 0); // 确保已经分配了一级间接块表
-
-            // 再将间接块地址写入 all_blocks
-            indirect_block_table = file->fd_inode->i_sectors[12];
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks+12, 1); // 将一级间接块表读进来写入到第 13 个块的位置之后
-        } else {
-            // 第三种情况, 数据在间接块中
-            ASSERT(file->fd_inode->i_sectors[12] != 0);
-            indirect_block_table = file->fd_inode->i_sectors[12]; // 获取一级间接表地址
-            // 将一级间接块表读进来写入到第 13 个块的位置之后
-            ide_read(cur_part->my_disk, indirect_block_table, all_blocks+12, 1);
+            // 只读入涉及的扇区
+            sec_off = blk_off_bytes / SECTOR_SIZE;
+            sec_cnt = DIV_ROUND_UP(blk_off_bytes + chunk_size, SECTOR_SIZE) - sec_off;
+            bcache_read(cur_part->bdev, block_lba + sec_off, io_buf, sec_cnt);
+            memcpy(buf_dst, io_buf + blk_off_bytes % SECTOR_SIZE, chunk_size);
         }
-    }
-
-    // 用到的块地址已经收集到 all_blocks 中, 下面开始读数据
-    uint32_t sec_idx, sec_lba, sec_off_bytes, sec_left_bytes, chunk_size;
-    uint32_t bytes_read = 0;
-    while (bytes_read < size) {
-        sec_idx = file->fd_pos / BLOCK_SIZE;
-        sec_lba = all_blocks[sec_idx];
-        sec_off_bytes = file->fd_pos % BLOCK_SIZE;
-        sec_left_bytes = BLOCK_SIZE - sec_off_bytes;
-        chunk_size = size_left < sec_left_bytes ? size_left : sec_left_bytes; // 待读入的数据大小
-
-        memset(io_buf, 0, BLOCK_SIZE);
-        ide_read(cur_part->my_disk, sec_lba, io_buf, 1);
-        memcpy(buf_dst, io_buf+sec_off_bytes, chunk_size);
 
         buf_dst += chunk_size;
         file->fd_pos += chunk_size;
         bytes_read += chunk_size;
         size_left -= chunk_size;
     }
-    sys_free(all_blocks);
+    file->ra_prev = file->fd_pos / block_size;
     sys_free(io_buf);
     return bytes_read;
-}
\ No newline at end of file
+}
+
+// 为文件预先分配能容纳 len 字节的块, 文件大小不变, 以后追加到这个长度时不必再分配.
+// 成功返回 0, 空间不足返回 -1, 此时已分配的块仍留在文件中
+int32_t file_fallocate(struct file* file, uint32_t len) {
+    struct inode* inode = file->fd_inode;
+    uint32_t block_size = cur_part->sb->block_size;
+    uint32_t blocks = len / block_size + (len % block_size != 0);
+    if (blocks <= inode->i_blocks) {
+        return 0;
+    }
+
+    uint8_t* io_buf = sys_malloc(block_size + SECTOR_SIZE);
+    if (io_buf == NULL) {
+        printk("file_fallocate: sys_malloc for io_buf failed\n");
+        return -1;
+    }
+    int32_t ret = 0;
+    if (inode->i_tail != 0 && inode_unpack_tail(cur_part, inode, io_buf) == -1) {
+        ret = -1;
+    } else {
+        // 先把缺的块一次预留成连续的一段, 再逐块挂到文件上
+        inode_prealloc(cur_part, inode, blocks - inode->i_blocks);
+        while (inode->i_blocks < blocks) {
+            if (inode_alloc_block(cur_part, inode) == -1) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (ret == -1) {
+        printk("file_fallocate: no space left for %d bytes\n", len);
+    }
+    inode_sync(cur_part, inode, io_buf);
+    sys_free(io_buf);
+    return ret;
+}
@@ -2,7 +2,7 @@
 #define __FS_FILE_H
 #include "stdint.h"
 #include "inode.h"
-#include "ide.h"
+#include "block.h"
 #include "fs.h"
 #include "super_block.h"
 #include "interrupt.h"
@@ -10,12 +10,18 @@
 #include "debug.h"
 
 #define MAX_FILE_OPEN 32 // 系统可打开的最大文件数
+#define FILE_RA_INIT_BLOCKS 4   // 检测到顺序读后第一个预读窗口的块数
+#define FILE_RA_MAX_BLOCKS  32  // 预读窗口最大的块数, 窗口每次加倍直到此值
 
 // 文件结构
 struct file {
     uint32_t fd_pos; // 记录当前文件操作的偏移地址, 以 0 为起始, 最大为文件大小 - 1
     uint32_t fd_flag;
     struct inode* fd_inode;
+    // 预读状态, 每次读都接着上次读完的位置时视为顺序读
+    uint32_t ra_prev;   // 上次读完时 fd_pos 所在的块, 下次从这块开始读即为顺序读
+    uint32_t ra_start;  // 当前预读窗口的起始块
+    uint32_t ra_size;   // 当前预读窗口的块数, 为 0 时没有预读
 };
 
 extern struct file file_table[MAX_FILE_OPEN];
@@ -43,9 +49,26 @@ int32_t pcb_fd_install(int32_t globa_fd_idx);
 // 分配一个 inode, 返回 inode 号
 int32_t inode_bitmap_alloc(struct partition* part);
 
-// 分配 1 个扇区, 返回其扇区地址
+// 分配 1 个块并同步块位图, 返回其起始扇区地址
 int32_t block_bitmap_alloc(struct partition* part);
 
+// 从 goal_lba 所在的块往后找空闲块, 分配其中最多 cnt 个连续的块并同步块位图.
+// 返回起始扇区地址, 分到的块数存入 *got, 没有空闲块时返回 -1
+int32_t block_bitmap_alloc_near(struct partition* part, uint32_t goal_lba, uint32_t cnt, uint32_t* got);
+
+// 和 block_bitmap_alloc_near 一样找连续的空闲块, 但只在内存中预留, 不写块位图.
+// 返回起始扇区地址, 预留到的块数存入 *got, 没有空闲块时返回 -1
+int32_t block_reserve_near(struct partition* part, uint32_t goal_lba, uint32_t cnt, uint32_t* got);
+
+// 把预留的块 lba 转为正式分配, 并同步块位图
+void block_reserve_take(struct partition* part, uint32_t lba);
+
+// 取消对块 lba 的预留
+void block_reserve_cancel(struct partition* part, uint32_t lba);
+
+// 回收块地址为 lba 的块, 并同步块位图
+void block_bitmap_free(struct partition* part, uint32_t lba);
+
 // 将内存中 bitmap 第 bit_idx 位所在的 512 字节同步到硬盘
 void bitmap_sync(struct partition* part, uint32_t bit_idx, uint8_t btmp);
 
@@ -63,4 +86,7 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count);
 
 // 从文件 file 中读取 count 个字节写入 buf, 返回读出的字节数, 若到文件尾则返回 -1
 int32_t file_read(struct file* file, void* buf, uint32_t count);
+
+// 为文件预先分配能容纳 len 字节的块, 文件大小不变, 成功返回 0, 失败返回 -1
+int32_t file_fallocate(struct file* file, uint32_t len);
 #endif
\ No newline at end of file
@@ -1,7 +1,8 @@
 #include "stdint.h"
 #include "fs.h"
 #include "inode.h"
-#include "ide.h"
+#include "block.h"
+#include "bcache.h"
 #include "memory.h"
 #include "super_block.h"
 #include "dir.h"
@@ -15,29 +16,45 @@
 
 struct partition* cur_part; // 默认情况下操作的是哪个分区
 
+/* 格式化时块位图每批写入的扇区数, 大分区的块位图有上千个扇区, 不必一次放进内存 */
+#define FORMAT_BITMAP_CHUNK_SECTS 64
 
-/* 格式化整个分区,也就是初始化分区的元信息, 创建文件系统 */
-static void partition_format(struct partition *part)
+
+// 块大小是否为 512/1024/2048/4096 之一
+static bool block_size_valid(uint32_t block_size) {
+    return block_size >= SECTOR_SIZE && block_size <= MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0;
+}
+
+// 超级块是否属于本版本的文件系统, 块大小字段也须合法, 否则按它挂载会读错位置
+static bool super_block_valid(struct super_block* sb) {
+    return sb->magic == SUPER_BLOCK_MAGIC && block_size_valid(sb->block_size) && \
+           sb->block_sects * SECTOR_SIZE == sb->block_size;
+}
+
+/* 格式化整个分区,也就是初始化分区的元信息, 创建文件系统.
+ * 数据区按block_size字节一块管理, 引导块,超级块,位图和inode表仍以扇区为单位 */
+static void partition_format(struct partition *part, uint32_t block_size)
 {
-    /* 为方便实现,一个块大小是一扇区 */
+    ASSERT(block_size_valid(block_size));
+    uint32_t block_sects = block_size / SECTOR_SIZE;
     uint32_t boot_sector_sects = 1;     // 一个启动块
     uint32_t super_block_sects = 1;     // 一个超级块
     uint32_t inode_bitmap_sects = DIV_ROUND_UP(MAX_FILES_PER_PART, BITS_PER_SECTOR);    // I结点位图占用的扇区数.最多支持4096个文件
-    uint32_t inode_table_sects = DIV_ROUND_UP(((sizeof(struct inode) * MAX_FILES_PER_PART)), SECTOR_SIZE);
+    uint32_t inode_table_sects = DIV_ROUND_UP(((INODE_DISK_SIZE * MAX_FILES_PER_PART)), SECTOR_SIZE);
     uint32_t used_sects = boot_sector_sects + super_block_sects + inode_bitmap_sects + inode_table_sects;
     uint32_t free_sects = part->sec_cnt - used_sects;
 
     /************** 简单处理块位图占据的扇区数 ***************/
     // 不太精确 够用即可
     uint32_t block_bitmap_sects;
-    block_bitmap_sects = DIV_ROUND_UP(free_sects, BITS_PER_SECTOR);
+    block_bitmap_sects = DIV_ROUND_UP(free_sects / block_sects, BITS_PER_SECTOR);
     /* block_bitmap_bit_len是位图中位的长度,也是可用块的数量 */
-    uint32_t block_bitmap_bit_len = free_sects - block_bitmap_sects;
+    uint32_t block_bitmap_bit_len = (free_sects - block_bitmap_sects) / block_sects;
     block_bitmap_sects = DIV_ROUND_UP(block_bitmap_bit_len, BITS_PER_SECTOR);
 
     /* 超级块初始化 */
     struct super_block sb;
-    sb.magic = 0x19590318;
+    sb.magic = SUPER_BLOCK_MAGIC;
     sb.sec_cnt = part->sec_cnt;
     sb.inode_cnt = MAX_FILES_PER_PART;
     sb.part_lba_base = part->start_lba;
@@ -54,39 +71,58 @@ static void partition_format(struct partition *part)
     sb.data_start_lba = sb.inode_table_lba + sb.inode_table_sects; // 数据区的起始就是inode数组的结束
     sb.root_inode_no = 0;   // 根目录的inode号
     sb.dir_entry_size = sizeof(struct dir_entry);
+    sb.block_size = block_size;
+    sb.block_sects = block_sects;
+    sb.tail_block_lba = 0;
 
     printk("%s info:\n", part->name);
-    printk("   magic:0x%x\n   part_lba_base:0x%x\n   all_sectors:0x%x\n   inode_cnt:0x%x\n   block_bitmap_lba:0x%x\n   block_bitmap_sectors:0x%x\n   inode_bitmap_lba:0x%x\n   inode_bitmap_sectors:0x%x\n   inode_table_lba:0x%x\n   inode_table_sectors:0x%x\n   data_start_lba:0x%x\n", sb.magic, sb.part_lba_base, sb.sec_cnt, sb.inode_cnt, sb.block_bitmap_lba, sb.block_bitmap_sects, sb.inode_bitmap_lba, sb.inode_bitmap_sects, sb.inode_table_lba, sb.inode_table_sects, sb.data_start_lba);
+    printk("   magic:0x%x\n   part_lba_base:0x%x\n   all_sectors:0x%x\n   inode_cnt:0x%x\n   block_bitmap_lba:0x%x\n   block_bitmap_sectors:0x%x\n   inode_bitmap_lba:0x%x\n   inode_bitmap_sectors:0x%x\n   inode_table_lba:0x%x\n   inode_table_sectors:0x%x\n   data_start_lba:0x%x\n   block_size:%d\n", sb.magic, sb.part_lba_base, sb.sec_cnt, sb.inode_cnt, sb.block_bitmap_lba, sb.block_bitmap_sects, sb.inode_bitmap_lba, sb.inode_bitmap_sects, sb.inode_table_lba, sb.inode_table_sects, sb.data_start_lba, sb.block_size);
 
-    struct disk *hd = part->my_disk;
+    struct block_device* bdev = part->bdev;
     /*******************************
      * 1 将超级块写入本分区的1扇区 *
      ******************************/
-    ide_write(hd, part->start_lba + 1, &sb, 1);
+    block_write(bdev, part->start_lba + 1, &sb, 1);
     printk("   super_block_lba:0x%x\n", part->start_lba + 1);
 
-    /* 找出数据量最大的元信息, 用其尺寸做存储缓冲区*/
-    uint32_t buf_size = (sb.block_bitmap_sects >= sb.inode_bitmap_sects ? sb.block_bitmap_sects : sb.inode_bitmap_sects);
+    /* 找出数据量最大的元信息, 用其尺寸做存储缓冲区, 块位图分批写, 只按一批计算 */
+    uint32_t buf_size = sb.block_bitmap_sects < FORMAT_BITMAP_CHUNK_SECTS ? sb.block_bitmap_sects : FORMAT_BITMAP_CHUNK_SECTS;
+    buf_size = (buf_size >= sb.inode_bitmap_sects ? buf_size : sb.inode_bitmap_sects);
     buf_size = (buf_size >= sb.inode_table_sects ? buf_size : sb.inode_table_sects) * SECTOR_SIZE;
+    buf_size = (buf_size >= block_size ? buf_size : block_size);
     uint8_t *buf = (uint8_t *)sys_malloc(buf_size); // 申请的内存由内存管理系统清0后返回
 
     /**************************************
      * 2 将块位图初始化并写入sb.block_bitmap_lba
      *************************************/
-    /* 初始化块位图block_bitmap */
-    buf[0] |= 0x01;                                                            // 第0个块预留给根目录,位图中先占位
     uint32_t block_bitmap_last_byte = block_bitmap_bit_len / 8;                // 计算出块位图最后一字节的偏移
     uint8_t block_bitmap_last_bit = block_bitmap_bit_len % 8;                  // 计算出块位图最后一字节中有效位的数量
-    uint32_t last_size = SECTOR_SIZE - (block_bitmap_last_byte % SECTOR_SIZE); // last_size是位图所在最后一个扇区中，不足一扇区的其余部分
-
-    /* 1 先将位图最后一字节到其所在的扇区的结束全置为1,即超出实际块数的部分直接置为已占用*/
-    memset(&buf[block_bitmap_last_byte], 0xff, last_size);
-
-    /* 2 再将上一步中覆盖的最后一字节内的有效位重新置0 */
-    uint8_t bit_idx = 0;
-    while (bit_idx < block_bitmap_last_bit)
-        buf[block_bitmap_last_byte] &= ~(1 << bit_idx++);
-    ide_write(hd, sb.block_bitmap_lba, buf, sb.block_bitmap_sects);
+    uint32_t sects_done = 0;
+    while (sects_done < sb.block_bitmap_sects) {
+        uint32_t chunk_sects = sb.block_bitmap_sects - sects_done;
+        if (chunk_sects > FORMAT_BITMAP_CHUNK_SECTS) {
+            chunk_sects = FORMAT_BITMAP_CHUNK_SECTS;
+        }
+        uint32_t chunk_start = sects_done * SECTOR_SIZE;                       // 本批在位图中的字节偏移
+        uint32_t chunk_end = chunk_start + chunk_sects * SECTOR_SIZE;
+        memset(buf, 0, chunk_sects * SECTOR_SIZE);
+        if (sects_done == 0) {
+            buf[0] |= 0x01;                                                    // 第0个块预留给根目录,位图中先占位
+        }
+        if (block_bitmap_last_byte < chunk_end) {
+            /* 1 先将位图最后一字节到其所在的扇区的结束全置为1,即超出实际块数的部分直接置为已占用*/
+            uint32_t last_off = block_bitmap_last_byte - chunk_start;
+            memset(&buf[last_off], 0xff, chunk_end - block_bitmap_last_byte);
+
+            /* 2 再将上一步中覆盖的最后一字节内的有效位重新置0 */
+            uint8_t bit_idx = 0;
+            while (bit_idx < block_bitmap_last_bit)
+                buf[last_off] &= ~(1 << bit_idx++);
+        }
+        block_write(bdev, sb.block_bitmap_lba + sects_done, buf, chunk_sects);
+        sects_done += chunk_sects;
+        cond_resched();     // 大分区的位图要写很多批, 每批之间给其他线程运行的机会
+    }
 
     /***************************************
      * 3 将inode位图初始化并写入sb.inode_bitmap_lba *
@@ -98,7 +134,7 @@ static void partition_format(struct partition *part)
      * 即inode_bitmap_sects等于1, 所以位图中的位全都代表inode_table中的inode,
      * 无须再像block_bitmap那样单独处理最后一扇区的剩余部分,
      * inode_bitmap所在的扇区中没有多余的无效位 */
-    ide_write(hd, sb.inode_bitmap_lba, buf, sb.inode_bitmap_sects);
+    block_write(bdev, sb.inode_bitmap_lba, buf, sb.inode_bitmap_sects);
 
     /***************************************
      * 4 将inode表初始化并写入sb.inode_table_lba *
@@ -108,8 +144,11 @@ static void partition_format(struct partition *part)
     struct inode *i = (struct inode *)buf;
     i->i_size = sb.dir_entry_size * 2; // 两个目录项 . 和 ..
     i->i_no = 0;                       // 根目录占inode数组中第0个inode
-    i->i_sectors[0] = sb.data_start_lba;
-    ide_write(hd, sb.inode_table_lba, buf, sb.inode_table_sects);
+    i->i_blocks = 1;                   // 根目录只有数据区的第 0 块
+    i->i_extents[0].start = sb.data_start_lba;
+    i->i_extents[0].len = 1;
+    block_write(bdev, sb.inode_table_lba, buf, sb.inode_table_sects);
+    cond_resched();     // inode表有上百个扇区, 写完后检查一次是否需要调度
 
     /***************************************
      * 5 将根目录初始化并写入sb.data_start_lba
@@ -130,7 +169,7 @@ static void partition_format(struct partition *part)
     p_de->f_type = FT_DIRECTORY;
 
     /* sb.data_start_lba已经分配给了根目录,里面是根目录的目录项 */
-    ide_write(hd, sb.data_start_lba, buf, 1);
+    block_write(bdev, sb.data_start_lba, buf, block_sects);
 
     printk("   root_dir_lba:0x%x\n", sb.data_start_lba);
     printk("%s format done\n", part->name);
@@ -138,27 +177,37 @@ static void partition_format(struct partition *part)
 }
 
 // 在分区链表中找到名为 part_name 的分区, 并将其指针赋值给 cur_part
+// 分区上不是本版本的文件系统时拒绝挂载, cur_part 保持不变
 static bool mount_partition(struct list_elem* pelem, int arg) {
     char* part_name = (char*)arg;
     struct partition* part = elem2entry(struct partition, part_tag, pelem); 
 
     if (!strcmp(part->name, part_name)) {   // 默认为sdb1
-        cur_part = part;
-        struct disk* hd = cur_part->my_disk;
+        struct block_device* bdev = part->bdev;
 
         // sb_buf 用来存储从硬盘上读入的超级块
         struct super_block* sb_buf = (struct super_block*)sys_malloc(SECTOR_SIZE);
+        if (sb_buf == NULL) {
+            PANIC("alloc memory failed!");
+        }
+
+        // 读入超级块
+        memset(sb_buf, 0, SECTOR_SIZE);
+        block_read(bdev, part->start_lba+1, sb_buf, 1);
+        if (!super_block_valid(sb_buf)) {
+            printk("mount %s failed: unknown filesystem, magic 0x%x, block size %d\n", part->name, \
+                   sb_buf->magic, sb_buf->block_size);
+            sys_free(sb_buf);
+            return true;    // 名字已匹配, 停止遍历
+        }
 
+        cur_part = part;
         // 在内存中创建分区 cur_part 的超级块
         cur_part->sb = (struct super_block*)sys_malloc(sizeof(struct super_block));
         if (cur_part->sb == NULL) {
             PANIC("alloc memory failed!");
         }
 
-        // 读入超级块
-        memset(sb_buf, 0, SECTOR_SIZE);
-        ide_read(hd, cur_part->start_lba+1, sb_buf, 1);
-
         // 把 sb_buf 中超级块的信息复制到分区的超级块 sb 中
         memcpy(cur_part->sb, sb_buf, sizeof(struct super_block));
 
@@ -168,7 +217,15 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
             PANIC("alloc memory failed!");
         }
         cur_part->block_bitmap.btmp_bytes_len = sb_buf->block_bitmap_sects * SECTOR_SIZE;
-        ide_read(hd, sb_buf->block_bitmap_lba, cur_part->block_bitmap.bits, sb_buf->block_bitmap_sects);
+        block_read(bdev, sb_buf->block_bitmap_lba, cur_part->block_bitmap.bits, sb_buf->block_bitmap_sects);
+
+        // 预分配窗口预留的块只记在内存中, 与块位图等长
+        cur_part->prealloc_bitmap.bits = (uint8_t*)sys_malloc(cur_part->block_bitmap.btmp_bytes_len);
+        if (cur_part->prealloc_bitmap.bits == NULL) {
+            PANIC("alloc memory failed!");
+        }
+        cur_part->prealloc_bitmap.btmp_bytes_len = cur_part->block_bitmap.btmp_bytes_len;
+        bitmap_init(&cur_part->prealloc_bitmap);
 
         // 将硬盘上的 inode 位图读入到内存
         cur_part->inode_bitmap.bits = (uint8_t*)sys_malloc(sb_buf->inode_bitmap_sects*SECTOR_SIZE);
@@ -176,9 +233,10 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
             PANIC("alloc memory failed!");
         }
         cur_part->inode_bitmap.btmp_bytes_len = sb_buf->inode_bitmap_sects*SECTOR_SIZE;
-        ide_read(hd, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.bits, sb_buf->inode_bitmap_sects);
+        block_read(bdev, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.bits, sb_buf->inode_bitmap_sects);
 
         list_init(&cur_part->open_inodes);
+        rwlock_init(&cur_part->inode_lock);
         printk("mount %s done!\n", part->name);
 
         sys_free(sb_buf);
@@ -187,10 +245,24 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
     return false; // 使 list_traversal 继续遍历
 }
 
-/* 在磁盘上搜索文件系统,若没有则格式化分区创建文件系统 */
+/* 在磁盘上搜索文件系统,若没有则格式化分区创建文件系统.
+ * 其它版本的本文件系统不会被自动格式化, 要重新格式化须用mkfs命令 */
+// 按名称查找分区, 找不到返回NULL
+static struct partition* partition_find(const char* part_name) {
+    struct list_elem* elem = partition_list.head.next;
+    while (elem != &partition_list.tail) {
+        struct partition* part = elem2entry(struct partition, part_tag, elem);
+        if (!strcmp(part->name, part_name)) {
+            return part;
+        }
+        elem = elem->next;
+    }
+    return NULL;
+}
+
 void filesys_init()
 {
-    uint8_t channel_no = 0, dev_no, part_idx = 0;
+    bcache_init();
 
     /* sb_buf用来存储从硬盘上读入的超级块 */
     struct super_block *sb_buf = (struct super_block *)sys_malloc(SECTOR_SIZE);
@@ -200,48 +272,52 @@ void filesys_init()
     }
 
     printk("searching filesystem......\n");
-    while (channel_no < channel_cnt) { // 遍历两个通道
-
-        dev_no = 0;
-        while (dev_no < 2) {    // 遍历通道下1主1从两个硬盘
-            if (dev_no == 0) {  // 跨过裸盘hd60M.img
-                dev_no++;
-                continue;
+    struct partition* first_fs = NULL;  // 第一个有本版本文件系统的分区, 默认分区挂载不上时挂载它
+    /* 遍历所有块设备上的分区 */
+    struct list_elem* elem = partition_list.head.next;
+    while (elem != &partition_list.tail) {
+        struct partition* part = elem2entry(struct partition, part_tag, elem);
+        // 分区存在，读出来超级块
+        block_read(part->bdev, part->start_lba + 1, sb_buf, 1);
+        if (super_block_valid(sb_buf)) {
+            printk("%s has filesystem\n", part->name);
+            if (first_fs == NULL) {
+                first_fs = part;
             }
-            struct disk *hd = &channels[channel_no].device[dev_no];
-            struct partition *part = hd->prime_parts;
-            while (part_idx < 12) {     // 遍历硬盘的分区，4个主分区+8个逻辑 
-                if (part_idx == 4) {    // 开始处理逻辑分区
-                    part = hd->logic_parts;
-                }
-                /* channels数组是全局变量,默认值为0,disk属于其嵌套结构,
-                 * partition又为disk的嵌套结构,因此partition中的成员默认也为0.
-                 * 若partition未初始化,则partition中的成员仍为0.
-                 * 下面处理存在的分区. */
-                if (part->sec_cnt != 0) {
-                    // 分区存在，读出来超级块
-                    ide_read(hd, part->start_lba + 1, sb_buf, 1);
-                    if (sb_buf->magic == 0x19590318) {
-                        printk("%s has filesystem\n", part->name);
-                    } else { // 其它文件系统不支持,一律按无文件系统处理
-                        printk("formatting %s`s partition %s......\n", hd->name, part->name);
-                        partition_format(part);
-                    }
-                }
-                part_idx++;
-                part++; // 下一分区
+        } else if ((sb_buf->magic & SUPER_BLOCK_MAGIC_MASK) == (SUPER_BLOCK_MAGIC & SUPER_BLOCK_MAGIC_MASK)) {
+            // 其它版本的本文件系统, 或超级块中的块大小已损坏. 上面可能有用户的数据, 不挂载也不格式化
+            printk("%s has filesystem of another version or a bad super block (magic 0x%x, block size %d), " \
+                   "skipped, use mkfs to reformat it\n", part->name, sb_buf->magic, sb_buf->block_size);
+        } else { // 其它文件系统不支持,一律按无文件系统处理
+            printk("formatting %s`s partition %s......\n", part->bdev->name, part->name);
+            partition_format(part, DEFAULT_BLOCK_SIZE);
+            if (first_fs == NULL) {
+                first_fs = part;
             }
-            dev_no++;
         }
-        channel_no++;
+        elem = elem->next;
     }
     sys_free(sb_buf);
 
     // 确定默认操作的分区
-    char default_part[8] = "sdb1";
+    char default_part[8] = DEFAULT_PART;
 
     // 挂载分区，使用mount_partition处理每个分区
     list_traversal(&partition_list, mount_partition, (int)default_part);
+    if (cur_part == NULL) {
+        if (first_fs == NULL) {
+            // 所有分区都是其它版本的文件系统, 格式化默认分区, 否则进不了shell也就无法用mkfs恢复
+            first_fs = partition_find(default_part);
+            if (first_fs == NULL) {
+                PANIC("no filesystem to mount");
+            }
+            printk("no filesystem of this version, formatting %s......\n", first_fs->name);
+            partition_format(first_fs, DEFAULT_BLOCK_SIZE);
+        } else {
+            printk("%s can not be mounted, mount %s instead\n", default_part, first_fs->name);
+        }
+        list_traversal(&partition_list, mount_partition, (int)first_fs->name);
+    }
 
     // 将当前分区的根目录打开
     open_root_dir(cur_part);
@@ -304,9 +380,8 @@ static int search_file(const char* pathname, struct path_search_record* searched
         return 0;
     }
 
-    uint32_t path_len = strlen(pathname);
     // 保证 pathname 至少是这样的路径 /x, 且小于最大长度
-    ASSERT(pathname[0] == '/' && path_len > 1 && path_len < MAX_PATH_LEN);
+    ASSERT(pathname[0] == '/' && strlen(pathname) > 1 && strlen(pathname) < MAX_PATH_LEN);
     char* sub_path = (char*)pathname;
     struct dir* parent_dir = &root_dir;
     struct dir_entry dir_e;
@@ -568,7 +643,7 @@ int32_t sys_unlink(const char* pathname) {
     ASSERT(file_idx == MAX_FILE_OPEN);
 
     // 为 delete_dir_entry 申请缓冲区
-    void* io_buf = sys_malloc(SECTOR_SIZE+SECTOR_SIZE);
+    void* io_buf = sys_malloc(MAX_BLOCK_SIZE);
     if (io_buf == NULL) {
         dir_close(searched_record.parent_dir);
         printk("sys_unlink: malloc for io_buf failed\n");
@@ -586,7 +661,7 @@ int32_t sys_unlink(const char* pathname) {
 // 创建目录 pathname, 成功返回 0, 失败返回 -1
 int32_t sys_mkdir(const char* pathname) {
     uint8_t rollback_step = 0; // 用于操作失败时回滚各资源状态
-    void* io_buf = sys_malloc(SECTOR_SIZE*2);
+    void* io_buf = sys_malloc(MAX_BLOCK_SIZE);
     if (io_buf == NULL) {
         printk("sys_mkdir: sys_malloc for io_buf failed\n");
         return -1;
@@ -626,23 +701,16 @@ int32_t sys_mkdir(const char* pathname) {
     struct inode new_dir_inode;
     inode_init(inode_no, &new_dir_inode); // 初始化 inode
 
-    uint32_t block_bitmap_idx = 0; // 用来记录 block 对应于 block_bitmap 中的索引
-    int32_t block_lba = -1;
     // 为目录分配一个块, 用来写入目录 . 和 ..
-    block_lba = block_bitmap_alloc(cur_part);
+    int32_t block_lba = inode_alloc_block(cur_part, &new_dir_inode);
     if (block_lba == -1) {
-        printk("sys_mkdir: block_bitmap_alloc for create directory failed\n");
+        printk("sys_mkdir: inode_alloc_block for create directory failed\n");
         rollback_step = 2;
         goto rollback;
     }
-    new_dir_inode.i_sectors[0] = block_lba;
-    // 每分配一个块就将位图同步到硬盘
-    block_bitmap_idx = block_lba - cur_part->sb->data_start_lba;
-    ASSERT(block_bitmap_idx != 0);
-    bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
 
     // 将当前目录的目录项 '.' 和 '..' 写入目录
-    memset(io_buf, 0, SECTOR_SIZE*2); // 清空 io_buf
+    memset(io_buf, 0, cur_part->sb->block_size); // 清空 io_buf, 目录块中其余的目录项为空
     struct dir_entry* p_de = (struct dir_entry*)io_buf;
 
     // 初始化当前目录 '.'
@@ -655,7 +723,7 @@ int32_t sys_mkdir(const char* pathname) {
     memcpy(p_de->filename, "..", 2);
     p_de->i_no = parent_dir->inode->i_no;
     p_de->f_type = FT_DIRECTORY;
-    ide_write(cur_part->my_disk, new_dir_inode.i_sectors[0], io_buf, 1);
+    bcache_write(cur_part->bdev, block_lba, io_buf, cur_part->sb->block_sects);
 
     new_dir_inode.i_size = 2 * cur_part->sb->dir_entry_size;
 
@@ -780,10 +848,11 @@ int32_t sys_rmdir(const char* pathname) {
 static uint32_t get_parent_dir_inode_nr(uint32_t child_inode_nr, void* io_buf) {
     struct inode* child_dir_inode = inode_open(cur_part, child_inode_nr);
     // 目录中的目录项 ".." 中包括父目录 inode 编号, ".." 位于目录的第 0 块
-    uint32_t block_lba = child_dir_inode->i_sectors[0];
+    uint32_t block_lba = 0;
+    inode_bmap(cur_part, child_dir_inode, 0, 1, &block_lba);
     ASSERT(block_lba >= cur_part->sb->data_start_lba);
     inode_close(child_dir_inode);
-    ide_read(cur_part->my_disk, block_lba, io_buf, 1);
+    bcache_read(cur_part->bdev, block_lba, io_buf, cur_part->sb->block_sects);
     struct dir_entry* dir_e = (struct dir_entry*)io_buf;
     // 第 0 个目录项是 ".", 第 1 个目录项是 ".."
     ASSERT(dir_e[1].i_no < 4096 && dir_e[1].f_type == FT_DIRECTORY);
@@ -795,40 +864,28 @@ static uint32_t get_parent_dir_inode_nr(uint32_t child_inode_nr, void* io_buf) {
 // 成功返回 0, 失败返回 -1
 static int get_child_dir_name(uint32_t p_inode_nr, uint32_t c_inode_nr, char* path, void* io_buf) {
     struct inode* parent_dir_inode = inode_open(cur_part, p_inode_nr);
-    // 填充 all_blocks, 将该目录的所占扇区地址全部写入 all_blocks
-    uint8_t block_idx = 0;
-    uint32_t all_blocks[140] = {0}, block_cnt = 12;
-    while (block_idx < 12) {
-        all_blocks[block_idx] = parent_dir_inode->i_sectors[block_idx];
-        block_idx++;
-    }
-    if (parent_dir_inode->i_sectors[12]) {
-        ide_read(cur_part->my_disk, parent_dir_inode->i_sectors[12], all_blocks+12, 1);
-        block_cnt = 140;
-    }
-    inode_close(parent_dir_inode);
-
     struct dir_entry* dir_e = (struct dir_entry*)io_buf;
     uint32_t dir_entry_size = cur_part->sb->dir_entry_size;
-    uint32_t dir_entrys_per_sec = (512 / dir_entry_size);
-    block_idx = 0;
+    uint32_t dir_entrys_per_block = (cur_part->sb->block_size / dir_entry_size);
+    uint32_t block_idx = 0, block_lba;
     // 遍历所有块
-    while (block_idx < block_cnt) {
-        if (all_blocks[block_idx]) {
-            ide_read(cur_part->my_disk, all_blocks[block_idx], io_buf, 1);
-            uint8_t dir_e_idx = 0;
-            // 遍历每个目录项
-            while (dir_e_idx < dir_entrys_per_sec) {
-                if ((dir_e + dir_e_idx)->i_no == c_inode_nr) {
-                    strcat(path, "/");
-                    strcat(path, (dir_e+dir_e_idx)->filename);
-                    return 0;
-                }
-                dir_e_idx++;
+    while (block_idx < parent_dir_inode->i_blocks) {
+        inode_bmap(cur_part, parent_dir_inode, block_idx, 1, &block_lba);
+        bcache_read(cur_part->bdev, block_lba, io_buf, cur_part->sb->block_sects);
+        uint32_t dir_e_idx = 0;
+        // 遍历每个目录项
+        while (dir_e_idx < dir_entrys_per_block) {
+            if ((dir_e + dir_e_idx)->f_type != FT_UNKNOWN && (dir_e + dir_e_idx)->i_no == c_inode_nr) {
+                strcat(path, "/");
+                strcat(path, (dir_e+dir_e_idx)->filename);
+                inode_close(parent_dir_inode);
+                return 0;
             }
+            dir_e_idx++;
         }
         block_idx++;
     }
+    inode_close(parent_dir_inode);
     return -1;
 }
 
@@ -837,7 +894,7 @@ static int get_child_dir_name(uint32_t p_inode_nr, uint32_t c_inode_nr, char* pa
 // 失败则返回 NULL
 char* sys_getcwd(char* buf, uint32_t size) {
     ASSERT(buf != NULL);
-    void* io_buf = sys_malloc(SECTOR_SIZE);
+    void* io_buf = sys_malloc(MAX_BLOCK_SIZE);
     if (io_buf == NULL) {
         return NULL;
     }
@@ -927,6 +984,60 @@ int32_t sys_stat(const char* path, struct stat* buf) {
     return ret;
 }
 
+// 把所有设备上缓存的脏数据写入硬盘, 成功返回 0, 有写入失败时返回 -1
+int32_t sys_sync(void) {
+    return bcache_sync(NULL);
+}
+
+// 把文件描述符 fd 所在分区的脏数据写入硬盘, 成功返回 0, 失败返回 -1
+// 缓存不记录脏块属于哪个文件, 因此写回整个设备上的脏数据, 其中包括此文件的数据和 inode
+int32_t sys_fsync(int32_t fd) {
+    if (fd <= stderr_no || fd >= MAX_FILES_OPEN_PER_PROC || running_thread()->fd_table[fd] == -1) {
+        printk("sys_fsync: fd error\n");
+        return -1;
+    }
+    ASSERT(file_table[fd_local2global(fd)].fd_inode != NULL);
+    return bcache_sync(cur_part->bdev);
+}
+
+// 为文件描述符 fd 指向的文件预先分配能容纳 len 字节的连续空间, 文件大小不变, 成功返回 0, 失败返回 -1
+int32_t sys_fallocate(int32_t fd, uint32_t len) {
+    if (fd <= stderr_no || fd >= MAX_FILES_OPEN_PER_PROC || running_thread()->fd_table[fd] == -1) {
+        printk("sys_fallocate: fd error\n");
+        return -1;
+    }
+    uint32_t _fd = fd_local2global(fd);
+    struct file* file = &file_table[_fd];
+    if (!(file->fd_flag & O_WRONLY || file->fd_flag & O_RDWR)) {
+        printk("sys_fallocate: not allowed to allocate file without flag O_RDWR or O_WRONLY\n");
+        return -1;
+    }
+    return file_fallocate(file, len);
+}
+
+// 在名为 part_name 的分区上重新创建文件系统, 块大小为 block_size 字节, 为 0 时用 DEFAULT_BLOCK_SIZE
+// 分区上原有的数据全部丢失, 当前挂载的分区不能格式化. 成功返回 0, 失败返回 -1
+int32_t sys_mkfs(const char* part_name, uint32_t block_size) {
+    if (block_size == 0) {
+        block_size = DEFAULT_BLOCK_SIZE;
+    }
+    if (!block_size_valid(block_size)) {
+        printk("mkfs: block size must be 512, 1024, 2048 or 4096\n");
+        return -1;
+    }
+    struct partition* part = partition_find(part_name);
+    if (part == NULL) {
+        printk("mkfs: partition %s not found\n", part_name);
+        return -1;
+    }
+    if (part == cur_part) {
+        printk("mkfs: %s is mounted\n", part_name);
+        return -1;
+    }
+    partition_format(part, block_size);
+    return 0;
+}
+
 /* 向屏幕输出一个字符 */
 void sys_putchar(char char_asci) {
     console_put_char(char_asci);
@@ -943,6 +1054,11 @@ void sys_help(void) {
        rm: remove a regular file\n\
        pwd: show current work directory\n\
        ps: show process information\n\
+       lockstat: show lock contention\n\
+       trace: on|off|clear|show|dump kernel event trace\n\
+       iostat: [device|partition] show disk io statistics\n\
+       sync: write cached data to disk\n\
+       mkfs: partition [block_size] create a new filesystem on an unmounted partition\n\
        clear: clear screen\n\
  shortcut key:\n\
        ctrl+l: clear screen\n\
@@ -7,7 +7,9 @@
 #define MAX_FILES_PER_PART 4096 // 每个分区所支持最大创建的文件数
 #define BITS_PER_SECTOR 4096    // 每扇区的位数
 #define SECTOR_SIZE 512         // 扇区字节大小
-#define BLOCK_SIZE SECTOR_SIZE  // 块字节大小
+#define MAX_BLOCK_SIZE 4096     // 块最大的字节数, 块大小在格式化时选定并记入超级块
+#define DEFAULT_BLOCK_SIZE 4096 // 开机格式化及mkfs未指定时使用的块大小, 可选 512/1024/2048/4096
+#define DEFAULT_PART "sdb1"     // 启动时挂载的分区, 以make RAMDISK=1编译时改为"rda1"即挂载RAM盘
 #define MAX_PATH_LEN 512
 
 extern struct partition* cur_part;
@@ -103,6 +105,19 @@ int32_t sys_chdir(const char* path);
 // 在 buf 中填充文件结构相关信息, 成功时返回 0, 失败返回 -1
 int32_t sys_stat(const char* path, struct stat* buf);
 
+// 把所有设备上缓存的脏数据写入硬盘, 成功返回 0, 有写入失败时返回 -1
+int32_t sys_sync(void);
+
+// 把文件描述符 fd 所在分区的脏数据写入硬盘, 成功返回 0, 失败返回 -1
+int32_t sys_fsync(int32_t fd);
+
+// 为文件描述符 fd 指向的文件预先分配能容纳 len 字节的连续空间, 文件大小不变, 成功返回 0, 失败返回 -1
+int32_t sys_fallocate(int32_t fd, uint32_t len);
+
+// 在名为 part_name 的分区上以 block_size 字节的块重新创建文件系统, block_size 为 0 时用默认块大小
+// 当前挂载的分区不能格式化, 成功返回 0, 失败返回 -1
+int32_t sys_mkfs(const char* part_name, uint32_t block_size);
+
 void sys_putchar(char char_asci);
 
 // 将最上层路径名称解析出来
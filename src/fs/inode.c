@@ -1,6 +1,10 @@
 #include "inode.h"
-#include "ide.h"
+#include "block.h"
+#include "bcache.h"
 #include "file.h"
+#include "atomic.h"
+#include "thread.h"
+#include "memory.h"
 
 
 // 用来存储 inode 位置
@@ -18,7 +22,7 @@ static void inode_locate(struct partition* part,
     ASSERT(inode_no < 4096);
     uint32_t inode_table_lba = part->sb->inode_table_lba;
 
-    uint32_t inode_size = sizeof(struct inode);
+    uint32_t inode_size = INODE_DISK_SIZE;
     // 第 inode_no 号 I 结点相对于 inode_table_lba 的字节偏移量
     uint32_t off_size = inode_no * inode_size;
     // 第 inode_no 号 I 结点相对于 inode_table_lba 的扇区偏移量
@@ -40,7 +44,7 @@ static void inode_locate(struct partition* part,
 
 // 将 inode 写入到硬盘分区 part
 void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
-    uint8_t inode_no = inode->i_no;
+    uint32_t inode_no = inode->i_no;
     struct inode_position inode_pos;
     // inode 位置信息会存入 inode_pos
     inode_locate(part, inode_no, &inode_pos);
@@ -63,31 +67,45 @@ void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
         // 若是跨了两个扇区, 就要读出两个扇区再写入两个扇区
         // 读写硬盘是以扇区为单位, 若写入的数据小于一扇区
         // 要将原硬盘上的内容先读出来再和新数据拼成一扇区后再写入
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_read(part->bdev, inode_pos.sec_lba, inode_buf, 2);
         // 开始将待写入的 inode 拼入到这 2 个扇区中的相应位置
-        memcpy((inode_buf+inode_pos.off_size), &pure_inode, sizeof(struct inode));
+        memcpy((inode_buf+inode_pos.off_size), &pure_inode, INODE_DISK_SIZE);
         // 将拼接好的数据再写入磁盘
-        ide_write(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_write(part->bdev, inode_pos.sec_lba, inode_buf, 2);
     } else {
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
-        memcpy((inode_buf + inode_pos.off_size), &pure_inode, sizeof(struct inode));
-        ide_write(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        bcache_read(part->bdev, inode_pos.sec_lba, inode_buf, 1);
+        memcpy((inode_buf + inode_pos.off_size), &pure_inode, INODE_DISK_SIZE);
+        bcache_write(part->bdev, inode_pos.sec_lba, inode_buf, 1);
     }
 }
 
-// 根据 i 结点号返回相应的 i 结点
-struct inode* inode_open(struct partition* part, uint32_t inode_no) {
-    // 先在已打开的 inode 链表中找 inode, 此链表是为提速创建的缓冲区
+// 在分区 part 已打开的 inode 链表中查找 inode_no, 调用者需持有 part->inode_lock
+static struct inode* open_inodes_find(struct partition* part, uint32_t inode_no) {
     struct list_elem* elem = part->open_inodes.head.next;
     struct inode* inode_found;
     while (elem != &part->open_inodes.tail) {
         inode_found = elem2entry(struct inode, inode_tag, elem);
         if (inode_found->i_no == inode_no) {
-            inode_found->i_open_cnts++;
             return inode_found;
         }
         elem = elem->next;
     }
+    return NULL;
+}
+
+// 根据 i 结点号返回相应的 i 结点
+struct inode* inode_open(struct partition* part, uint32_t inode_no) {
+    // 先在已打开的 inode 链表中找 inode, 此链表是为提速创建的缓冲区
+    // 查找只读链表, 多个任务可以同时持有读锁
+    rwlock_read_acquire(&part->inode_lock);
+    struct inode* inode_found = open_inodes_find(part, inode_no);
+    if (inode_found != NULL) {
+        // 读锁下可能有其它读者同时增加打开数, 必须原子地加 1
+        atomic_inc(&inode_found->i_open_cnts);
+        rwlock_read_release(&part->inode_lock);
+        return inode_found;
+    }
+    rwlock_read_release(&part->inode_lock);
 
     // 由于 open_inodes 链表中找不到, 从硬盘读入此 inode 并加入此链表
     struct inode_position inode_pos;
@@ -102,34 +120,62 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no) {
     uint32_t* cur_pagedir_bak = cur->pgdir;
     cur->pgdir = NULL;
     // 以上三行代码完成后下面分配的内存将位于内核区
-    inode_found = (struct inode*)sys_malloc(sizeof(struct inode));
+    struct inode* new_inode = (struct inode*)sys_malloc(sizeof(struct inode));
     // 恢复 pgdir
     cur->pgdir = cur_pagedir_bak;
 
     char* inode_buf;
     if (inode_pos.two_sec) { // 跨扇区的情况
         inode_buf = (char*)sys_malloc(1024);
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_read(part->bdev, inode_pos.sec_lba, inode_buf, 2);
     } else { // 未跨扇区
         inode_buf = (char*)sys_malloc(512);
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        bcache_read(part->bdev, inode_pos.sec_lba, inode_buf, 1);
     }
-    memcpy(inode_found, inode_buf+inode_pos.off_size, sizeof(struct inode));
-    
-    list_push(&part->open_inodes, &inode_found->inode_tag);
-    inode_found->i_open_cnts = 1;
-
+    memcpy(new_inode, inode_buf+inode_pos.off_size, INODE_DISK_SIZE);
     sys_free(inode_buf);
+    new_inode->i_prealloc_lba = new_inode->i_prealloc_len = 0;
+
+    // 读硬盘期间没有持锁, 其它任务可能已经把同一个 inode 加入了链表, 需要再查一次
+    rwlock_write_acquire(&part->inode_lock);
+    inode_found = open_inodes_find(part, inode_no);
+    if (inode_found != NULL) {
+        inode_found->i_open_cnts++;
+    } else {
+        inode_found = new_inode;
+        new_inode = NULL;
+        list_push(&part->open_inodes, &inode_found->inode_tag);
+        inode_found->i_open_cnts = 1;
+    }
+    rwlock_write_release(&part->inode_lock);
+
+    if (new_inode != NULL) {
+        cur->pgdir = NULL;
+        sys_free(new_inode);
+        cur->pgdir = cur_pagedir_bak;
+    }
     return inode_found;
 }
 
+// 取消预分配窗口中剩下的块的预留
+static void inode_prealloc_release(struct partition* part, struct inode* inode) {
+    while (inode->i_prealloc_len > 0) {
+        block_reserve_cancel(part, inode->i_prealloc_lba);
+        inode->i_prealloc_lba += part->sb->block_sects;
+        inode->i_prealloc_len--;
+    }
+}
+
 // 关闭 inode 或减少 inode 的打开数
 void inode_close(struct inode* inode) {
     // 若没有进程再打开此文件, 将此 inode 去掉并释放空间
-    enum intr_status old_status = intr_disable();
+    rwlock_write_acquire(&cur_part->inode_lock);
     if (--inode->i_open_cnts == 0) { 
         // 将 inode 结点从 part->open_inodes 中去掉
         list_remove(&inode->inode_tag);
+        rwlock_write_release(&cur_part->inode_lock);
+        // 预留而没用上的块还给分区
+        inode_prealloc_release(cur_part, inode);
         // inode_open 时为实现 inode 被所有进程共享
         // 已经在 sys_malloc 为 inode 分配了内核空间
         // 释放 inode 时也要确保释放的是内核内存池
@@ -138,8 +184,9 @@ void inode_close(struct inode* inode) {
         cur->pgdir = NULL;
         sys_free(inode);
         cur->pgdir = cur_pagedir_bak;
+        return;
     }
-    intr_set_status(old_status);
+    rwlock_write_release(&cur_part->inode_lock);
 }
 
 // 初始化 new_inode
@@ -148,14 +195,13 @@ void inode_init(uint32_t inode_no, struct inode* new_inode) {
     new_inode->i_size = 0;
     new_inode->i_open_cnts = 0;
     new_inode->write_deny = false;
+    new_inode->i_prealloc_lba = new_inode->i_prealloc_len = 0;
 
-    // 初始化块索引数组 i_sector
-    uint8_t sec_idx = 0;
-    while (sec_idx < 13) {
-        // i_sectors[12] 为一级间接块地址
-        new_inode->i_sectors[sec_idx] = 0;
-        sec_idx++;
-    }
+    // 还没有任何块
+    new_inode->i_blocks = 0;
+    memset(new_inode->i_extents, 0, sizeof(new_inode->i_extents));
+    memset(new_inode->i_indirect, 0, sizeof(new_inode->i_indirect));
+    new_inode->i_tail = 0;
 }
 
 // 将硬盘分区 part 上的 inode 清空
@@ -168,19 +214,342 @@ void inode_delete(struct partition* part, uint32_t inode_no, void* io_buf) {
     char* inode_buf = (char*)io_buf;
     if (inode_pos.two_sec) { // inode 跨扇区, 读入 2 个扇区
         // 将原硬盘上的内容先读出来
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_read(part->bdev, inode_pos.sec_lba, inode_buf, 2);
         // 将 inode_buf 清 0
-        memset((inode_buf + inode_pos.off_size), 0, sizeof(struct inode));
+        memset((inode_buf + inode_pos.off_size), 0, INODE_DISK_SIZE);
         // 用清 0 的内存数据覆盖磁盘
-        ide_write(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
+        bcache_write(part->bdev, inode_pos.sec_lba, inode_buf, 2);
     } else { // 未跨扇区, 只读入 1 个扇区就好
         // 将原硬盘上的内容先读出来
-        ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        bcache_read(part->bdev, inode_pos.sec_lba, inode_buf, 1);
         // 将 inode_buf 清 0
-        memset((inode_buf + inode_pos.off_size), 0, sizeof(struct inode));
+        memset((inode_buf + inode_pos.off_size), 0, INODE_DISK_SIZE);
         // 用清 0 的内存数据覆盖磁盘
-        ide_write(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
+        bcache_write(part->bdev, inode_pos.sec_lba, inode_buf, 1);
+    }
+}
+
+// 读出间接块 blk 中的第 idx 项
+static uint32_t indirect_get(struct partition* part, uint32_t blk, uint32_t idx) {
+    uint32_t ptr;
+    bcache_read_part(part->bdev, blk + idx * 4 / SECTOR_SIZE, idx * 4 % SECTOR_SIZE, &ptr, 4);
+    return ptr;
+}
+
+// 把间接块 blk 中的第 idx 项改为 ptr
+static void indirect_set(struct partition* part, uint32_t blk, uint32_t idx, uint32_t ptr) {
+    bcache_write_part(part->bdev, blk + idx * 4 / SECTOR_SIZE, idx * 4 % SECTOR_SIZE, &ptr, 4);
+}
+
+// 分配一个清 0 的间接块, 返回其块地址, 失败返回 -1
+static int32_t indirect_alloc(struct partition* part) {
+    int32_t blk = block_bitmap_alloc(part);
+    if (blk == -1) {
+        return -1;
+    }
+    bcache_zero(part->bdev, blk, part->sb->block_sects);
+    return blk;
+}
+
+// 每个间接块中的块地址数
+static uint32_t indirect_ptrs(struct partition* part) {
+    return part->sb->block_size / 4;
+}
+
+// 返回 inode 的 extent 覆盖的块数
+static uint32_t inode_extent_blocks(struct inode* inode) {
+    uint32_t blocks = 0, ext_idx = 0;
+    while (ext_idx < INODE_EXTENTS) {
+        blocks += inode->i_extents[ext_idx].len;
+        ext_idx++;
+    }
+    return blocks;
+}
+
+// 间接块树中的第 *tree_idx 块属于几级树(1~3), 并把 *tree_idx 换算为在该级树中的序号.
+// 超出三级树的容量时返回 0
+static uint32_t indirect_level(uint32_t ptrs, uint32_t* tree_idx) {
+    uint32_t level = 1, capacity = ptrs;
+    while (level <= 3) {
+        if (*tree_idx < capacity) {
+            return level;
+        }
+        *tree_idx -= capacity;
+        capacity *= ptrs;
+        level++;
+    }
+    return 0;
+}
+
+// level 级树中每个根间接块的一项所覆盖的块数
+static uint32_t indirect_span(uint32_t ptrs, uint32_t level) {
+    uint32_t span = 1;
+    while (--level > 0) {
+        span *= ptrs;
+    }
+    return span;
+}
+
+// 查找文件第 block_idx 块的硬盘地址存入 *lba, 返回从它开始在硬盘上连续的块数(不超过 max_blocks), 未分配时返回 0
+uint32_t inode_bmap(struct partition* part, struct inode* inode, uint32_t block_idx, uint32_t max_blocks, uint32_t* lba) {
+    ASSERT(max_blocks > 0);
+    if (block_idx >= inode->i_blocks) {
+        return 0;
+    }
+
+    // 先在 extent 中找, 一个 extent 就能映射一长串块
+    uint32_t ext_idx = 0;
+    while (ext_idx < INODE_EXTENTS) {
+        struct extent* ext = &inode->i_extents[ext_idx];
+        if (block_idx < ext->len) {
+            *lba = ext->start + block_idx * part->sb->block_sects;
+            uint32_t run = ext->len - block_idx;
+            return run < max_blocks ? run : max_blocks;
+        }
+        block_idx -= ext->len;
+        ext_idx++;
+    }
+
+    // 不在 extent 中, 沿间接块树逐级向下找
+    uint32_t ptrs = indirect_ptrs(part);
+    uint32_t level = indirect_level(ptrs, &block_idx);
+    ASSERT(level != 0);
+    uint32_t blk = inode->i_indirect[level - 1];
+    uint32_t span = indirect_span(ptrs, level);
+    while (span > 1) {
+        ASSERT(blk != 0);
+        blk = indirect_get(part, blk, block_idx / span % ptrs);
+        span /= ptrs;
+    }
+    // blk 是最底层的间接块, 顺着它数出硬盘上连续的块, 未分配的项为 0 自然不连续
+    uint32_t idx = block_idx % ptrs;
+    *lba = indirect_get(part, blk, idx);
+    ASSERT(*lba != 0);
+    uint32_t run = 1;
+    while (run < max_blocks && idx + run < ptrs &&
+           indirect_get(part, blk, idx + run) == *lba + run * part->sb->block_sects) {
+        run++;
+    }
+    return run;
+}
+
+// 把数据块 lba 挂到间接块树的第 tree_idx 项, 途中缺少的间接块随之分配, 失败返回 -1
+static int32_t indirect_insert(struct partition* part, struct inode* inode, uint32_t tree_idx, uint32_t lba) {
+    uint32_t ptrs = indirect_ptrs(part);
+    uint32_t level = indirect_level(ptrs, &tree_idx);
+    if (level == 0) {   // 超出三级间接块的容量
+        return -1;
+    }
+    if (inode->i_indirect[level - 1] == 0) {
+        int32_t root = indirect_alloc(part);
+        if (root == -1) {
+            return -1;
+        }
+        inode->i_indirect[level - 1] = root;
     }
+
+    uint32_t blk = inode->i_indirect[level - 1];
+    uint32_t span = indirect_span(ptrs, level);
+    while (span > 1) {
+        uint32_t idx = tree_idx / span % ptrs;
+        uint32_t next = indirect_get(part, blk, idx);
+        if (next == 0) {
+            int32_t new_blk = indirect_alloc(part);
+            if (new_blk == -1) {
+                return -1;
+            }
+            next = new_blk;
+            indirect_set(part, blk, idx, next);
+        }
+        blk = next;
+        span /= ptrs;
+    }
+    indirect_set(part, blk, tree_idx % ptrs, lba);
+    return 0;
+}
+
+// 文件下一块最好的位置: 紧接文件最后一块, 文件还没有块时从数据区开头找
+static uint32_t inode_goal(struct partition* part, struct inode* inode) {
+    uint32_t lba;
+    if (inode->i_blocks == 0) {
+        return part->sb->data_start_lba;
+    }
+    inode_bmap(part, inode, inode->i_blocks - 1, 1, &lba);
+    return lba + part->sb->block_sects;
+}
+
+// 确保文件的预分配窗口中至少有 blocks 个块, 尽量紧接文件的最后一块. 分不到时窗口可能不足 blocks 块
+void inode_prealloc(struct partition* part, struct inode* inode, uint32_t blocks) {
+    if (inode->i_prealloc_len >= blocks) {
+        return;
+    }
+    // 原窗口不够大, 归还后在同一处重新找一段更长的, 原窗口通常就是这段的开头
+    inode_prealloc_release(part, inode);
+    uint32_t got;
+    int32_t lba = block_reserve_near(part, inode_goal(part, inode), blocks, &got);
+    if (lba != -1) {
+        inode->i_prealloc_lba = lba;
+        inode->i_prealloc_len = got;
+    }
+}
+
+// 为文件分配第 i_blocks 块, 返回其块地址, 失败返回 -1. 调用者负责同步 inode
+int32_t inode_alloc_block(struct partition* part, struct inode* inode) {
+    int32_t lba;
+    if (inode->i_prealloc_len > 0) {    // 先从预分配窗口中取
+        lba = inode->i_prealloc_lba;
+        block_reserve_take(part, lba);
+        inode->i_prealloc_lba += part->sb->block_sects;
+        inode->i_prealloc_len--;
+    } else {    // 没有窗口就找离文件最后一块最近的空闲块
+        uint32_t got;
+        lba = block_bitmap_alloc_near(part, inode_goal(part, inode), 1, &got);
+        if (lba == -1) {
+            return -1;
+        }
+    }
+
+    // 间接块树还没启用时, 新块紧接最后一个 extent 就延长它, 否则占用一个空 extent
+    if (inode->i_indirect[0] == 0) {
+        uint32_t ext_idx = 0;
+        while (ext_idx < INODE_EXTENTS && inode->i_extents[ext_idx].len != 0) {
+            ext_idx++;
+        }
+        if (ext_idx > 0) {
+            struct extent* last = &inode->i_extents[ext_idx - 1];
+            if (last->start + last->len * part->sb->block_sects == (uint32_t)lba) {
+                last->len++;
+                inode->i_blocks++;
+                return lba;
+            }
+        }
+        if (ext_idx < INODE_EXTENTS) {
+            inode->i_extents[ext_idx].start = lba;
+            inode->i_extents[ext_idx].len = 1;
+            inode->i_blocks++;
+            return lba;
+        }
+    }
+
+    // extent 用完了, 挂到间接块树上
+    if (indirect_insert(part, inode, inode->i_blocks - inode_extent_blocks(inode), lba) == -1) {
+        block_bitmap_free(part, lba);
+        return -1;
+    }
+    inode->i_blocks++;
+    return lba;
+}
+
+// 尾块的第 0 扇区是头部, 开头的位图记录块内哪些扇区已被文件尾部占用, 第 0 位代表头部自身
+static uint32_t tail_mask_get(struct partition* part, uint32_t blk) {
+    uint32_t mask;
+    bcache_read_part(part->bdev, blk, 0, &mask, 4);
+    return mask;
+}
+
+static void tail_mask_set(struct partition* part, uint32_t blk, uint32_t mask) {
+    bcache_write_part(part->bdev, blk, 0, &mask, 4);
+}
+
+// 把内存中的超级块写回硬盘
+static void super_block_sync(struct partition* part) {
+    bcache_write(part->bdev, part->start_lba + 1, part->sb, 1);
+}
+
+// 在尾块中分配 sects 个连续的扇区, 返回起始扇区地址, 失败返回 -1
+static int32_t tail_alloc(struct partition* part, uint32_t sects) {
+    uint32_t block_sects = part->sb->block_sects;
+    uint32_t want = (1 << sects) - 1;
+    uint32_t blk = part->sb->tail_block_lba;
+    if (blk != 0) {
+        uint32_t mask = tail_mask_get(part, blk);
+        uint32_t sec = 1;
+        while (sec + sects <= block_sects) {
+            if ((mask & (want << sec)) == 0) {
+                tail_mask_set(part, blk, mask | (want << sec));
+                return blk + sec;
+            }
+            sec++;
+        }
+    }
+
+    // 当前尾块放不下, 另分配一块作为新的尾块, 旧尾块中的扇区随文件删除陆续释放
+    int32_t new_blk = block_bitmap_alloc(part);
+    if (new_blk == -1) {
+        return -1;
+    }
+    tail_mask_set(part, new_blk, 1 | (want << 1));
+    part->sb->tail_block_lba = new_blk;
+    super_block_sync(part);
+    return new_blk + 1;
+}
+
+// 释放尾块中从 lba 开始的 sects 个扇区, 尾块空了就回收整块
+static void tail_free(struct partition* part, uint32_t lba, uint32_t sects) {
+    uint32_t blk = lba - (lba - part->sb->data_start_lba) % part->sb->block_sects;
+    uint32_t mask = tail_mask_get(part, blk) & ~(((1 << sects) - 1) << (lba - blk));
+    if (mask == 1 && blk != part->sb->tail_block_lba) {
+        block_bitmap_free(part, blk);
+    } else {    // 还有其它文件的尾部, 或者是正在使用的尾块, 留着它
+        tail_mask_set(part, blk, mask);
+    }
+}
+
+// 把打包在尾块中的文件数据移回文件的第 0 块, 成功返回 0, 失败返回 -1. io_buf 至少一块大
+int32_t inode_unpack_tail(struct partition* part, struct inode* inode, void* io_buf) {
+    ASSERT(inode->i_tail != 0 && inode->i_blocks == 0);
+    uint32_t sects = DIV_ROUND_UP(inode->i_size, SECTOR_SIZE);
+    int32_t lba = inode_alloc_block(part, inode);
+    if (lba == -1) {
+        return -1;
+    }
+    memset(io_buf, 0, part->sb->block_size);
+    bcache_read(part->bdev, inode->i_tail, io_buf, sects);
+    bcache_write(part->bdev, lba, io_buf, part->sb->block_sects);
+    tail_free(part, inode->i_tail, sects);
+    inode->i_tail = 0;
+    return 0;
+}
+
+// 若文件只有不满的一块, 把数据打包进尾块并回收该块. 调用者负责同步 inode, io_buf 至少一块大
+void inode_pack_tail(struct partition* part, struct inode* inode, void* io_buf) {
+    uint32_t sects = DIV_ROUND_UP(inode->i_size, SECTOR_SIZE);
+    // 块太小时打包省不了多少空间, 还要多占一个头部扇区
+    if (part->sb->block_sects < TAIL_MIN_BLOCK_SECTS || inode->i_blocks != 1 ||
+        sects == 0 || sects >= part->sb->block_sects) {
+        return;
+    }
+    ASSERT(inode->i_tail == 0);
+
+    int32_t tail = tail_alloc(part, sects);
+    if (tail == -1) {   // 分不出尾块就仍占整块
+        return;
+    }
+    uint32_t lba = inode->i_extents[0].start;
+    bcache_read(part->bdev, lba, io_buf, sects);
+    bcache_write(part->bdev, tail, io_buf, sects);
+    block_bitmap_free(part, lba);
+    inode->i_extents[0].start = inode->i_extents[0].len = 0;
+    inode->i_blocks = 0;
+    inode->i_tail = tail;
+}
+
+// 回收间接块 blk 和它下面 level 级的所有块, level 为 1 时 blk 中直接是数据块地址
+static void indirect_release(struct partition* part, uint32_t blk, uint32_t level) {
+    uint32_t idx = 0;
+    while (idx < indirect_ptrs(part)) {
+        uint32_t ptr = indirect_get(part, blk, idx);
+        if (ptr != 0) {
+            if (level > 1) {
+                indirect_release(part, ptr, level - 1);
+            } else {
+                block_bitmap_free(part, ptr);
+            }
+        }
+        idx++;
+    }
+    block_bitmap_free(part, blk);
+    cond_resched();     // 大文件要回收成千上万个块, 给其他线程运行的机会
 }
 
 // 回收 inode 的数据块和 inode 本身
@@ -189,39 +558,31 @@ void inode_release(struct partition* part, uint32_t inode_no) {
     ASSERT(inode_to_del->i_no == inode_no);
 
 // 1 回收 inode 占用的所有块
-    uint8_t block_idx = 0, block_cnt = 12;
-    uint32_t block_bitmap_idx;
-    uint32_t all_blocks[140] = {0}; // 12 个直接块 + 128 个间接块
-
-    // a 先将前 12 个直接块存入 all_blocks
-    while (block_idx < 12) {
-        all_blocks[block_idx] = inode_to_del->i_sectors[block_idx];
-        block_idx++;
-    }
-
-    // b 如果一级间接块表存在, 将其 128 个间接块读到 all_blocks[12~], 并释放一级间接块表所占的扇区
-    if (inode_to_del->i_sectors[12] != 0) {
-        ide_read(part->my_disk, inode_to_del->i_sectors[12], all_blocks+12, 1);
-        block_cnt = 140;
-
-        // 回收一级间接块表占用的扇区
-        block_bitmap_idx = inode_to_del->i_sectors[12] - part->sb->data_start_lba;
-        ASSERT(block_bitmap_idx > 0);
-        bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
-        bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
-    }
-
-    // c inode 所有的块地址已经收集到 all_blocks 中, 下面逐个回收
-    block_idx = 0;
-    while (block_idx < block_cnt) {
-        if (all_blocks[block_idx] != 0) {
-            block_bitmap_idx = 0;
-            block_bitmap_idx = all_blocks[block_idx] - part->sb->data_start_lba;
-            ASSERT(block_bitmap_idx > 0);
-            bitmap_set(&part->block_bitmap, block_bitmap_idx, 0);
-            bitmap_sync(cur_part, block_bitmap_idx, BLOCK_BITMAP);
+    // a 先回收 extent 中的块
+    uint32_t ext_idx = 0;
+    while (ext_idx < INODE_EXTENTS) {
+        struct extent* ext = &inode_to_del->i_extents[ext_idx];
+        uint32_t block_idx = 0;
+        while (block_idx < ext->len) {
+            block_bitmap_free(part, ext->start + block_idx * part->sb->block_sects);
+            block_idx++;
         }
-        block_idx++;
+        ext_idx++;
+        cond_resched();
+    }
+
+    // b 再回收各级间接块树, 包括间接块本身
+    uint32_t level = 1;
+    while (level <= 3) {
+        if (inode_to_del->i_indirect[level - 1] != 0) {
+            indirect_release(part, inode_to_del->i_indirect[level - 1], level);
+        }
+        level++;
+    }
+
+    // c 最后释放打包在尾块中的扇区
+    if (inode_to_del->i_tail != 0) {
+        tail_free(part, inode_to_del->i_tail, DIV_ROUND_UP(inode_to_del->i_size, SECTOR_SIZE));
     }
 
 // 2 回收该 inode 所占用的 inode
@@ -233,4 +594,4 @@ void inode_release(struct partition* part, uint32_t inode_no) {
     sys_free(io_buf);
 
     inode_close(inode_to_del);
-}
\ No newline at end of file
+}
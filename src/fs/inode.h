@@ -2,23 +2,49 @@
 #define __FS_INODE_H
 #include "stdint.h"
 #include "list.h"
-#include "ide.h"
+#include "block.h"
 #include "fs.h"
 #include "super_block.h"
 #include "interrupt.h"
 #include "string.h"
 #include "debug.h"
 
+#define INODE_EXTENTS 4         // inode 中的 extent 数
+#define TAIL_MIN_BLOCK_SECTS 4  // 每块至少有这么多扇区时才把小文件打包进尾块
+#define INODE_PREALLOC_BLOCKS 16    // 文件追加需要新块时至少预留的连续块数
+
+// extent, 文件中连续的 len 个块在硬盘上也连续存放, 起始块的扇区地址为 start
+struct extent {
+    uint32_t start;
+    uint32_t len;
+};
+
 // inode 结构
 struct inode {
     uint32_t i_no;          // inode 编号
     uint32_t i_size;        // 文件大小，字节为单位
     uint32_t i_open_cnts;   // 记录此文件被打开的次数
     bool write_deny;        // 写文件不能并行, 进程写文件前检查此标识
-    uint32_t i_sectors[13]; // i_sectors[0-11]是直接块, i_sectors[13]用来存储一级间接块指针
+    uint32_t i_blocks;      // 已分配的块数, 文件的第 0 ~ i_blocks-1 块都有对应的硬盘块
+    // 文件块依次由 i_extents 映射, 其余的块由一级, 二级, 三级间接块树依次映射.
+    // 间接块树启用后 extent 不再增长, 它们覆盖的块数就固定了
+    struct extent i_extents[INODE_EXTENTS];
+    uint32_t i_indirect[3]; // 一级, 二级, 三级间接块地址
+    // 不足一块的小文件可以不占整块, 而是打包在与其它文件共用的尾块中.
+    // 不为 0 时文件没有数据块(i_blocks 为 0), 全部数据存放在从 i_tail 开始的几个扇区中
+    uint32_t i_tail;
     struct list_elem inode_tag; // 用于加入已打开的文件(inode)队列
+
+    // 以下成员只在内存中有效, 不占硬盘 inode 表的空间
+    // 预分配窗口: 从 i_prealloc_lba 开始为文件预留的 i_prealloc_len 个连续块.
+    // 预留只记在分区的 prealloc_bitmap 中, 不写入块位图, 文件增长时依次取用, 最后一次关闭文件时取消
+    uint32_t i_prealloc_lba;
+    uint32_t i_prealloc_len;
 };
 
+// inode 在硬盘 inode 表中所占的字节数, 预分配窗口及之后的成员不写入硬盘
+#define INODE_DISK_SIZE ((uint32_t)offset(struct inode, i_prealloc_lba))
+
 // 将 inode 写入到硬盘分区 part
 void inode_sync(struct partition* , struct inode* , void* );
 // 根据 i 结点号返回相应的 i 结点
@@ -31,4 +57,14 @@ void inode_init(uint32_t , struct inode* );
 void inode_delete(struct partition* part, uint32_t inode_no, void* io_buf);
 // 回收 inode 的数据块和 inode 本身
 void inode_release(struct partition* part, uint32_t inode_no);
+// 查找文件第 block_idx 块的硬盘地址存入 *lba, 返回从它开始在硬盘上连续的块数(不超过 max_blocks), 未分配时返回 0
+uint32_t inode_bmap(struct partition* part, struct inode* inode, uint32_t block_idx, uint32_t max_blocks, uint32_t* lba);
+// 为文件分配第 i_blocks 块, 返回其块地址, 失败返回 -1. 调用者负责同步 inode
+int32_t inode_alloc_block(struct partition* part, struct inode* inode);
+// 确保文件的预分配窗口中至少有 blocks 个块, 尽量紧接文件的最后一块. 分不到时窗口可能不足 blocks 块
+void inode_prealloc(struct partition* part, struct inode* inode, uint32_t blocks);
+// 把打包在尾块中的文件数据移回文件的第 0 块, 成功返回 0, 失败返回 -1. io_buf 至少一块大
+int32_t inode_unpack_tail(struct partition* part, struct inode* inode, void* io_buf);
+// 若文件只有不满的一块, 把数据打包进尾块并回收该块. 调用者负责同步 inode, io_buf 至少一块大
+void inode_pack_tail(struct partition* part, struct inode* inode, void* io_buf);
 #endif
\ No newline at end of file
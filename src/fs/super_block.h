@@ -2,6 +2,9 @@
 #define __FS_SUPER_BLOCK_H
 #include "stdint.h"
 
+#define SUPER_BLOCK_MAGIC 0x1959031a  // 文件系统标识, 磁盘格式变化时随之修改
+#define SUPER_BLOCK_MAGIC_MASK 0xfffffff0   // 本文件系统各版本的标识只有低4位不同, 其它版本的分区拒绝挂载, 不会被自动格式化
+
 // 超级块
 struct super_block {
     uint32_t magic;         // 用来标识文件系统类型
@@ -22,7 +25,11 @@ struct super_block {
     uint32_t root_inode_no;  // 根目录所在的inode号
     uint32_t dir_entry_size; // 目录项大小
 
-    uint8_t pad[460]; // 加上 460 字节, 凑够 512 字节 1 扇区大小
+    uint32_t block_size;     // 块字节大小, 为扇区大小的 2 的幂倍
+    uint32_t block_sects;    // 每块的扇区数
+    uint32_t tail_block_lba; // 正在向其中打包小文件的尾块, 为 0 时没有
+
+    uint8_t pad[448]; // 加上 448 字节, 凑够 512 字节 1 扇区大小
 } __attribute__ ((packed));//防止编译器对齐而填充空隙
 
 #endif
\ No newline at end of file
@@ -0,0 +1,264 @@
+#include "fpu.h"
+#include "thread.h"
+#include "interrupt.h"
+#include "print.h"
+#include "debug.h"
+#include "string.h"
+#include "memory.h"
+#include "list.h"
+
+#define CR0_MP          (1 << 1)    // 与TS配合, 使wait/fwait也触发#NM
+#define CR0_EM          (1 << 2)    // 置位时所有FPU指令都触发#NM, 须清0
+#define CR0_TS          (1 << 3)    // 任务切换标志, 置位后下一条FPU/SSE指令触发#NM
+#define CR0_NE          (1 << 5)    // 以#MF异常而不是外部中断报告FPU错误
+#define CR4_OSFXSR      (1 << 9)    // 操作系统支持FXSAVE/FXRSTOR, 开启后才能用SSE
+#define CR4_OSXMMEXCPT  (1 << 10)   // 操作系统处理SSE的#XM异常
+#define CPUID_EDX_FXSR  (1 << 24)
+#define CPUID_EDX_SSE   (1 << 25)
+#define MXCSR_DEFAULT   0x1f80      // 屏蔽全部SSE异常, 就近舍入
+
+#define FPU_MEMCPY_MIN  256         // 小于此字节数时用SSE复制不划算
+
+static struct task_struct* fpu_owner;   // FPU寄存器中当前保存的是哪个任务的状态
+static bool has_fxsr, has_sse;
+/* 空闲的FPU保存区. 每次取一页切成8个, 页对齐保证了保存区16字节对齐 */
+static struct list fpu_free_list;
+
+static inline uint32_t read_cr0(void) {
+    uint32_t val;
+    asm volatile ("movl %%cr0, %0":"=r"(val));
+    return val;
+}
+
+static inline void write_cr0(uint32_t val) {
+    asm volatile ("movl %0, %%cr0"::"r"(val):"memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t val;
+    asm volatile ("movl %%cr4, %0":"=r"(val));
+    return val;
+}
+
+static inline void write_cr4(uint32_t val) {
+    asm volatile ("movl %0, %%cr4"::"r"(val):"memory");
+}
+
+/* 清除TS, 允许执行FPU指令 */
+static inline void clts(void) {
+    asm volatile ("clts":::"memory");
+}
+
+/* 置位TS, 下一条FPU指令将触发#NM */
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+/* 将FPU寄存器保存到st */
+static void fpu_save(struct fpu_state* st) {
+    if (has_fxsr) {
+        asm volatile ("fxsave %0":"=m"(*st));
+    } else {
+        asm volatile ("fnsave %0; fwait":"=m"(*st));
+    }
+}
+
+/* 从st恢复FPU寄存器 */
+static void fpu_restore(struct fpu_state* st) {
+    if (has_fxsr) {
+        asm volatile ("fxrstor %0"::"m"(*st));
+    } else {
+        asm volatile ("frstor %0"::"m"(*st));
+    }
+}
+
+/* 分配一个清0的FPU保存区, 内存不足时返回NULL. 可能睡眠 */
+static struct fpu_state* fpu_state_alloc(void) {
+    enum intr_status old_status = intr_disable();
+    if (list_empty(&fpu_free_list)) {
+        struct fpu_state* page = get_kernel_pages(1);
+        if (page == NULL) {
+            intr_set_status(old_status);
+            return NULL;
+        }
+        uint32_t idx = 0;
+        while (idx < PG_SIZE / sizeof(struct fpu_state)) {
+            list_append(&fpu_free_list, (struct list_elem*)&page[idx]);
+            idx++;
+        }
+    }
+    struct fpu_state* st = (struct fpu_state*)list_pop(&fpu_free_list);
+    intr_set_status(old_status);
+    memset(st, 0, sizeof(struct fpu_state));
+    return st;
+}
+
+/* 归还FPU保存区 */
+static void fpu_state_free(struct fpu_state* st) {
+    enum intr_status old_status = intr_disable();
+    list_push(&fpu_free_list, (struct list_elem*)st);
+    intr_set_status(old_status);
+}
+
+/* 为首次使用FPU的任务准备干净的状态 */
+static void fpu_fresh(void) {
+    asm volatile ("fninit");
+    if (has_sse) {
+        uint32_t mxcsr = MXCSR_DEFAULT;
+        asm volatile ("ldmxcsr %0"::"m"(mxcsr));
+    }
+}
+
+/* #NM异常处理程序: 任务第一次, 或被换下后再次执行FPU/SSE指令时触发.
+ * 此时才把上一个使用者的状态存回其保存区, 再恢复当前任务的状态 */
+static void intr_fpu_handler(void) {
+    struct task_struct* cur = running_thread();
+    bool fresh = false;
+    if (cur->fpu == NULL) {
+        /* 第一次用FPU, 先分配保存区. 分配可能睡眠, 要在碰FPU寄存器之前做 */
+        cur->fpu = fpu_state_alloc();
+        if (cur->fpu == NULL) {
+            PANIC("fpu: no memory for fpu state");
+        }
+        fresh = true;
+    }
+    clts();
+    if (fpu_owner == cur) {     // 寄存器中已是自己的状态
+        return;
+    }
+    if (fpu_owner != NULL) {
+        fpu_save(fpu_owner->fpu);
+    }
+    if (fresh) {
+        fpu_fresh();
+    } else {
+        fpu_restore(cur->fpu);
+    }
+    fpu_owner = cur;
+}
+
+/* 在schedule中切换到next之前调用.
+ * 寄存器中正是next的状态时直接放行, 否则置TS等它用到FPU时再恢复 */
+void fpu_switch(struct task_struct* next) {
+    if (next == fpu_owner) {
+        clts();
+    } else {
+        stts();
+    }
+}
+
+/* fork时为子进程复制父进程的FPU状态. child是复制来的PCB, 其fpu指针仍指向父进程的保存区.
+ * 成功返回0, 内存不足返回-1, 此时child没有保存区 */
+int32_t fpu_fork(struct task_struct* child, struct task_struct* parent) {
+    child->fpu = NULL;
+    if (parent->fpu == NULL) {
+        return 0;
+    }
+    struct fpu_state* st = fpu_state_alloc();
+    if (st == NULL) {
+        return -1;
+    }
+    enum intr_status old_status = intr_disable();
+    if (fpu_owner == parent) {
+        /* 父进程的状态还在寄存器中, 先写回保存区.
+         * FNSAVE会重置FPU, 统一交由下次#NM从保存区恢复 */
+        clts();
+        fpu_save(parent->fpu);
+        fpu_owner = NULL;
+        stts();
+    }
+    memcpy(st, parent->fpu, sizeof(struct fpu_state));
+    intr_set_status(old_status);
+    child->fpu = st;
+    return 0;
+}
+
+/* 丢弃pthread的FPU状态并归还保存区, 用于线程退出和exec */
+void fpu_release(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    if (fpu_owner == pthread) {
+        fpu_owner = NULL;
+        if (pthread == running_thread()) {
+            stts();
+        }
+    }
+    if (pthread->fpu != NULL) {
+        fpu_state_free(pthread->fpu);
+        pthread->fpu = NULL;
+    }
+    intr_set_status(old_status);
+}
+
+/* 内核要用FPU/SSE寄存器时调用, 先把当前使用者的状态存回其保存区.
+ * 期间关中断, 不会被调度走, 须与kernel_fpu_end成对使用 */
+enum intr_status kernel_fpu_begin(void) {
+    enum intr_status old_status = intr_disable();
+    clts();
+    if (fpu_owner != NULL) {
+        fpu_save(fpu_owner->fpu);
+        fpu_owner = NULL;
+    }
+    return old_status;
+}
+
+/* 内核用完FPU, 置TS使下一个用户在#NM中恢复自己的状态 */
+void kernel_fpu_end(enum intr_status old_status) {
+    stts();
+    intr_set_status(old_status);
+}
+
+/* 用SSE寄存器每次复制64字节, 适合页面这样的大块复制, 不支持SSE时退回memcpy */
+void fpu_memcpy(void* dst, const void* src, uint32_t size) {
+    if (!has_sse || size < FPU_MEMCPY_MIN) {
+        memcpy(dst, src, size);
+        return;
+    }
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    enum intr_status old_status = kernel_fpu_begin();
+    while (size >= 64) {
+        asm volatile ("movups   (%0), %%xmm0\n\t"
+                      "movups 16(%0), %%xmm1\n\t"
+                      "movups 32(%0), %%xmm2\n\t"
+                      "movups 48(%0), %%xmm3\n\t"
+                      "movups %%xmm0,   (%1)\n\t"
+                      "movups %%xmm1, 16(%1)\n\t"
+                      "movups %%xmm2, 32(%1)\n\t"
+                      "movups %%xmm3, 48(%1)"
+                      ::"r"(s), "r"(d):"memory");
+        s += 64;
+        d += 64;
+        size -= 64;
+    }
+    kernel_fpu_end(old_status);
+    if (size > 0) {
+        memcpy(d, s, size);
+    }
+}
+
+/* 检测并开启FPU/SSE, 注册#NM处理程序 */
+void fpu_init(void) {
+    put_str("fpu_init start\n");
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1));
+    has_fxsr = (edx & CPUID_EDX_FXSR) != 0;
+    has_sse = has_fxsr && (edx & CPUID_EDX_SSE) != 0;
+
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+    if (has_fxsr) {
+        uint32_t cr4 = read_cr4() | CR4_OSFXSR;
+        if (has_sse) {
+            cr4 |= CR4_OSXMMEXCPT;
+        }
+        write_cr4(cr4);
+    }
+    clts();
+    asm volatile ("fninit");
+    fpu_owner = NULL;
+    list_init(&fpu_free_list);
+    stts();     // 谁先用FPU谁触发#NM
+
+    register_handler(0x07, intr_fpu_handler);
+    put_str(has_sse ? "   fpu: fxsave, sse\n" : (has_fxsr ? "   fpu: fxsave\n" : "   fpu: fnsave\n"));
+    put_str("fpu_init done\n");
+}
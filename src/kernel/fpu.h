@@ -0,0 +1,23 @@
+#ifndef __KERNEL_FPU_H
+#define __KERNEL_FPU_H
+#include "stdint.h"
+#include "global.h"
+#include "interrupt.h"
+
+struct task_struct;
+
+/* FXSAVE/FXRSTOR使用的512字节保存区, 必须16字节对齐.
+ * 不支持FXSR的cpu用其前108字节存放FNSAVE的结果.
+ * 保存区不放在PCB中以免挤占内核栈, 任务第一次用FPU时才分配 */
+struct fpu_state {
+    uint8_t area[512];
+} __attribute__((aligned(16)));
+
+void fpu_init(void);
+void fpu_switch(struct task_struct* next);
+int32_t fpu_fork(struct task_struct* child, struct task_struct* parent);
+void fpu_release(struct task_struct* pthread);
+enum intr_status kernel_fpu_begin(void);
+void kernel_fpu_end(enum intr_status old_status);
+void fpu_memcpy(void* dst, const void* src, uint32_t size);
+#endif
@@ -9,19 +9,39 @@
 #include "tss.h"
 #include "syscall_init.h"
 #include "ide.h"
+#include "block.h"
+#include "ahci.h"
+#include "ramdisk.h"
+#include "virtio_blk.h"
 #include "fs.h"
+#include "softirq.h"
+#include "workqueue.h"
+#include "fpu.h"
+#include "trace.h"
+#include "pci.h"
 
 /* 负责初始化所有模块 */
 void init_all() {
     put_str("init_all\n");
     idt_init();         // 初始化中断
+    softirq_init();     // 初始化软中断
     timer_init();       // 初始化PIT
+    fpu_init();         // 开启FPU/SSE, 惰性切换
     mem_init();         // 内存初始化
     thread_init();      // 初始化主线程
+    trace_init();       // 初始化跟踪缓冲区
+    workqueue_init();   // 初始化工作队列及其工作线程
     console_init();     // 初始化显示终端
     keyboard_init();    // 初始化键盘
     tss_init();         // 初始化任务状态段
     syscall_init();     // 初始化系统调用
+    pci_init();         // 枚举pci设备
+    block_init();       // 初始化块设备层
     ide_init();         // 初始化ide
+    ahci_init();        // 初始化AHCI控制器上的SATA硬盘
+#ifdef CONFIG_RAMDISK
+    ramdisk_init();     // 创建RAM盘
+#endif
+    virtio_blk_init();  // 初始化virtio盘, 仅在qemu中存在
     filesys_init();     // 初始化文件系统
 }
\ No newline at end of file
@@ -173,6 +173,15 @@ void register_handler(uint8_t vector_no, intr_handler function) {
     idt_table[vector_no] = function;
 }
 
+/* 在8259A中打开外部中断irq(0~15), 供运行时才知道中断号的pci设备使用 */
+void pic_enable_irq(uint8_t irq) {
+    if (irq < 8) {
+        outb(PIC_M_DATA, inb(PIC_M_DATA) & ~(1 << irq));
+    } else {
+        outb(PIC_S_DATA, inb(PIC_S_DATA) & ~(1 << (irq - 8)));
+    }
+}
+
 /* 将中断状态设置为status */
 enum intr_status intr_set_status(enum intr_status status) {
     return status & INTR_ON ? intr_enable() : intr_disable();
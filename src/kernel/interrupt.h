@@ -19,4 +19,5 @@ enum intr_status intr_enable();
 enum intr_status intr_disable(void);
 
 void register_handler(uint8_t vector_no, intr_handler function);
+void pic_enable_irq(uint8_t irq);
 #endif
@@ -6,10 +6,13 @@
 #include "debug.h"
 #include "shell.h"
 #include "console.h"
-#include "ide.h"
+#include "block.h"
 
 void init(void);
 
+/* prog_no_arg在sda上的起始扇区, 须位于内核(第9扇区起KERNEL_SECTORS个)之后, 与command/compile.sh一致 */
+#define PROG_NO_ARG_LBA 400
+
 int main(void) {
    put_str("I am kernel\n");
    init_all();
@@ -17,9 +20,9 @@ int main(void) {
 /*************    写入应用程序    *************/
    uint32_t file_size = 4488; 
    uint32_t sec_cnt = DIV_ROUND_UP(file_size, 512);
-   struct disk* sda = &channels[0].device[0];
+   struct block_device* sda = block_find("sda");
    void* prog_buf = sys_malloc(file_size);
-   ide_read(sda, 300, prog_buf, sec_cnt);
+   block_read(sda, PROG_NO_ARG_LBA, prog_buf, sec_cnt);
    int32_t fd = sys_open("/prog_no_arg", O_CREAT|O_RDWR);
    if (fd != -1) {
       if(sys_write(fd, prog_buf, file_size) == -1) {
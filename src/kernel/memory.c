@@ -42,6 +42,8 @@ struct mem_block_desc k_block_descs[DESC_CNT];  // 内核内存块描述符数
 struct pool kernel_pool, user_pool; // 内核内存池和用户内存池
 struct virtual_addr kernel_vaddr;   // 管理内核的虚拟地址
 
+static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
+
 /* 在pf表示的虚拟内存池中申请pg_cnt个虚拟页，成功则返回虚拟页的起始地址，失败则返回NULL */
 static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
     int vaddr_start = 0, bit_idx_start = -1;
@@ -182,6 +184,46 @@ void* get_kernel_pages(uint32_t pg_cnt) {
     return vaddr;
 }
 
+/* 为内核线程申请pg_cnt页的栈, 栈的最低页之下再留一页虚拟地址不做映射作保护页,
+ * 栈溢出时会触发页错误而不是悄悄改写相邻内存. 成功返回栈的最低地址, 失败返回NULL */
+void* get_kernel_stack(uint32_t pg_cnt) {
+    lock_acquire(&kernel_pool.lock);
+    void* guard = vaddr_get(PF_KERNEL, pg_cnt + 1);
+    if (guard == NULL) {
+        lock_release(&kernel_pool.lock);
+        return NULL;
+    }
+
+    void* stack = (void*)((uint32_t)guard + PG_SIZE);
+    uint32_t vaddr = (uint32_t)stack, cnt = 0;
+    while (cnt < pg_cnt) {
+        void* page_phyaddr = palloc(&kernel_pool);
+        if (page_phyaddr == NULL) {     // 物理内存不足, 归还已申请的部分
+            if (cnt > 0) {
+                mfree_page(PF_KERNEL, stack, cnt);
+            }
+            vaddr_remove(PF_KERNEL, guard, 1);
+            vaddr_remove(PF_KERNEL, (void*)vaddr, pg_cnt - cnt);
+            lock_release(&kernel_pool.lock);
+            return NULL;
+        }
+        page_table_add((void*)vaddr, page_phyaddr);
+        vaddr += PG_SIZE;
+        cnt++;
+    }
+    lock_release(&kernel_pool.lock);
+    memset(stack, 0, pg_cnt * PG_SIZE);
+    return stack;
+}
+
+/* 释放get_kernel_stack申请的栈及其保护页 */
+void free_kernel_stack(void* stack, uint32_t pg_cnt) {
+    lock_acquire(&kernel_pool.lock);
+    mfree_page(PF_KERNEL, stack, pg_cnt);
+    vaddr_remove(PF_KERNEL, (void*)((uint32_t)stack - PG_SIZE), 1);
+    lock_release(&kernel_pool.lock);
+}
+
 /* 在用户内存空间中申请cnt页内存，并返回其虚拟地址 */
 void* get_user_pages(uint32_t pg_cnt) {
     lock_acquire(&user_pool.lock);
@@ -227,6 +269,27 @@ uint32_t addr_v2p(uint32_t vaddr) {
     return ((*pte & 0xfffff000) + (vaddr & 0x00000fff)); // 物理页起始地址+页内偏移
 }
 
+/* 将从物理地址phy_addr开始size字节的设备寄存器映射到内核空间, 不占用物理内存池.
+ * 成功返回phy_addr对应的虚拟地址, 失败返回NULL */
+void* ioremap(uint32_t phy_addr, uint32_t size) {
+    uint32_t pg_cnt = DIV_ROUND_UP((phy_addr & 0xfff) + size, PG_SIZE);
+    lock_acquire(&kernel_pool.lock);
+    void* vaddr_start = vaddr_get(PF_KERNEL, pg_cnt);
+    if (vaddr_start == NULL) {
+        lock_release(&kernel_pool.lock);
+        return NULL;
+    }
+    uint32_t vaddr = (uint32_t)vaddr_start, page_phyaddr = phy_addr & 0xfffff000;
+    while (pg_cnt-- > 0) {
+        page_table_add((void*)vaddr, (void*)page_phyaddr);
+        *pte_ptr(vaddr) |= PG_PCD;  // 寄存器的读写必须直达设备
+        vaddr += PG_SIZE;
+        page_phyaddr += PG_SIZE;
+    }
+    lock_release(&kernel_pool.lock);
+    return (void*)((uint32_t)vaddr_start + (phy_addr & 0xfff));
+}
+
 /* 初始化内存池 */
 static void mem_pool_init(uint32_t all_mem) {
     put_str("    mem_pool_init start\n");
@@ -290,6 +353,8 @@ static void mem_pool_init(uint32_t all_mem) {
     /* 初始化内存池的锁 */
     lock_init(&kernel_pool.lock);
     lock_init(&user_pool.lock);
+    lock_stat_register(&kernel_pool.lock, "kernel_pool");
+    lock_stat_register(&user_pool.lock, "user_pool");
 
     /* 下面初始化内核虚拟地址的位图，按实际物理内存大小生成数组 */
     kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;    // 用于维护内核堆的虚拟地址,所以要和内核内存池大小一致
@@ -15,6 +15,7 @@ enum pool_flags {
 #define PG_RW_W 2   // R/W属性位值，读/写/执行
 #define PG_US_S 0   // U/S属性位值，系统级
 #define PG_US_U 4   // U/S属性位值，用户级
+#define PG_PCD  0x10    // PCD属性位, 置1时不缓存该页, 用于映射设备寄存器
 
 /* 虚拟地址池，用于虚拟地址管理 */
 struct virtual_addr {
@@ -43,8 +44,11 @@ uint32_t* pde_ptr(uint32_t vaddr);
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt);
 void* get_kernel_pages(uint32_t pg_cnt);
 void* get_user_pages(uint32_t pg_cnt);
+void* get_kernel_stack(uint32_t pg_cnt);
+void free_kernel_stack(void* stack, uint32_t pg_cnt);
 void* get_a_page(enum pool_flags pf, uint32_t vaddr);
 uint32_t addr_v2p(uint32_t vaddr);
+void* ioremap(uint32_t phy_addr, uint32_t size);
 void block_desc_init(struct mem_block_desc* desc_array);
 void* sys_malloc(uint32_t size);
 void mem_init(void);
@@ -0,0 +1,80 @@
+#include "softirq.h"
+#include "global.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "atomic.h"
+#include "thread.h"
+#include "trace.h"
+
+#define SOFTIRQ_RESTART_MAX 10  // 一次irq_exit中最多重复处理的轮数, 防止中断风暴时饿死线程
+
+static softirq_action* softirq_vec[NR_SOFTIRQS];    // 各软中断的处理函数
+static volatile uint32_t softirq_pending;           // 待处理的软中断位图
+static bool softirq_running;                        // 是否正在处理软中断
+
+/* 初始化软中断 */
+void softirq_init(void) {
+    softirq_pending = 0;
+    softirq_running = false;
+}
+
+/* 注册软中断nr的处理函数 */
+void open_softirq(enum softirq_nr nr, softirq_action* action) {
+    ASSERT(nr < NR_SOFTIRQS);
+    softirq_vec[nr] = action;
+}
+
+/* 标记软中断nr待处理, 可在中断处理程序中调用 */
+void raise_softirq(enum softirq_nr nr) {
+    ASSERT(nr < NR_SOFTIRQS);
+    atomic_or(&softirq_pending, 1 << nr);
+}
+
+/* 是否处于软中断上下文, 此时不能阻塞, 也不应被调度走 */
+bool in_softirq(void) {
+    return softirq_running;
+}
+
+/* 开中断处理所有待处理的软中断, 调用时须关中断 */
+static void do_softirq(void) {
+    uint32_t restart = 0;
+    softirq_running = true;
+    uint32_t pending;
+    while ((pending = atomic_xchg(&softirq_pending, 0)) != 0 && restart++ < SOFTIRQ_RESTART_MAX) {
+        /* 处理期间开中断, 新到的硬中断只会置位pending, 由下一轮处理 */
+        intr_enable();
+        uint32_t nr = 0;
+        while (pending != 0) {
+            if ((pending & 1) && softirq_vec[nr] != NULL) {
+                softirq_vec[nr]();
+            }
+            pending >>= 1;
+            nr++;
+        }
+        intr_disable();
+    }
+    /* 超过轮数时剩下的等下一次中断返回时再处理 */
+    if (pending != 0) {
+        atomic_or(&softirq_pending, pending);
+    }
+    softirq_running = false;
+}
+
+/* 由kernel.S在调用中断处理函数前调用 */
+void irq_enter(uint8_t vec_nr) {
+    TRACE(TRACE_IRQ_ENTRY, vec_nr, 0);
+}
+
+/* 由kernel.S在中断处理函数返回后调用, 此时仍为关中断.
+ * 只有外部中断返回时才处理软中断和抢占, 软中断处理中再来的中断不会嵌套处理 */
+void irq_exit(uint8_t vec_nr) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    TRACE(TRACE_IRQ_EXIT, vec_nr, 0);
+    if (vec_nr < 0x20 || softirq_running) {
+        return;
+    }
+    if (softirq_pending != 0) {
+        do_softirq();
+    }
+    preempt_schedule_irq();
+}
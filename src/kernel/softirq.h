@@ -0,0 +1,24 @@
+#ifndef __KERNEL_SOFTIRQ_H
+#define __KERNEL_SOFTIRQ_H
+#include "stdint.h"
+#include "global.h"
+
+/* 软中断号, 数值越小越先处理 */
+enum softirq_nr {
+    SOFTIRQ_TIMER,      // 时钟, 处理到期的延迟工作
+    SOFTIRQ_BLOCK,      // 块设备, 处理硬盘命令完成
+    SOFTIRQ_VIRTIO_BLK, // virtio块设备, 唤醒派发线程回收已完成的命令
+    SOFTIRQ_AHCI,       // AHCI硬盘, 唤醒有命令完成的端口的派发线程
+    SOFTIRQ_KEYBOARD,   // 键盘, 解码扫描码
+    NR_SOFTIRQS
+};
+
+typedef void softirq_action(void);
+
+void softirq_init(void);
+void open_softirq(enum softirq_nr nr, softirq_action* action);
+void raise_softirq(enum softirq_nr nr);
+bool in_softirq(void);
+void irq_enter(uint8_t vec_nr);
+void irq_exit(uint8_t vec_nr);
+#endif
@@ -0,0 +1,176 @@
+#include "trace.h"
+#include "global.h"
+#include "atomic.h"
+#include "memory.h"
+#include "thread.h"
+#include "timer.h"
+#include "block.h"
+#include "string.h"
+#include "syscall.h"
+#include "stdio_kernel.h"
+#include "print.h"
+#include "debug.h"
+#include "fs.h"
+
+#define TRACE_SHOW_EVENTS 32    // trace show时显示的最近事件数
+
+bool trace_on;                              // 是否记录事件
+static struct trace_event* trace_buf;       // 环形缓冲区
+static volatile uint32_t trace_head;        // 写过的事件总数, 对槽数取余即下一条的位置
+
+static const char* trace_type_name[NR_TRACE_TYPES] = {
+    "none", "switch", "block", "unblock", "irq", "irq_ret",
+    "syscall", "sys_ret", "ide_cmd", "ide_done"
+};
+
+/* 初始化跟踪缓冲区, 须在thread_init之后调用, 记录时要用到当前任务的pid */
+void trace_init(void) {
+    put_str("trace_init start\n");
+    trace_head = 0;
+    trace_buf = get_kernel_pages(TRACE_BUF_PAGES);
+    /* 分配不到缓冲区时不开启跟踪, 其余功能不受影响 */
+    trace_on = (trace_buf != NULL);
+    put_str("trace_init done\n");
+}
+
+/* 记录一条事件. 不加锁也不关中断:
+ * 先用一条原子加法占住槽位, 之后即使被中断嵌套记录, 各自写各自的槽 */
+void trace_record(enum trace_type type, uint32_t arg0, uint32_t arg1) {
+    uint32_t idx = atomic_fetch_add(&trace_head, 1);
+    struct trace_event* ev = &trace_buf[idx & (TRACE_BUF_EVENTS - 1)];
+    ev->tsc = rdtsc32();
+    ev->type = type;
+    ev->pid = running_thread()->pid;
+    ev->arg0 = arg0;
+    ev->arg1 = arg1;
+}
+
+/* 由kernel.S中的syscall_handler在调用处理函数前后调用 */
+void syscall_trace_enter(uint32_t nr) {
+    TRACE(TRACE_SYSCALL_ENTRY, nr, 0);
+}
+
+void syscall_trace_exit(uint32_t ret) {
+    TRACE(TRACE_SYSCALL_EXIT, ret, 0);
+}
+
+/* 用于list_traversal的回调, 把任务名记入导出头部 */
+static bool record_task_name(struct list_elem* pelem, int arg) {
+    struct trace_header* hdr = (struct trace_header*)arg;
+    if (hdr->name_cnt == TRACE_NAMES_MAX) {
+        return true;
+    }
+    struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
+    struct trace_name* tn = &hdr->names[hdr->name_cnt++];
+    tn->pid = pthread->pid;
+    strcpy(tn->name, pthread->name);
+    return false;
+}
+
+/* 将缓冲区写入sda上的保留区域, 由主机端的tools/trace.py解析 */
+static int32_t trace_dump(void) {
+    struct block_device* sda = block_find("sda");
+    if (sda == NULL) {
+        printk("trace dump: no disk\n");
+        return -1;
+    }
+    struct trace_header* hdr = get_kernel_pages(1);
+    if (hdr == NULL) {
+        printk("trace dump: alloc memory failed\n");
+        return -1;
+    }
+    ASSERT(sizeof(struct trace_header) <= SECTOR_SIZE);
+    hdr->magic = TRACE_MAGIC;
+    hdr->event_size = sizeof(struct trace_event);
+    hdr->nr_slots = TRACE_BUF_EVENTS;
+    hdr->head = trace_head;
+    hdr->tsc_per_us = tsc_per_us;
+    hdr->ticks = ticks;
+    hdr->name_cnt = 0;
+    list_traversal(&thread_all_list, record_task_name, (int)hdr);
+
+    /* 头部与缓冲区扇区相接, 攒在一起异步提交, 合并成一个请求写出 */
+    struct bio bios[2];
+    struct completion done;
+    completion_init(&done);
+    bio_init(&bios[0], sda, TRACE_DISK_LBA, hdr, 1, true);
+    bio_init(&bios[1], sda, TRACE_DISK_LBA + 1, trace_buf, TRACE_BUF_PAGES * PG_SIZE / SECTOR_SIZE, true);
+    struct blk_plug plug;
+    blk_start_plug(&plug);
+    uint32_t idx = 0;
+    while (idx < 2) {
+        bios[idx].end_io = bio_end_complete;
+        bios[idx].private = &done;
+        submit_bio(&bios[idx]);
+        idx++;
+    }
+    blk_finish_plug(&plug);
+    wait_for_completion(&done);
+    wait_for_completion(&done);
+
+    int32_t ret = 0;
+    if (bios[0].error != 0 || bios[1].error != 0) {
+        printk("trace dump: write %s failed\n", sda->name);
+        ret = -1;
+    } else {
+        printk("trace dump: %d events written to %s lba 0x%x\n", \
+               hdr->head < TRACE_BUF_EVENTS ? hdr->head : TRACE_BUF_EVENTS, sda->name, TRACE_DISK_LBA);
+    }
+    mfree_page(PF_KERNEL, hdr, 1);
+    return ret;
+}
+
+/* 在屏幕上显示最近的事件, 时间为相对最新一条事件的微秒数 */
+static void trace_show(void) {
+    uint32_t head = trace_head;
+    uint32_t cnt = head < TRACE_SHOW_EVENTS ? head : TRACE_SHOW_EVENTS;
+    if (cnt == 0) {
+        printk("trace: empty\n");
+        return;
+    }
+    uint32_t newest = trace_buf[(head - 1) & (TRACE_BUF_EVENTS - 1)].tsc;
+    uint32_t idx = head - cnt;
+    while (idx != head) {
+        struct trace_event* ev = &trace_buf[idx & (TRACE_BUF_EVENTS - 1)];
+        const char* name = ev->type < NR_TRACE_TYPES ? trace_type_name[ev->type] : "?";
+        printk("-%dus pid %d %s 0x%x 0x%x\n", tsc_to_us(newest - ev->tsc), ev->pid, name, ev->arg0, ev->arg1);
+        idx++;
+    }
+}
+
+/* 跟踪控制, cmd为enum trace_cmd */
+int32_t sys_trace(uint32_t cmd) {
+    if (trace_buf == NULL) {
+        printk("trace: no trace buffer\n");
+        return -1;
+    }
+    int32_t ret = 0;
+    bool old_on = trace_on;
+    switch (cmd) {
+        case TRACE_CMD_OFF:
+            trace_on = false;
+            break;
+        case TRACE_CMD_ON:
+            trace_on = true;
+            break;
+        case TRACE_CMD_CLEAR:
+            trace_on = false;
+            trace_head = 0;
+            trace_on = old_on;
+            break;
+        case TRACE_CMD_DUMP:
+            /* 导出期间暂停记录, 保证导出的是同一时刻的快照 */
+            trace_on = false;
+            ret = trace_dump();
+            trace_on = old_on;
+            break;
+        case TRACE_CMD_SHOW:
+            trace_on = false;
+            trace_show();
+            trace_on = old_on;
+            break;
+        default:
+            ret = -1;
+    }
+    return ret;
+}
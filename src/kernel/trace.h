@@ -0,0 +1,74 @@
+#ifndef __KERNEL_TRACE_H
+#define __KERNEL_TRACE_H
+#include "stdint.h"
+#include "global.h"
+
+/* 跟踪事件类型 */
+enum trace_type {
+    TRACE_NONE,
+    TRACE_SWITCH,           // 线程切换, arg0为换上的pid, arg1为换下线程的状态
+    TRACE_BLOCK,            // 线程阻塞, arg0为阻塞后的状态
+    TRACE_UNBLOCK,          // 唤醒线程, arg0为被唤醒的pid
+    TRACE_IRQ_ENTRY,        // 进入中断, arg0为中断号
+    TRACE_IRQ_EXIT,         // 中断处理函数返回, arg0为中断号
+    TRACE_SYSCALL_ENTRY,    // 进入系统调用, arg0为调用号
+    TRACE_SYSCALL_EXIT,     // 系统调用返回, arg0为返回值
+    TRACE_IDE_ISSUE,        // 向硬盘发出命令, arg0为起始扇区, arg1低8位为扇区数, 最高位为1表示写
+    TRACE_IDE_DONE,         // 硬盘完成命令, arg0为中断号
+    NR_TRACE_TYPES
+};
+
+/* 跟踪缓冲区中的一条记录, 固定16字节 */
+struct trace_event {
+    uint32_t tsc;           // 时间戳计数的低32位, 由导出工具处理回绕
+    uint16_t type;          // enum trace_type
+    int16_t pid;            // 记录事件时正在运行的任务
+    uint32_t arg0;
+    uint32_t arg1;
+};
+
+#define TRACE_BUF_PAGES     16
+#define TRACE_BUF_EVENTS    (TRACE_BUF_PAGES * PG_SIZE / sizeof(struct trace_event))  // 须为2的幂
+
+/* 导出到启动盘sda上的保留区域, 位于hd60M.img末尾, 远离kernel.bin.
+ * 第一个扇区为struct trace_header, 之后是整个环形缓冲区 */
+#define TRACE_DISK_LBA      0x1d000
+#define TRACE_MAGIC         0x43415254  // "TRAC"
+#define TRACE_NAMES_MAX     22          // 头部扇区中最多记录的任务名数
+
+/* 导出时的任务名快照, 供主机端工具把pid翻译成名字 */
+struct trace_name {
+    int16_t pid;
+    int16_t pad;
+    char name[16];
+};
+
+/* 导出区域的头部, 恰好占一个扇区 */
+struct trace_header {
+    uint32_t magic;
+    uint32_t event_size;                // sizeof(struct trace_event)
+    uint32_t nr_slots;                  // 环形缓冲区的槽数
+    uint32_t head;                      // 写过的事件总数, 最旧的事件在head-nr_slots处
+    uint32_t tsc_per_us;                // 每微秒的时间戳计数
+    uint32_t ticks;                     // 导出时的嘀嗒数
+    uint32_t name_cnt;
+    uint32_t reserved;
+    struct trace_name names[TRACE_NAMES_MAX];
+};
+
+extern bool trace_on;
+
+/* 关闭跟踪时只多一次判断, 不进入trace_record */
+#define TRACE(type, arg0, arg1)                         \
+    do {                                                \
+        if (trace_on) {                                 \
+            trace_record(type, (uint32_t)(arg0), (uint32_t)(arg1)); \
+        }                                               \
+    } while (0)
+
+void trace_init(void);
+void trace_record(enum trace_type type, uint32_t arg0, uint32_t arg1);
+void syscall_trace_enter(uint32_t nr);
+void syscall_trace_exit(uint32_t ret);
+int32_t sys_trace(uint32_t cmd);
+#endif
@@ -0,0 +1,46 @@
+#ifndef __LIB_KERNEL_ATOMIC_H
+#define __LIB_KERNEL_ATOMIC_H
+#include "stdint.h"
+
+/******************** 原子操作 ********************
+ * 单条带lock前缀(或隐含lock的xchg)的指令,
+ * 无须关中断即可保证读-改-写不被打断,
+ * 用作锁、计数器等的无竞争快速路径。
+ **************************************************/
+
+/* 将*ptr置为val, 返回*ptr原来的值 */
+static inline uint32_t atomic_xchg(volatile uint32_t* ptr, uint32_t val) {
+    // xchg操作内存时隐含lock前缀
+    asm volatile("xchgl %0, %1":"+r"(val), "+m"(*ptr)::"memory");
+    return val;
+}
+
+/* 若*ptr等于old则将其置为new, 返回*ptr原来的值 */
+static inline uint32_t atomic_cmpxchg(volatile uint32_t* ptr, uint32_t old, uint32_t new) {
+    uint32_t prev;
+    asm volatile("lock cmpxchgl %2, %1":"=a"(prev), "+m"(*ptr):"r"(new), "0"(old):"memory");
+    return prev;
+}
+
+/* *ptr加1 */
+static inline void atomic_inc(volatile uint32_t* ptr) {
+    asm volatile("lock incl %0":"+m"(*ptr)::"memory");
+}
+
+/* *ptr减1 */
+static inline void atomic_dec(volatile uint32_t* ptr) {
+    asm volatile("lock decl %0":"+m"(*ptr)::"memory");
+}
+
+/* *ptr按位或上val */
+static inline void atomic_or(volatile uint32_t* ptr, uint32_t val) {
+    asm volatile("lock orl %1, %0":"+m"(*ptr):"r"(val):"memory");
+}
+
+/* *ptr加上val, 返回*ptr原来的值 */
+static inline uint32_t atomic_fetch_add(volatile uint32_t* ptr, uint32_t val) {
+    asm volatile("lock xaddl %0, %1":"+r"(val), "+m"(*ptr)::"memory");
+    return val;
+}
+
+#endif
@@ -21,6 +21,11 @@ static inline void outb(uint16_t port, uint8_t data) {  // static表示该函数
     asm volatile("outb %b0, %w1"::"a"(data), "Nd"(port));
 }
 
+/* 向端口port写入一个字 */
+static inline void outw(uint16_t port, uint16_t data) {
+    asm volatile("outw %w0, %w1"::"a"(data), "Nd"(port));
+}
+
 /* 将addr处起始的word_cnt个字写入端口port*/
 static inline void outsw(uint16_t port, const void* addr, uint32_t word_cnt) {
     // outsw 是把 ds:esi 处的 16 位的内容写入 port 端口
@@ -36,10 +41,39 @@ static inline uint8_t inb(uint16_t port) {
     return data;
 }
 
+/* 将从端口port读入的一个字返回 */
+static inline uint16_t inw(uint16_t port) {
+    uint16_t data;
+    asm volatile("inw %w1, %w0":"=a"(data):"Nd"(port));
+    return data;
+}
+
 /* 将从端口port读入的word_cnt个字写入addr */
 static inline void insw(uint16_t port, void* addr, uint32_t word_cnt) {
     // insw 是将从端口 port 处读入的 16 位内容写入 es:edi 指向的内存
     asm volatile("cld; rep insw":"+D"(addr), "+c"(word_cnt):"d"(port):"memory");
 }
 
+/* 将addr处起始的dword_cnt个双字写入端口port */
+static inline void outsl(uint16_t port, const void* addr, uint32_t dword_cnt) {
+    asm volatile("cld; rep outsl":"+S"(addr), "+c"(dword_cnt): "d"(port));
+}
+
+/* 将从端口port读入的dword_cnt个双字写入addr */
+static inline void insl(uint16_t port, void* addr, uint32_t dword_cnt) {
+    asm volatile("cld; rep insl":"+D"(addr), "+c"(dword_cnt):"d"(port):"memory");
+}
+
+/* 向端口port写入一个双字 */
+static inline void outl(uint16_t port, uint32_t data) {
+    asm volatile("outl %0, %w1"::"a"(data), "Nd"(port));
+}
+
+/* 从端口port读入一个双字 */
+static inline uint32_t inl(uint16_t port) {
+    uint32_t data;
+    asm volatile("inl %w1, %0":"=a"(data):"Nd"(port));
+    return data;
+}
+
 #endif
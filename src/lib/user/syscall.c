@@ -162,4 +162,44 @@ void help(void) {
 int execv(const char *pathname, char **argv)
 {
     return _syscall2(SYS_EXECV, pathname, argv);
-}
\ No newline at end of file
+}
+
+/* 显示锁的竞争统计 */
+void lockstat(void) {
+   _syscall0(SYS_LOCKSTAT);
+}
+
+/* 控制内核跟踪缓冲区 */
+int32_t trace(uint32_t cmd) {
+   return _syscall1(SYS_TRACE, cmd);
+}
+
+/* 设置pid的调度策略, pid为0表示自己 */
+int32_t sched_setattr(pid_t pid, struct sched_attr *attr) {
+   return _syscall2(SYS_SCHED_SETATTR, pid, attr);
+}
+
+/* 显示块设备的I/O统计, name为NULL时列出全部 */
+int32_t iostat(const char *name) {
+   return _syscall1(SYS_IOSTAT, name);
+}
+
+/* 把缓存的脏数据全部写入硬盘 */
+int32_t sync(void) {
+   return _syscall0(SYS_SYNC);
+}
+
+/* 把文件fd的脏数据写入硬盘 */
+int32_t fsync(int32_t fd) {
+   return _syscall1(SYS_FSYNC, fd);
+}
+
+/* 为文件fd预先分配能容纳len字节的硬盘空间, 文件大小不变 */
+int32_t fallocate(int32_t fd, uint32_t len) {
+   return _syscall2(SYS_FALLOCATE, fd, len);
+}
+
+/* 在未挂载的分区part_name上重新创建文件系统, block_size为0时用默认块大小 */
+int32_t mkfs(const char *part_name, uint32_t block_size) {
+   return _syscall2(SYS_MKFS, part_name, block_size);
+}
@@ -29,6 +29,23 @@ enum SYSCALL_NR {
    SYS_PS,
    SYS_HELP,
    SYS_EXECV,
+   SYS_LOCKSTAT,
+   SYS_TRACE,
+   SYS_SCHED_SETATTR,
+   SYS_IOSTAT,
+   SYS_SYNC,
+   SYS_FSYNC,
+   SYS_FALLOCATE,
+   SYS_MKFS,
+};
+
+/* trace系统调用的命令 */
+enum trace_cmd {
+   TRACE_CMD_OFF,       // 停止记录
+   TRACE_CMD_ON,        // 开始记录
+   TRACE_CMD_CLEAR,     // 清空缓冲区
+   TRACE_CMD_DUMP,      // 导出到硬盘的保留区域
+   TRACE_CMD_SHOW       // 在屏幕上显示最近的事件
 };
 
 uint32_t getpid(void);
@@ -56,4 +73,12 @@ void ps(void);
 /* 显示系统支持的命令 */
 void help(void);
 int execv(const char *pathname, char **argv);
+void lockstat(void);
+int32_t trace(uint32_t cmd);
+int32_t sched_setattr(pid_t pid, struct sched_attr *attr);
+int32_t iostat(const char *name);
+int32_t sync(void);
+int32_t fsync(int32_t fd);
+int32_t fallocate(int32_t fd, uint32_t len);
+int32_t mkfs(const char *part_name, uint32_t block_size);
 #endif
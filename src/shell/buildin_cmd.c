@@ -270,6 +270,108 @@ void buildin_ps(uint32_t argc, char **argv UNUSED)
     ps();
 }
 
+/* lockstat命令内建函数 */
+void buildin_lockstat(uint32_t argc, char **argv UNUSED)
+{
+    if (argc != 1)
+    {
+        printf("lockstat: no argument support!\n");
+        return;
+    }
+    lockstat();
+}
+
+/* trace命令内建函数 */
+void buildin_trace(uint32_t argc, char **argv)
+{
+    if (argc != 2)
+    {
+        printf("usage: trace on|off|clear|show|dump\n");
+        return;
+    }
+    if (!strcmp(argv[1], "on"))
+    {
+        trace(TRACE_CMD_ON);
+    }
+    else if (!strcmp(argv[1], "off"))
+    {
+        trace(TRACE_CMD_OFF);
+    }
+    else if (!strcmp(argv[1], "clear"))
+    {
+        trace(TRACE_CMD_CLEAR);
+    }
+    else if (!strcmp(argv[1], "show"))
+    {
+        trace(TRACE_CMD_SHOW);
+    }
+    else if (!strcmp(argv[1], "dump"))
+    {
+        trace(TRACE_CMD_DUMP);
+    }
+    else
+    {
+        printf("trace: unknown command %s\n", argv[1]);
+    }
+}
+
+/* iostat命令内建函数, 不带参数时列出所有设备和分区, 带参数时显示其延迟直方图 */
+void buildin_iostat(uint32_t argc, char **argv)
+{
+    if (argc > 2)
+    {
+        printf("usage: iostat [device|partition]\n");
+        return;
+    }
+    if (iostat(argc == 2 ? argv[1] : NULL) == -1)
+    {
+        printf("iostat: %s not found\n", argv[1]);
+    }
+}
+
+/* sync命令内建函数 */
+void buildin_sync(uint32_t argc, char **argv UNUSED)
+{
+    if (argc != 1)
+    {
+        printf("sync: no argument support!\n");
+        return;
+    }
+    if (sync() == -1)
+    {
+        printf("sync: write back failed\n");
+    }
+}
+
+/* mkfs命令内建函数 */
+void buildin_mkfs(uint32_t argc, char **argv)
+{
+    if (argc != 2 && argc != 3)
+    {
+        printf("usage: mkfs partition [512|1024|2048|4096]\n");
+        return;
+    }
+    uint32_t block_size = 0;
+    if (argc == 3)
+    {
+        char *p = argv[2];
+        while (*p >= '0' && *p <= '9')
+        {
+            block_size = block_size * 10 + (*p - '0');
+            p++;
+        }
+        if (*p != 0 || block_size == 0)
+        {
+            printf("mkfs: bad block size %s\n", argv[2]);
+            return;
+        }
+    }
+    if (mkfs(argv[1], block_size) == -1)
+    {
+        printf("mkfs: format %s failed\n", argv[1]);
+    }
+}
+
 /* clear命令内建函数 */
 void buildin_clear(uint32_t argc, char **argv UNUSED)
 {
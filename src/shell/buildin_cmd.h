@@ -6,6 +6,11 @@ void buildin_pwd(uint32_t argc, char **argv UNUSED);
 char *buildin_cd(uint32_t argc, char **argv);
 void buildin_ls(uint32_t argc, char **argv);
 void buildin_ps(uint32_t argc, char **argv UNUSED);
+void buildin_lockstat(uint32_t argc, char **argv UNUSED);
+void buildin_trace(uint32_t argc, char **argv);
+void buildin_iostat(uint32_t argc, char **argv);
+void buildin_sync(uint32_t argc, char **argv UNUSED);
+void buildin_mkfs(uint32_t argc, char **argv);
 void buildin_clear(uint32_t argc, char **argv UNUSED);
 int32_t buildin_mkdir(uint32_t argc, char **argv);
 int32_t buildin_rmdir(uint32_t argc, char **argv);
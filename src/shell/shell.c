@@ -174,6 +174,26 @@ void my_shell(void)
         {
             buildin_ps(argc, argv);
         }
+        else if (!strcmp("lockstat", argv[0]))
+        {
+            buildin_lockstat(argc, argv);
+        }
+        else if (!strcmp("trace", argv[0]))
+        {
+            buildin_trace(argc, argv);
+        }
+        else if (!strcmp("iostat", argv[0]))
+        {
+            buildin_iostat(argc, argv);
+        }
+        else if (!strcmp("sync", argv[0]))
+        {
+            buildin_sync(argc, argv);
+        }
+        else if (!strcmp("mkfs", argv[0]))
+        {
+            buildin_mkfs(argc, argv);
+        }
         else if (!strcmp("clear", argv[0]))
         {
             buildin_clear(argc, argv);
@@ -0,0 +1,111 @@
+#include "kthread.h"
+#include "global.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "sync.h"
+
+static struct list reap_list;   // 已退出且已分离, 等待回收的线程
+
+/* 初始化内核线程管理 */
+void kthread_init(void) {
+    list_init(&reap_list);
+}
+
+/* 释放已退出线程pthread的栈和PCB */
+static void kthread_free(struct task_struct* pthread) {
+    ASSERT(pthread->status == TASK_DIED);
+    enum intr_status old_status = intr_disable();
+    list_remove(&pthread->all_list_tag);
+    intr_set_status(old_status);
+    release_pid(pthread);
+    fpu_release(pthread);
+
+    if (pthread->kstack_base != NULL) {
+        free_kernel_stack(pthread->kstack_base, pthread->kstack_pages);
+    }
+    mfree_page(PF_KERNEL, pthread, 1);
+}
+
+/* 回收所有已退出的分离线程.
+ * 线程不能释放自己正在使用的栈, 只好留给之后创建或join线程的人来做 */
+void kthread_reap(void) {
+    while (1) {
+        enum intr_status old_status = intr_disable();
+        if (list_empty(&reap_list)) {
+            intr_set_status(old_status);
+            return;
+        }
+        struct task_struct* dead = elem2entry(struct task_struct, general_tag, list_pop(&reap_list));
+        intr_set_status(old_status);
+        kthread_free(dead);
+    }
+}
+
+/* 创建内核线程, 栈大小为stack_pages页.
+ * stack_pages不超过1时与thread_start相同, 栈与PCB共用一页;
+ * 否则栈单独分配, 且其下方留有保护页.
+ * 新线程默认可join, 须由kthread_join或kthread_detach处理, 失败返回NULL */
+struct task_struct* kthread_create(char* name, int prio, uint32_t stack_pages, thread_func function, void* func_arg) {
+    ASSERT(stack_pages <= KTHREAD_STACK_PAGES_MAX);
+    kthread_reap();
+
+    struct task_struct* thread = get_kernel_pages(1);
+    if (thread == NULL) {
+        return NULL;
+    }
+    init_thread(thread, name, prio);
+
+    if (stack_pages > 1) {
+        uint32_t* stack = get_kernel_stack(stack_pages);
+        if (stack == NULL) {
+            release_pid(thread);
+            mfree_page(PF_KERNEL, thread, 1);
+            return NULL;
+        }
+        thread->kstack_base = stack;
+        thread->kstack_pages = stack_pages;
+        thread->self_kstack = (uint32_t*)((uint32_t)stack + stack_pages * PG_SIZE);
+    }
+    thread->detached = false;
+
+    thread_create(thread, function, func_arg);
+    thread_enqueue(thread);
+    return thread;
+}
+
+/* 等待线程pthread退出并回收它, 此后pthread不可再被使用 */
+void kthread_join(struct task_struct* pthread) {
+    ASSERT(pthread != running_thread() && !pthread->detached);
+    /* exited在线程关中断切走之前才完成, 醒来时它已不再运行 */
+    wait_for_completion(&pthread->exited);
+    kthread_free(pthread);
+    kthread_reap();
+}
+
+/* 分离线程pthread, 它退出后自动回收, 不能再join */
+void kthread_detach(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(!pthread->detached);
+    pthread->detached = true;
+    if (completion_done(&pthread->exited)) {    // 已经退出了, 直接交给回收队列
+        list_append(&reap_list, &pthread->general_tag);
+    }
+    intr_set_status(old_status);
+}
+
+/* 当前线程退出, 线程函数返回时也会走到这里 */
+void kthread_exit(void) {
+    struct task_struct* cur = running_thread();
+    intr_disable();
+    if (cur->policy != SCHED_NORMAL) {
+        struct sched_attr normal = {SCHED_NORMAL, 0, 0, 0, 0};
+        thread_setscheduler(cur, &normal);  // 归还SCHED_DEADLINE的带宽
+    }
+    if (cur->detached) {
+        list_append(&reap_list, &cur->general_tag);
+    }
+    complete_all(&cur->exited);
+    thread_block(TASK_DIED);
+    PANIC("kthread_exit: dead thread was scheduled\n");
+}
@@ -0,0 +1,14 @@
+#ifndef __THREAD_KTHREAD_H
+#define __THREAD_KTHREAD_H
+#include "stdint.h"
+#include "thread.h"
+
+#define KTHREAD_STACK_PAGES_MAX 16  // 单个内核线程栈最多的页数
+
+void kthread_init(void);
+struct task_struct* kthread_create(char* name, int prio, uint32_t stack_pages, thread_func function, void* func_arg);
+void kthread_join(struct task_struct* pthread);
+void kthread_detach(struct task_struct* pthread);
+void kthread_exit(void);
+void kthread_reap(void);
+#endif
@@ -3,18 +3,102 @@
 #include "interrupt.h"
 #include "debug.h"
 #include "thread.h"
+#include "atomic.h"
+#include "timer.h"
+#include "stdio_kernel.h"
+
+static struct list lock_stat_list;      // 登记了竞争统计的锁
+static bool lock_stat_list_ready = false;
+
+/* 初始化等待队列 */
+void wait_queue_init(struct wait_queue* wq) {
+    list_init(&wq->waiters);
+}
+
+/* 判断等待队列上是否没有线程 */
+bool wait_queue_empty(struct wait_queue* wq) {
+    return list_empty(&wq->waiters);
+}
+
+/* 当前线程在wq上睡眠, 调用前须关中断,
+ * 否则检查条件与睡眠之间可能漏掉唤醒 */
+void wait_queue_sleep(struct wait_queue* wq) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct task_struct* cur = running_thread();
+    ASSERT(!elem_find(&wq->waiters, &cur->general_tag));
+    list_append(&wq->waiters, &cur->general_tag);
+    thread_block(TASK_BLOCKED);
+}
+
+/* 将pthread按优先级插入wq, 同优先级的排在后面, 调用前须关中断 */
+static void wait_queue_insert_prio(struct wait_queue* wq, struct task_struct* pthread) {
+    struct list_elem* elem = wq->waiters.head.next;
+    while (elem != &wq->waiters.tail) {
+        struct task_struct* waiter = elem2entry(struct task_struct, general_tag, elem);
+        if (waiter->priority < pthread->priority) {
+            break;
+        }
+        elem = elem->next;
+    }
+    list_insert_before(elem, &pthread->general_tag);
+}
+
+/* 与wait_queue_sleep相同, 但按优先级排队, 唤醒时优先级高的先醒 */
+void wait_queue_sleep_prio(struct wait_queue* wq) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct task_struct* cur = running_thread();
+    ASSERT(!elem_find(&wq->waiters, &cur->general_tag));
+    wait_queue_insert_prio(wq, cur);
+    thread_block(TASK_BLOCKED);
+}
+
+/* 返回wq上队首线程的优先级, 队列为空时返回0 */
+static uint8_t wait_queue_top_priority(struct wait_queue* wq) {
+    if (list_empty(&wq->waiters)) {
+        return 0;
+    }
+    struct task_struct* top = elem2entry(struct task_struct, general_tag, wq->waiters.head.next);
+    return top->priority;
+}
+
+/* 唤醒wq上等待最久的一个线程, 队列为空时返回false */
+bool wait_queue_wake_one(struct wait_queue* wq) {
+    enum intr_status old_status = intr_disable();
+    bool woken = false;
+    if (!list_empty(&wq->waiters)) {
+        thread_unblock(elem2entry(struct task_struct, general_tag, list_pop(&wq->waiters)));
+        woken = true;
+    }
+    intr_set_status(old_status);
+    return woken;
+}
+
+/* 唤醒wq上的全部线程 */
+void wait_queue_wake_all(struct wait_queue* wq) {
+    enum intr_status old_status = intr_disable();
+    while (!list_empty(&wq->waiters)) {
+        thread_unblock(elem2entry(struct task_struct, general_tag, list_pop(&wq->waiters)));
+    }
+    intr_set_status(old_status);
+}
 
 /* 初始化信号量 */
 void sema_init(struct semaphore* psema, uint8_t value) {
     psema->value = value;
-    list_init(&psema->waiters);
+    wait_queue_init(&psema->waiters);
 }
 
 /* 初始化锁 */
 void lock_init(struct lock* plock) {
+    plock->state = LOCK_FREE;
     plock->holder = NULL;
     plock->holder_repeat_nr = 0;
-    sema_init(&plock->semaphore, 1);  // 信号量初值为1
+    wait_queue_init(&plock->waiters);
+    plock->in_holder_list = false;
+    plock->name = NULL;
+    plock->contended_cnt = 0;
+    plock->wait_ticks_total = 0;
+    plock->wait_ticks_max = 0;
 }
 
 /* 信号量down操作 */
@@ -23,9 +107,7 @@ void sema_down(struct semaphore* psema) {
     enum intr_status old_status = intr_disable();
 
     while (psema->value == 0) {     // 若当前信号量（资源量）为0，则将线程放入waiter队列中，并将其阻塞
-        ASSERT(!elem_find(&psema->waiters, &running_thread()->general_tag));
-        list_append(&psema->waiters, &running_thread()->general_tag);   // 将当前线程阻塞
-        thread_block(TASK_BLOCKED);
+        wait_queue_sleep(&psema->waiters);
     }
 
     /* 若信号量为1或被唤醒后，执行下面代码，获得锁 */
@@ -39,10 +121,7 @@ void sema_up(struct semaphore* psema) {
     /* 关中断，保证原子操作 */
     enum intr_status old_status = intr_disable();
     ASSERT(psema->value == 0);
-    if (!list_empty(&psema->waiters)) {
-        struct task_struct* thread_blocked = elem2entry(struct task_struct, general_tag, list_pop(&psema->waiters));
-        thread_unblock(thread_blocked);
-    }
+    wait_queue_wake_one(&psema->waiters);
 
     psema->value++;
     ASSERT(psema->value == 1);
@@ -50,12 +129,149 @@ void sema_up(struct semaphore* psema) {
     intr_set_status(old_status);
 }
 
+/* 将plock登记到持有者的contended_locks中, 调用前须关中断 */
+static void lock_link_holder(struct lock* plock, struct task_struct* holder) {
+    if (!plock->in_holder_list) {
+        list_append(&holder->contended_locks, &plock->holder_tag);
+        plock->in_holder_list = true;
+    }
+}
+
+/* 优先级继承: 把等待plock的线程donor的优先级沿持有链传递下去,
+ * A等B持有的锁, B又在等C持有的锁时, B和C都会被提高.
+ * donor是实时任务时, 持有者还继承其调度策略, 否则普通的持有者会被其他实时任务无限期压住. 调用前须关中断 */
+static void lock_donate_priority(struct lock* plock, struct task_struct* donor) {
+    uint32_t depth = 0;
+    while (plock != NULL && depth++ < LOCK_PI_MAX_DEPTH) {
+        struct task_struct* holder = plock->holder;
+        if (holder == NULL) {   // 持有者刚通过快速路径拿到锁, 还未登记, 由它登记后自行继承
+            break;
+        }
+        lock_link_holder(plock, holder);
+        bool prio_up = holder->priority < donor->priority;
+        bool policy_up = sched_before(donor, holder);
+        if (!prio_up && !policy_up) {
+            break;
+        }
+        if (prio_up) {
+            thread_set_priority(holder, donor->priority);
+        }
+        if (policy_up) {
+            thread_pi_setscheduler(holder, donor);
+        }
+        /* 持有者自己也在等锁, 按新优先级调整它在等待队列中的位置 */
+        if (holder->status == TASK_BLOCKED && holder->blocked_on != NULL) {
+            list_remove(&holder->general_tag);
+            wait_queue_insert_prio(&holder->blocked_on->waiters, holder);
+        }
+        plock = holder->blocked_on;
+    }
+}
+
+/* 返回pthread所持锁上按有效策略最优先的实时等待者, 没有时返回NULL. 调用前须关中断 */
+struct task_struct* lock_top_rt_waiter(struct task_struct* pthread) {
+    struct task_struct* rt_top = NULL;
+    struct list_elem* elem = pthread->contended_locks.head.next;
+    while (elem != &pthread->contended_locks.tail) {
+        struct lock* plock = elem2entry(struct lock, holder_tag, elem);
+        /* 等待队列按priority排序, 实时等待者要逐个比较 */
+        struct list_elem* welem = plock->waiters.waiters.head.next;
+        while (welem != &plock->waiters.waiters.tail) {
+            struct task_struct* waiter = elem2entry(struct task_struct, general_tag, welem);
+            if (waiter->policy != SCHED_NORMAL && (rt_top == NULL || sched_before(waiter, rt_top))) {
+                rt_top = waiter;
+            }
+            welem = welem->next;
+        }
+        elem = elem->next;
+    }
+    return rt_top;
+}
+
+/* 重新计算pthread的有效优先级: 自身优先级与所持锁上最高等待者优先级的较大者.
+ * 有效调度策略同样取自身策略与所持锁上最优先的实时等待者中靠前的一个. 调用前须关中断 */
+static void lock_restore_priority(struct task_struct* pthread) {
+    uint8_t prio = pthread->base_priority;
+    struct list_elem* elem = pthread->contended_locks.head.next;
+    while (elem != &pthread->contended_locks.tail) {
+        struct lock* plock = elem2entry(struct lock, holder_tag, elem);
+        uint8_t top = wait_queue_top_priority(&plock->waiters);
+        if (top > prio) {
+            prio = top;
+        }
+        elem = elem->next;
+    }
+    if (prio != pthread->priority) {
+        thread_set_priority(pthread, prio);
+    }
+    struct task_struct* rt_donor = lock_top_rt_waiter(pthread);
+    if (rt_donor != NULL || thread_pi_boosted(pthread)) {
+        thread_pi_setscheduler(pthread, rt_donor);
+    }
+}
+
+/* 仍有线程在等plock, 它们的优先级和实时策略转而继承给持有者cur. 调用前须关中断 */
+static void lock_inherit_waiters(struct lock* plock, struct task_struct* cur) {
+    if (!wait_queue_empty(&plock->waiters)) {
+        lock_link_holder(plock, cur);
+        lock_restore_priority(cur);
+    }
+}
+
+/* 记录一次竞争等待 */
+static void lock_stat_account(struct lock* plock, uint32_t wait_ticks) {
+    plock->contended_cnt++;
+    plock->wait_ticks_total += wait_ticks;
+    if (wait_ticks > plock->wait_ticks_max) {
+        plock->wait_ticks_max = wait_ticks;
+    }
+}
+
+/* 锁的慢速路径：锁已被占用，阻塞等待持有者释放 */
+static void lock_acquire_slow(struct lock* plock) {
+    struct task_struct* cur = running_thread();
+    enum intr_status old_status = intr_disable();
+    uint32_t start_tick = ticks;
+    bool waited = false;
+    /* 先将锁标记为有等待者, 若交换前锁恰好空闲则直接获得锁.
+     * 被唤醒后同样以LOCK_CONTENDED抢锁, 保证释放者不会漏掉仍在等待的线程 */
+    while (atomic_xchg(&plock->state, LOCK_CONTENDED) != LOCK_FREE) {
+        cur->blocked_on = plock;
+        lock_donate_priority(plock, cur);
+        wait_queue_sleep_prio(&plock->waiters);
+        waited = true;
+    }
+    cur->blocked_on = NULL;
+    if (waited) {
+        lock_stat_account(plock, ticks - start_tick);
+    }
+
+    /* 开中断前登记持有者, 此后来的等待者都能把优先级捐赠给自己 */
+    plock->holder = cur;
+    ASSERT(!plock->in_holder_list);
+    lock_inherit_waiters(plock, cur);
+    intr_set_status(old_status);
+}
+
 /* 获取锁plock */
 void lock_acquire(struct lock* plock) {
+    struct task_struct* cur = running_thread();
     /* 排除曾经自己已经持有锁但还未将其释放的情况 */
-    if (plock->holder != running_thread()) {    // 锁的拥有者不是当前线程
-        sema_down(&plock->semaphore);   // 对信号量执行P操作，原子操作
-        plock->holder = running_thread();
+    if (plock->holder != cur) {    // 锁的拥有者不是当前线程
+        /* 快速路径: 无竞争时一条cmpxchg即可拿到锁, 无须关中断 */
+        if (atomic_cmpxchg(&plock->state, LOCK_FREE, LOCK_LOCKED) == LOCK_FREE) {
+            plock->holder = cur;
+            /* cmpxchg之后、登记holder之前被切换时, 其间排队的等待者找不到持有者, 没能捐赠优先级.
+             * 先登记holder再检查state, 有等待者就由自己补上继承 */
+            asm volatile ("":::"memory");
+            if (plock->state == LOCK_CONTENDED) {
+                enum intr_status old_status = intr_disable();
+                lock_inherit_waiters(plock, cur);
+                intr_set_status(old_status);
+            }
+        } else {
+            lock_acquire_slow(plock);   // 返回时已登记holder
+        }
         ASSERT(plock->holder_repeat_nr == 0);
         plock->holder_repeat_nr = 1;
     } else {
@@ -74,5 +290,182 @@ void lock_release(struct lock* plock) {
 
     plock->holder = NULL;
     plock->holder_repeat_nr = 0;
-    sema_up(&plock->semaphore);     // 信号量的V操作，原子操作
-}
\ No newline at end of file
+    /* 先清holder再检查in_holder_list, 此后等待者不会再把锁登记给自己 */
+    asm volatile ("":::"memory");
+    if (plock->in_holder_list) {
+        /* 有线程等过此锁, 自己可能继承过优先级, 释放后需要恢复 */
+        enum intr_status old_status = intr_disable();
+        list_remove(&plock->holder_tag);
+        plock->in_holder_list = false;
+        lock_restore_priority(running_thread());
+        intr_set_status(old_status);
+    }
+    /* 快速路径: 无等待者时一条xchg即可释放 */
+    if (atomic_xchg(&plock->state, LOCK_FREE) == LOCK_CONTENDED) {
+        wait_queue_wake_one(&plock->waiters);
+    }
+}
+
+/* 登记锁的名字, 此后其竞争统计会出现在sys_lockstat的输出中 */
+void lock_stat_register(struct lock* plock, const char* name) {
+    enum intr_status old_status = intr_disable();
+    if (!lock_stat_list_ready) {
+        list_init(&lock_stat_list);
+        lock_stat_list_ready = true;
+    }
+    ASSERT(plock->name == NULL);
+    plock->name = name;
+    list_append(&lock_stat_list, &plock->stat_tag);
+    intr_set_status(old_status);
+}
+
+/* 用于在list_traversal中输出一把锁的竞争统计 */
+static bool lock_stat_info(struct list_elem* pelem, int arg UNUSED) {
+    struct lock* plock = elem2entry(struct lock, stat_tag, pelem);
+    uint32_t avg = plock->contended_cnt == 0 ? 0 : plock->wait_ticks_total / plock->contended_cnt;
+    printk("   %s: contended %d, wait total %d avg %d max %d\n", plock->name,
+           plock->contended_cnt, plock->wait_ticks_total, avg, plock->wait_ticks_max);
+    return false;
+}
+
+/* 输出各锁的竞争统计, 等待时间以时钟嘀嗒为单位 */
+void sys_lockstat(void) {
+    printk("lock contention (wait in ticks):\n");
+    if (lock_stat_list_ready) {
+        list_traversal(&lock_stat_list, lock_stat_info, 0);
+    }
+}
+
+/* 初始化读写锁 */
+void rwlock_init(struct rwlock* prw) {
+    prw->readers = 0;
+    prw->writer = NULL;
+    prw->writers_waiting = 0;
+    wait_queue_init(&prw->read_waiters);
+    wait_queue_init(&prw->write_waiters);
+}
+
+/* 获取读锁, 有写者持有或等待时阻塞 */
+void rwlock_read_acquire(struct rwlock* prw) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(prw->writer != running_thread());     // 持有写锁时不能再申请读锁
+    while (prw->writer != NULL || prw->writers_waiting > 0) {
+        wait_queue_sleep(&prw->read_waiters);
+    }
+    prw->readers++;
+    intr_set_status(old_status);
+}
+
+/* 释放读锁, 最后一个读者负责唤醒一个写者 */
+void rwlock_read_release(struct rwlock* prw) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(prw->readers > 0);
+    if (--prw->readers == 0) {
+        wait_queue_wake_one(&prw->write_waiters);
+    }
+    intr_set_status(old_status);
+}
+
+/* 获取写锁, 有读者或写者持有时阻塞 */
+void rwlock_write_acquire(struct rwlock* prw) {
+    struct task_struct* cur = running_thread();
+    enum intr_status old_status = intr_disable();
+    ASSERT(prw->writer != cur);     // 写锁不可重入
+    while (prw->writer != NULL || prw->readers > 0) {
+        prw->writers_waiting++;
+        wait_queue_sleep(&prw->write_waiters);
+        prw->writers_waiting--;
+    }
+    prw->writer = cur;
+    intr_set_status(old_status);
+}
+
+/* 释放写锁, 优先唤醒下一个写者, 没有写者时唤醒全部读者 */
+void rwlock_write_release(struct rwlock* prw) {
+    enum intr_status old_status = intr_disable();
+    ASSERT(prw->writer == running_thread());
+    prw->writer = NULL;
+    if (!wait_queue_wake_one(&prw->write_waiters)) {
+        wait_queue_wake_all(&prw->read_waiters);
+    }
+    intr_set_status(old_status);
+}
+
+/* 初始化条件变量 */
+void cond_init(struct condition* cond) {
+    wait_queue_init(&cond->waiters);
+}
+
+/* 释放plock并在cond上睡眠, 被唤醒后重新获得plock再返回.
+ * 释放锁与睡眠在同一关中断区间内完成, 期间的cond_signal不会丢失.
+ * 醒来后条件未必成立, 调用者应在循环中检查条件 */
+void cond_wait(struct condition* cond, struct lock* plock) {
+    ASSERT(plock->holder == running_thread());
+    enum intr_status old_status = intr_disable();
+    /* 锁可能被重复持有, 需彻底释放, 醒来后再恢复重入次数 */
+    uint32_t repeat_nr = plock->holder_repeat_nr;
+    plock->holder_repeat_nr = 1;
+    lock_release(plock);
+    wait_queue_sleep(&cond->waiters);
+    intr_set_status(old_status);
+
+    lock_acquire(plock);
+    plock->holder_repeat_nr = repeat_nr;
+}
+
+/* 唤醒一个在cond上等待的线程 */
+void cond_signal(struct condition* cond) {
+    wait_queue_wake_one(&cond->waiters);
+}
+
+/* 唤醒所有在cond上等待的线程 */
+void cond_broadcast(struct condition* cond) {
+    wait_queue_wake_all(&cond->waiters);
+}
+
+/* 初始化完成量 */
+void completion_init(struct completion* x) {
+    x->done = 0;
+    wait_queue_init(&x->waiters);
+}
+
+/* 重新置为未完成, 以便再次使用, 此时不应有线程在等待 */
+void reinit_completion(struct completion* x) {
+    ASSERT(wait_queue_empty(&x->waiters));
+    x->done = 0;
+}
+
+/* 判断是否已完成 */
+bool completion_done(struct completion* x) {
+    return x->done != 0;
+}
+
+/* 等待x完成, 每次返回消耗一次complete */
+void wait_for_completion(struct completion* x) {
+    enum intr_status old_status = intr_disable();
+    while (x->done == 0) {
+        wait_queue_sleep(&x->waiters);
+    }
+    if (x->done != COMPLETION_DONE_ALL) {
+        x->done--;
+    }
+    intr_set_status(old_status);
+}
+
+/* 通知完成一次, 唤醒一个等待者 */
+void complete(struct completion* x) {
+    enum intr_status old_status = intr_disable();
+    if (x->done != COMPLETION_DONE_ALL) {
+        x->done++;
+    }
+    wait_queue_wake_one(&x->waiters);
+    intr_set_status(old_status);
+}
+
+/* 永久置为完成, 唤醒全部等待者, 之后的等待都立即返回 */
+void complete_all(struct completion* x) {
+    enum intr_status old_status = intr_disable();
+    x->done = COMPLETION_DONE_ALL;
+    wait_queue_wake_all(&x->waiters);
+    intr_set_status(old_status);
+}
@@ -2,27 +2,107 @@
 #define __THREAD_SYNC_H
 #include "list.h"
 #include "stdint.h"
-#include "thread.h"
+#include "interrupt.h"
+
+struct task_struct;
+
+/* 等待队列, 所有阻塞型同步原语的基础 */
+struct wait_queue {
+    struct list waiters;    // 在此队列上睡眠的线程
+};
+
+/* 关中断后反复检查condition, 不满足则在wq上睡眠, 直到condition成立.
+ * 检查与睡眠之间不会被中断打断, 因此不会丢失唤醒 */
+#define wait_event(wq, condition)                               \
+    do {                                                        \
+        enum intr_status __old_status = intr_disable();         \
+        while (!(condition)) {                                  \
+            wait_queue_sleep(wq);                               \
+        }                                                       \
+        intr_set_status(__old_status);                          \
+    } while (0)
 
 /* 信号量结构 */
 struct semaphore {
     uint8_t value;
-    struct list waiters;
+    struct wait_queue waiters;
 };
 
+/* 锁状态 */
+#define LOCK_FREE       0   // 空闲
+#define LOCK_LOCKED     1   // 已被持有, 无等待者
+#define LOCK_CONTENDED  2   // 已被持有, 可能有等待者
+
+/* 优先级继承沿持有链传递的最大深度, 防止死锁成环时无限循环 */
+#define LOCK_PI_MAX_DEPTH   8
 
 /* 锁结构 */
 struct lock {
+    volatile uint32_t state;        // 锁状态, 无竞争时只用一条cmpxchg修改
     struct task_struct* holder;     // 锁的持有者
-    struct semaphore semaphore;     // 用二元信号量实现锁
+    struct wait_queue waiters;      // 竞争失败而阻塞的线程, 按优先级从高到低排列
     uint32_t holder_repeat_nr;      // 锁的持有者重复申请锁的次数
+    struct list_elem holder_tag;    // 用于加入持有者的contended_locks队列
+    bool in_holder_list;            // 是否已在持有者的contended_locks中
+
+    /* 竞争统计, 仅lock_stat_register登记过的锁会被sys_lockstat输出 */
+    const char* name;               // 锁名
+    uint32_t contended_cnt;         // 因竞争而阻塞的次数
+    uint32_t wait_ticks_total;      // 累计等待的嘀嗒数
+    uint32_t wait_ticks_max;        // 单次最长等待的嘀嗒数
+    struct list_elem stat_tag;      // 用于加入lock_stat_list
 };
 
+/* 读写锁结构, 写者优先, 避免读多写少时写者饿死 */
+struct rwlock {
+    uint32_t readers;               // 当前持有读锁的线程数
+    struct task_struct* writer;     // 当前持有写锁的线程
+    uint32_t writers_waiting;       // 正在等待写锁的线程数
+    struct wait_queue read_waiters; // 等待读锁的线程
+    struct wait_queue write_waiters;// 等待写锁的线程
+};
+
+/* 完成量, 一方等待某件事完成, 另一方在事情完成时通知 */
+struct completion {
+    uint32_t done;                  // 已完成但还未被等待者消耗的次数
+    struct wait_queue waiters;      // 等待完成的线程
+};
+
+#define COMPLETION_DONE_ALL 0xffffffff  // complete_all之后done的值, 不再被消耗
+
+/* 条件变量, 须与struct lock配合使用 */
+struct condition {
+    struct wait_queue waiters;      // 等待条件成立的线程
+};
 
+void wait_queue_init(struct wait_queue* wq);
+bool wait_queue_empty(struct wait_queue* wq);
+void wait_queue_sleep(struct wait_queue* wq);
+void wait_queue_sleep_prio(struct wait_queue* wq);
+bool wait_queue_wake_one(struct wait_queue* wq);
+void wait_queue_wake_all(struct wait_queue* wq);
 void sema_init(struct semaphore* psema, uint8_t value);
 void lock_init(struct lock* plock);
 void sema_down(struct semaphore* psema);
 void sema_up(struct semaphore* psema);
 void lock_acquire(struct lock* plock);
 void lock_release(struct lock* plock);
+struct task_struct* lock_top_rt_waiter(struct task_struct* pthread);
+void lock_stat_register(struct lock* plock, const char* name);
+void sys_lockstat(void);
+void rwlock_init(struct rwlock* prw);
+void rwlock_read_acquire(struct rwlock* prw);
+void rwlock_read_release(struct rwlock* prw);
+void rwlock_write_acquire(struct rwlock* prw);
+void rwlock_write_release(struct rwlock* prw);
+void cond_init(struct condition* cond);
+void cond_wait(struct condition* cond, struct lock* plock);
+void cond_signal(struct condition* cond);
+void cond_broadcast(struct condition* cond);
+void completion_init(struct completion* x);
+void reinit_completion(struct completion* x);
+bool completion_done(struct completion* x);
+void wait_for_completion(struct completion* x);
+void complete(struct completion* x);
+void complete_all(struct completion* x);
 #endif
@@ -9,15 +9,38 @@
 #include "process.h"
 #include "sync.h"
 #include "file.h"
+#include "kthread.h"
+#include "timer.h"
+#include "softirq.h"
+#include "trace.h"
+#include "blk_queue.h"
 
 #define PG_SIZE 4096
 struct task_struct* idle_thread;        // idel线程
 struct task_struct* main_thread;        // 主线程的PCB
 struct list thread_ready_list;          // 就绪队列，调度器从中选出一个执行
 struct list thread_all_list;            // 所有任务队列
+static struct list thread_rt_list;      // SCHED_FIFO任务的就绪队列, 按rt_priority从高到低
+static struct list thread_dl_list;      // SCHED_DEADLINE任务的就绪队列, 按绝对截止期从早到晚
+static struct list dl_throttled_list;   // 本周期预算用完的SCHED_DEADLINE任务, 状态仍为TASK_READY
+static uint32_t dl_total_bw;            // 已接纳的SCHED_DEADLINE任务的总带宽
+static uint32_t rt_used_ticks;          // 本窗口中SCHED_FIFO任务已运行的嘀嗒数
+static uint32_t rt_window_end;          // 本窗口结束的时刻
+static bool rt_throttled;               // 本窗口SCHED_FIFO任务已用满RT_RUNTIME_TICKS
 static struct list_elem* thread_tag;    // 用于保存队列中的线程结点
+static struct task_struct* current_task;    // 当前运行的线程, 在schedule中切换前更新
+static uint32_t max_latency_all;            // 所有线程中唤醒到运行的最大延迟, 单位为时间戳计数
+static char max_latency_name[TASK_NAME_LEN];    // 出现该最大延迟的线程
 
-struct lock pid_lock;
+struct lock pid_lock;                   // 保护pid位图及pid哈希表
+
+/* pid位图, 已分配的pid对应位为1 */
+static uint8_t pid_bitmap_bits[MAX_PID / 8];
+static struct bitmap pid_bitmap = {MAX_PID / 8, pid_bitmap_bits};
+static pid_t next_pid = 1;                          // 下次从此处开始查找空闲pid, 避免刚释放的pid马上被重用
+static struct list pid_hash[PID_HASH_BUCKETS];      // pid到task_struct的哈希表, 按pid低位分桶
+
+#define pid_hashfn(pid) ((uint32_t)(pid) & (PID_HASH_BUCKETS - 1))
 
 extern void switch_to(struct task_struct* cur, struct task_struct* next);
 
@@ -32,6 +55,11 @@ static void idle(void* arg UNUSED) {
 
 /* 获取当前线程的PCB指针 */
 struct task_struct* running_thread() {
+    /* 线程的内核栈可能多于一页且不与PCB同页, 不能只靠esp推算 */
+    if (current_task != NULL) {
+        return current_task;
+    }
+    /* 主线程建立之前, 栈与PCB仍在同一页 */
     uint32_t esp;
     asm ("mov %%esp, %0":"=g"(esp));
     // esp指向PCB所在页的高地址端，取esp高20位，即PCB所在页的起始地址
@@ -43,15 +71,61 @@ static void kernel_thread(thread_func* function, void* func_arg) {
     /* 执行function前要开中断，避免后面的时钟中断被屏蔽，无法调度其他线程 */
     intr_enable(INTR_ON);
     function(func_arg);
+    /* 函数返回后线程退出, 栈上并没有可以返回的地址 */
+    kthread_exit();
+}
+
+/* 为pthread分配pid并将其加入pid哈希表.
+ * 从上次分配的位置向后循环查找空闲pid, 已释放的pid要等一轮之后才会被重用 */
+static pid_t allocate_pid(struct task_struct* pthread) {
+    lock_acquire(&pid_lock);
+    uint32_t bit_idx = next_pid;
+    uint32_t tries = 0;
+    while (bitmap_scan_test(&pid_bitmap, bit_idx)) {
+        if (++tries == MAX_PID) {
+            PANIC("allocate_pid: no free pid");
+        }
+        if (++bit_idx == MAX_PID) {
+            bit_idx = 1;    // pid 0不使用
+        }
+    }
+    bitmap_set(&pid_bitmap, bit_idx, 1);
+    next_pid = (bit_idx + 1 == MAX_PID) ? 1 : bit_idx + 1;
+
+    pthread->pid = bit_idx;
+    list_append(&pid_hash[pid_hashfn(bit_idx)], &pthread->pid_tag);
+    lock_release(&pid_lock);
+    return pthread->pid;
 }
 
-/* 分配pid */
-static pid_t allocate_pid(void) {
-    static pid_t next_pid = 0;      // 静态局部变量
+/* 释放pthread的pid并将其移出pid哈希表, 在回收PCB前调用 */
+void release_pid(struct task_struct* pthread) {
     lock_acquire(&pid_lock);
-    next_pid++;
+    ASSERT(bitmap_scan_test(&pid_bitmap, pthread->pid));
+    bitmap_set(&pid_bitmap, pthread->pid, 0);
+    list_remove(&pthread->pid_tag);
     lock_release(&pid_lock);
-    return next_pid;
+}
+
+/* 根据pid查找task_struct, 找不到返回NULL */
+struct task_struct* pid2thread(pid_t pid) {
+    if (pid <= 0) {
+        return NULL;
+    }
+    struct task_struct* found = NULL;
+    lock_acquire(&pid_lock);
+    struct list* bucket = &pid_hash[pid_hashfn(pid)];
+    struct list_elem* elem = bucket->head.next;
+    while (elem != &bucket->tail) {
+        struct task_struct* pthread = elem2entry(struct task_struct, pid_tag, elem);
+        if (pthread->pid == pid) {
+            found = pthread;
+            break;
+        }
+        elem = elem->next;
+    }
+    lock_release(&pid_lock);
+    return found;
 }
 
 /* 初始化线程栈thread_stack,将待执行的函数和参数放到thread_stack中相应的位置 */
@@ -71,7 +145,7 @@ void thread_create(struct task_struct* pthread, thread_func function, void* func
 /* 初始化线程基本信息 */
 void init_thread(struct task_struct* pthread, char* name, int prio) {
     memset(pthread, 0, sizeof(*pthread));
-    pthread->pid = allocate_pid();
+    allocate_pid(pthread);
     strcpy(pthread->name, name);
 
     if (pthread == main_thread) {   // 将main函数封装为一个线程，直接将其设置为TASK_RUNNING
@@ -83,12 +157,30 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
     /* 内核栈是线程自己在内核态下使用的，放在PCB所在页的最高端 */
     pthread->self_kstack = (uint32_t*)((uint32_t)pthread + PG_SIZE);  // 设置线程的内核栈
     pthread->priority = prio;
+    pthread->base_priority = prio;
     pthread->ticks = prio;      // 时间片就是线程的优先级！！
+    pthread->blocked_on = NULL;
+    list_init(&pthread->contended_locks);
     pthread->elapsed_ticks = 0;
+    pthread->preempt_count = 0;
+    pthread->need_resched = false;
+    pthread->policy = SCHED_NORMAL;
+    pthread->rt_priority = 0;
+    pthread->normal_policy = SCHED_NORMAL;
+    pthread->normal_rt_priority = 0;
+    pthread->pi_dl = false;
+    pthread->dl_throttled = false;
+    pthread->wakeup_tsc = 0;
+    pthread->max_latency = 0;
+    pthread->plug = NULL;
     pthread->pgdir = NULL;
     pthread->cwd_inode_nr = 0;
     pthread->parent_pid = -1;
-    pthread->stack_magic = 0x19870916;  // 魔数，用于越界检查
+    pthread->kstack_base = NULL;
+    pthread->kstack_pages = 0;
+    pthread->detached = true;   // thread_start创建的线程无人join, 退出后自动回收
+    completion_init(&pthread->exited);
+    pthread->stack_magic = STACK_MAGIC;  // 魔数，用于越界检查
 
     /* 准备好三个标准输入/输出 */ 
     pthread->fd_table[0] = 0;
@@ -110,15 +202,19 @@ struct task_struct* thread_start(char* name, int prio, thread_func function, voi
 
     init_thread(thread, name, prio);
     thread_create(thread, function, func_arg);
+    thread_enqueue(thread);
+    return thread;
+}
 
+/* 将新建的线程加入就绪队列和全部队列 */
+void thread_enqueue(struct task_struct* pthread) {
     // 确保之前不在就绪队列中，加入就绪队列
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
+    list_append(&thread_ready_list, &pthread->general_tag);
 
     // 确保之前不在全部队列中，加入全部队列
-    ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
-    list_append(&thread_all_list, &thread->all_list_tag);
-    return thread;
+    ASSERT(!elem_find(&thread_all_list, &pthread->all_list_tag));
+    list_append(&thread_all_list, &pthread->all_list_tag);
 }
 
 /* 将kernel中的main函数完善为主线程 */
@@ -133,38 +229,147 @@ static void make_main_thread(void) {
 
     ASSERT(!elem_find(&thread_all_list, &main_thread->all_list_tag));
     list_append(&thread_all_list, &main_thread->all_list_tag);
+    current_task = main_thread;
     put_str("make_main_thread done\n");
 }
 
 
+/* 调度类的先后, 数值大的先运行 */
+static uint8_t sched_class(struct task_struct* pthread) {
+    switch (pthread->policy) {
+        case SCHED_DEADLINE:
+            return 2;
+        case SCHED_FIFO:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* SCHED_DEADLINE任务排序用的截止期, 继承来的截止期优先 */
+static uint32_t dl_sort_deadline(struct task_struct* pthread) {
+    return pthread->pi_dl ? pthread->pi_abs_deadline : pthread->dl_abs_deadline;
+}
+
+/* a是否应排在b之前运行, 按有效策略比较, 同类的实时任务之间才有意义 */
+bool sched_before(struct task_struct* a, struct task_struct* b) {
+    if (sched_class(a) != sched_class(b)) {
+        return sched_class(a) > sched_class(b);
+    }
+    if (a->policy == SCHED_DEADLINE) {
+        return (int32_t)(dl_sort_deadline(a) - dl_sort_deadline(b)) < 0;
+    }
+    if (a->policy == SCHED_FIFO) {
+        return a->rt_priority > b->rt_priority;
+    }
+    return false;
+}
+
+/* 按sched_before插入有序队列.
+ * at_head为true时排在同级任务之前(被抢占的任务), 否则排在同级任务之后 */
+static void ready_insert_ordered(struct list* plist, struct task_struct* pthread, bool at_head) {
+    struct list_elem* elem = plist->head.next;
+    while (elem != &plist->tail) {
+        struct task_struct* queued = elem2entry(struct task_struct, general_tag, elem);
+        if (at_head ? !sched_before(queued, pthread) : sched_before(pthread, queued)) {
+            break;
+        }
+        elem = elem->next;
+    }
+    list_insert_before(elem, &pthread->general_tag);
+}
+
+/* 按调度策略把就绪的pthread放入对应的就绪队列, 须关中断 */
+static void ready_enqueue(struct task_struct* pthread, bool at_head) {
+    switch (pthread->policy) {
+        case SCHED_DEADLINE:
+            ready_insert_ordered(&thread_dl_list, pthread, at_head);
+            break;
+        case SCHED_FIFO:
+            ready_insert_ordered(&thread_rt_list, pthread, at_head);
+            break;
+        default:
+            if (at_head) {
+                list_push(&thread_ready_list, &pthread->general_tag);
+            } else {
+                list_append(&thread_ready_list, &pthread->general_tag);
+            }
+    }
+}
+
+/* pthread刚就绪, 若它应先于当前线程运行, 则请求在下一个抢占点调度 */
+static void check_preempt(struct task_struct* pthread) {
+    struct task_struct* cur = running_thread();
+    if (cur != pthread && sched_before(pthread, cur)) {
+        cur->need_resched = true;
+    }
+}
+
+/* 开始SCHED_DEADLINE任务的新周期: 补满预算, 截止期与周期从现在算起 */
+static void dl_replenish(struct task_struct* pthread) {
+    pthread->dl_budget = pthread->dl_runtime;
+    pthread->dl_abs_deadline = ticks + pthread->dl_deadline;
+    pthread->dl_period_end = ticks + pthread->dl_period;
+    pthread->dl_throttled = false;
+}
+
 /* 实现任务调度 */
 void schedule() {
     ASSERT(intr_get_status() == INTR_OFF);  // 必须关中断，保证原子性
 
     struct task_struct* cur = running_thread();
+    ASSERT(cur->stack_magic == STACK_MAGIC);    // 不止在时钟中断里, 每次切换都检查是否溢出
+    bool preempted = cur->need_resched;         // 被抢占而非主动让出
+    cur->need_resched = false;
     /* 在取出线程运行时使用的是pop，因此上一个正在运行的线程已不在就绪队列中 */
     if (cur->status == TASK_RUNNING) {
         ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-        list_append(&thread_ready_list, &cur->general_tag);     // 加到队尾去
+        if (cur->dl_throttled) {
+            list_append(&dl_throttled_list, &cur->general_tag); // 预算用完, 等下个周期
+        } else {
+            /* 被抢占的实时任务仍排在同级任务之前, 普通任务加到队尾去 */
+            ready_enqueue(cur, preempted && cur->policy == SCHED_FIFO);
+        }
         cur->ticks = cur->priority;
         cur->status = TASK_READY;
     } else {
         /* 若此线程需要某时间发生后才继续上cpu运行，不需要将其加入队列，因为当前线程不在就绪队列中 */
     }
 
-    /* 若就绪队列中没有可运行的任务，唤醒idle线程 */
-    if (list_empty(&thread_ready_list)) {
-        thread_unblock(idle_thread);    // idle线程，啥也不干
-    }
-
-    ASSERT(!list_empty(&thread_ready_list));    // 就绪队列非空
     thread_tag = NULL;
-    thread_tag = list_pop(&thread_ready_list);  // 取出就绪队列队首线程的tag
+    if (!list_empty(&thread_dl_list)) {
+        thread_tag = list_pop(&thread_dl_list);     // 截止期最早的SCHED_DEADLINE任务
+    } else if (!list_empty(&thread_rt_list) && (!rt_throttled || list_empty(&thread_ready_list))) {
+        thread_tag = list_pop(&thread_rt_list);     // 优先级最高的SCHED_FIFO任务, 被限制时只在没有普通任务可运行时运行
+    } else {
+        /* 若就绪队列中没有可运行的任务，唤醒idle线程 */
+        if (list_empty(&thread_ready_list)) {
+            thread_unblock(idle_thread);    // idle线程，啥也不干
+        }
+        ASSERT(!list_empty(&thread_ready_list));    // 就绪队列非空
+        thread_tag = list_pop(&thread_ready_list);  // 取出就绪队列队首线程的tag
+    }
     struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);
     next->status = TASK_RUNNING;
 
+    /* 统计被唤醒到真正上cpu之间的延迟 */
+    if (next->wakeup_tsc != 0) {
+        uint32_t latency = rdtsc32() - next->wakeup_tsc;
+        next->wakeup_tsc = 0;
+        if (latency > next->max_latency) {
+            next->max_latency = latency;
+        }
+        if (latency > max_latency_all) {
+            max_latency_all = latency;
+            strcpy(max_latency_name, next->name);
+        }
+    }
+
     process_activate(next); // 激活任务页表
 
+    fpu_switch(next);       // 惰性切换FPU状态, 只按需设置CR0.TS
+    current_task = next;
+    TRACE(TRACE_SWITCH, next->pid, cur->status);
     switch_to(cur, next);   // 执行完线程切换后，还要返回kernel.S，继续执行中断返回的指令
 }
 
@@ -175,7 +380,22 @@ void thread_init(void)
     put_str("thread_init start\n");
     list_init(&thread_ready_list);
     list_init(&thread_all_list);
+    list_init(&thread_rt_list);
+    list_init(&thread_dl_list);
+    list_init(&dl_throttled_list);
+    dl_total_bw = 0;
+    rt_used_ticks = 0;
+    rt_window_end = 0;
+    rt_throttled = false;
     lock_init(&pid_lock);
+    lock_stat_register(&pid_lock, "pid");
+    bitmap_init(&pid_bitmap);
+    bitmap_set(&pid_bitmap, 0, 1);     // pid 0保留不用
+    uint32_t bucket_idx = 0;
+    while (bucket_idx < PID_HASH_BUCKETS) {
+        list_init(&pid_hash[bucket_idx++]);
+    }
+    kthread_init();
     /* 先创建第一个用户进程:init */
     process_execute(init, "init");         // 放在第一个初始化,这是第一个进程,init进程的pid为1
     /* 将当前main函数创建为线程 */
@@ -187,11 +407,16 @@ void thread_init(void)
 
 /* 当前线程将自己阻塞，标志其状态为stat */
 void thread_block(enum task_status stat) {
-    /* stat取值为TASK_BLOCKED、TASK_WAITING、TASK_HANGING*/
-    ASSERT(((stat == TASK_BLOCKED) || (stat == TASK_WAITING) || (stat == TASK_HANGING)));
+    /* stat取值为TASK_BLOCKED、TASK_WAITING、TASK_HANGING, 线程退出时为TASK_DIED */
+    ASSERT(((stat == TASK_BLOCKED) || (stat == TASK_WAITING) || (stat == TASK_HANGING) || (stat == TASK_DIED)));
     enum intr_status old_status = intr_disable();
     struct task_struct* cur_thread = running_thread();
+    /* 睡眠前把攒下的bio交给请求队列, 否则可能在等一个还没提交的I/O */
+    if (cur_thread->plug != NULL) {
+        blk_flush_plug(cur_thread);
+    }
     cur_thread->status = stat;
+    TRACE(TRACE_BLOCK, stat, 0);
     schedule();     // 在其中将当前线程从就绪队列中剔除
     intr_set_status(old_status);
 }
@@ -202,11 +427,24 @@ void thread_unblock(struct task_struct* pthread) {
     ASSERT(((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING) || (pthread->status == TASK_HANGING)));
     if (pthread->status != TASK_READY) {
         // ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-        if (elem_find(&thread_ready_list, &pthread->general_tag)) {    // 保险起见，再判断一下
+#ifndef NDEBUG
+        if (elem_find(&thread_ready_list, &pthread->general_tag)) {    // 保险起见，再判断一下, 遍历就绪队列开销大, 发布版编译时去掉
             PANIC("thread_unblock: blocked thread in ready_list\n");
         }   
-        list_push(&thread_ready_list, &pthread->general_tag);   // 将刚刚unblock的线程加入就绪队列队首
+#endif
+        /* 睡过了本周期的SCHED_DEADLINE任务从新周期开始, 否则沿用剩余预算 */
+        if (pthread->normal_policy == SCHED_DEADLINE && ticks_reached(pthread->dl_period_end)) {
+            dl_replenish(pthread);
+        }
+        if (pthread->dl_throttled) {
+            list_append(&dl_throttled_list, &pthread->general_tag);    // 本周期预算已用完, 等下个周期
+        } else {
+            ready_enqueue(pthread, true);   // 将刚刚unblock的线程加入就绪队列队首
+            check_preempt(pthread);
+        }
         pthread->status = TASK_READY;
+        pthread->wakeup_tsc = rdtsc32();
+        TRACE(TRACE_UNBLOCK, pthread->pid, 0);
     }
     intr_set_status(old_status);
 }
@@ -216,15 +454,256 @@ void thread_yield(void) {
     struct task_struct *cur = running_thread();
     enum intr_status old_status = intr_disable();
     ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-    list_append(&thread_ready_list, &cur->general_tag);
+    if (cur->policy == SCHED_DEADLINE && !cur->pi_dl) {
+        /* SCHED_DEADLINE任务让出cpu即放弃本周期剩余的预算 */
+        cur->dl_throttled = true;
+        list_append(&dl_throttled_list, &cur->general_tag);
+    } else {
+        ready_enqueue(cur, false);
+    }
     cur->status = TASK_READY;
     schedule();
     intr_set_status(old_status);
 }
 
+/* 修改线程pthread的有效优先级,
+ * 提高时补足时间片, 若已就绪则移到就绪队列队首尽快运行;
+ * 降低时收回多出的时间片 */
+void thread_set_priority(struct task_struct* pthread, uint8_t prio) {
+    enum intr_status old_status = intr_disable();
+    if (prio > pthread->priority) {
+        pthread->ticks = prio;
+        /* 实时任务的就绪队列不按priority排序, 不必移动 */
+        if (pthread->status == TASK_READY && pthread->policy == SCHED_NORMAL) {
+            list_remove(&pthread->general_tag);
+            list_push(&thread_ready_list, &pthread->general_tag);
+        }
+    } else if (pthread->ticks > prio) {
+        pthread->ticks = prio;
+    }
+    pthread->priority = prio;
+    intr_set_status(old_status);
+}
+
+/* 由时钟中断处理程序每个嘀嗒调用一次, 消耗当前任务的时间片或预算 */
+void sched_tick(void) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    /* 到了下个周期的SCHED_DEADLINE任务补充预算后重新就绪 */
+    struct list_elem* elem = dl_throttled_list.head.next;
+    while (elem != &dl_throttled_list.tail) {
+        struct list_elem* next_elem = elem->next;
+        struct task_struct* pthread = elem2entry(struct task_struct, general_tag, elem);
+        if (ticks_reached(pthread->dl_period_end)) {
+            list_remove(elem);
+            dl_replenish(pthread);
+            ready_enqueue(pthread, false);
+            check_preempt(pthread);
+        }
+        elem = next_elem;
+    }
+
+    struct task_struct* cur = running_thread();
+    /* 新的统计窗口开始, 解除对SCHED_FIFO任务的限制 */
+    if (ticks_reached(rt_window_end)) {
+        rt_window_end = ticks + RT_PERIOD_TICKS;
+        rt_used_ticks = 0;
+        if (rt_throttled) {
+            rt_throttled = false;
+            if (!list_empty(&thread_rt_list) && cur->policy == SCHED_NORMAL) {
+                cur->need_resched = true;
+            }
+        }
+    }
+
+    switch (cur->policy) {
+        case SCHED_DEADLINE:
+            if (cur->pi_dl) {
+                break;  // 截止期继承自等待者, 尽快运行完临界区, 不计预算
+            }
+            if (cur->dl_budget > 0) {
+                cur->dl_budget--;
+            }
+            if (ticks_reached(cur->dl_period_end)) {
+                dl_replenish(cur);              // 新周期截止期推后, 重新和其他任务比较
+                cur->need_resched = true;
+            } else if (cur->dl_budget == 0) {
+                cur->dl_throttled = true;       // 在schedule中移入dl_throttled_list
+                cur->need_resched = true;
+            }
+            break;
+        case SCHED_FIFO:
+            /* 没有时间片, 只会被更高优先级的任务抢占.
+             * 但一个窗口内用满RT_RUNTIME_TICKS后要让给普通任务, 防止失控的实时任务锁死系统 */
+            if (++rt_used_ticks >= RT_RUNTIME_TICKS && !rt_throttled) {
+                rt_throttled = true;
+                cur->need_resched = true;
+            }
+            break;
+        default:
+            if (cur->ticks == 0) {   // 时间片用完，标记需要调度, 在中断返回前允许抢占时调度
+                cur->need_resched = true;
+            } else {
+                cur->ticks--;
+            }
+    }
+}
+
+/* 修改pthread的调度策略, 成功返回0, 参数非法或SCHED_DEADLINE带宽不足时返回-1.
+ * SCHED_DEADLINE要求0 < runtime <= deadline <= period <= DL_PARAM_MAX,
+ * 所有SCHED_DEADLINE任务的runtime/period之和不超过DL_BW_LIMIT.
+ * 注意SCHED_FIFO任务每RT_PERIOD_TICKS只给普通任务留出很少的时间, 等待时须阻塞而不能用mtime_sleep轮询 */
+int32_t thread_setscheduler(struct task_struct* pthread, const struct sched_attr* attr) {
+    uint32_t new_bw = 0;
+    switch (attr->policy) {
+        case SCHED_NORMAL:
+            break;
+        case SCHED_FIFO:
+            if (attr->rt_priority == 0 || attr->rt_priority > SCHED_FIFO_PRIO_MAX) {
+                return -1;
+            }
+            break;
+        case SCHED_DEADLINE:
+            if (attr->runtime == 0 || attr->runtime > attr->deadline || attr->deadline > attr->period ||
+                attr->period > DL_PARAM_MAX) {
+                return -1;
+            }
+            new_bw = (attr->runtime << DL_BW_SHIFT) / attr->period;
+            break;
+        default:
+            return -1;
+    }
+
+    enum intr_status old_status = intr_disable();
+    uint32_t old_bw = 0;
+    if (pthread->normal_policy == SCHED_DEADLINE) {
+        old_bw = (pthread->dl_runtime << DL_BW_SHIFT) / pthread->dl_period;
+    }
+    /* 接纳控制, 保证所有任务的截止期都能满足 */
+    if (dl_total_bw - old_bw + new_bw > DL_BW_LIMIT) {
+        intr_set_status(old_status);
+        return -1;
+    }
+    dl_total_bw = dl_total_bw - old_bw + new_bw;
+
+    pthread->normal_policy = attr->policy;
+    pthread->normal_rt_priority = attr->rt_priority;
+    pthread->dl_runtime = attr->runtime;
+    pthread->dl_deadline = attr->deadline;
+    pthread->dl_period = attr->period;
+    pthread->dl_throttled = false;
+    if (attr->policy == SCHED_DEADLINE) {
+        dl_replenish(pthread);
+    }
+    /* 有效策略还要看所持锁上是否有更优先的实时等待者, 按新的有效策略重新排队 */
+    thread_pi_setscheduler(pthread, lock_top_rt_waiter(pthread));
+    intr_set_status(old_status);
+    return 0;
+}
+
+/* pthread的有效调度策略是否继承自锁的等待者 */
+bool thread_pi_boosted(struct task_struct* pthread) {
+    return pthread->pi_dl || pthread->policy != pthread->normal_policy ||
+           pthread->rt_priority != pthread->normal_rt_priority;
+}
+
+/* 优先级继承对调度策略的部分: 先恢复pthread自身设置的策略,
+ * 若donor按有效策略应先于它运行, 则继承donor的策略和rt_priority,
+ * SCHED_DEADLINE的donor则传递其截止期. donor为NULL表示不再继承. 须关中断 */
+void thread_pi_setscheduler(struct task_struct* pthread, struct task_struct* donor) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    /* 就绪的任务在某个就绪队列或dl_throttled_list中, 先取出, 改完策略再放回 */
+    bool queued = (pthread->status == TASK_READY);
+    if (queued) {
+        list_remove(&pthread->general_tag);
+    }
+    pthread->policy = pthread->normal_policy;
+    pthread->rt_priority = pthread->normal_rt_priority;
+    pthread->pi_dl = false;
+    if (donor != NULL && sched_before(donor, pthread)) {
+        pthread->policy = donor->policy;
+        if (donor->policy == SCHED_DEADLINE) {
+            pthread->pi_dl = true;
+            pthread->pi_abs_deadline = dl_sort_deadline(donor);
+            pthread->dl_throttled = false;  // 预算用完也要先跑完临界区
+        } else {
+            pthread->rt_priority = donor->rt_priority;
+        }
+    }
+    if (queued) {
+        if (pthread->dl_throttled) {
+            list_append(&dl_throttled_list, &pthread->general_tag);
+        } else {
+            ready_enqueue(pthread, false);
+            check_preempt(pthread);
+        }
+    } else if (pthread == running_thread()) {
+        pthread->need_resched = true;   // 可能不再是最该运行的任务
+    }
+}
+
+/* 修改pid对应任务的调度策略, pid为0表示当前任务.
+ * 只能修改自己或自己的子进程, 内核线程的策略不允许从用户态修改 */
+int32_t sys_sched_setattr(pid_t pid, const struct sched_attr* attr) {
+    struct task_struct* cur = running_thread();
+    struct task_struct* pthread = pid == 0 ? cur : pid2thread(pid);
+    if (pthread == NULL || attr == NULL) {
+        return -1;
+    }
+    if (pthread != cur && (pthread->parent_pid != cur->pid || pthread->pgdir == NULL)) {
+        return -1;
+    }
+    struct sched_attr kattr = *attr;
+    return thread_setscheduler(pthread, &kattr);
+}
+
+/* 禁止抢占, 可嵌套, 须与preempt_enable成对使用 */
+void preempt_disable(void) {
+    running_thread()->preempt_count++;
+}
+
+/* 允许抢占, 计数归0时若期间有调度请求则立即调度 */
+void preempt_enable(void) {
+    struct task_struct* cur = running_thread();
+    ASSERT(cur->preempt_count > 0);
+    if (--cur->preempt_count == 0 && cur->need_resched && intr_get_status() == INTR_ON) {
+        intr_disable();
+        schedule();
+        intr_enable();
+    }
+}
+
+/* 由irq_exit在中断返回前调用, 当前线程需要调度且允许抢占时将其换下 */
+void preempt_schedule_irq(void) {
+    ASSERT(intr_get_status() == INTR_OFF);
+    struct task_struct* cur = running_thread();
+    if (cur->need_resched && cur->preempt_count == 0) {
+        schedule();
+    }
+}
+
+/* 长循环中的抢占点. 系统调用经中断门进入, 全程关中断,
+ * 在此短暂开中断, 让积压的时钟等中断得到处理, 若需要调度则让出cpu.
+ * 调用者不能在此依赖关中断保护任何状态 */
+void cond_resched(void) {
+    struct task_struct* cur = running_thread();
+    if (cur->preempt_count != 0 || in_softirq()) {
+        return;
+    }
+    enum intr_status old_status = intr_get_status();
+    if (old_status == INTR_OFF) {
+        intr_enable();      // 窗口中到来的中断返回时即会按需调度
+        intr_disable();
+    }
+    if (cur->need_resched) {
+        intr_disable();
+        schedule();
+    }
+    intr_set_status(old_status);
+}
+
 // 为fork出来的子进程分配pid
-pid_t fork_pid(void) {
-    return allocate_pid();
+pid_t fork_pid(struct task_struct* child) {
+    return allocate_pid(child);
 }
 
 /* 以填充空格的方式输出buf */
@@ -237,6 +716,10 @@ static void pad_print(char* buf, int32_t buf_len, void* ptr, char format) {
 	 break;
       case 'd':
 	 out_pad_0idx = sprintf(buf, "%d", *((int16_t*)ptr));
+	 break;
+      case 'u':
+	 out_pad_0idx = sprintf(buf, "%d", *((uint32_t*)ptr));
+	 break;
       case 'x':
 	 out_pad_0idx = sprintf(buf, "%x", *((uint32_t*)ptr));
    }
@@ -252,12 +735,12 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
    struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
    char out_pad[16] = {0};
 
-   pad_print(out_pad, 16, &pthread->pid, 'd');
+   pad_print(out_pad, 8, &pthread->pid, 'd');
 
    if (pthread->parent_pid == -1) {
-      pad_print(out_pad, 16, "NULL", 's');
+      pad_print(out_pad, 8, "NULL", 's');
    } else { 
-      pad_print(out_pad, 16, &pthread->parent_pid, 'd');
+      pad_print(out_pad, 8, &pthread->parent_pid, 'd');
    }
 
    switch (pthread->status) {
@@ -280,6 +763,8 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
 	 pad_print(out_pad, 16, "DIED", 's');
    }
    pad_print(out_pad, 16, &pthread->elapsed_ticks, 'x');
+   uint32_t latency_us = tsc_to_us(pthread->max_latency);
+   pad_print(out_pad, 16, &latency_us, 'u');
 
    memset(out_pad, 0, 16);
    ASSERT(strlen(pthread->name) < 17);
@@ -291,7 +776,11 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
 
  /* 打印任务列表 */
 void sys_ps(void) {
-   char* ps_title = "PID            PPID           STAT           TICKS          COMMAND\n";
+   char* ps_title = "PID    PPID   STAT           TICKS          LATENCY(us)    COMMAND\n";
    sys_write(stdout_no, ps_title, strlen(ps_title));
    list_traversal(&thread_all_list, elem2thread_info, 0);
+
+   char buf[64];
+   sprintf(buf, "max wakeup latency: %d us (%s)\n", tsc_to_us(max_latency_all), max_latency_name);
+   sys_write(stdout_no, buf, strlen(buf));
 }
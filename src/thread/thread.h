@@ -4,9 +4,22 @@
 #include "list.h"
 #include "bitmap.h"
 #include "memory.h"
+#include "sync.h"
+#include "fpu.h"
 
 #define MAX_FILES_OPEN_PER_PROC 8
 #define TASK_NAME_LEN 16
+#define STACK_MAGIC 0x19870916      // PCB末尾的栈边界魔数
+#define MAX_PID 32768               // pid取值范围为1~MAX_PID-1, 受pid_t为int16_t所限
+#define PID_HASH_BUCKETS 128        // pid哈希表的桶数, 须为2的幂
+#define SCHED_FIFO_PRIO_MAX 99      // SCHED_FIFO的rt_priority取值为1~99, 越大越优先
+#define RT_PERIOD_TICKS 100         // SCHED_FIFO任务的运行时间按此长度的窗口统计
+#define RT_RUNTIME_TICKS 95         // 每个窗口中SCHED_FIFO任务最多运行的嘀嗒数, 有普通任务就绪时其余时间留给它们
+#define DL_BW_SHIFT 10              // 带宽以1/1024为单位
+#define DL_BW_LIMIT ((1 << DL_BW_SHIFT) * 9 / 10)  // SCHED_DEADLINE任务总带宽上限, 至少给普通任务留10%
+#define DL_PARAM_MAX (0xffffffff >> DL_BW_SHIFT)    // runtime和period的上限, 保证算带宽时左移不溢出
+
+struct blk_plug;
 
 extern struct list thread_ready_list, thread_all_list;
 /* 自定义通用函数类型，它将在很多线程函数中作为形参类型 */
@@ -23,6 +36,22 @@ enum task_status {
     TASK_DIED
 };
 
+/* 调度策略, 先运行SCHED_DEADLINE, 再SCHED_FIFO, 最后普通任务 */
+enum sched_policy {
+    SCHED_NORMAL,       // 按优先级分配时间片, 轮转调度
+    SCHED_FIFO,         // 实时, 按rt_priority抢占, 没有时间片, 直到阻塞或让出cpu, 总运行时间受RT_RUNTIME_TICKS限制
+    SCHED_DEADLINE      // 最早截止期优先, 每period嘀嗒最多运行runtime嘀嗒
+};
+
+/* sched_setattr的参数, 时间均以嘀嗒为单位 */
+struct sched_attr {
+    uint32_t policy;        // enum sched_policy
+    uint32_t rt_priority;   // SCHED_FIFO的优先级
+    uint32_t runtime;       // SCHED_DEADLINE每周期的运行预算
+    uint32_t deadline;      // SCHED_DEADLINE相对于周期开始的截止期
+    uint32_t period;        // SCHED_DEADLINE的周期
+};
+
 /******************** 中断栈 intr_stack *****************
  * 此结构用于中断发生时保护程序的上下文环境：
  * 进程或线程被外部中断或软中断打断时,会按照此结构压入上下文
@@ -80,7 +109,8 @@ struct task_struct {
     pid_t pid;
     enum task_status status;    // 进程状态
     char name[16];
-    uint8_t priority;           // 优先级
+    uint8_t priority;           // 优先级, 持有的锁被高优先级线程等待时会被临时提高
+    uint8_t base_priority;      // 线程自身的优先级, 释放锁后据此恢复
     uint8_t ticks;              // 时间片
 
     uint32_t elapsed_ticks;     // 从上cpu起总共执行了多少嘀嗒数
@@ -89,13 +119,44 @@ struct task_struct {
 
     struct list_elem general_tag;   // 用于线程在一般队列中的结点
     struct list_elem all_list_tag;  // 线用于线程队列thread_all_list中的结点
+    struct list_elem pid_tag;       // 用于pid哈希表中的结点
 
     uint32_t* pgdir;            // 进程自己页表的虚拟地址
     struct virtual_addr userprog_vaddr; // 用户进程的虚拟地址
     struct mem_block_desc u_block_desc[DESC_CNT];
 
     uint32_t cwd_inode_nr;      // 进程所在工作目录的inode编号
-    
+
+    struct lock* blocked_on;        // 正在等待的锁, 用于沿持有链传递优先级
+    struct list contended_locks;    // 持有且有线程等待的锁, 释放锁时据此重新计算优先级
+
+    uint32_t* kstack_base;      // 独立内核栈的最低地址, 为NULL表示内核栈与PCB共用一页
+    uint32_t kstack_pages;      // 独立内核栈的页数, 不含其下方的保护页
+    bool detached;              // 为true时退出后自动回收, 否则须由kthread_join回收
+    struct completion exited;   // 线程退出时完成, 供kthread_join等待
+
+    uint32_t preempt_count;     // 不为0时不允许被抢占
+    bool need_resched;          // 时间片用完等原因需要调度, 在允许抢占时进行
+    uint32_t wakeup_tsc;        // 被唤醒时的时间戳计数, 用于统计唤醒到运行的延迟
+    uint32_t max_latency;       // 唤醒到运行的最大延迟, 单位为时间戳计数
+
+    enum sched_policy policy;   // 有效调度策略, 可能继承自所持锁上的实时等待者
+    uint32_t rt_priority;       // 有效的SCHED_FIFO优先级
+    enum sched_policy normal_policy;    // sched_setattr设置的策略, 不再继承时恢复为此
+    uint32_t normal_rt_priority;
+    bool pi_dl;                 // 有效策略SCHED_DEADLINE继承自等待者, 不受自身预算约束
+    uint32_t pi_abs_deadline;   // pi_dl为true时代替dl_abs_deadline排序
+    uint32_t dl_runtime;        // SCHED_DEADLINE的参数, 见struct sched_attr
+    uint32_t dl_deadline;
+    uint32_t dl_period;
+    uint32_t dl_budget;         // 本周期剩余的运行预算
+    uint32_t dl_abs_deadline;   // 本周期的绝对截止期, 就绪队列按此排序
+    uint32_t dl_period_end;     // 本周期结束, 即下次补充预算的时刻
+    bool dl_throttled;          // 本周期预算已用完, 等待补充
+
+    struct blk_plug* plug;      // 正在攒批的块I/O, 不为NULL时提交的bio先留在其中
+
+    struct fpu_state* fpu;      // 被其他任务抢走FPU时, 其状态保存在此. 没用过FPU的任务为NULL
 
     uint32_t stack_magic;       // 栈的边界标记，用于检测栈的溢出
 };
@@ -109,8 +170,22 @@ void thread_block(enum task_status stat);
 void init_thread(struct task_struct* pthread, char* name, int prio);
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg);
 void thread_yield(void);
+void thread_set_priority(struct task_struct* pthread, uint8_t prio);
+void thread_enqueue(struct task_struct* pthread);
+void preempt_disable(void);
+void preempt_enable(void);
+void preempt_schedule_irq(void);
+void cond_resched(void);
+void sched_tick(void);
+bool sched_before(struct task_struct* a, struct task_struct* b);
+bool thread_pi_boosted(struct task_struct* pthread);
+void thread_pi_setscheduler(struct task_struct* pthread, struct task_struct* donor);
+int32_t thread_setscheduler(struct task_struct* pthread, const struct sched_attr* attr);
+int32_t sys_sched_setattr(pid_t pid, const struct sched_attr* attr);
 // 为fork出来的子进程分配pid
-pid_t fork_pid(void);
+pid_t fork_pid(struct task_struct* child);
+void release_pid(struct task_struct* pthread);
+struct task_struct* pid2thread(pid_t pid);
  /* 打印任务列表 */
 void sys_ps(void);
 #endif
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "workqueue.h"
+#include "global.h"
+#include "string.h"
+#include "stdio.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "thread.h"
+#include "kthread.h"
+#include "softirq.h"
+#include "timer.h"
+#include "print.h"
+
+#define WORKER_STACK_PAGES  2   // 工作线程的栈页数
+#define WORKER_PRIO         31  // 工作线程的优先级
+
+struct workqueue system_wq;         // 通用工作队列, 供没有专门队列的子系统使用
+static struct list delayed_list;    // 未到期的延迟工作, 按到期时间从早到晚排列
+
+/* 将work加入wq并唤醒一个空闲的工作线程, 调用前须关中断 */
+static void insert_work(struct workqueue* wq, struct work_struct* work) {
+    list_append(&wq->works, &work->entry);
+    wait_queue_wake_one(&wq->more_work);
+}
+
+/* 工作线程, 不断从wq中取出工作项执行 */
+static void worker_thread(void* arg) {
+    struct workqueue* wq = arg;
+    while (1) {
+        enum intr_status old_status = intr_disable();
+        while (list_empty(&wq->works)) {
+            wait_queue_sleep(&wq->more_work);
+        }
+        struct work_struct* work = elem2entry(struct work_struct, entry, list_pop(&wq->works));
+        work->pending = false;  // 执行前清除, 执行过程中可以再次排队
+        wq->in_flight++;
+        intr_set_status(old_status);
+
+        /* 执行完后work可能已被func释放, 不可再访问 */
+        work->func(work);
+
+        old_status = intr_disable();
+        wq->in_flight--;
+        if (wq->in_flight == 0 && list_empty(&wq->works)) {
+            wait_queue_wake_all(&wq->flush_wait);
+        }
+        intr_set_status(old_status);
+    }
+}
+
+/* 时钟软中断, 将到期的延迟工作加入各自的工作队列 */
+static void delayed_work_timer(void) {
+    enum intr_status old_status = intr_disable();
+    while (!list_empty(&delayed_list)) {
+        struct delayed_work* dwork = elem2entry(struct delayed_work, timer_tag, delayed_list.head.next);
+        if ((int32_t)(ticks - dwork->expires) < 0) {
+            break;
+        }
+        list_remove(&dwork->timer_tag);
+        dwork->timer_armed = false;
+        insert_work(dwork->wq, &dwork->work);
+    }
+    intr_set_status(old_status);
+}
+
+/* 初始化工作队列wq, 创建nr_workers个工作线程 */
+void workqueue_create(struct workqueue* wq, const char* name, uint32_t nr_workers) {
+    ASSERT(nr_workers > 0 && nr_workers <= WORKQUEUE_WORKERS_MAX);
+    ASSERT(strlen(name) < WORKQUEUE_NAME_LEN);
+    strcpy(wq->name, name);
+    list_init(&wq->works);
+    wait_queue_init(&wq->more_work);
+    wait_queue_init(&wq->flush_wait);
+    wq->in_flight = 0;
+    wq->nr_workers = nr_workers;
+
+    char worker_name[TASK_NAME_LEN];
+    uint32_t worker_idx = 0;
+    while (worker_idx < nr_workers) {
+        sprintf(worker_name, "%s/%d", name, worker_idx);
+        struct task_struct* worker = kthread_create(worker_name, WORKER_PRIO, WORKER_STACK_PAGES, worker_thread, wq);
+        if (worker == NULL) {
+            PANIC("workqueue_create: create worker failed\n");
+        }
+        kthread_detach(worker);     // 工作线程不会退出, 也无人join
+        worker_idx++;
+    }
+}
+
+/* 初始化工作项 */
+void work_init(struct work_struct* work, work_func* func) {
+    work->func = func;
+    work->pending = false;
+}
+
+/* 初始化延迟工作项 */
+void delayed_work_init(struct delayed_work* dwork, work_func* func) {
+    work_init(&dwork->work, func);
+    dwork->wq = NULL;
+    dwork->timer_armed = false;
+}
+
+/* 将work加入wq, 可在中断处理程序中调用. work已在排队时返回false */
+bool queue_work(struct workqueue* wq, struct work_struct* work) {
+    enum intr_status old_status = intr_disable();
+    if (work->pending) {
+        intr_set_status(old_status);
+        return false;
+    }
+    work->pending = true;
+    insert_work(wq, work);
+    intr_set_status(old_status);
+    return true;
+}
+
+/* delay_ticks个嘀嗒后将dwork加入wq. dwork已在等待或排队时返回false */
+bool queue_delayed_work(struct workqueue* wq, struct delayed_work* dwork, uint32_t delay_ticks) {
+    if (delay_ticks == 0) {
+        return queue_work(wq, &dwork->work);
+    }
+    enum intr_status old_status = intr_disable();
+    if (dwork->work.pending) {
+        intr_set_status(old_status);
+        return false;
+    }
+    dwork->work.pending = true;
+    dwork->wq = wq;
+    dwork->expires = ticks + delay_ticks;
+    dwork->timer_armed = true;
+
+    /* 按到期时间插入, 时钟软中断只需检查队首 */
+    struct list_elem* elem = delayed_list.head.next;
+    while (elem != &delayed_list.tail) {
+        struct delayed_work* other = elem2entry(struct delayed_work, timer_tag, elem);
+        if ((int32_t)(other->expires - dwork->expires) > 0) {
+            break;
+        }
+        elem = elem->next;
+    }
+    list_insert_before(elem, &dwork->timer_tag);
+    intr_set_status(old_status);
+    return true;
+}
+
+/* 取消还未开始执行的延迟工作, 成功取消返回true */
+bool cancel_delayed_work(struct delayed_work* dwork) {
+    enum intr_status old_status = intr_disable();
+    bool canceled = false;
+    if (dwork->timer_armed) {
+        list_remove(&dwork->timer_tag);
+        dwork->timer_armed = false;
+        dwork->work.pending = false;
+        canceled = true;
+    } else if (dwork->work.pending) {   // 已到期, 还在工作队列中排队
+        list_remove(&dwork->work.entry);
+        dwork->work.pending = false;
+        canceled = true;
+    }
+    intr_set_status(old_status);
+    return canceled;
+}
+
+/* 等待wq中已排队的工作全部执行完毕. 未到期的延迟工作不在等待之列,
+ * 不可在wq自己的工作项中调用, 否则会等待自己 */
+void flush_workqueue(struct workqueue* wq) {
+    enum intr_status old_status = intr_disable();
+    while (!list_empty(&wq->works) || wq->in_flight > 0) {
+        wait_queue_sleep(&wq->flush_wait);
+    }
+    intr_set_status(old_status);
+}
+
+/* 初始化延迟工作的定时机制及通用工作队列 */
+void workqueue_init(void) {
+    put_str("workqueue_init start\n");
+    list_init(&delayed_list);
+    open_softirq(SOFTIRQ_TIMER, delayed_work_timer);
+    workqueue_create(&system_wq, "events", 2);
+    put_str("workqueue_init done\n");
+}
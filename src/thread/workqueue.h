@@ -0,0 +1,49 @@
+#ifndef __THREAD_WORKQUEUE_H
+#define __THREAD_WORKQUEUE_H
+#include "stdint.h"
+#include "list.h"
+#include "sync.h"
+
+#define WORKQUEUE_NAME_LEN 12
+#define WORKQUEUE_WORKERS_MAX 4     // 每个工作队列最多的工作线程数
+
+struct work_struct;
+typedef void work_func(struct work_struct* work);
+
+/* 工作项, 由工作线程在进程上下文中执行, 可以阻塞 */
+struct work_struct {
+    struct list_elem entry;     // 用于加入工作队列
+    work_func* func;            // 要执行的函数
+    bool pending;               // 是否已排队但还未开始执行
+};
+
+/* 延迟工作项, 到期后才加入工作队列 */
+struct delayed_work {
+    struct work_struct work;
+    struct workqueue* wq;       // 到期后加入的工作队列
+    uint32_t expires;           // 到期的时钟嘀嗒
+    bool timer_armed;           // 是否还在等待到期
+    struct list_elem timer_tag; // 用于加入延迟工作队列
+};
+
+/* 工作队列, 由若干工作线程共同处理 */
+struct workqueue {
+    char name[WORKQUEUE_NAME_LEN];
+    struct list works;              // 待执行的工作项
+    struct wait_queue more_work;    // 空闲的工作线程在此等待
+    struct wait_queue flush_wait;   // flush_workqueue在此等待队列变空闲
+    uint32_t in_flight;             // 正在执行的工作项数
+    uint32_t nr_workers;            // 工作线程数
+};
+
+extern struct workqueue system_wq;
+
+void workqueue_init(void);
+void workqueue_create(struct workqueue* wq, const char* name, uint32_t nr_workers);
+void work_init(struct work_struct* work, work_func* func);
+void delayed_work_init(struct delayed_work* dwork, work_func* func);
+bool queue_work(struct workqueue* wq, struct work_struct* work);
+bool queue_delayed_work(struct workqueue* wq, struct delayed_work* dwork, uint32_t delay_ticks);
+bool cancel_delayed_work(struct delayed_work* dwork);
+void flush_workqueue(struct workqueue* wq);
+#endif
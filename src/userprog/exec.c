@@ -180,6 +180,7 @@ int32_t sys_execv(const char *path, const char *argv[])
     struct task_struct *cur = running_thread();
     /* 修改进程名 */
     memcpy(cur->name, path, TASK_NAME_LEN);
+    fpu_release(cur);   // 新程序从干净的FPU状态开始
     cur->name[TASK_NAME_LEN - 1] = 0;
 
     struct intr_stack *intr_0_stack = (struct intr_stack *)((uint32_t)cur + PG_SIZE - sizeof(struct intr_stack));
@@ -9,26 +9,50 @@
 #include "interrupt.h"
 #include "memory.h"
 
+/* 用户虚拟地址池位图占用的页数 */
+#define VADDR_BITMAP_PG_CNT DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE)
 
 
-/* 将父进程的pcb、虚拟地址位图拷贝给子进程 */
+/* 将父进程的pcb、虚拟地址位图拷贝给子进程. 失败时自行撤销已做的部分, 返回-1 */
 static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct *child_thread, struct task_struct *parent_thread)
 {
     /* a 复制pcb所在的整个页,里面包含进程pcb信息及特级0极的栈,里面包含了返回地址, 然后再单独修改个别部分 */
     memcpy(child_thread, parent_thread, PG_SIZE);
-    child_thread->pid = fork_pid();
+    /* FPU保存区不在PCB中, 复制来的指针仍指向父进程的, 需单独复制一份 */
+    if (fpu_fork(child_thread, parent_thread) == -1)
+        return -1;
+    fork_pid(child_thread);     // 复制来的pid_tag仍是父进程的, 由fork_pid重新挂入哈希表
     child_thread->elapsed_ticks = 0;
     child_thread->status = TASK_READY;
+    child_thread->priority = child_thread->base_priority;   // 继承来的优先级不传给子进程
     child_thread->ticks = child_thread->priority; // 为新进程把时间片充满
+    child_thread->blocked_on = NULL;
+    child_thread->preempt_count = 0;
+    child_thread->need_resched = false;
+    child_thread->wakeup_tsc = 0;
+    child_thread->max_latency = 0;
+    child_thread->policy = SCHED_NORMAL;    // 实时策略不继承, 子进程未经接纳控制
+    child_thread->rt_priority = 0;
+    child_thread->normal_policy = SCHED_NORMAL;
+    child_thread->normal_rt_priority = 0;
+    child_thread->pi_dl = false;
+    child_thread->dl_throttled = false;
+    child_thread->plug = NULL;
+    list_init(&child_thread->contended_locks);
+    completion_init(&child_thread->exited);
     child_thread->parent_pid = parent_thread->pid;
     child_thread->general_tag.prev = child_thread->general_tag.next = NULL;
     child_thread->all_list_tag.prev = child_thread->all_list_tag.next = NULL;
     block_desc_init(child_thread->u_block_desc);
     /* b 复制父进程的虚拟地址池的位图 */
-    uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE);
+    uint32_t bitmap_pg_cnt = VADDR_BITMAP_PG_CNT;
     void *vaddr_btmp = get_kernel_pages(bitmap_pg_cnt);
     if (vaddr_btmp == NULL)
+    {
+        release_pid(child_thread);
+        fpu_release(child_thread);
         return -1;
+    }
     /* 此时child_thread->userprog_vaddr.vaddr_bitmap.bits还是指向父进程虚拟地址的位图地址
      * 下面将child_thread->userprog_vaddr.vaddr_bitmap.bits指向自己的位图vaddr_btmp */
     memcpy(vaddr_btmp, child_thread->userprog_vaddr.vaddr_bitmap.bits, bitmap_pg_cnt * PG_SIZE);
@@ -66,7 +90,7 @@ static void copy_body_stack3(struct task_struct *child_thread, struct task_struc
 
                     /* a 将父进程在用户空间中的数据复制到内核缓冲区buf_page,
                     目的是下面切换到子进程的页表后,还能访问到父进程的数据*/
-                    memcpy(buf_page, (void *)prog_vaddr, PG_SIZE);
+                    fpu_memcpy(buf_page, (void *)prog_vaddr, PG_SIZE);
 
                     /* b 将页表切换到子进程,目的是避免下面申请内存的函数将pte及pde安装在父进程的页表中 */
                     page_dir_activate(child_thread);
@@ -74,10 +98,11 @@ static void copy_body_stack3(struct task_struct *child_thread, struct task_struc
                     get_a_page_without_opvaddrbitmap(PF_USER, prog_vaddr);
 
                     /* d 从内核缓冲区中将父进程数据复制到子进程的用户空间 */
-                    memcpy((void *)prog_vaddr, buf_page, PG_SIZE);
+                    fpu_memcpy((void *)prog_vaddr, buf_page, PG_SIZE);
 
                     /* e 恢复父进程页表 */
                     page_dir_activate(parent_thread);
+                    cond_resched();     // 每复制一页检查一次是否需要调度
                 }
                 idx_bit++;
             }
@@ -138,9 +163,11 @@ static void update_inode_open_cnts(struct task_struct *thread)
     }
 }
 
-/* 拷贝父进程本身所占资源给子进程 */
+/* 拷贝父进程本身所占资源给子进程. 失败时释放已为子进程申请的资源(pcb页除外), 返回-1 */
 static int32_t copy_process(struct task_struct *child_thread, struct task_struct *parent_thread)
 {
+    uint8_t rollback_step = 0; // 用于操作失败时回滚已完成的步骤
+
     /* 内核缓冲区,作为父进程用户空间的数据复制到子进程用户空间的中转 */
     void *buf_page = get_kernel_pages(1);
     if (buf_page == NULL)
@@ -151,14 +178,16 @@ static int32_t copy_process(struct task_struct *child_thread, struct task_struct
     /* a 复制父进程的pcb、虚拟地址位图、内核栈到子进程 */
     if (copy_pcb_vaddrbitmap_stack0(child_thread, parent_thread) == -1)
     {
-        return -1;
+        rollback_step = 1;
+        goto rollback;
     }
 
     /* b 为子进程创建页表,此页表仅包括内核空间 */
     child_thread->pgdir = create_page_dir();
     if (child_thread->pgdir == NULL)
     {
-        return -1;
+        rollback_step = 2;
+        goto rollback;
     }
 
     /* c 复制父进程进程体及用户栈给子进程 */
@@ -172,6 +201,21 @@ static int32_t copy_process(struct task_struct *child_thread, struct task_struct
 
     mfree_page(PF_KERNEL, buf_page, 1);
     return 0;
+
+rollback:
+    switch (rollback_step)
+    {
+    case 2:
+        /* pid、FPU保存区和虚拟地址位图都已为子进程申请 */
+        mfree_page(PF_KERNEL, child_thread->userprog_vaddr.vaddr_bitmap.bits, VADDR_BITMAP_PG_CNT);
+        release_pid(child_thread);
+        fpu_release(child_thread);
+        /* fall through */
+    case 1:
+        mfree_page(PF_KERNEL, buf_page, 1);
+        break;
+    }
+    return -1;
 }
 
 /* fork子进程,内核线程不可直接调用 */
@@ -187,6 +231,7 @@ pid_t sys_fork(void)
 
     if (copy_process(child_thread, parent_thread) == -1)
     {
+        mfree_page(PF_KERNEL, child_thread, 1);
         return -1;
     }
 
@@ -9,6 +9,9 @@
 #include "fs.h"
 #include "fork.h"
 #include "exec.h"
+#include "sync.h"
+#include "trace.h"
+#include "block.h"
 
 #define syscall_nr 32
 typedef void* syscall;
@@ -46,5 +49,13 @@ void syscall_init(void) {
    syscall_table[SYS_STAT]	    = sys_stat;
    syscall_table[SYS_PS]	    = sys_ps;
    syscall_table[SYS_EXECV] = sys_execv;
+   syscall_table[SYS_LOCKSTAT] = sys_lockstat;
+   syscall_table[SYS_TRACE] = sys_trace;
+   syscall_table[SYS_SCHED_SETATTR] = sys_sched_setattr;
+   syscall_table[SYS_IOSTAT] = sys_iostat;
+   syscall_table[SYS_SYNC] = sys_sync;
+   syscall_table[SYS_FSYNC] = sys_fsync;
+   syscall_table[SYS_FALLOCATE] = sys_fallocate;
+   syscall_table[SYS_MKFS] = sys_mkfs;
     put_str("syscall_init done\n");
 }
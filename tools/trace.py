@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# 解析内核trace dump写入硬盘镜像的跟踪缓冲区, 输出时间线
+# 用法: python3 trace.py ../bochs/hd60M.img [--json out.json]
+#   --json 另外输出Chrome tracing格式, 可在chrome://tracing或Perfetto中查看
+import json
+import struct
+import sys
+
+SECTOR_SIZE = 512
+TRACE_DISK_LBA = 0x1d000        # 与kernel/trace.h保持一致
+TRACE_MAGIC = 0x43415254
+TRACE_NAMES_MAX = 22
+
+TYPES = ["none", "switch", "block", "unblock", "irq", "irq_ret",
+         "syscall", "sys_ret", "ide_cmd", "ide_done"]
+STATUS = ["RUNNING", "READY", "BLOCKED", "WAITING", "HANGING", "DIED"]
+
+
+def load(path):
+    with open(path, "rb") as f:
+        f.seek(TRACE_DISK_LBA * SECTOR_SIZE)
+        hdr = f.read(SECTOR_SIZE)
+        magic, event_size, nr_slots, head, tsc_per_us, ticks, name_cnt, _ = \
+            struct.unpack_from("<8I", hdr, 0)
+        if magic != TRACE_MAGIC:
+            sys.exit("no trace found at lba 0x%x, run 'trace dump' first" % TRACE_DISK_LBA)
+        names = {}
+        for i in range(min(name_cnt, TRACE_NAMES_MAX)):
+            pid, _, name = struct.unpack_from("<hh16s", hdr, 32 + i * 20)
+            names[pid] = name.split(b"\0")[0].decode("ascii", "replace")
+        buf = f.read(nr_slots * event_size)
+
+    # 缓冲区是环形的, 从最旧的事件开始按写入顺序取出
+    cnt = min(head, nr_slots)
+    events = []
+    last = None
+    base = 0
+    for idx in range(head - cnt, head):
+        tsc, typ, pid, arg0, arg1 = struct.unpack_from("<IHhII", buf, (idx % nr_slots) * event_size)
+        # 只记录了时间戳的低32位, 相邻事件间隔远小于一次回绕, 据此展开
+        if last is not None and tsc < last:
+            base += 1 << 32
+        last = tsc
+        events.append((base + tsc, typ, pid, arg0, arg1))
+    return events, names, max(tsc_per_us, 1)
+
+
+def describe(typ, arg0, arg1, names):
+    if typ == 1:
+        st = STATUS[arg1] if arg1 < len(STATUS) else str(arg1)
+        return "-> %s(%d), prev %s" % (names.get(arg0, "?"), arg0, st)
+    if typ == 2:
+        return STATUS[arg0] if arg0 < len(STATUS) else str(arg0)
+    if typ == 3:
+        return "%s(%d)" % (names.get(arg0, "?"), arg0)
+    if typ in (4, 5, 9):
+        return "vec 0x%x" % arg0
+    if typ == 6:
+        return "nr %d" % arg0
+    if typ == 7:
+        return "ret %d" % struct.unpack("<i", struct.pack("<I", arg0))[0]
+    if typ == 8:
+        return "%s lba 0x%x cnt %d" % ("write" if arg1 & 0x80000000 else "read", arg0, arg1 & 0x7fffffff)
+    return "0x%x 0x%x" % (arg0, arg1)
+
+
+def to_chrome(events, names, tsc_per_us):
+    """线程运行区间画成时间条, 其余事件画成瞬时标记"""
+    out = []
+    t0 = events[0][0]
+    running = None
+    for tsc, typ, pid, arg0, arg1 in events:
+        ts = (tsc - t0) / tsc_per_us
+        if typ == 1:
+            if running is not None:
+                out.append({"name": names.get(pid, str(pid)), "ph": "E", "pid": 0, "tid": pid, "ts": ts})
+            out.append({"name": names.get(arg0, str(arg0)), "ph": "B", "pid": 0, "tid": arg0, "ts": ts})
+            running = arg0
+        else:
+            name = TYPES[typ] if typ < len(TYPES) else str(typ)
+            out.append({"name": name, "ph": "i", "s": "t", "pid": 0, "tid": pid, "ts": ts,
+                        "args": {"arg0": arg0, "arg1": arg1}})
+    for pid, name in names.items():
+        out.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": pid, "args": {"name": name}})
+    return {"traceEvents": out}
+
+
+def main():
+    if len(sys.argv) not in (2, 4) or (len(sys.argv) == 4 and sys.argv[2] != "--json"):
+        sys.exit("usage: %s disk.img [--json out.json]" % sys.argv[0])
+    events, names, tsc_per_us = load(sys.argv[1])
+    if not events:
+        sys.exit("trace is empty")
+    t0 = events[0][0]
+    for tsc, typ, pid, arg0, arg1 in events:
+        name = TYPES[typ] if typ < len(TYPES) else str(typ)
+        print("%12.1fus %-8s(%3d) %-9s %s" % ((tsc - t0) / tsc_per_us, names.get(pid, "?"), pid, name,
+                                             describe(typ, arg0, arg1, names)))
+    if len(sys.argv) == 4:
+        with open(sys.argv[3], "w") as f:
+            json.dump(to_chrome(events, names, tsc_per_us), f)
+
+
+if __name__ == "__main__":
+    main()